@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "mf.h"
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Measures the latency of mf_connect() and mf_disconnect() of a process.
+// Run mfserver first. The configuration file is read by mf_connect() unless MF_SHMEM_NAME is set,
+// so run it both ways to compare:
+// ./connectbench 1000
+// MF_SHMEM_NAME=/sharedmemoryname ./connectbench 1000
+
+int compare_ns(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*)a;
+    unsigned long y = *(const unsigned long*)b;
+    return (x > y) - (x < y);
+}
+
+unsigned long elapsed_ns(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000UL + end->tv_nsec - start->tv_nsec;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 2) {
+        printf("usage: ./connectbench [iterations]\n");
+        exit(1);
+    }
+
+    int iterations = 1000;
+    if (argc == 2) {
+        iterations = atoi(argv[1]);
+    }
+    if (iterations <= 0) {
+        printf("iterations must be positive\n");
+        exit(1);
+    }
+
+    unsigned long* connect_ns = malloc(sizeof(unsigned long) * iterations);
+    unsigned long* disconnect_ns = malloc(sizeof(unsigned long) * iterations);
+
+    // The library prints on every connect, keep the output of the benchmark readable
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    int failed = 0;
+    for (int i = 0; i < iterations; i++) {
+        struct timespec start, middle, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (mf_connect() != MF_SUCCESS) {
+            failed = 1;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &middle);
+        mf_disconnect();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        connect_ns[i] = elapsed_ns(&start, &middle);
+        disconnect_ns[i] = elapsed_ns(&middle, &end);
+    }
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(null_fd);
+    close(saved_stdout);
+
+    if (failed) {
+        printf("mf_connect failed, is mfserver running?\n");
+        exit(1);
+    }
+
+    qsort(connect_ns, iterations, sizeof(unsigned long), compare_ns);
+    qsort(disconnect_ns, iterations, sizeof(unsigned long), compare_ns);
+
+    unsigned long connect_total = 0;
+    for (int i = 0; i < iterations; i++) {
+        connect_total += connect_ns[i];
+    }
+
+    printf("connect path: %s\n", getenv("MF_SHMEM_NAME") != NULL ? "MF_SHMEM_NAME + superblock" : "config file + superblock");
+    printf("iterations: %d\n", iterations);
+    printf("mf_connect    avg %.2f us  p50 %.2f us  p99 %.2f us  max %.2f us\n",
+        connect_total / 1000.0 / iterations, connect_ns[iterations / 2] / 1000.0,
+        connect_ns[(int)(iterations * 0.99)] / 1000.0, connect_ns[iterations - 1] / 1000.0);
+    printf("mf_disconnect p50 %.2f us  p99 %.2f us\n",
+        disconnect_ns[iterations / 2] / 1000.0, disconnect_ns[(int)(iterations * 0.99)] / 1000.0);
+
+    free(connect_ns);
+    free(disconnect_ns);
+
+    return 0;
+}
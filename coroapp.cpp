@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <memory>
+#include <vector>
+#include "mf.hpp"
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Serves a number of message queues from one thread with the coroutine front-end.
+// Each message queue has a sender coroutine and a receiver coroutine, the receiver checks the order of the messages.
+// The messages are sent through a typed channel of a trivially copyable struct.
+// The number of message queues is limited by MAX_QUEUES_IN_SHMEM of the config file.
+// Run mfserver first.
+// usage: ./coroapp [queues] [messages_per_queue]
+
+struct coro_message {
+    int sequence;
+    char payload[60];
+};
+
+typedef mf::typed_channel<coro_message> coro_channel;
+
+int errors = 0;
+
+mf::task sender(coro_channel& channel, int messages) {
+    coro_message message;
+    memset(message.payload, 's', sizeof(message.payload));
+    for (int i = 0; i < messages; i++) {
+        message.sequence = i;
+        if (co_await channel.send(message) != MF_SUCCESS) {
+            errors++;
+        }
+    }
+}
+
+mf::task receiver(coro_channel& channel, int messages) {
+    for (int i = 0; i < messages; i++) {
+        std::optional<coro_message> message = co_await channel.recv();
+        if (!message || message->sequence != i) {
+            errors++;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 3) {
+        printf("usage: ./coroapp [queues] [messages_per_queue]\n");
+        exit(1);
+    }
+
+    int queues = argc > 1 ? atoi(argv[1]) : 4;
+    int messages = argc > 2 ? atoi(argv[2]) : 10000;
+    if (queues <= 0 || messages <= 0) {
+        printf("queues and messages_per_queue must be positive\n");
+        exit(1);
+    }
+
+    // The library prints on every message, keep the output readable
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    if (mf_connect() != MF_SUCCESS) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        printf("mf_connect failed, is mfserver running?\n");
+        exit(1);
+    }
+
+    std::vector<std::unique_ptr<coro_channel>> channels;
+    {
+        mf::reactor reactor;
+        for (int q = 0; q < queues; q++) {
+            char mqname[32];
+            snprintf(mqname, sizeof(mqname), "coro%d", q);
+            if (mf_create(mqname, 16) != MF_SUCCESS) {
+                dup2(saved_stdout, STDOUT_FILENO);
+                printf("mf_create failed for %s, raise MAX_QUEUES_IN_SHMEM in the config\n", mqname);
+                exit(1);
+            }
+            channels.push_back(std::make_unique<coro_channel>(reactor, mqname));
+            reactor.spawn(receiver(*channels.back(), messages));
+            reactor.spawn(sender(*channels.back(), messages));
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        reactor.run();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        long total = (long)queues * messages;
+        printf("queues: %d  messages: %ld  seconds: %.3f  messages/s: %.0f  errors: %d\n",
+            queues, total, seconds, total / seconds, errors);
+        fflush(stdout);
+        dup2(null_fd, STDOUT_FILENO);
+    }
+
+    channels.clear();
+    for (int q = 0; q < queues; q++) {
+        char mqname[32];
+        snprintf(mqname, sizeof(mqname), "coro%d", q);
+        mf_remove(mqname);
+    }
+    mf_disconnect();
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(null_fd);
+    close(saved_stdout);
+
+    return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "mf.h"
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Measures the fairness of the blocked senders of a full message queue.
+// small_senders threads send small messages and one thread sends large messages (near MAX_DATALEN) to a small message queue,
+// one receiver thread drains it. The latency of each mf_send() is recorded, the percentiles of the small and the large
+// messages show if the large messages starve while the small ones slip into the freed space.
+// Run mfserver first.
+// usage: ./fairbench [messages_per_sender] [small_senders]
+
+#define SMALL_MSG_SIZE 64
+#define LARGE_MSG_SIZE 4000
+
+char mqname[32] = "fairbench";
+
+mf_ctx_t* ctx;
+int qid;
+int messages_per_sender;
+
+// Latencies of the sends in nanoseconds, one array per sender thread
+struct sender_args {
+    int msg_size;
+    unsigned long long* latencies;
+};
+
+unsigned long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void* sender(void* arg) {
+    struct sender_args* args = arg;
+    char sendbuffer[MAX_DATALEN];
+    memset(sendbuffer, 's', args->msg_size);
+    for (int i = 0; i < messages_per_sender; i++) {
+        unsigned long long start = now_ns();
+        mf_ctx_send(ctx, qid, sendbuffer, args->msg_size);
+        args->latencies[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+void* receiver(void* arg) {
+    long messages = *(long*)arg;
+    char recvbuffer[MAX_DATALEN];
+    for (long i = 0; i < messages; i++) {
+        mf_ctx_recv(ctx, qid, recvbuffer, MAX_DATALEN);
+    }
+    return NULL;
+}
+
+int compare_latencies(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Prints the percentiles of count latencies in microseconds, the latencies are sorted
+void print_latencies(char* name, unsigned long long* latencies, long count) {
+    qsort(latencies, count, sizeof(unsigned long long), compare_latencies);
+    printf("%-6s  %8ld  %9.1f  %9.1f  %9.1f  %10.1f\n", name, count,
+        latencies[count / 2] / 1e3, latencies[count * 99 / 100] / 1e3, latencies[count * 999 / 1000] / 1e3, latencies[count - 1] / 1e3);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 3) {
+        printf("usage: ./fairbench [messages_per_sender] [small_senders]\n");
+        exit(1);
+    }
+
+    messages_per_sender = argc > 1 ? atoi(argv[1]) : 5000;
+    int small_senders = argc > 2 ? atoi(argv[2]) : 4;
+    if (messages_per_sender <= 0 || small_senders <= 0) {
+        printf("messages_per_sender and small_senders must be positive\n");
+        exit(1);
+    }
+
+    // The library prints on every message, keep the output of the benchmark readable
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    ctx = mf_ctx_create();
+    if (ctx == NULL) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        printf("mf_ctx_create failed, is mfserver running?\n");
+        exit(1);
+    }
+    mf_create(mqname, 16);
+    qid = mf_ctx_open(ctx, mqname);
+
+    // The large sender is the last one
+    int senders = small_senders + 1;
+    pthread_t* threads = malloc(sizeof(pthread_t) * (senders + 1));
+    struct sender_args* args = malloc(sizeof(struct sender_args) * senders);
+    for (int i = 0; i < senders; i++) {
+        args[i].msg_size = i < small_senders ? SMALL_MSG_SIZE : LARGE_MSG_SIZE;
+        args[i].latencies = malloc(sizeof(unsigned long long) * messages_per_sender);
+    }
+
+    long messages = (long)senders * messages_per_sender;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_create(&threads[senders], NULL, receiver, &messages);
+    for (int i = 0; i < senders; i++) {
+        pthread_create(&threads[i], NULL, sender, &args[i]);
+    }
+    for (int i = 0; i <= senders; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("senders: %d small, 1 large  messages: %ld  seconds: %.3f  messages/s: %.0f\n", small_senders, messages, seconds, messages / seconds);
+    printf("send latencies in microseconds\n");
+    printf("class      sends        p50        p99      p99.9         max\n");
+
+    // All the small senders are reported together
+    unsigned long long* small_latencies = malloc(sizeof(unsigned long long) * messages_per_sender * small_senders);
+    for (int i = 0; i < small_senders; i++) {
+        memcpy(small_latencies + (long)i * messages_per_sender, args[i].latencies, sizeof(unsigned long long) * messages_per_sender);
+    }
+    print_latencies("small", small_latencies, (long)messages_per_sender * small_senders);
+    print_latencies("large", args[small_senders].latencies, messages_per_sender);
+
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    mf_ctx_close(ctx, qid);
+    mf_remove(mqname);
+    mf_ctx_destroy(ctx);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+
+    close(null_fd);
+    close(saved_stdout);
+    for (int i = 0; i < senders; i++) {
+        free(args[i].latencies);
+    }
+    free(small_latencies);
+    free(args);
+    free(threads);
+
+    return 0;
+}
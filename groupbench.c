@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "mf.h"
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Measures the latency of a worker pool under a skewed load, with and without the work stealing of consumer groups.
+// A partitioned message queue has one partition for each worker, the producer sends half of the messages to partition 0
+// and spreads the rest over the others, at a rate the pool keeps up with but worker 0 alone does not.
+// Each worker serves a message by sleeping service_us microseconds. The latency of a message is from the time it is due
+// to be sent to the time a worker takes it, so a producer that blocks on a full partition adds to the latency.
+// The workers first receive from their own partition with mf_recv(), then with mf_group_recv(), which steals from the deepest partition.
+// Run mfserver first, the partitions count towards MAX_QUEUES_IN_SHMEM.
+// usage: ./groupbench [messages] [workers] [service_us]
+
+#define LOAD_PERCENT 60 // load of the whole pool, worker 0 gets half of it
+
+char mqname[32] = "groupbench";
+
+int qid;
+int messages;
+int workers;
+int service_us;
+int use_group;
+int done; // Set by the producer when all the messages are taken, the workers stop at the next message
+int taken; // Number of messages taken by the workers
+unsigned long long* latencies; // Latency of each message in nanoseconds, indexed by the sequence number
+
+struct bench_message {
+    long long seq; // Sequence number, -1 for the messages that stop the workers
+    unsigned long long due_ns; // Time the message is due to be sent at
+};
+
+unsigned long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void sleep_until_ns(unsigned long long deadline_ns) {
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ns / 1000000000ULL;
+    deadline.tv_nsec = deadline_ns % 1000000000ULL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+}
+
+void* worker(void* arg) {
+    int member = (int)(long)arg;
+    int partition = mf_partition(qid, member);
+    mf_group_t* group = use_group ? mf_group_join(qid, member) : NULL;
+    struct bench_message message;
+    struct timespec service = { 0, service_us * 1000L };
+
+    while (1) {
+        if (use_group) {
+            mf_group_recv(group, &message, sizeof(message));
+        } else {
+            mf_recv(partition, &message, sizeof(message));
+        }
+        if (__atomic_load_n(&done, __ATOMIC_ACQUIRE) || message.seq < 0) {
+            break;
+        }
+
+        latencies[message.seq] = now_ns() - message.due_ns;
+        __atomic_fetch_add(&taken, 1, __ATOMIC_RELEASE);
+        nanosleep(&service, NULL);
+    }
+
+    if (use_group) {
+        mf_group_leave(group);
+    }
+    return NULL;
+}
+
+// Sends the messages at a fixed rate, half of them to partition 0, then stops the workers
+void produce() {
+    unsigned long long interval_ns = (unsigned long long)service_us * 1000ULL * 100 / (workers * LOAD_PERCENT);
+    unsigned long long start_ns = now_ns();
+    struct bench_message message;
+
+    for (int i = 0; i < messages; i++) {
+        message.seq = i;
+        message.due_ns = start_ns + i * interval_ns;
+        sleep_until_ns(message.due_ns);
+        int member = i % 2 == 0 ? 0 : 1 + (i / 2) % (workers - 1);
+        mf_send(mf_partition(qid, member), &message, sizeof(message));
+    }
+
+    while (__atomic_load_n(&taken, __ATOMIC_ACQUIRE) < messages) {
+        usleep(1000);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+    // One stop message for each worker, a worker of a group may take the stop message of another one
+    message.seq = -1;
+    for (int i = 0; i < workers; i++) {
+        mf_send(mf_partition(qid, i), &message, sizeof(message));
+    }
+}
+
+int compare_latencies(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Prints the percentiles of count latencies in microseconds, the latencies are sorted
+void print_latencies(char* name, unsigned long long* latencies, int count) {
+    qsort(latencies, count, sizeof(unsigned long long), compare_latencies);
+    printf("%-10s  %8d  %9.1f  %9.1f  %9.1f  %10.1f\n", name, count,
+        latencies[count / 2] / 1e3, latencies[count * 99 / 100] / 1e3, latencies[count * 999 / 1000] / 1e3, latencies[count - 1] / 1e3);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 4) {
+        printf("usage: ./groupbench [messages] [workers] [service_us]\n");
+        exit(1);
+    }
+
+    messages = argc > 1 ? atoi(argv[1]) : 5000;
+    workers = argc > 2 ? atoi(argv[2]) : 4;
+    service_us = argc > 3 ? atoi(argv[3]) : 1000;
+    if (messages <= 0 || workers < 2 || workers > MF_MAX_PARTITIONS || service_us <= 0 || service_us >= 1000000) {
+        printf("messages must be positive, workers between 2 and MF_MAX_PARTITIONS and service_us below a second\n");
+        exit(1);
+    }
+
+    // The library prints on every message, keep the output of the benchmark readable
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    if (mf_connect() != MF_SUCCESS) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        printf("mf_connect failed, is mfserver running?\n");
+        exit(1);
+    }
+    if (mf_create_partitioned(mqname, workers, 64) != MF_SUCCESS) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        printf("mf_create_partitioned failed, MAX_QUEUES_IN_SHMEM must be at least the number of workers\n");
+        exit(1);
+    }
+    qid = mf_open(mqname);
+
+    latencies = malloc(sizeof(unsigned long long) * messages);
+    pthread_t* threads = malloc(sizeof(pthread_t) * workers);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    printf("workers: %d  service: %d us  load: %d%%, half of it on worker 0\n", workers, service_us, LOAD_PERCENT);
+    printf("latency of the messages in microseconds\n");
+    printf("receive     messages        p50        p99      p99.9         max\n");
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+
+    for (use_group = 0; use_group <= 1; use_group++) {
+        done = 0;
+        taken = 0;
+        for (int i = 0; i < workers; i++) {
+            pthread_create(&threads[i], NULL, worker, (void*)(long)i);
+        }
+        produce();
+        for (int i = 0; i < workers; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        print_latencies(use_group ? "group" : "own", latencies, messages);
+        fflush(stdout);
+        dup2(null_fd, STDOUT_FILENO);
+    }
+
+    mf_close(qid);
+    mf_remove(mqname);
+    mf_disconnect();
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(null_fd);
+    close(saved_stdout);
+    free(latencies);
+    free(threads);
+
+    return 0;
+}
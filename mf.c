@@ -5,9 +5,19 @@
 #include <malloc.h>
 #include <assert.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "mf.h"
+#include "mf_trace.h"
+#include "mf_compress.h"
 
 // Görkem Kadir Solun 22003214
 // Murat Çağrı Kara 22102505
@@ -18,18 +28,388 @@ struct MFConfig {
     int MAX_MSGS_IN_QUEUE;
     int MAX_QUEUES_IN_SHMEM;
     char SHMEM_NAME[MAXFILENAME];
+    char DURABLE_QUEUES[256]; // Comma separated names of the message queues backed by a file
+    char DURABLE_DIR[MAXFILENAME]; // Directory of the files of the durable message queues
+    int DURABLE_COMMIT_US; // Latency budget of the group commit of the durable message queues in microseconds
+    int MAX_PROCESSES; // Maximum number of processes in the process registry
+    int SEGMENT_SIZE; // Size of the segments created when the shared memory region is full in KB
+    char COMPRESSED_QUEUES[256]; // Comma separated names of the message queues that compress their messages
+    int COMPRESS_THRESHOLD; // Shortest message that is compressed in the compressing message queues in bytes
+    char SPILL_QUEUES[256]; // Comma separated names of the message queues that spill to an overflow log when they are full
+    char SPILL_DIR[MAXFILENAME]; // Directory of the overflow logs of the spilling message queues
+    int SPILL_SIZE; // Size of the overflow log of a spilling message queue in KB
+    char POOLED_QUEUES[256]; // Comma separated names of the message queues that borrow chunks of the buffer pool when they are full
+    int POOL_SIZE; // Size of the buffer pool in KB, 0 if there is no buffer pool
+    int POOL_QUEUE_MIN; // Chunks a pooled message queue keeps even when they are drained, in KB
+    int POOL_QUEUE_MAX; // Chunks a pooled message queue may hold at a time, in KB, 0 for the whole buffer pool
+};
+
+// Indexes of the 4-byte fields that follow the message queue name in the message queue header
+#define MQ_FIELD_ID 0
+#define MQ_FIELD_SIZE 1
+#define MQ_FIELD_MSG_COUNT 2
+#define MQ_FIELD_START 3
+#define MQ_FIELD_NEXT_MSG 4
+#define MQ_FIELD_END_MSG 5
+#define MQ_FIELD_REF_COUNT 6
+#define MQ_FIELD_FLAGS 7
+#define MQ_FIELD_INSTANCE 8
+#define MQ_FIELD_SEGMENT 9
+#define MQ_FIELD_START_HIGH 10
+#define MQ_FIELD_COMPRESS_THRESHOLD 11
+#define MQ_FIELD_SEND_WAITERS 12
+#define MQ_FIELD_RECV_WAITERS 13
+#define MQ_FIELD_SEND_WAIT_BYTES 14
+#define MQ_FIELD_SEND_TICKET_NEXT 15
+#define MQ_FIELD_SEND_TICKET_HEAD 16
+#define MQ_FIELD_PARTITIONS 17
+#define MQ_FIELD_NEXT_PARTITION 18
+#define MQ_FIELD_TAG_HOLES 19
+#define MQ_FIELD_TAG_SEQ 20
+#define MQ_FIELD_TAG_WAITERS 21
+#define MQ_FIELD_TAG_CHAINS 22 // first message of tag chain i at MQ_FIELD_TAG_CHAINS + 2 * i, last message after it
+#define MQ_FIELD_TTL 38 // default time to live of the messages in milliseconds, 0 if they do not expire
+#define MQ_FIELD_SPILL_COUNT 39 // messages in the overflow log of a spilling message queue, or in the chunks of a pooled message queue
+#define MQ_FIELD_SPILL_HEAD 40 // offset of the oldest message in the overflow log, chunk * MF_POOL_CHUNK_SIZE + offset in the chunks
+#define MQ_FIELD_SPILL_TAIL 41 // offset of the end of the newest message in the overflow log or in the chunks
+#define MQ_FIELD_SPILL_SIZE 42 // size of the overflow log in bytes, 0 if the message queue does not spill to a file
+#define MQ_FIELD_POOL_CHUNKS 43 // chunks of the buffer pool held by a pooled message queue, in its chain and reserved
+#define MQ_FIELD_POOL_MIN 44 // chunks the pooled message queue keeps reserved when they are drained
+#define MQ_FIELD_POOL_MAX 45 // chunks the pooled message queue may hold at a time
+#define MQ_FIELD_POOL_RESERVE 46 // first reserved chunk + 1, the reserved chunks are linked like the chain, 0 if none is reserved
+#define MQ_FIELD_MAX_MSGS 47 // most messages in the message queue, 0 if only its size limits them
+#define MQ_FIELD_MAX_BYTES 48 // most bytes of the messages in the message queue, headers included, 0 if only its size limits them
+#define MQ_FIELD_MSG_BYTES 49 // bytes of the messages in the message queue, headers included, the removed messages not counted
+#define MQ_FIELD_DURABLE_SEQ 50 // changes of a durable message queue, incremented with the access mutex held, see durable_persist_state()
+#define MQ_FIELD_DURABLE_SYNCED 51 // MQ_FIELD_DURABLE_SEQ covered by the last group commit, the futex word of the waiting senders
+#define MQ_FIELD_RING_SEQ 52 // incremented when the ring workers waiting for the message queue are woken up, their futex word
+#define MQ_FIELD_RING_WAITERS 53 // ring workers waiting for a message or for space in the message queue, see ring_worker()
+#define MQ_FIELD_PARTITION_HEAD 54 // qid of partition 0 of the logical message queue of a partition i > 0, 0 for the other message queues
+
+// Message queue flags of the message queues that keep the messages that do not fit outside their ring, see spill_append()
+#define MQ_OVERFLOW_FLAGS (MF_QATTR_SPILL | MF_QATTR_POOL)
+
+// Longest prefix the library stores before the message data, a tag header, a call header and an expiry header
+#define MQ_MAX_DATA_PREFIX (sizeof(struct MFTagHeader) + sizeof(struct MFCallHeader) + sizeof(struct MFExpiryHeader))
+
+// Returned by the non-blocking helpers when the caller would have to wait, see mq_try_send() and mq_try_recv()
+#define MQ_WOULD_BLOCK 1
+// Returned by mq_try_send() when the caller holds a ticket that is not at the head of the blocked senders yet
+#define MQ_WAIT_TURN 2
+
+// Tickets of the blocked senders wrap around at MQ_TICKET_MASK, MQ_NO_TICKET is held by a sender that is not blocked
+#define MQ_TICKET_MASK 0x3FFFFFFF
+#define MQ_NO_TICKET -1
+
+// States of a reply slot in the low bits of its state word, see struct MFReplySlot
+#define REPLY_STATE_MASK 0x3
+#define REPLY_FREE 0 // no call uses the slot
+#define REPLY_WAITING 1 // the caller waits for the reply
+#define REPLY_WRITING 2 // a server writes the reply
+#define REPLY_DONE 3 // the reply is written, the caller copies it and frees the slot
+#define REPLY_GENERATION 0x4 // added to the state word when the slot is freed
+
+// Reply areas of the callers a server process keeps mapped, see rpc_reply_area_of()
+#define REPLY_MAPPINGS 16
+
+// Timer wheel of the delayed messages, see mf_send_at()
+// TIMER_LEVELS levels of TIMER_SLOTS slots, level l spans TIMER_SLOTS^(l+1) ticks of MF_TIMER_TICK_US
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_NONE -1 // ends a list of timer entries
+
+// Ends a list of the chunks of the buffer pool, see struct MFPoolArea
+#define POOL_NONE -1
+
+// Time the ring worker waits before it retries the submissions that would block, in microseconds,
+// used only when the kernel cannot wait for the message queues, see ring_wait_queues()
+#define RING_RETRY_US 200
+
+// Sleep of the ring worker, see struct mf_ring
+#define RING_AWAKE 0
+#define RING_SLEEP_SUBMIT 1 // sleeps on sq_cond until submissions are published
+#define RING_SLEEP_QUEUES 2 // sleeps on wake_seq and the message queues the pending submissions block on
+
+// Largest staging buffer of a batching message queue, see mf_set_batching()
+#define BATCH_MAX_BYTES (1024 * 1024)
+
+// Size of the name of the file of a durable message queue or an overflow log, the directory, the shared memory name and the message queue name
+#define DURABLE_FILENAME_SIZE (MAXFILENAME * 2 + MAX_MQNAMESIZE + 8)
+
+// Access mutex of a message queue in the shared memory region
+// It is a robust mutex, if its owner dies the next locker repairs the message queue, see mq_lock()
+struct MFQueueLock {
+    pthread_mutex_t mutex;
+    int owner_pid; // Process holding the access mutex, 0 if it is free
+};
+
+// Process registry in the shared memory region, it is followed by MAX_PROCESSES entries, see registry_entry()
+// It lets mfserver release the reference counts and the active process counts of the processes that die without mf_disconnect()
+struct MFRegistry {
+    pthread_mutex_t mutex; // Protects the registry entries, the reference counts and the active process count
+    int reaped_processes; // Number of dead processes reaped by mfserver
+};
+
+// Segments of the shared memory region in the control area
+// Segment 0 is the shared memory region created by mf_init(), the others are created by mf_create() when the message queues do not fit
+struct MFSegmentTable {
+    int segment_count; // Number of segments, including segment 0
+    int reserved;
+    long long segment_sizes[MF_MAX_SEGMENTS]; // Size of the message queues region of each segment in bytes, unused for segment 0
+};
+
+// Superblock at the start of the shared memory region, written by mf_init() after the rest of the region is initialized
+// It publishes the configuration, so that mf_connect() does not read the configuration file and always agrees with mfserver
+struct MFSuperblock {
+    unsigned int magic; // MF_SUPERBLOCK_MAGIC, written last, a connecting process waits for mf_init() if it is not set
+    int layout_version; // MF_LAYOUT_VERSION of the library that initialized the region
+    int superblock_size; // Size of this structure in bytes, guards against libraries with a different MFConfig
+    int feature_flags; // MF_FEATURE_* flags of the region
+    int queue_alignment; // Page size of mfserver, the control area and the message queues are aligned to it so that they are mapped separately
+    struct MFConfig config; // Configuration parameters read by mf_init()
+};
+
+// Memory mapping of a message queue of the shared memory region in the calling process, see mq_region_address()
+// Only the control area is mapped by mf_connect(), the message queues are mapped by mf_open() and unmapped by mf_close()
+struct MFQueueMapping {
+    int instance; // Instance id of the message queue the mapping belongs to
+    void* address; // Start address of the mapping, NULL if the message queue is not mapped
+    int size; // Size of the mapping in bytes
+};
+
+// Semaphores of a message queue cached by a thread, so that mf_send() and mf_recv() do not open and close them on every call
+struct MFQueueHandle {
+    int instance; // Instance id of the message queue the semaphores are opened for
+    sem_t* empty_sem; // Semaphore for no message in the message queue, NULL if not opened
+    sem_t* full_sem; // Semaphore for insufficient space in the message queue
+};
+
+// Queue handles of a thread, indexed by qid - 1, they are closed when the thread exits
+struct MFThreadHandles {
+    int count; // Number of handles
+    struct MFQueueHandle handles[];
+};
+
+// Context of a part of an application that uses the MF library, see mf_ctx_create()
+// It keeps the message queues opened through it, so that mf_ctx_destroy() closes them
+struct mf_ctx {
+    pthread_mutex_t mutex; // Protects the open counts
+    int* open_counts; // Number of times each message queue is opened through the context, indexed by qid - 1
+};
+
+// Submission and completion rings of the asynchronous API, see mf_ring_create()
+// The submission ring is written by the application and read by the worker thread, the completion ring the other way around,
+// so each index has a single writer and the rings need no lock. The mutex and the condition variables are only used to sleep.
+struct mf_ring {
+    unsigned int sq_entries; // Capacity of the submission ring, a power of two
+    unsigned int cq_entries; // Capacity of the completion ring, twice the submission ring
+    struct mf_sqe* sqes; // Submission ring
+    struct mf_cqe* cqes; // Completion ring
+    unsigned int sq_head; // Next submission to be taken by the worker
+    unsigned int sq_tail; // Submissions published by mf_ring_submit()
+    unsigned int sq_prepared; // Submissions handed out by mf_ring_get_sqe(), published by the next mf_ring_submit()
+    unsigned int cq_head; // Next completion to be reaped
+    unsigned int cq_tail; // Completions posted by the worker
+    // The submissions that are not reaped yet are sq_prepared - cq_head, bounded by the completion ring capacity
+    // sq_prepared is written by the submitting thread only and cq_head by the reaping thread only, so no count is shared
+    struct mf_sqe* pending; // Submissions taken by the worker that would block, in submission order
+    int pending_count; // Number of pending submissions
+    char* blocked_queues; // Operations (1 << opcode) that would block on each message queue in the current pass of the worker, indexed by qid
+    char* waiting_queues; // Message queues the worker is counted as a waiter of, indexed by qid, see ring_register_waits()
+    int* wait_seqs; // MQ_FIELD_RING_SEQ of each message queue when the worker was counted as its waiter, indexed by qid
+    pthread_t worker; // Worker thread
+    pthread_mutex_t mutex; // Protects the sleep flags below
+    pthread_cond_t sq_cond; // Signaled when the worker sleeps on it and submissions are published
+    pthread_cond_t cq_cond; // Signaled when the reaper sleeps and completions are posted
+    int wake_seq; // Futex word of the worker sleeping on the message queues, incremented when submissions are published
+    int worker_sleeping; // RING_SLEEP_* while the worker sleeps, RING_AWAKE otherwise
+    int reaper_sleeping; // Reaper waits for completions
+    int stop; // Set by mf_ring_destroy() to stop the worker
+};
+
+// Staged messages of a message queue the calling process sends to in batches, see mf_set_batching()
+// Each staged message is stored as in the message queue, a message header and the stored (possibly compressed) data
+struct MFBatch {
+    pthread_mutex_t mutex; // Serializes the senders of the process and the flusher, so the staged messages keep their order
+    int max_bytes; // Staged bytes that make the batch publish, 0 if batching is turned off
+    int max_delay_us; // Longest time a staged message waits before the flusher publishes it
+    char* buffer; // Staged messages, max_bytes plus room for one more message
+    int capacity; // Size of the buffer in bytes
+    int staged_bytes; // End of the staged messages in the buffer
+    int published_bytes; // Start of the staged messages that are not published yet, a publish may stop at a full message queue
+    int staged_count; // Number of staged messages that are not published yet
+    unsigned long long deadline_ns; // Time the oldest staged message must be published at
+};
+
+// Memory mapping of the file of a durable message queue in the calling process
+struct MFDurableMapping {
+    int instance; // Instance id of the message queue the mapping belongs to
+    int fd; // File descriptor of the file
+    void* address; // Start address of the mapping, the file header is followed by the message queue
+    int size; // Size of the mapping in bytes
+};
+
+// Memory mapping of the overflow log of a spilling message queue in the calling process
+struct MFSpillMapping {
+    int instance; // Instance id of the message queue the mapping belongs to
+    void* address; // Start address of the mapping, the messages lay in it like in the message queue
+    int size; // Size of the mapping in bytes
+};
+
+// Partitions of a logical message queue in the calling process, resolved from the partition chain of the message queue headers
+// The partition 0 of a logical message queue holds the number of partitions, each partition holds the qid of the next one
+struct MFPartitionMap {
+    int instance; // Instance id of the partition 0 the map belongs to, 0 if not resolved
+    int count; // Number of partitions
+    int qids[MF_MAX_PARTITIONS]; // qid of each partition
+};
+
+// Message a consumer group member stole from another partition, kept in the group handle until it is received
+struct MFStolenMessage {
+    int qid; // Partition the message is stolen from
+    int len; // Length of the message data, or of the compressed data
+    int compressed; // Set if data holds the compressed message, it is decompressed when the message is received
+    char data[MAX_DATALEN]; // Message data
+};
+
+// Member of a consumer group, see mf_group_join()
+struct mf_group {
+    int member; // Index of the partition the member owns
+    int count; // Number of partitions, one for each member
+    int qids[MF_MAX_PARTITIONS]; // qid of each partition
+    int stolen_next; // Next stolen message to receive
+    int stolen_count; // Number of messages of the last steal
+    struct MFStolenMessage stolen[MF_GROUP_STEAL_BATCH]; // Messages of the last steal
+};
+
+// Reply slot of a call in the reply area of the calling process, see mf_call()
+// The state word holds the generation of the slot in its high bits and the REPLY_* state in its low bits, a server writes
+// the reply only if the word is still the one of the request, so a late reply never lands in a slot reused by another call
+struct MFReplySlot {
+    unsigned int word; // Generation and state, the caller waits on it with a futex
+    int len; // Length of the reply, MF_ERROR if the call failed
+    char data[MAX_DATALEN]; // Reply data
+};
+
+// Reply area of a process, the shared memory object "<SHMEM_NAME>.rpc.<pid>" created by its first mf_call()
+struct MFReplyArea {
+    unsigned int nonce; // Tells apart the reply areas of two processes with the same pid
+    struct MFReplySlot slots[MF_MAX_CALLS];
+};
+
+// Call header at the start of the data of a request, see MF_MSG_CALL
+struct MFCallHeader {
+    int pid; // Caller process, 0 if the message is not a request
+    unsigned int nonce; // Nonce of the reply area of the caller
+    int slot; // Reply slot of the call
+    unsigned int word; // State word of the reply slot while the caller waits
+};
+
+// Tag header at the start of the data of a tagged message, see MF_MSG_TAGGED
+// The messages of a tag chain are linked from the oldest to the newest, the links are address differences plus 1, 0 ends the chain
+struct MFTagHeader {
+    unsigned int tag; // Tag of the message
+    int next; // Next message of the tag chain
+};
+
+// Expiry header in the data of a message with a time to live, after the tag header and the call header, see MF_MSG_EXPIRES
+struct MFExpiryHeader {
+    unsigned long long expires_at; // CLOCK_MONOTONIC time the message expires at, in nanoseconds
+};
+
+// Reply area of a caller mapped by a server process
+struct MFReplyMapping {
+    int pid; // Caller process, 0 if the mapping is not used
+    unsigned int nonce; // Nonce of the reply area
+    struct MFReplyArea* area; // Start address of the mapping
+};
+
+// Message held by the timer wheel until its delivery tick, see mf_send_at()
+struct MFTimerEntry {
+    int next; // Next entry of the slot, the due list or the free list, TIMER_NONE ends the list
+    int qid; // Destination message queue, 0 if the entry is free
+    int instance; // Instance id of the destination message queue, the message is dropped if the message queue is created again
+    int len; // Length of the stored message data
+    int msg_flags; // Message flags of the stored message data, MF_MSG_COMPRESSED if it is compressed
+    unsigned long long deliver_tick; // Tick the message is delivered at
+    char data[sizeof(struct MFExpiryHeader) + MAX_DATALEN]; // Stored message data, compressed if the message queue compresses its messages
+};
+
+// List of timer entries, the entries are appended at the tail so that the messages of a tick keep their order
+struct MFTimerList {
+    int head;
+    int tail;
+};
+
+// Timer area, the shared memory object "<SHMEM_NAME>.timers" created by mf_init()
+// A delayed message is in the lowest level of the wheel whose span holds its delay, in the slot of its delivery tick.
+// When the ticks of level 0 wrap around, the next slot of level 1 is spread over level 0, and so on up the levels,
+// so a message is inserted and expired in constant time and moved at most once for each level.
+struct MFTimerArea {
+    pthread_mutex_t mutex; // Robust mutex, it protects the timer area, taken before the access mutex of a message queue
+    unsigned long long tick; // Next tick to expire, the ticks before it are expired
+    int pending; // Number of messages held, in the wheel or in the due list
+    int free_head; // First free entry
+    struct MFTimerList due; // Expired messages not delivered yet, their message queue was full
+    struct MFTimerList slots[TIMER_LEVELS][TIMER_SLOTS]; // Messages of each slot of each level
+    struct MFTimerEntry entries[MF_MAX_TIMERS];
+};
+
+// Buffer pool, the shared memory object "<SHMEM_NAME>.pool" created by mf_init(), see MF_QATTR_POOL
+// The chunks follow the header and the links, at the first page boundary after them. The link of a chunk is owned by its holder:
+// the free chunks are linked in the free list under the mutex, the chunks of a message queue in its chain or its reserved chunks
+// under the access mutex of the message queue.
+struct MFPoolArea {
+    pthread_mutex_t mutex; // Robust mutex, it protects the free list, taken after the access mutex of a message queue
+    int chunk_count; // Number of chunks
+    int free_head; // First free chunk, POOL_NONE if none is free
+    int free_count; // Number of free chunks
+    int next[]; // Next chunk of each chunk in its list, POOL_NONE ends the list
 };
 
 // Global variables
 struct MFConfig config; // Configuration parameters
-void* shared_memory_address_fixed; // Start address of the shared memory region
+void* shared_memory_address_superblock; // Start address of the shared memory region, the superblock is at the start
+void* shared_memory_address_fixed; // Start address of the message queue headers after the superblock
 void* shared_memory_address_info; // Start address of the shared memory region for the shared memory information after the fixed shared memory region
-void* shared_memory_address_queues; // Start address of the message queues in the shared memory region after the info shared memory region
+void* shared_memory_address_stats; // Start address of the statistics of the message queues after the info shared memory region
+void* shared_memory_address_locks; // Start address of the access mutexes of the message queues after the statistics region
+void* shared_memory_address_registry; // Start address of the process registry after the access mutexes
+void* shared_memory_address_segments; // Start address of the segment table after the process registry
 int shared_memory_id; // ID of the shared memory region
+int* segment_fds = NULL; // File descriptors of the segments in the calling process, indexed by the segment id, -1 if not opened
+int queue_alignment; // Alignment of the control area and the message queues in the shared memory region, a page
+struct MFQueueMapping* queue_mappings = NULL; // Mappings of the message queues in the calling process, indexed by qid - 1
+struct MFDurableMapping* durable_mappings = NULL; // Mappings of the durable message queues in the calling process, indexed by qid - 1
+struct MFSpillMapping* spill_mappings = NULL; // Mappings of the overflow logs of the spilling message queues in the calling process, indexed by qid - 1
+struct MFPartitionMap* partition_maps = NULL; // Partitions of the logical message queues used by the calling process, indexed by qid - 1
+struct MFBatch** batches = NULL; // Batches of the message queues the calling process sends to in batches, indexed by qid - 1, NULL if never batched
+pthread_t batch_flusher; // Thread that publishes the batches whose oldest message reached its deadline
+int batch_flusher_running = 0; // Set while the flusher thread runs
+int batch_flusher_stop = 0; // Set by mf_disconnect() to stop the flusher thread
+int batch_tick_us = 0; // Smallest max_delay_us of the batching message queues, 0 if none is batching
+pthread_mutex_t batch_flusher_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the flusher state above
+pthread_cond_t batch_flusher_cond = PTHREAD_COND_INITIALIZER; // Signaled when the flusher state changes
+pthread_once_t batch_atfork_once = PTHREAD_ONCE_INIT; // Registers batch_atfork_child() with the first mf_set_batching()
+struct MFReplyArea* reply_area = NULL; // Reply area of the calling process, created by its first mf_call()
+int reply_area_pid = 0; // Process that created the reply area, a forked child creates its own
+struct MFReplyMapping reply_mappings[REPLY_MAPPINGS]; // Reply areas of the callers mapped by the servers of the process
+pthread_mutex_t reply_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the reply area and the reply mappings of the process
+struct MFTimerArea* timer_area = NULL; // Timer area mapped in the calling process, by mf_init() or by the first mf_send_at()
+struct MFPoolArea* pool_area = NULL; // Buffer pool mapped in the calling process, by mf_init() or by the first pooled message queue
+int pool_area_size = 0; // Size of the mapping of the buffer pool
+// Thread safety of the process state above, see the thread safety model in mf.h
+pthread_mutex_t library_mutex; // Serializes connect, disconnect, close and the mapping of the message queues in the process, recursive
+pthread_once_t library_mutex_once = PTHREAD_ONCE_INIT; // Initializes the library mutex
+int connect_count = 0; // Number of mf_connect() calls of the process that are not disconnected yet
+int connected_pid = 0; // Process that made the connection, a forked child inherits the connection but registers itself
+__thread struct MFThreadHandles* thread_handles = NULL; // Queue handles of the calling thread
+pthread_key_t thread_handles_key; // Closes the queue handles of a thread when it exits
+pthread_once_t thread_handles_once = PTHREAD_ONCE_INIT; // Creates the thread handles key
 // Semaphore names are constants as we get queues' semaphore names by adding some suffixes to these names
 char empty_sem_additon[MAXFILENAME] = "empty"; // Semaphore name addition for no message in the message queue
 char full_sem_additon[MAXFILENAME] = "full"; // Semaphore name addition for insufficient space in the message queue
-char access_mutex_sem_additon[MAXFILENAME] = "access_mutex"; // Semaphore name addition for access mutex in the message queue
 char base_sem_name[MAXFILENAME] = "/semaphore"; // Base semaphore name
 
 
@@ -37,6 +417,173 @@ char base_sem_name[MAXFILENAME] = "/semaphore"; // Base semaphore name
 int read_config_file(struct MFConfig* config);
 int bytes_to_int_little_endian(char* bytes);
 void int_to_bytes_little_endian(int val, char* bytes);
+int fixed_region_size();
+int queue_region_size();
+int control_area_size();
+int align_to_queue_alignment(int size);
+void set_region_addresses();
+int superblock_feature_flags();
+int validate_superblock(struct MFSuperblock* superblock, int shared_memory_size);
+struct mf_stats* mq_stats_address(int qid);
+void mq_lock(int qid, unsigned long long* hold_start_ns);
+void mq_unlock(int qid, unsigned long long hold_start_ns);
+int align_region_offset(int offset);
+int stats_region_offset();
+int locks_region_offset();
+int registry_region_offset();
+int registry_entry_size();
+int segments_region_offset();
+long long mq_start_offset(int qid);
+void mq_set_start_offset(int qid, long long offset);
+int segment_holds_queue(int segment, int qid);
+long long segment_size(int segment);
+void segment_name(int segment, char* name);
+int segment_fd(int segment);
+void segment_close_all();
+void segment_remove_all();
+long long segment_find_space(int segment, long long mq_size);
+int segment_create(long long mq_size);
+struct MFQueueLock* mq_lock_address(int qid);
+void init_robust_mutex(pthread_mutex_t* mutex);
+void mq_repair(int qid);
+int* registry_entry(int pid, int is_create);
+void registry_lock();
+void registry_unlock();
+void registry_add_ref(int qid, int value);
+void registry_add_active(int value);
+void registry_release(int* entry);
+int registry_reap();
+unsigned long long monotonic_time_ns();
+void init_library_mutex();
+void library_lock();
+void library_unlock();
+void registry_register();
+void init_thread_handles_key();
+void free_thread_handles(void* handles);
+struct MFQueueHandle* mq_handle(int qid);
+int mq_try_send(int qid, struct MFQueueHandle* handle, void* bufptr, int datalen, int msg_flags, int* ticket);
+int mq_send_wait(int qid, struct MFQueueHandle* handle, void* bufptr, int datalen, int msg_flags);
+int mq_try_recv(int qid, struct MFQueueHandle* handle, void* bufptr, int bufsize, int* msg_len, int will_wait, struct MFCallHeader* call_header);
+void mq_wait_send(int qid, struct MFQueueHandle* handle, int ticket, int send_status);
+int mq_send_turn(int qid, int* ticket);
+int mq_take_ticket(int qid);
+int mq_pass_ticket(int qid, int* ticket);
+int mq_ticket_bitset(int ticket);
+int mq_ticket_cancelled(int ticket, int head);
+void mq_wake_turns(int qid, int bitset);
+void mq_reset_send_tickets(int qid);
+void mq_add_send_waiter(int qid, int msg_size);
+int mq_take_send_waiter(int qid);
+int mq_take_recv_waiters(int qid, int count);
+void mq_post_wakeups(sem_t* sem, int count);
+struct MFBatch* batch_of(int qid);
+int batch_stage(int qid, struct MFBatch* batch, struct MFQueueHandle* handle, void* bufptr, int datalen);
+int batch_publish(int qid, struct MFBatch* batch, struct MFQueueHandle* handle, int* ticket);
+int batch_flush(int qid, struct MFBatch* batch);
+void batch_update_tick();
+void* batch_flusher_main(void* arg);
+void batch_stop_all();
+void batch_register_atfork();
+void batch_atfork_child();
+void* ring_worker(void* arg);
+int ring_register_waits(mf_ring_t* ring);
+void ring_wake_worker(mf_ring_t* ring);
+void ring_wait_queues(mf_ring_t* ring, int wake_seq);
+void mq_wake_ring_waiters(int qid);
+int ring_try_operation(struct mf_sqe* sqe, int* result);
+int mq_header_get(int qid, int field);
+void mq_header_set(int qid, int field, int value);
+int* mq_header_address(int qid, int field);
+int mq_find_by_name(char* mqname);
+void* mq_region_address(int qid);
+int mq_find_space(int qid, int msg_size);
+int mq_within_limits(int qid, int msg_size);
+int mq_count_msg_bytes(int qid);
+void mq_put_message(int qid, int msg_address_diff, void* bufptr, int datalen, int msg_flags);
+int mq_get_message(int qid, void* bufptr, int bufsize, void* compressed_buffer, int* compressed_len, struct MFCallHeader* call_header);
+int mq_copy_message(int qid, int msg_address_diff, void* bufptr, int bufsize, void* compressed_buffer, int* compressed_len, struct MFCallHeader* call_header);
+void mq_drop_message(int qid);
+int mq_following_message(int qid, int msg_address_diff, int msg_len);
+int mq_find_tagged(int qid, unsigned int tag, unsigned int mask, int* prev_address_diff);
+int mq_remove_tagged(int qid, int msg_address_diff, int prev_address_diff, void* bufptr, int bufsize, void* compressed_buffer, int* compressed_len);
+void mq_link_tagged(int qid, int msg_address_diff);
+void mq_unlink_tagged(int qid, int msg_address_diff, int prev_address_diff);
+int mq_tag_next(int qid, int msg_address_diff);
+void mq_set_tag_next(int qid, int msg_address_diff, int next_address_diff);
+void mq_reclaim_holes(int qid);
+void mq_rebuild_tag_chains(int qid);
+int mq_take_tag_waiters(int qid);
+int splice_accepts(int qid, void* data, int msg_len, int msg_flags, mf_filter_t filter, void* arg);
+void* mq_encode_message(int qid, void* bufptr, int* datalen, void* compressed_buffer, int* msg_flags);
+int mq_send_ttl(int qid, struct MFQueueHandle* handle, void* bufptr, int datalen, int ttl_ms);
+unsigned long long mq_expires_at(unsigned long long start_ns, int ttl_ms);
+void* mq_add_expiry(void* stored_data, int* stored_len, unsigned long long expires_at, void* message_buffer, int* msg_flags);
+int mq_expiry_offset(int msg_flags);
+int mq_message_expired(void* msg_start_address, unsigned long long* now_ns);
+int mq_reclaim_expired(int qid);
+int mq_expired_hint(int qid);
+void spill_file_name(char* mqname, char* filename);
+int spill_create_log(char* mqname, int spill_size_bytes);
+struct MFSpillMapping* spill_mapping_slot(int qid);
+struct MFSpillMapping* spill_mapping(int qid);
+int spill_find_space(int qid, int msg_size);
+int spill_append(int qid, void* bufptr, int datalen, int msg_flags);
+int spill_refill(int qid);
+void spill_remove_queue(int qid, char* mqname);
+void* spill_log_address(int qid);
+int spill_next_head(int qid, void* log_address, int head);
+void pool_area_name(char* name);
+int pool_data_offset(int chunk_count);
+int pool_create_area();
+struct MFPoolArea* pool_area_map();
+void pool_unmap();
+void pool_lock(struct MFPoolArea* pool);
+int pool_take_chunks(struct MFPoolArea* pool, int count);
+void pool_give_chunks(struct MFPoolArea* pool, int first_chunk, int last_chunk, int count);
+int pool_fits_tail(int qid, int msg_size);
+int pool_can_borrow(int qid);
+int pool_borrow_tail(int qid);
+void pool_return_chunk(int qid, int chunk);
+void pool_release_queue(int qid);
+int mq_decode_message(int qid, void* compressed_buffer, int compressed_len, void* bufptr, int bufsize);
+unsigned int message_checksum(void* data, int datalen);
+int is_queue_name_listed(char* queue_names, char* mqname);
+void config_queue_attr(char* mqname, struct mf_qattr* attr);
+void durable_file_name(char* mqname, char* filename);
+int durable_open_queue(int qid, char* mqname, int mqsize_bytes, int instance, int* msg_count, int* next_msg_diff, int* end_msg_diff);
+void ring_recover(void* mq_start_address, int mqsize_bytes, int verify_checksum, int* msg_count, int* next_msg_diff, int* end_msg_diff);
+void durable_recover_all();
+struct MFQueueMapping* queue_mapping(int qid);
+void queue_unmap(int qid);
+int registry_open_count(int qid);
+struct MFDurableMapping* durable_mapping_slot(int qid);
+struct MFDurableMapping* durable_mapping(int qid);
+void durable_persist_state(int qid);
+void durable_commit(int qid);
+void durable_wait_commit(int qid, int durable_seq);
+void durable_remove_queue(int qid, char* mqname);
+struct MFPartitionMap* partition_map(int qid);
+int partition_qids(int qid, int* qids);
+int mq_depth_hint(int qid);
+int group_steal(struct mf_group* group);
+int group_take_stolen(struct mf_group* group, void* bufptr, int bufsize);
+void group_cancel_wait(int qid, struct MFQueueHandle* handle);
+void rpc_area_name(int pid, char* name);
+struct MFReplyArea* rpc_reply_area();
+struct MFReplyArea* rpc_reply_area_of(int pid, unsigned int nonce);
+void rpc_reply(struct MFCallHeader* call_header, void* resp, int resp_len);
+void rpc_close_all();
+void timer_area_name(char* name);
+int timer_create_area();
+struct MFTimerArea* timer_area_map();
+void timer_unmap();
+void timer_lock(struct MFTimerArea* area);
+void timer_rebuild(struct MFTimerArea* area);
+void timer_list_append(struct MFTimerArea* area, struct MFTimerList* list, int index);
+void timer_insert(struct MFTimerArea* area, int index);
+void timer_advance(struct MFTimerArea* area, unsigned long long now_tick);
+void timer_deliver_due(struct MFTimerArea* area);
+void init_remove_region();
 
 
 // Start of the library functions
@@ -69,8 +616,12 @@ int mf_init() {
     printf("Shared memory id: %d\n", shared_memory_id);
 
     // Set the size of the shared memory region
+    // It is truncated to 0 first, so that a region left by a previous mfserver is filled with zeros without touching its pages
     int shared_memory_size = config.SHMEM_SIZE * 1024 * sizeof(char);
-    int shared_memory_status = ftruncate(shared_memory_id, shared_memory_size);
+    int shared_memory_status = ftruncate(shared_memory_id, 0);
+    if (shared_memory_status != -1) {
+        shared_memory_status = ftruncate(shared_memory_id, shared_memory_size);
+    }
     if (shared_memory_status == -1) {
         printf("Error: Could not set the size of the shared memory region\n");
         close(shared_memory_id);
@@ -78,9 +629,21 @@ int mf_init() {
         return (MF_ERROR);
     }
 
-    // Map the shared memory region to the address space of the calling process
-    shared_memory_address_fixed = mmap(NULL, shared_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_memory_id, 0);
-    if (shared_memory_address_fixed == MAP_FAILED) {
+    // The control area and the message queues are aligned to the page size
+    queue_alignment = (int)sysconf(_SC_PAGESIZE);
+
+    // The fixed portion must leave space for the message queues
+    if (queue_region_size() <= 0) {
+        printf("Error: Shared memory region is too small for MAX_QUEUES_IN_SHMEM and MAX_PROCESSES\n");
+        close(shared_memory_id);
+        shm_unlink(config.SHMEM_NAME);
+        return (MF_ERROR);
+    }
+
+    // Map the control area of the shared memory region to the address space of the calling process
+    // The message queues are mapped when they are used, see mq_region_address()
+    shared_memory_address_superblock = mmap(NULL, control_area_size(), PROT_READ | PROT_WRITE, MAP_SHARED, shared_memory_id, 0);
+    if (shared_memory_address_superblock == MAP_FAILED) {
         printf("Error: Could not map the shared memory region to the address space of the calling process\n");
         close(shared_memory_id);
         shm_unlink(config.SHMEM_NAME);
@@ -88,7 +651,11 @@ int mf_init() {
     }
 
     // Memory layout of the shared memory region
-    // The shared memory region will be divided into three parts
+    // The shared memory region will be divided into these parts
+    // The superblock and the parts 1, 2 and 3 make up the control area, it is mapped by every process
+    // 0. Superblock at the start of the shared memory region, its size will be MF_SUPERBLOCK_SIZE bytes
+    // It holds the magic number, the layout version, the feature flags and the configuration parameters, see struct MFSuperblock
+    // The address differences below are from the end of the superblock
     // 1. Fixed shared memory region for the message queue headers.
     // Its size will be (MF_MQ_HEADER_SIZE bytes for each message queue) * config.MAX_QUEUES_IN_SHMEM
     // Each message queue header will contain the following information:
@@ -106,17 +673,27 @@ int mf_init() {
     // - Total used space in the shared memory region (4 bytes)
     // - Total free space in the shared memory region (4 bytes)
     // - Active processes using the MF library (4 bytes)
-    // 3. Shared memory region for the message queues after the info shared memory region
-    // Its size will be shared_memory_size - (MF_MQ_HEADER_SIZE bytes for each message queue) * config.MAX_QUEUES_IN_SHMEM - MF_SHMEM_INFO_SIZE bytes
+    // 3. Statistics region for the message queues after the info shared memory region
+    // It starts at a MF_STATS_ALIGNMENT aligned address difference and holds a struct mf_stats for each message queue, indexed by qid - 1
+    // 4. Shared memory region for the message queues after the control area, it starts at a page aligned offset
+    // Its size will be queue_region_size() bytes, each message queue is page aligned and mapped on its own
 
-    // Initialize the shared memory region by filling the region with zeros
-    memset(shared_memory_address_fixed, 0, shared_memory_size);
+    // Initialize the control area by filling it with zeros
+    memset(shared_memory_address_superblock, 0, control_area_size());
+    shared_memory_address_fixed = shared_memory_address_superblock + MF_SUPERBLOCK_SIZE;
 
-    // Calculate the address of the shared memory region for the shared memory information after the fixed shared memory region
-    shared_memory_address_info = shared_memory_address_fixed + (sizeof(char) * MF_MQ_HEADER_SIZE) * config.MAX_QUEUES_IN_SHMEM;
+    // Calculate the addresses of the info, statistics and message queue regions
+    set_region_addresses();
+
+    // Initialize the access mutexes of the message queues and the registry mutex
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        init_robust_mutex(&mq_lock_address(qid)->mutex);
+    }
+    init_robust_mutex(&((struct MFRegistry*)shared_memory_address_registry)->mutex);
 
-    // Calculate the address of the shared memory region for the message queues after the info shared memory region
-    shared_memory_address_queues = shared_memory_address_fixed + (sizeof(char) * MF_MQ_HEADER_SIZE) * config.MAX_QUEUES_IN_SHMEM + MF_SHMEM_INFO_SIZE;
+    // Segment 0 is the shared memory region, the segments left by a previous mfserver are removed
+    ((struct MFSegmentTable*)shared_memory_address_segments)->segment_count = 1;
+    segment_remove_all();
 
     // Initialize the shared memory information
     // Set the number of message queues in the shared memory region to 0
@@ -129,9 +706,9 @@ int mf_init() {
     int_to_bytes_little_endian(0, total_used_space_bytes);
     memcpy(shared_memory_address_info + sizeof(int), total_used_space_bytes, 4);
 
-    // Set the total free space in the shared memory region to shared_memory_size - (MF_MQ_HEADER_SIZE bytes for each message queue) * config.MAX_QUEUES_IN_SHMEM - MF_SHMEM_INFO_SIZE bytes
+    // Set the total free space in the shared memory region to queue_region_size() bytes
     char total_free_space_bytes[4];
-    int_to_bytes_little_endian(shared_memory_size - (sizeof(char) * MF_MQ_HEADER_SIZE) * config.MAX_QUEUES_IN_SHMEM - MF_SHMEM_INFO_SIZE, total_free_space_bytes);
+    int_to_bytes_little_endian(queue_region_size(), total_free_space_bytes);
     memcpy(shared_memory_address_info + sizeof(int) * 2, total_free_space_bytes, 4);
 
     // Set the number of active processes using the MF library to 0
@@ -139,11 +716,40 @@ int mf_init() {
     int_to_bytes_little_endian(0, active_processes_bytes);
     memcpy(shared_memory_address_info + sizeof(int) * 3, active_processes_bytes, 4);
 
+    // Recover the durable message queues from their files
+    durable_recover_all();
+
+    // Create the timer area of the delayed messages, see mf_send_at()
+    if (timer_create_area() == MF_ERROR) {
+        init_remove_region();
+        return (MF_ERROR);
+    }
+
+    // Create the buffer pool of the pooled message queues if POOL_SIZE asks for one, see MF_QATTR_POOL
+    if (pool_create_area() == MF_ERROR) {
+        timer_unmap();
+        char timer_name[MAXFILENAME];
+        timer_area_name(timer_name);
+        shm_unlink(timer_name);
+        init_remove_region();
+        return (MF_ERROR);
+    }
+
+    // Publish the configuration in the superblock, the magic number is written last
+    // so that a process connecting during the initialization never sees a partially initialized region
+    struct MFSuperblock* superblock = (struct MFSuperblock*)shared_memory_address_superblock;
+    superblock->layout_version = MF_LAYOUT_VERSION;
+    superblock->superblock_size = sizeof(struct MFSuperblock);
+    superblock->feature_flags = superblock_feature_flags();
+    superblock->queue_alignment = queue_alignment;
+    superblock->config = config;
+    __atomic_store_n(&superblock->magic, MF_SUPERBLOCK_MAGIC, __ATOMIC_RELEASE);
+
     // Print successful initialization
     printf("MF library initialized\n");
 
     // Print usable memory for the message queues
-    printf("Usable memory for the message queues: %ld\n", shared_memory_size - (sizeof(char) * MF_MQ_HEADER_SIZE) * config.MAX_QUEUES_IN_SHMEM - MF_SHMEM_INFO_SIZE);
+    printf("Usable memory for the message queues: %d\n", queue_region_size());
 
     return (MF_SUCCESS);
 }
@@ -154,6 +760,9 @@ int mf_init() {
 // Destroys the shared memory region
 // Destroys the semaphores
 int mf_destroy() {
+    // Commit the durable message queues, their files are kept so that they are recovered by the next mf_init()
+    mf_maintain();
+
     // Destroy the semaphores for each message queue
     for (int i = 1; i <= config.MAX_QUEUES_IN_SHMEM; i++) {
         // Control if the message queue is created by checking the message queue id
@@ -183,10 +792,6 @@ int mf_destroy() {
         strcpy(full_sem_name, sem_name);
         strcat(full_sem_name, full_sem_additon);
 
-        // Assemble the semaphore name for access mutex in the message queue
-        char access_mutex_sem_name[MAXFILENAME];
-        strcpy(access_mutex_sem_name, sem_name);
-        strcat(access_mutex_sem_name, access_mutex_sem_additon);
 
         // Destroy the semaphores
         int empty_sem_status = sem_unlink(empty_sem_name);
@@ -201,16 +806,47 @@ int mf_destroy() {
             return (MF_ERROR);
         }
 
-        int access_mutex_sem_status = sem_unlink(access_mutex_sem_name);
-        if (access_mutex_sem_status == -1) {
-            printf("Error: Could not destroy the semaphore for the access mutex in the message queue\n");
-            return (MF_ERROR);
+        // Remove the overflow log of a spilling message queue, the messages in it are lost
+        if (mq_header_get(i, MQ_FIELD_FLAGS) & MF_QATTR_SPILL) {
+            char mq_name[MAX_MQNAMESIZE];
+            memcpy(mq_name, shared_memory_address_fixed + (i - 1) * MF_MQ_HEADER_SIZE, MAX_MQNAMESIZE);
+            if (mq_header_get(i, MQ_FIELD_SPILL_COUNT) > 0) {
+                printf("Warning: %d spilled messages of the message queue %s are lost\n", mq_header_get(i, MQ_FIELD_SPILL_COUNT), mq_name);
+            }
+            spill_remove_queue(i, mq_name);
+        }
+
+        // The messages in the chunks of a pooled message queue are lost with the buffer pool
+        if ((mq_header_get(i, MQ_FIELD_FLAGS) & MF_QATTR_POOL) && mq_header_get(i, MQ_FIELD_SPILL_COUNT) > 0) {
+            char mq_name[MAX_MQNAMESIZE];
+            memcpy(mq_name, shared_memory_address_fixed + (i - 1) * MF_MQ_HEADER_SIZE, MAX_MQNAMESIZE);
+            printf("Warning: %d pooled messages of the message queue %s are lost\n", mq_header_get(i, MQ_FIELD_SPILL_COUNT), mq_name);
         }
     }
 
     // Destroy the shared memory region
-    // Unmap the shared memory region from the address space of the calling process
-    int shared_memory_status = munmap(shared_memory_address_fixed, config.SHMEM_SIZE);
+    // Unmap the shared memory region from the address space of the calling process and remove the segments after segment 0
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        queue_unmap(qid);
+    }
+    segment_remove_all();
+
+    // Remove the timer area, the delayed messages that are not delivered yet are lost
+    if (timer_area != NULL && timer_area->pending > 0) {
+        printf("Warning: %d delayed messages are not delivered\n", timer_area->pending);
+    }
+    timer_unmap();
+    char timer_name[MAXFILENAME];
+    timer_area_name(timer_name);
+    shm_unlink(timer_name);
+
+    // Remove the buffer pool, the chunks of the message queues went with them
+    pool_unmap();
+    char pool_name[MAXFILENAME];
+    pool_area_name(pool_name);
+    shm_unlink(pool_name);
+
+    int shared_memory_status = munmap(shared_memory_address_superblock, control_area_size());
     if (shared_memory_status == -1) {
         printf("Error: Could not unmap the shared memory region from the address space of the calling process\n");
         return (MF_ERROR);
@@ -235,49 +871,138 @@ int mf_destroy() {
     return (MF_SUCCESS);
 }
 
+// Removes what a failed mf_init() created before it failed: the semaphores and the mappings of the recovered durable message queues,
+// the segments, and the shared memory region. The files of the durable message queues are kept for the next mf_init()
+void init_remove_region() {
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        if (mq_header_get(qid, MQ_FIELD_ID) != qid) {
+            continue;
+        }
+        char empty_sem_name[MAXFILENAME];
+        char full_sem_name[MAXFILENAME];
+        snprintf(empty_sem_name, MAXFILENAME, "%.32s%d%.32s", base_sem_name, qid, empty_sem_additon);
+        snprintf(full_sem_name, MAXFILENAME, "%.32s%d%.32s", base_sem_name, qid, full_sem_additon);
+        sem_unlink(empty_sem_name);
+        sem_unlink(full_sem_name);
+        queue_unmap(qid);
+    }
+    segment_remove_all();
+
+    munmap(shared_memory_address_superblock, control_area_size());
+    shared_memory_address_superblock = NULL;
+    close(shared_memory_id);
+    shm_unlink(config.SHMEM_NAME);
+}
+
 // Applications linked with the MF library begin by calling the mf_connect() function, initializing the library for their use.
 // This function will be called by each application (process) intending to utilize the MF library for message-based communication.
 // It will perform the required initialization for the process.
 int mf_connect() {
-    // Read the configuration file
-    int conf_status = read_config_file(&config);
-    if (conf_status == MF_ERROR) {
-        printf("Error: Could not read the configuration file\n");
-        return (MF_ERROR);
+    library_lock();
+
+    // The threads of a process share its connection, the next calls only count it
+    if (connect_count > 0 && connected_pid == getpid()) {
+        connect_count++;
+        library_unlock();
+        return (MF_SUCCESS);
+    }
+
+    // A forked child inherits the mappings of its parent, it only registers itself as a new process
+    if (connect_count > 0) {
+        connected_pid = getpid();
+        connect_count = 1;
+        registry_register();
+        library_unlock();
+        return (MF_SUCCESS);
+    }
+
+    // The name of the shared memory region is taken from the MF_SHMEM_NAME environment variable,
+    // the configuration file is read only if it is not set, the rest of the configuration comes from the superblock
+    char* shmem_name = getenv("MF_SHMEM_NAME");
+    if (shmem_name != NULL) {
+        if (shmem_name[0] == '/') {
+            shmem_name++;
+        }
+        snprintf(config.SHMEM_NAME, MAXFILENAME, "%s", shmem_name);
+    } else {
+        int conf_status = read_config_file(&config);
+        if (conf_status == MF_ERROR) {
+            printf("Error: Could not read the configuration file\n");
+            library_unlock();
+            return (MF_ERROR);
+        }
     }
 
-    // Create a shared memory region or open an existing shared memory region
+    // Open the existing shared memory region created by mfserver
     shared_memory_id = shm_open(config.SHMEM_NAME, O_RDWR, 0666);
     if (shared_memory_id == -1) {
         printf("Error: Could not create or open the shared memory region\n");
+        library_unlock();
         return (MF_ERROR);
     }
 
-    // Set the size of the shared memory region
-    int shared_memory_size = config.SHMEM_SIZE * 1024 * sizeof(char);
+    // The size of the shared memory region must cover the superblock before it is mapped
+    struct stat shared_memory_stat;
+    if (fstat(shared_memory_id, &shared_memory_stat) == -1 || shared_memory_stat.st_size < MF_SUPERBLOCK_SIZE) {
+        printf("Error: Shared memory region is not initialized by mfserver\n");
+        close(shared_memory_id);
+        library_unlock();
+        return (MF_ERROR);
+    }
 
-    // Map the shared memory region to the address space of the calling process
-    shared_memory_address_fixed = mmap(NULL, shared_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_memory_id, 0);
-    if (shared_memory_address_fixed == MAP_FAILED) {
-        printf("Error: Could not map the shared memory region to the address space of the calling process\n");
+    // Map the superblock, validate it and take the configuration parameters from it
+    struct MFSuperblock* superblock = mmap(NULL, MF_SUPERBLOCK_SIZE, PROT_READ, MAP_SHARED, shared_memory_id, 0);
+    if (superblock == MAP_FAILED) {
+        printf("Error: Could not map the superblock of the shared memory region\n");
         close(shared_memory_id);
-        shm_unlink(config.SHMEM_NAME);
+        library_unlock();
         return (MF_ERROR);
     }
 
-    // Calculate the address of the shared memory region for the shared memory information after the fixed shared memory region 
-    shared_memory_address_info = shared_memory_address_fixed + (sizeof(char) * MF_MQ_HEADER_SIZE) * config.MAX_QUEUES_IN_SHMEM;
+    if (validate_superblock(superblock, (int)shared_memory_stat.st_size) == MF_ERROR) {
+        munmap(superblock, MF_SUPERBLOCK_SIZE);
+        close(shared_memory_id);
+        library_unlock();
+        return (MF_ERROR);
+    }
 
-    // Calculate the address of the shared memory region for the message queues after the info shared memory region
-    shared_memory_address_queues = shared_memory_address_fixed + (sizeof(char) * MF_MQ_HEADER_SIZE) * config.MAX_QUEUES_IN_SHMEM + MF_SHMEM_INFO_SIZE;
+    config = superblock->config;
+    queue_alignment = superblock->queue_alignment;
+    munmap(superblock, MF_SUPERBLOCK_SIZE);
 
-    // Increment the number of active processes in the shared memory information region
-    char active_processes_bytes[4];
-    memcpy(active_processes_bytes, shared_memory_address_info + sizeof(int) * 3, 4);
-    int active_processes = bytes_to_int_little_endian(active_processes_bytes);
-    active_processes++;
-    int_to_bytes_little_endian(active_processes, active_processes_bytes);
-    memcpy(shared_memory_address_info + sizeof(int) * 3, active_processes_bytes, 4);
+    // Map the control area of the shared memory region to the address space of the calling process
+    // The message queues are mapped by mf_open(), so the mapped size depends on the message queues used, not on SHMEM_SIZE
+    shared_memory_address_superblock = mmap(NULL, control_area_size(), PROT_READ | PROT_WRITE, MAP_SHARED, shared_memory_id, 0);
+    if (shared_memory_address_superblock == MAP_FAILED) {
+        printf("Error: Could not map the shared memory region to the address space of the calling process\n");
+        close(shared_memory_id);
+        library_unlock();
+        return (MF_ERROR);
+    }
+    shared_memory_address_fixed = shared_memory_address_superblock + MF_SUPERBLOCK_SIZE;
+
+    // Calculate the addresses of the info, statistics and message queue regions
+    set_region_addresses();
+
+    // Allocate the per-process mappings of the message queues, they are filled when the message queues are used
+    free(queue_mappings);
+    free(durable_mappings);
+    free(spill_mappings);
+    queue_mappings = calloc(config.MAX_QUEUES_IN_SHMEM, sizeof(struct MFQueueMapping));
+    durable_mappings = calloc(config.MAX_QUEUES_IN_SHMEM, sizeof(struct MFDurableMapping));
+    spill_mappings = calloc(config.MAX_QUEUES_IN_SHMEM, sizeof(struct MFSpillMapping));
+
+    // Register the process in the process registry and increment the number of active processes in the shared memory information region
+    registry_register();
+    connected_pid = getpid();
+    connect_count = 1;
+
+    // Start the trace ring if it is requested by the MF_TRACE environment variable
+    if (getenv("MF_TRACE") != NULL) {
+        mf_trace_start(MF_TRACE_DEFAULT_EVENTS);
+    }
+
+    library_unlock();
 
     // Print successful connection
     printf("MF library connected\n");
@@ -288,21 +1013,62 @@ int mf_connect() {
 // This function will be invoked by an application (process)that no longer requires the messaging library.
 // The library will remove this process from the list of active processes utilizing the library.
 int mf_disconnect() {
-    // Decrement the number of active processes in the shared memory information region
-    char active_processes_bytes[4];
-    memcpy(active_processes_bytes, shared_memory_address_info + sizeof(int) * 3, 4);
-    int active_processes = bytes_to_int_little_endian(active_processes_bytes);
-    active_processes--;
-    int_to_bytes_little_endian(active_processes, active_processes_bytes);
-    memcpy(shared_memory_address_info + sizeof(int) * 3, active_processes_bytes, 4);
+    library_lock();
+
+    // The connection of the process is shared by its threads, it is closed by the last mf_disconnect()
+    if (connect_count > 1 && connected_pid == getpid()) {
+        connect_count--;
+        library_unlock();
+        return (MF_SUCCESS);
+    }
+    connect_count = 0;
+
+    // Publish the staged messages of the batching message queues and stop the flusher thread
+    batch_stop_all();
+
+    // Remove the reply area of the process and unmap the reply areas of its callers
+    rpc_close_all();
+
+    // Unmap the timer area and the buffer pool
+    timer_unmap();
+    pool_unmap();
+
+    // Dump the trace ring to "<MF_TRACE>.<pid>" if it is requested by the MF_TRACE environment variable
+    char* trace_prefix = getenv("MF_TRACE");
+    if (trace_prefix != NULL && mf_trace_enabled) {
+        char trace_filename[MAXFILENAME];
+        snprintf(trace_filename, MAXFILENAME, "%s.%d", trace_prefix, (int)getpid());
+        mf_trace_stop();
+        mf_trace_dump(trace_filename);
+    }
+
+    // Remove the process from the process registry and decrement the number of active processes in the shared memory information region
+    // The message queues the process did not close are closed
+    registry_lock();
+    int* entry = registry_entry(getpid(), 0);
+    if (entry != NULL) {
+        registry_release(entry);
+    } else {
+        registry_add_active(-1);
+    }
+    registry_unlock();
 
-    // Unmap the shared memory region from the address space of the calling process
-    int shared_memory_status = munmap(shared_memory_address_fixed, config.SHMEM_SIZE);
+    // Unmap the message queues and the control area of the shared memory region from the address space of the calling process
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        queue_unmap(qid);
+    }
+    segment_close_all();
+    int shared_memory_status = munmap(shared_memory_address_superblock, control_area_size());
     if (shared_memory_status == -1) {
         printf("Error: Could not unmap the shared memory region from the address space of the calling process\n");
+        library_unlock();
         return (MF_ERROR);
     }
 
+    // Close the shared memory region, the region itself is removed by mfserver
+    close(shared_memory_id);
+    library_unlock();
+
     return (MF_SUCCESS);
 }
 
@@ -312,7 +1078,99 @@ int mf_disconnect() {
 // Assign a unique ID to each message queue (qid)
 // Allocate space for the message queue in the shared memory region
 // Initialize the message queue structure
+// The message queue is durable if its name is listed in DURABLE_QUEUES of the config file,
+// and compresses its messages if its name is listed in COMPRESSED_QUEUES, it spills to an overflow log if it is listed in SPILL_QUEUES
+// and to chunks of the buffer pool if it is listed in POOLED_QUEUES.
 int mf_create(char* mqname, int mqsize) {
+    struct mf_qattr attr;
+    config_queue_attr(mqname, &attr);
+
+    return mf_create_attr(mqname, mqsize, &attr);
+}
+
+// This function creates a new message queue with the given attributes, see struct mf_qattr.
+// A durable message queue (MF_QATTR_DURABLE) is backed by a memory-mapped file in DURABLE_DIR instead of the shared memory region.
+// If the file of a durable message queue exists, the messages in it are recovered.
+// A compressing message queue (MF_QATTR_COMPRESS) stores the messages of at least compress_threshold bytes compressed when that makes them smaller.
+// A spilling message queue (MF_QATTR_SPILL) appends the messages to an overflow log of spill_size KB in SPILL_DIR when it is full.
+// A pooled message queue (MF_QATTR_POOL) appends them to chunks it borrows from the buffer pool, between pool_min and pool_max KB.
+int mf_create_attr(char* mqname, int mqsize, struct mf_qattr* attr) {
+    int is_durable = attr != NULL && (attr->flags & MF_QATTR_DURABLE);
+    int is_spilling = attr != NULL && (attr->flags & MF_QATTR_SPILL);
+    int is_pooled = attr != NULL && (attr->flags & MF_QATTR_POOL);
+
+    // The overflow log and the buffer pool are not durable, the messages in them would be lost by a restart of a durable message queue
+    if (is_durable && (is_spilling || is_pooled)) {
+        printf("Error: A durable message queue cannot spill to an overflow log or the buffer pool\n");
+        return (MF_ERROR);
+    }
+    if (is_spilling && is_pooled) {
+        printf("Error: A message queue spills either to an overflow log or to the buffer pool\n");
+        return (MF_ERROR);
+    }
+
+    // The quotas of a pooled message queue are rounded up to chunks, the maximum is the whole buffer pool by default
+    struct MFPoolArea* pool = is_pooled ? pool_area_map() : NULL;
+    if (is_pooled && pool == NULL) {
+        printf("Error: There is no buffer pool for the pooled message queue, see POOL_SIZE in the config file\n");
+        return (MF_ERROR);
+    }
+    int pool_min_chunks = is_pooled && attr->pool_min > 0 ? (attr->pool_min * 1024 + MF_POOL_CHUNK_SIZE - 1) / MF_POOL_CHUNK_SIZE : 0;
+    int pool_max_chunks = is_pooled && attr->pool_max > 0 ? (attr->pool_max * 1024 + MF_POOL_CHUNK_SIZE - 1) / MF_POOL_CHUNK_SIZE : 0;
+    if (is_pooled && pool_max_chunks == 0) {
+        pool_max_chunks = pool->chunk_count;
+    }
+    if (is_pooled && (pool_min_chunks > pool_max_chunks || pool_max_chunks > pool->chunk_count)) {
+        printf("Error: Buffer pool quotas of the message queue are not within the limits\n");
+        return (MF_ERROR);
+    }
+    // The message count limit is MAX_MSGS_IN_QUEUE of the config unless the message queue sets its own, 0 in the header is no limit
+    int max_msgs = attr != NULL && attr->max_msgs != 0 ? attr->max_msgs : config.MAX_MSGS_IN_QUEUE;
+    int max_bytes = attr != NULL ? attr->max_bytes : 0;
+    if (max_msgs < MF_UNLIMITED_MSGS || max_bytes < 0) {
+        printf("Error: Message count or byte limit of the message queue is not within the limits\n");
+        return (MF_ERROR);
+    }
+    int spill_size = is_spilling && attr->spill_size > 0 ? attr->spill_size : MF_DEFAULT_SPILL_SIZE;
+    if (is_spilling && spill_size > MF_MAX_SPILL_SIZE) {
+        printf("Error: Overflow log size is not within the limits\n");
+        return (MF_ERROR);
+    }
+
+    // The compression threshold is 0 if the message queue does not compress its messages
+    int compress_threshold = 0;
+    if (attr != NULL && (attr->flags & MF_QATTR_COMPRESS)) {
+        compress_threshold = attr->compress_threshold > 0 ? attr->compress_threshold : MF_DEFAULT_COMPRESS_THRESHOLD;
+    }
+    int ttl_ms = attr != NULL && attr->ttl_ms > 0 ? attr->ttl_ms : 0;
+
+    // Check if the message queue size is within the limits
+    if (mqsize < MIN_MQSIZE || mqsize > MAX_MQSIZE) {
+        printf("Error: Message queue size is not within the limits\n");
+        return (MF_ERROR);
+    }
+
+    // The registry mutex is held from the search of the space to the publication of the header, so that two processes creating
+    // message queues at the same time never take the same space, qid or file, and the counters of the shared memory information stay right
+    registry_lock();
+
+    // A durable message queue may already be recovered from its file by mf_init(), reuse it if it has the same size and attributes
+    int existing_qid = is_durable ? mq_find_by_name(mqname) : MF_ERROR;
+    if (existing_qid != MF_ERROR) {
+        registry_unlock();
+        if (mq_header_get(existing_qid, MQ_FIELD_SIZE) != align_to_queue_alignment(mqsize * 1024 * sizeof(char))
+            || mq_header_get(existing_qid, MQ_FIELD_FLAGS) != attr->flags
+            || mq_header_get(existing_qid, MQ_FIELD_MAX_MSGS) != (max_msgs == MF_UNLIMITED_MSGS ? 0 : max_msgs)
+            || mq_header_get(existing_qid, MQ_FIELD_MAX_BYTES) != max_bytes
+            || mq_header_get(existing_qid, MQ_FIELD_COMPRESS_THRESHOLD) != compress_threshold
+            || mq_header_get(existing_qid, MQ_FIELD_TTL) != ttl_ms) {
+            printf("Error: Durable message queue %s already exists with a different size or attributes\n", mqname);
+            return (MF_ERROR);
+        }
+        printf("Durable message queue already exists with message queue name: %s\n", mqname);
+        return (MF_SUCCESS);
+    }
+
     // Get the number of message queues in the shared memory region from the shared memory information region
     char mq_count_bytes[4];
     memcpy(mq_count_bytes, shared_memory_address_info, 4);
@@ -320,6 +1178,7 @@ int mf_create(char* mqname, int mqsize) {
 
     // Check if the count of message queues in the shared memory region is less than the maximum alslowed
     if (msg_queue_count >= config.MAX_QUEUES_IN_SHMEM) {
+        registry_unlock();
         printf("Error: Maximum number of message queues in the shared memory region is reached\n");
         printf("Consider increasing the maximum number of message queues in the shared memory region from config.\n");
         return (MF_ERROR);
@@ -330,85 +1189,35 @@ int mf_create(char* mqname, int mqsize) {
         printf("Warning: Message queue count is %d. Be careful.", msg_queue_count);
     }
 
-    // Check if the message queue size is within the limits
-    if (mqsize < MIN_MQSIZE || mqsize > MAX_MQSIZE) {
-        printf("Error: Message queue size is not within the limits\n");
-        return (MF_ERROR);
-    }
-
     // Calculate the message queue size in bytes
-    int mqsize_bytes = mqsize * 1024 * sizeof(char);
-
-    // Find space for the message queue in the shared memory region by 
-    // Searching for the first empty slot and suitable slot in the shared memory region for the message queues
-    // Initialize two pointers, one for the start of the free space and one for the end of the free space
-    // Please note that these are all address differences
-    int start_free_space_i = 0;
-
-    // End of the free space is the end of the shared memory region, meaning end of the shared memory region for the message queues
-    // So we remove the size of the fixed shared memory region and the size of the shared memory information region from the shared memory size
-
-    // Size of the free space
-    int free_space_size = config.SHMEM_SIZE * 1024 - (sizeof(char) * MF_MQ_HEADER_SIZE) * config.MAX_QUEUES_IN_SHMEM - MF_SHMEM_INFO_SIZE;
-    // End of the free space
-    int end_free_space_j = free_space_size;
-
-    // Loop through the message queues in the fixed shared memory region to find the first empty slot by
-    // checking the address differences of the message queues in the fixed shared memory region
-    // While looping, update the start and end of the free space
-    int end_of_last_mq = 0; // End of the filled space right after the last empty space
-    int visited_free_space = 0; // Visited free space in the shared memory region
-    while (visited_free_space <= msg_queue_count + 1) {
-        end_free_space_j = free_space_size;
-
-        // Loop through the message queues in the fixed shared memory region
-        // to find an empty slot by checking the address differences of the start of message queues
-        // Get minimum address difference of the start of the message queues higher than the start of the free space
-        for (int i = 0; i < config.MAX_QUEUES_IN_SHMEM; i++) {
-            // First check if the message queue is empty by checking the message queue id
-            char mq_id_bytes[4];
-            memcpy(mq_id_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE, 4);
-            int mq_id = bytes_to_int_little_endian(mq_id_bytes);
-            // If the message queue is empty, continue
-            if (mq_id == 0) {
-                continue;
-            }
-
-            // Get the address difference between the start address of the message queue and the start address of the shared memory region for message queues
-            char mq_start_address_difference_bytes[4];
-            memcpy(mq_start_address_difference_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 3, 4);
-            int mq_start_address_diff = bytes_to_int_little_endian(mq_start_address_difference_bytes);
-
-            // Check if the start address of the message queue is higher than the start of the free space
-            // and lower than the end of the free space, then update the end of the free space and end of the last message queue
-            if (mq_start_address_diff < end_free_space_j && mq_start_address_diff >= start_free_space_i) {
-                end_free_space_j = mq_start_address_diff;
-
-                // Get the message queue size to calculate the end of the last message queue
-                char mq_size_bytes[4];
-                memcpy(mq_size_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int), 4);
-                int mq_size = bytes_to_int_little_endian(mq_size_bytes);
-
-                // Calculate the end of the last message queue to update the start of the free space next time
-                end_of_last_mq = mq_start_address_diff + mq_size;
+    // It is rounded up to the page size so that every message queue starts at a page and can be mapped on its own
+    int mqsize_bytes = align_to_queue_alignment(mqsize * 1024 * sizeof(char));
+
+    // Durable message queues do not use space in the shared memory region
+    int shmem_bytes = is_durable ? 0 : mqsize_bytes;
+
+    // Find space for the message queue in the segments of the shared memory region, first fit in the first segment that has space
+    // A new segment is created if none of the segments has space, see segment_create()
+    int mq_segment = -1;
+    long long mq_start_offset = 0;
+    if (!is_durable) {
+        struct MFSegmentTable* segment_table = (struct MFSegmentTable*)shared_memory_address_segments;
+        for (int segment = 0; segment < segment_table->segment_count && mq_segment == -1; segment++) {
+            mq_start_offset = segment_find_space(segment, shmem_bytes);
+            if (mq_start_offset != -1) {
+                mq_segment = segment;
             }
         }
 
-        // Update the visited free space
-        visited_free_space++;
-
-        // Check the empty space we found is enough for the message queue
-        if (end_free_space_j - start_free_space_i >= mqsize_bytes) {
-            break;
+        if (mq_segment == -1) {
+            mq_segment = segment_create(shmem_bytes);
+            mq_start_offset = 0;
         }
-
-        // If the empty space is not enough, update the start of the free space to the end of the last message queue
-        // Update the start of the free space to the end of the last message queue
-        start_free_space_i = end_of_last_mq;
     }
 
     // Check if the empty space is enough for the message queue
-    if (end_free_space_j - start_free_space_i < mqsize_bytes) {
+    if (!is_durable && mq_segment == -1) {
+        registry_unlock();
         printf("Error: Not enough space for the message queue in the shared memory region\n");
         return (MF_ERROR);
     }
@@ -436,20 +1245,48 @@ int mf_create(char* mqname, int mqsize) {
         qid++;
     }
 
+    // Instance id distinguishes this message queue from the previous message queues with the same qid
+    int instance = (int)((monotonic_time_ns() ^ ((unsigned long long)getpid() << 20)) & 0x7FFFFFFF) | 1;
+
+    // Messages in the message queue, a durable message queue starts with the messages recovered from its file
+    int mq_msg_count = 0;
+    int mq_next_msg_address_diff = 0;
+    int mq_end_msg_address_diff = 0;
+
+    // Create or recover the file of the durable message queue
+    if (is_durable && durable_open_queue(qid, mqname, mqsize_bytes, instance, &mq_msg_count, &mq_next_msg_address_diff, &mq_end_msg_address_diff) == MF_ERROR) {
+        registry_unlock();
+        printf("Error: Could not create the file of the durable message queue\n");
+        return (MF_ERROR);
+    }
+
+    // Create the overflow log of the spilling message queue, a log left by a previous message queue with the same name is emptied
+    if (is_spilling && spill_create_log(mqname, spill_size * 1024) == MF_ERROR) {
+        registry_unlock();
+        printf("Error: Could not create the overflow log of the message queue\n");
+        return (MF_ERROR);
+    }
+
+    // Reserve the minimum chunks of the pooled message queue, they are held until the message queue is removed
+    int pool_reserve = POOL_NONE;
+    if (is_pooled && pool_min_chunks > 0) {
+        pool_reserve = pool_take_chunks(pool, pool_min_chunks);
+        if (pool_reserve == POOL_NONE) {
+            registry_unlock();
+            printf("Error: Not enough free chunks in the buffer pool for the minimum of the message queue\n");
+            return (MF_ERROR);
+        }
+    }
+
     // Start address of the header of the message queue in the fixed shared memory region
     void* mq_header_address = shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE;
 
     // Set the message queue name in the message queue header
     memcpy(mq_header_address, mqname, sizeof(char) * MAX_MQNAMESIZE);
 
-    // Set qid in the message queue header
-    char qid_bytes[4];
-    int_to_bytes_little_endian(qid, qid_bytes);
-    memcpy(mq_header_address + sizeof(char) * MAX_MQNAMESIZE, qid_bytes, 4);
-
-    // Initialize the message count to 0
+    // Initialize the message count, it is 0 unless messages are recovered
     char mq_msg_count_bytes[4];
-    int_to_bytes_little_endian(0, mq_msg_count_bytes);
+    int_to_bytes_little_endian(mq_msg_count, mq_msg_count_bytes);
     memcpy(mq_header_address + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 2, mq_msg_count_bytes, 4);
 
     // Set the message queue size in the message queue header
@@ -466,7 +1303,7 @@ int mf_create(char* mqname, int mqsize) {
     char total_used_space_bytes[4];
     memcpy(total_used_space_bytes, shared_memory_address_info + sizeof(int), 4);
     int total_used_space = bytes_to_int_little_endian(total_used_space_bytes);
-    total_used_space += mqsize_bytes;
+    total_used_space += shmem_bytes;
     int_to_bytes_little_endian(total_used_space, total_used_space_bytes);
     memcpy(shared_memory_address_info + sizeof(int), total_used_space_bytes, 4);
 
@@ -474,29 +1311,24 @@ int mf_create(char* mqname, int mqsize) {
     char total_free_space_bytes[4];
     memcpy(total_free_space_bytes, shared_memory_address_info + sizeof(int) * 2, 4);
     int total_free_space = bytes_to_int_little_endian(total_free_space_bytes);
-    total_free_space -= mqsize_bytes;
+    total_free_space -= shmem_bytes;
     int_to_bytes_little_endian(total_free_space, total_free_space_bytes);
     memcpy(shared_memory_address_info + sizeof(int) * 2, total_free_space_bytes, 4);
 
-    // Calculate the start address of the message queue in the shared memory region
-    void* mq_start_address = shared_memory_address_queues + start_free_space_i;
-
-    // Calculate the address difference between the start address of the message queue and the start address of the shared memory region for message queues
-    int mq_start_address_diff = mq_start_address - shared_memory_address_queues;
+    // Set the segment of the message queue and the 64-bit address difference between the start address of the message queue
+    // and the start address of the message queues in the segment
+    // It is -1 for a durable message queue as it is not in the shared memory region
+    mq_header_set(qid, MQ_FIELD_SEGMENT, is_durable ? 0 : mq_segment);
+    mq_set_start_offset(qid, is_durable ? -1 : mq_start_offset);
 
-    // Set the address difference in the message queue header
-    char mq_start_address_difference_bytes[4];
-    int_to_bytes_little_endian(mq_start_address_diff, mq_start_address_difference_bytes);
-    memcpy(mq_header_address + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 3, mq_start_address_difference_bytes, 4);
-
-    // Set the address difference between the start address of the next message in the message queue and the start address of the message queue to 0
+    // Set the address difference between the start address of the next message in the message queue and the start address of the message queue
     char mq_next_msg_address_difference_bytes[4];
-    int_to_bytes_little_endian(0, mq_next_msg_address_difference_bytes);
+    int_to_bytes_little_endian(mq_next_msg_address_diff, mq_next_msg_address_difference_bytes);
     memcpy(mq_header_address + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 4, mq_next_msg_address_difference_bytes, 4);
 
-    // Set the address difference between the end address of the last message in the message queue and the start address of the message queue to 0
+    // Set the address difference between the end address of the last message in the message queue and the start address of the message queue
     char mq_end_msg_address_difference_bytes[4];
-    int_to_bytes_little_endian(0, mq_end_msg_address_difference_bytes);
+    int_to_bytes_little_endian(mq_end_msg_address_diff, mq_end_msg_address_difference_bytes);
     memcpy(mq_header_address + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 5, mq_end_msg_address_difference_bytes, 4);
 
     // Set the reference count to 0
@@ -504,7 +1336,54 @@ int mf_create(char* mqname, int mqsize) {
     int_to_bytes_little_endian(0, mq_ref_count_bytes);
     memcpy(mq_header_address + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 6, mq_ref_count_bytes, 4);
 
+    // Set the flags and the instance id of the message queue
+    mq_header_set(qid, MQ_FIELD_FLAGS, attr != NULL ? attr->flags : 0);
+    mq_header_set(qid, MQ_FIELD_INSTANCE, instance);
+
+    // Set the compression threshold, 0 if the message queue does not compress its messages
+    mq_header_set(qid, MQ_FIELD_COMPRESS_THRESHOLD, compress_threshold);
+
+    // Set the default time to live of the messages, 0 if they do not expire
+    mq_header_set(qid, MQ_FIELD_TTL, ttl_ms);
+
+    // Set the size of the overflow log, 0 if the message queue does not spill, the log starts empty
+    mq_header_set(qid, MQ_FIELD_SPILL_COUNT, 0);
+    mq_header_set(qid, MQ_FIELD_SPILL_HEAD, 0);
+    mq_header_set(qid, MQ_FIELD_SPILL_TAIL, 0);
+    mq_header_set(qid, MQ_FIELD_SPILL_SIZE, is_spilling ? spill_size * 1024 : 0);
+
+    // Set the buffer pool quotas and the reserved chunks of a pooled message queue
+    mq_header_set(qid, MQ_FIELD_POOL_CHUNKS, pool_reserve != POOL_NONE ? pool_min_chunks : 0);
+    mq_header_set(qid, MQ_FIELD_POOL_MIN, pool_min_chunks);
+    mq_header_set(qid, MQ_FIELD_POOL_MAX, pool_max_chunks);
+    mq_header_set(qid, MQ_FIELD_POOL_RESERVE, pool_reserve + 1);
+
+    // Set the message count and byte limits, and count the bytes of the recovered messages
+    mq_header_set(qid, MQ_FIELD_MAX_MSGS, max_msgs == MF_UNLIMITED_MSGS ? 0 : max_msgs);
+    mq_header_set(qid, MQ_FIELD_MAX_BYTES, max_bytes);
+    mq_header_set(qid, MQ_FIELD_MSG_BYTES, mq_msg_count > 0 ? mq_count_msg_bytes(qid) : 0);
+
+    // Reset the statistics of the message queue
+    memset(mq_stats_address(qid), 0, sizeof(struct mf_stats));
+
+    // Set qid in the message queue header last, the message queue is found by its qid, see mq_find_by_name(),
+    // so the other processes see it only once the rest of its header is set
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    char qid_bytes[4];
+    int_to_bytes_little_endian(qid, qid_bytes);
+    memcpy(mq_header_address + sizeof(char) * MAX_MQNAMESIZE, qid_bytes, 4);
+    registry_unlock();
+
+    // Wake up the ring workers whose submissions wait for the message queue to be created
+    unsigned long long hold_start_ns = 0;
+    mq_lock(qid, &hold_start_ns);
+    mq_wake_ring_waiters(qid);
+    mq_unlock(qid, hold_start_ns);
+
     printf("Message queue created with message queue name: %s, message queue id: %d, message queue size: %d\n", mqname, qid, mqsize_bytes);
+    if (mq_msg_count > 0) {
+        printf("Recovered %d messages of the durable message queue %s\n", mq_msg_count, mqname);
+    }
 
     return (MF_SUCCESS);
 }
@@ -512,6 +1391,34 @@ int mf_create(char* mqname, int mqsize) {
 // This function removes the message queue specified by the message queue name.
 // It deallocates the space in the shared memory used by the message queue.
 int mf_remove(char* mqname) {
+    // A partition i > 0 is removed only with its logical message queue, by the name of partition 0
+    int partition_qid = mq_find_by_name(mqname);
+    if (partition_qid != MF_ERROR && mq_header_get(partition_qid, MQ_FIELD_PARTITION_HEAD) != 0) {
+        printf("Error: Message queue is a partition of a logical message queue, remove the logical message queue instead\n");
+        return (MF_ERROR);
+    }
+
+    // The partitions of a logical message queue are removed with it, none of them may be in use
+    if (partition_qid != MF_ERROR && mq_header_get(partition_qid, MQ_FIELD_PARTITIONS) > 1) {
+        int qids[MF_MAX_PARTITIONS];
+        int partitions = partition_qids(partition_qid, qids);
+        for (int i = 0; i < partitions; i++) {
+            if (mq_header_get(qids[i], MQ_FIELD_REF_COUNT) > 0) {
+                printf("Error: Message queue is still in use\n");
+                return (MF_ERROR);
+            }
+        }
+
+        // Partition 0 is removed last, it holds the number of partitions
+        mq_header_set(partition_qid, MQ_FIELD_PARTITIONS, 0);
+        for (int i = partitions - 1; i >= 1; i--) {
+            char partition_name[MAX_MQNAMESIZE];
+            memcpy(partition_name, shared_memory_address_fixed + (qids[i] - 1) * MF_MQ_HEADER_SIZE, MAX_MQNAMESIZE);
+            mq_header_set(qids[i], MQ_FIELD_PARTITION_HEAD, 0);
+            mf_remove(partition_name);
+        }
+    }
+
     // Search for the message queue header in the fixed shared memory region
     // If the message queue is found, deallocate the space in the shared memory used by the message queue
     // Search through the message queue names in the fixed shared memory region
@@ -545,10 +1452,31 @@ int mf_remove(char* mqname) {
             memcpy(mq_start_address_difference_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 3, 4);
             int mq_start_address_diff = bytes_to_int_little_endian(mq_start_address_difference_bytes);
 
-            // Calculate the start address of the message queue in the shared memory region
-            void* mq_start_address = shared_memory_address_queues + mq_start_address_diff;
+            // Map the message queue in the shared memory region to clear it
+            void* mq_start_address = NULL;
+            if (mq_start_address_diff != -1) {
+                mq_start_address = mq_region_address(i + 1);
+            }
+
+            // A durable message queue does not use space in the shared memory region, its file is removed instead
+            int is_durable = mq_header_get(i + 1, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE;
+            if (is_durable) {
+                durable_remove_queue(i + 1, mq_name);
+                mq_size = 0;
+            }
+
+            // The overflow log of a spilling message queue is removed with the messages in it
+            // The chunks of a pooled message queue go back to the buffer pool
+            if (mq_header_get(i + 1, MQ_FIELD_FLAGS) & MF_QATTR_SPILL) {
+                spill_remove_queue(i + 1, mq_name);
+            }
+            if (mq_header_get(i + 1, MQ_FIELD_FLAGS) & MF_QATTR_POOL) {
+                pool_release_queue(i + 1);
+            }
 
             // Update the message queue count in the shared memory information
+            // The registry mutex keeps the counters right while other processes create message queues, see mf_create_attr()
+            registry_lock();
             char mq_count_bytes[4];
             memcpy(mq_count_bytes, shared_memory_address_info, 4);
             int mq_count = bytes_to_int_little_endian(mq_count_bytes);
@@ -571,6 +1499,7 @@ int mf_remove(char* mqname) {
             total_free_space += mq_size;
             int_to_bytes_little_endian(total_free_space, total_free_space_bytes);
             memcpy(shared_memory_address_info + sizeof(int) * 2, total_free_space_bytes, 4);
+            registry_unlock();
 
             // Clear the semaphores for the message queue
             // Create a semaphore base name for the message queue
@@ -592,10 +1521,6 @@ int mf_remove(char* mqname) {
             strcpy(full_sem_name, sem_name);
             strcat(full_sem_name, full_sem_additon);
 
-            // Assemble the semaphore name for access mutex in the message queue
-            char access_mutex_sem_name[MAXFILENAME];
-            strcpy(access_mutex_sem_name, sem_name);
-            strcat(access_mutex_sem_name, access_mutex_sem_additon);
 
             // Destroy the semaphores
             int empty_sem_status = sem_unlink(empty_sem_name);
@@ -610,17 +1535,18 @@ int mf_remove(char* mqname) {
                 return (MF_ERROR);
             }
 
-            int access_mutex_sem_status = sem_unlink(access_mutex_sem_name);
-            if (access_mutex_sem_status == -1) {
-                printf("Error: Could not destroy the semaphore for the access mutex in the message queue\n");
-                return (MF_ERROR);
-            }
 
             // Clear the message queue header in the fixed shared memory region by filling it with zeros
             memset(shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE, 0, MF_MQ_HEADER_SIZE);
 
-            // Clear the message queue in the shared memory region by filling it with zeros
-            memset(mq_start_address, 0, mq_size);
+            // Clear the statistics of the message queue
+            memset(mq_stats_address(i + 1), 0, sizeof(struct mf_stats));
+
+            // Clear the message queue in the shared memory region by filling it with zeros and unmap it
+            if (!is_durable && mq_start_address != NULL) {
+                memset(mq_start_address, 0, mq_size);
+            }
+            queue_unmap(i + 1);
 
             // Print successful removal
             printf("Message queue removed with message queue name: %s\n", mqname);
@@ -651,15 +1577,31 @@ int mf_open(char* mqname) {
             memcpy(mq_id_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE, 4);
             int qid = bytes_to_int_little_endian(mq_id_bytes);
 
-            // Get the reference count of the message queue
-            char mq_ref_count_bytes[4];
-            memcpy(mq_ref_count_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 6, 4);
-            int mq_ref_count = bytes_to_int_little_endian(mq_ref_count_bytes);
+            // Map the message queue to the address space of the calling process
+            if (mq_region_address(qid) == NULL) {
+                printf("Error: Could not map the message queue\n");
+                return (MF_ERROR);
+            }
 
-            // Increment the reference count of the message queue   
-            mq_ref_count++;
-            int_to_bytes_little_endian(mq_ref_count, mq_ref_count_bytes);
-            memcpy(shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 6, mq_ref_count_bytes, 4);
+            // Increment the reference count of the message queue and the open count of the process in the process registry
+            registry_lock();
+            registry_add_ref(qid, 1);
+            registry_unlock();
+
+            // Open the other partitions of a logical message queue
+            if (mq_header_get(qid, MQ_FIELD_PARTITIONS) > 1) {
+                int qids[MF_MAX_PARTITIONS];
+                int partitions = partition_qids(qid, qids);
+                for (int p = 1; p < partitions; p++) {
+                    if (mq_region_address(qids[p]) == NULL) {
+                        printf("Error: Could not map the message queue\n");
+                        return (MF_ERROR);
+                    }
+                    registry_lock();
+                    registry_add_ref(qids[p], 1);
+                    registry_unlock();
+                }
+            }
 
             // Print successful opening
             printf("Message queue opened with message queue name: %s, message queue id: %d\n", mqname, qid);
@@ -690,16 +1632,29 @@ int mf_close(int qid) {
 
         // Compare the message queue ID with the given message queue ID
         if (mq_id == qid) {
+            // Close the other partitions of a logical message queue
+            if (mq_header_get(qid, MQ_FIELD_PARTITIONS) > 1) {
+                int qids[MF_MAX_PARTITIONS];
+                int partitions = partition_qids(qid, qids);
+                for (int p = 1; p < partitions; p++) {
+                    mf_close(qids[p]);
+                }
+            }
 
-            // Get the reference count of the message queue
-            char mq_ref_count_bytes[4];
-            memcpy(mq_ref_count_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 6, 4);
-            int mq_ref_count = bytes_to_int_little_endian(mq_ref_count_bytes);
-
-            // Decrement the reference count of the message queue
-            mq_ref_count--;
-            int_to_bytes_little_endian(mq_ref_count, mq_ref_count_bytes);
-            memcpy(shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 6, mq_ref_count_bytes, 4);
+            // Publish the messages the process staged for the message queue
+            mf_flush(qid);
+
+            // Decrement the reference count of the message queue and the open count of the process in the process registry
+            // Unmap the message queue when the process closes it for the last time
+            library_lock();
+            registry_lock();
+            registry_add_ref(qid, -1);
+            int open_count = registry_open_count(qid);
+            registry_unlock();
+            if (open_count == 0) {
+                queue_unmap(qid);
+            }
+            library_unlock();
 
             return(MF_SUCCESS);
         }
@@ -720,661 +1675,5174 @@ int mf_send(int qid, void* bufptr, int datalen) {
         return (MF_ERROR);
     }
 
-    // Create a semaphore base name for the message queue
-    // The semaphore base name will be "semaphore" + qid
-    char sem_name[MAXFILENAME];
-    strcpy(sem_name, base_sem_name);
-    // Add the message queue id to the base semaphore name
-    char qid_str[4];
-    sprintf(qid_str, "%d", qid);
-    strcat(sem_name, qid_str);
-
-    // Assemble the semaphore name for empty message queue
-    char empty_sem_name[MAXFILENAME];
-    strcpy(empty_sem_name, sem_name);
-    strcat(empty_sem_name, empty_sem_additon);
-
-    // Assemble the semaphore name for full message queue
-    char full_sem_name[MAXFILENAME];
-    strcpy(full_sem_name, sem_name);
-    strcat(full_sem_name, full_sem_additon);
-
-    // Assemble the semaphore name for access mutex in the message queue
-    char access_mutex_sem_name[MAXFILENAME];
-    strcpy(access_mutex_sem_name, sem_name);
-    strcat(access_mutex_sem_name, access_mutex_sem_additon);
-
-    // Open the semaphores
-    sem_t* empty_sem = sem_open(empty_sem_name, O_CREAT, 0666, 0);
-    sem_t* full_sem = sem_open(full_sem_name, O_CREAT, 0666, 0);
-    sem_t* access_mutex_sem = sem_open(access_mutex_sem_name, O_CREAT, 0666, 1);
+    // Control the message queue id
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-    // Check variable if the message queue is full
-    int is_sent = 0;
+    MF_TRACE(send_start, MF_EV_SEND_START, qid, datalen);
 
-    // Block the caller until space is available in the queue
-    while (!is_sent) {
-        // Wait for the access mutex semaphore
-        sem_wait(access_mutex_sem);
+    // Get the semaphores of the message queue from the handle cache of the calling thread
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return (MF_ERROR);
+    }
 
-        // Search for the message queue header in the fixed shared memory region
-        int qid_found = 0;
-        for (int i = 0; i < config.MAX_QUEUES_IN_SHMEM; i++) {
-            char mq_id_bytes[4];
-            memcpy(mq_id_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE, 4);
-            int mq_id = bytes_to_int_little_endian(mq_id_bytes);
-            if (mq_id == qid) {
-                qid_found = 1;
-                break;
+    // Stage the message if the process sends to the message queue in batches, see mf_set_batching()
+    struct MFBatch* batch = batch_of(qid);
+    if (batch != NULL) {
+        pthread_mutex_lock(&batch->mutex);
+        if (batch->max_bytes > 0) {
+            int stage_status = batch_stage(qid, batch, handle, bufptr, datalen);
+            pthread_mutex_unlock(&batch->mutex);
+            if (stage_status == MF_ERROR) {
+                return (MF_ERROR);
             }
+            MF_TRACE(send_commit, MF_EV_SEND_COMMIT, qid, datalen);
+            printf("Message staged for message queue with message queue id: %d\n", qid);
+            return (MF_SUCCESS);
         }
+        pthread_mutex_unlock(&batch->mutex);
+    }
 
-        // If the message queue is not found, release the access mutex semaphore and wait for the empty semaphore
-        if (qid_found == 0) {
-            sem_post(access_mutex_sem);
-            sem_wait(empty_sem);
-            continue;
-        }
-
-        // Update the data length to get actual data length
-        datalen = datalen * sizeof(char);
+    // Block the caller until space is available in the queue, the message gets the default time to live of the message queue
+    if (mq_send_ttl(qid, handle, bufptr, datalen, mq_header_get(qid, MQ_FIELD_TTL)) == MF_ERROR) {
+        return (MF_ERROR);
+    }
 
-        // Get message count
-        char mq_msg_count_bytes[4];
-        memcpy(mq_msg_count_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 2, 4);
-        int mq_msg_count = bytes_to_int_little_endian(mq_msg_count_bytes);
+    // Print successful sending
+    printf("Message sent to message queue with message queue id: %d\n", qid);
 
-        // Check if the message queue is full and block the caller until space is available in the queue
-        if (mq_msg_count == config.MAX_MSGS_IN_QUEUE) {
-            sem_post(access_mutex_sem);
-            sem_wait(empty_sem);
-            continue;
-        }
+    return (MF_SUCCESS);
+}
 
-        // Get the start address difference of the message queue in the shared memory region
-        char mq_start_address_difference_bytes[4];
-        memcpy(mq_start_address_difference_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 3, 4);
-        int mq_start_address_diff = bytes_to_int_little_endian(mq_start_address_difference_bytes);
+// This function sends a message to the message queue like mf_send(), the message expires ttl_ms milliseconds later.
+// An expired message is reclaimed without being received, see mq_reclaim_expired(). A ttl_ms of 0 sends a message that does not expire.
+// The message is not staged if the process sends to the message queue in batches.
+int mf_send_ttl(int qid, void* bufptr, int datalen, int ttl_ms) {
+    // Control the data length
+    if (datalen < MIN_DATALEN || datalen > MAX_DATALEN) {
+        printf("Error: Data length is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-        // Calculate the start address of the message queue in the shared memory region
-        void* mq_start_address = shared_memory_address_queues + mq_start_address_diff;
+    // Control the message queue id
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-        // Get message queue size
-        char mq_size_bytes[4];
-        memcpy(mq_size_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int), 4);
-        int mq_size = bytes_to_int_little_endian(mq_size_bytes);
+    // Control the time to live
+    if (ttl_ms < 0) {
+        printf("Error: Time to live is negative\n");
+        return (MF_ERROR);
+    }
 
-        // Get the address difference between the start address of the next message in the message queue and the start address of the message queue
-        char mq_next_msg_address_difference_bytes[4];
-        memcpy(mq_next_msg_address_difference_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 4, 4);
-        int mq_next_msg_address_diff = bytes_to_int_little_endian(mq_next_msg_address_difference_bytes);
+    MF_TRACE(send_start, MF_EV_SEND_START, qid, datalen);
 
-        // Get the address difference between the end address of the last message in the message queue and the start address of the message queue
-        char mq_end_msg_address_difference_bytes[4];
-        memcpy(mq_end_msg_address_difference_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 5, 4);
-        int mq_end_msg_address_diff = bytes_to_int_little_endian(mq_end_msg_address_difference_bytes);
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return (MF_ERROR);
+    }
 
-        // The message format in the message queue will be as follows:
-        // - Message length (4 bytes)
-        // - Message data (datalen bytes)
+    if (mq_send_ttl(qid, handle, bufptr, datalen, ttl_ms) == MF_ERROR) {
+        return (MF_ERROR);
+    }
 
-        // Find an empty slot in the message queue
-        // If the message queue is empty
-        if (mq_msg_count == 0) {
-            // Calculate the start address of the message in the message queue
-            void* mq_msg_start_address = mq_start_address;
+    printf("Message sent to message queue with message queue id: %d, time to live: %d ms\n", qid, ttl_ms);
 
-            // Calculate the end address of the message in the message queue
-            void* mq_msg_end_address = mq_msg_start_address + sizeof(int) + datalen;
+    return (MF_SUCCESS);
+}
 
-            // Check if the message fits in the message queue
-            if (mq_msg_end_address > mq_start_address + mq_size) {
-                printf("Error: Message does not fit in the message queue even though the message queue is empty\n");
-                return (MF_ERROR);
-            }
+// This function retrieves a message from the message queue, blocking the caller if no message is available for removal.
+// The messages are removed from the message queue in the order they were added (FIFO).
+// The message is copied to the memory space pointed to by bufptr.
+// After the message is copied, the message is removed from the message queue.
+// The bufsize parameter of this function specifies the size of the application buffer where the incoming message is to be stored.
+// It does not represent the length of the incoming message.
+// If the incoming message is larger than the buffer size, the message is truncated.
+// The bufsize parameter value (i.e., application buffer size) must be larger or equal to MAXDATALEN to ensure sufficient space in the application buffer for any incoming message.
+int mf_recv(int qid, void* bufptr, int bufsize) {
+    // Control the message queue id
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-            // Copy the message length to the message queue
-            char msg_len_bytes[4];
-            int_to_bytes_little_endian(datalen, msg_len_bytes);
-            memcpy(mq_msg_start_address, msg_len_bytes, 4);
-
-            // Copy the message data to the message queue
-            memcpy(mq_msg_start_address + sizeof(int), bufptr, datalen);
-
-            // Update the message count in the message queue header
-            mq_msg_count++;
-            int_to_bytes_little_endian(mq_msg_count, mq_msg_count_bytes);
-            memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 2, mq_msg_count_bytes, 4);
-
-            // Update the address difference between the end address of the last message in the message queue and the start address of the message queue
-            mq_end_msg_address_diff = mq_msg_end_address - mq_start_address;
-            int_to_bytes_little_endian(mq_end_msg_address_diff, mq_end_msg_address_difference_bytes);
-            memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 5, mq_end_msg_address_difference_bytes, 4);
-
-            is_sent = 1;
-        }
-        // If the end address of the last message is bigger than the start address of the next message
-        else if (mq_end_msg_address_diff > mq_next_msg_address_diff) {
-            // Two conditions may occur here:
-            // 1. The difference between the end address of the last message and end of the message queue is bigger than the start address of the next message
-            // In this case, the message can be added to end of the last message
-            // 2. The difference between the end address of the last message and end of the message queue is smaller than the start address of the next message
-            // In this case, the message can be added to the start of the message queue.
-            // Beware that, we also need to check if the message fits in the message queue,
-            // So, we have 2 cases in the second case.
-            // Check the start address of the message queue and the start address of the next message.
-            // If the message does not fit in the message queue, block the caller until space is available in the queue
-            // Block the caller until space is available in the queue
-            // Else, add the message to the start of the message queue
-
-            // 1. The difference between the end address of the last message and end of the message queue is bigger than the start address of the next message
-            // Check if the message fits in the message queue by checking the difference between the end address of the last message and end of the message queue
-            if (mq_size - mq_end_msg_address_diff >= datalen + sizeof(int)) {
-                // Calculate the start address of the message in the message queue
-                void* mq_msg_start_address = mq_start_address + mq_end_msg_address_diff;
-
-                // Calculate the end address of the message in the message queue
-                void* mq_msg_end_address = mq_msg_start_address + sizeof(int) + datalen;
-
-                // Copy the message length to the message queue
-                char msg_len_bytes[4];
-                int_to_bytes_little_endian(datalen, msg_len_bytes);
-                memcpy(mq_msg_start_address, msg_len_bytes, 4);
-
-                // Copy the message data to the message queue
-                memcpy(mq_msg_start_address + sizeof(int), bufptr, datalen);
-
-                // Update the message count in the message queue header
-                mq_msg_count++;
-                int_to_bytes_little_endian(mq_msg_count, mq_msg_count_bytes);
-                memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 2, mq_msg_count_bytes, 4);
-
-                // Update the address difference between the end address of the last message in the message queue and the start address of the message queue
-                mq_end_msg_address_diff = mq_msg_end_address - mq_start_address;
-                int_to_bytes_little_endian(mq_end_msg_address_diff, mq_end_msg_address_difference_bytes);
-                memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 5, mq_end_msg_address_difference_bytes, 4);
-
-                is_sent = 1;
-            }
-            // 2. The difference between the end address of the last message and end of the message queue is smaller than the start address of the next message
-            // In this case, we have 2 cases as described above.
-            else {
-                // Calculate the start address of the message in the message queue
-                void* mq_msg_start_address = mq_start_address;
-
-                // Calculate the end address of the message in the message queue
-                void* mq_msg_end_address = mq_msg_start_address + sizeof(int) + datalen;
-
-                // Calculate the start address of the next message in the message queue
-                void* mq_next_msg_start_address = mq_start_address + mq_next_msg_address_diff;
-
-                // Check if the message fits in the message queue
-                // If the message does not fit in the message queue, block the caller until space is available in the queue
-                if (mq_msg_end_address > mq_next_msg_start_address) {
-                    sem_post(access_mutex_sem);
-                    sem_wait(empty_sem);
-                    continue;
-                }
+    MF_TRACE(recv_start, MF_EV_RECV_START, qid, bufsize);
 
-                // If the message fits in the message queue
-                if (mq_msg_end_address <= mq_next_msg_start_address) {
-                    // Copy the message length to the message queue
-                    char msg_len_bytes[4];
-                    int_to_bytes_little_endian(datalen, msg_len_bytes);
-                    memcpy(mq_msg_start_address, msg_len_bytes, 4);
+    // Get the semaphores of the message queue from the handle cache of the calling thread
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return (MF_ERROR);
+    }
 
-                    // Copy the message data to the message queue
-                    memcpy(mq_msg_start_address + sizeof(int), bufptr, datalen);
+    // Block the caller until a message is available
+    int msg_len = 0;
+    while (mq_try_recv(qid, handle, bufptr, bufsize, &msg_len, 1, NULL) == MQ_WOULD_BLOCK) {
+        MF_TRACE(block, MF_EV_BLOCK, qid, 1);
+        sem_wait(handle->full_sem);
+        MF_TRACE(wake, MF_EV_WAKE, qid, 1);
+    }
 
-                    // Update the message count in the message queue header
-                    mq_msg_count++;
-                    int_to_bytes_little_endian(mq_msg_count, mq_msg_count_bytes);
-                    memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 2, mq_msg_count_bytes, 4);
+    // Return the actual message length
+    return msg_len;
+}
 
-                    // Update the address difference between the end address of the last message in the message queue and the start address of the message queue
-                    mq_end_msg_address_diff = mq_msg_end_address - mq_start_address;
-                    int_to_bytes_little_endian(mq_end_msg_address_diff, mq_end_msg_address_difference_bytes);
-                    memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 5, mq_end_msg_address_difference_bytes, 4);
+// Performs the periodic work of the library, it is called by mfserver in a loop.
+// It reaps the dead processes, see registry_reap(),
+// and makes the durable message queues durable with a group commit, see durable_commit().
+// Returns the number of microseconds to wait before the next call.
+int mf_maintain() {
+    // Release the reference counts of the processes that died without mf_disconnect()
+    int reaped_processes = registry_reap();
 
-                    is_sent = 1;
-                }
-            }
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        if (mq_header_get(qid, MQ_FIELD_ID) == 0) {
+            continue;
         }
-        // If the end address of the last message is smaller than the start address of the next message
-        // This means that there is an empty slot between the end address of the last message and the start address of the next message
-        // Here, we have 2 cases as in the previous cases the second case
-        else if (mq_end_msg_address_diff < mq_next_msg_address_diff) {
-            // Calculate the start address of the message in the message queue
-            void* mq_msg_start_address = mq_start_address + mq_end_msg_address_diff;
 
-            // Calculate the end address of the message in the message queue
-            void* mq_msg_end_address = mq_msg_start_address + sizeof(int) + datalen;
-
-            // Calculate the start address of the next message in the message queue
-            void* mq_next_msg_start_address = mq_start_address + mq_next_msg_address_diff;
-
-            // Check if the message fits in the message queue
-            if (mq_msg_end_address > mq_next_msg_start_address) {
-                sem_post(access_mutex_sem);
-                sem_wait(empty_sem);
-                continue;
-            }
-
-            // If the message fits in the message queue
-            if (mq_msg_end_address <= mq_next_msg_start_address) {
-                // Copy the message length to the message queue
-                char msg_len_bytes[4];
-                int_to_bytes_little_endian(datalen, msg_len_bytes);
-                memcpy(mq_msg_start_address, msg_len_bytes, 4);
-
-                // Copy the message data to the message queue
-                memcpy(mq_msg_start_address + sizeof(int), bufptr, datalen);
-
-                // Update the message count in the message queue header
-                mq_msg_count++;
-                int_to_bytes_little_endian(mq_msg_count, mq_msg_count_bytes);
-                memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 2, mq_msg_count_bytes, 4);
+        // A dead process may have held a ticket of the blocked senders, the line would never move again
+        if (reaped_processes > 0) {
+            mq_reset_send_tickets(qid);
+        }
 
-                // Update the address difference between the end address of the last message in the message queue and the start address of the message queue
-                mq_end_msg_address_diff = mq_msg_end_address - mq_start_address;
-                int_to_bytes_little_endian(mq_end_msg_address_diff, mq_end_msg_address_difference_bytes);
-                memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 5, mq_end_msg_address_difference_bytes, 4);
+        if (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE) {
+            durable_commit(qid);
+        }
 
-                is_sent = 1;
+        // Reclaim the expired messages at the head of a message queue nobody receives from, and wake up its blocked sender
+        if (mq_expired_hint(qid)) {
+            struct MFQueueHandle* handle = mq_handle(qid);
+            unsigned long long hold_start_ns = 0;
+            mq_lock(qid, &hold_start_ns);
+            int wake_senders = mq_header_get(qid, MQ_FIELD_ID) == qid && mq_reclaim_expired(qid) > 0 ? mq_take_send_waiter(qid) : 0;
+            mq_unlock(qid, hold_start_ns);
+            if (handle != NULL) {
+                mq_post_wakeups(handle->empty_sem, wake_senders);
             }
         }
-        // If the end address of the last message is equal to the start address of the next message
-        // This means that the message queue is full
-        else {
-            sem_post(access_mutex_sem);
-            sem_wait(empty_sem);
-            continue;
+    }
+
+    // Deliver the delayed messages whose time came, mfserver comes back every tick while the timer wheel holds messages
+    if (timer_area != NULL) {
+        timer_lock(timer_area);
+        timer_advance(timer_area, monotonic_time_ns() / (MF_TIMER_TICK_US * 1000ULL));
+        int pending = timer_area->pending;
+        pthread_mutex_unlock(&timer_area->mutex);
+        if (pending > 0 && (config.DURABLE_COMMIT_US <= 0 || config.DURABLE_COMMIT_US > MF_TIMER_TICK_US)) {
+            return MF_TIMER_TICK_US;
         }
     }
 
-    // Signal mutex semaphore
-    sem_post(access_mutex_sem);
+    return config.DURABLE_COMMIT_US;
+}
 
-    // Signal full semaphore
-    sem_post(full_sem);
+// Turns on sending in batches for the message queue in the calling process, or turns it off if max_bytes is 0.
+// mf_send() stages the message in a buffer of the process instead of taking the access mutex, the staged messages are
+// published to the message queue in one critical section when max_bytes bytes are staged, when the oldest one has waited
+// max_delay_us microseconds or when mf_flush() is called. The receivers see the messages in the order they are sent.
+int mf_set_batching(int qid, int max_bytes, int max_delay_us) {
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM || mq_header_get(qid, MQ_FIELD_ID) != qid) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
+    if (max_bytes < 0 || max_bytes > BATCH_MAX_BYTES || (max_bytes > 0 && max_delay_us <= 0)) {
+        printf("Error: Batch size or batch delay is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-    // Close the semaphores
-    sem_close(empty_sem);
-    sem_close(full_sem);
-    sem_close(access_mutex_sem);
+    // The batch of the message queue is allocated once and kept until the process disconnects, a forked child discards the inherited batches
+    pthread_once(&batch_atfork_once, batch_register_atfork);
+    library_lock();
+    if (batches == NULL) {
+        batches = calloc(config.MAX_QUEUES_IN_SHMEM, sizeof(struct MFBatch*));
+    }
+    struct MFBatch* batch = batches[qid - 1];
+    if (batch == NULL) {
+        if (max_bytes == 0) {
+            library_unlock();
+            return (MF_SUCCESS);
+        }
+        batch = calloc(1, sizeof(struct MFBatch));
+        pthread_mutex_init(&batch->mutex, NULL);
+        __atomic_store_n(&batches[qid - 1], batch, __ATOMIC_RELEASE);
+    }
 
-    // Print successful sending
-    printf("Message sent to message queue with message queue id: %d\n", qid);
+    // The staged messages are published before the buffer changes
+    pthread_mutex_lock(&batch->mutex);
+    batch_flush(qid, batch);
+    free(batch->buffer);
+    batch->buffer = NULL;
+    batch->capacity = 0;
+    if (max_bytes > 0) {
+        batch->capacity = max_bytes + MF_MSG_HEADER_SIZE + MAX_DATALEN;
+        batch->buffer = malloc(batch->capacity);
+    }
+    batch->max_bytes = max_bytes;
+    batch->max_delay_us = max_delay_us;
+    pthread_mutex_unlock(&batch->mutex);
+
+    // Start the flusher thread with the first batching message queue
+    batch_update_tick();
+    pthread_mutex_lock(&batch_flusher_mutex);
+    if (batch_tick_us > 0 && !batch_flusher_running) {
+        batch_flusher_stop = 0;
+        if (pthread_create(&batch_flusher, NULL, batch_flusher_main, NULL) == 0) {
+            batch_flusher_running = 1;
+        } else {
+            printf("Warning: Could not start the batch flusher thread, staged messages wait for mf_flush()\n");
+        }
+    }
+    pthread_cond_signal(&batch_flusher_cond);
+    pthread_mutex_unlock(&batch_flusher_mutex);
+    library_unlock();
 
     return (MF_SUCCESS);
 }
 
-// This function retrieves a message from the message queue, blocking the caller if no message is available for removal.
-// The messages are removed from the message queue in the order they were added (FIFO).
-// The message is copied to the memory space pointed to by bufptr.
-// After the message is copied, the message is removed from the message queue.
-// The bufsize parameter of this function specifies the size of the application buffer where the incoming message is to be stored.
-// It does not represent the length of the incoming message.
-// If the incoming message is larger than the buffer size, the message is truncated.
-// The bufsize parameter value (i.e., application buffer size) must be larger or equal to MAXDATALEN to ensure sufficient space in the application buffer for any incoming message.
-int mf_recv(int qid, void* bufptr, int bufsize) {
-    // Create a semaphore base name for the message queue
-    // The semaphore base name will be "semaphore" + qid
-    char sem_name[MAXFILENAME];
-    strcpy(sem_name, base_sem_name);
-    // Add the message queue id to the base semaphore name
-    char qid_str[4];
-    sprintf(qid_str, "%d", qid);
-    strcat(sem_name, qid_str);
-
-    // Assemble the semaphore name for empty message queue
-    char empty_sem_name[MAXFILENAME];
-    strcpy(empty_sem_name, sem_name);
-    strcat(empty_sem_name, empty_sem_additon);
+// Publishes the messages the calling process staged for the message queue, blocking the caller until they are all in the message queue.
+int mf_flush(int qid) {
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-    // Assemble the semaphore name for full message queue
-    char full_sem_name[MAXFILENAME];
-    strcpy(full_sem_name, sem_name);
-    strcat(full_sem_name, full_sem_additon);
+    struct MFBatch* batch = batch_of(qid);
+    if (batch == NULL) {
+        return (MF_SUCCESS);
+    }
 
-    // Assemble the semaphore name for access mutex in the message queue
-    char access_mutex_sem_name[MAXFILENAME];
-    strcpy(access_mutex_sem_name, sem_name);
-    strcat(access_mutex_sem_name, access_mutex_sem_additon);
+    pthread_mutex_lock(&batch->mutex);
+    int flush_status = batch_flush(qid, batch);
+    pthread_mutex_unlock(&batch->mutex);
 
-    // Open the semaphores
-    sem_t* empty_sem = sem_open(empty_sem_name, O_CREAT, 0666, 0);
-    sem_t* full_sem = sem_open(full_sem_name, O_CREAT, 0666, 0);
-    sem_t* access_mutex_sem = sem_open(access_mutex_sem_name, O_CREAT, 0666, 1);
+    return flush_status;
+}
 
-    int is_received = 0;
+// Sends the request of reqlen bytes to the message queue specified by qid and waits for its reply up to timeout_ms milliseconds,
+// a negative timeout_ms waits forever. The reply is copied to resp and its length is returned, it is truncated to resp_size bytes.
+// The request carries the reply slot of the call, the server writes the reply into it and wakes up the caller with a futex,
+// so the reply takes no message queue, no access mutex and no semaphore.
+int mf_call(int qid, void* req, int reqlen, void* resp, int resp_size, int timeout_ms) {
+    // Control the data length
+    if (reqlen < MIN_DATALEN || reqlen > MAX_DATALEN) {
+        printf("Error: Data length is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-    while (!is_received) {
+    // Control the message queue id
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-        // Wait for the access mutex semaphore
-        sem_wait(access_mutex_sem);
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return (MF_ERROR);
+    }
 
-        // Search for the message queue in the fixed shared memory region
-        int qid_found = 0;
-        for (int i = 0; i < config.MAX_QUEUES_IN_SHMEM; i++) {
-            char mq_id_bytes[4];
-            memcpy(mq_id_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE, 4);
-            int mq_id = bytes_to_int_little_endian(mq_id_bytes);
-            if (mq_id == qid) {
-                qid_found = 1;
-                break;
-            }
-        }
+    struct MFReplyArea* area = rpc_reply_area();
+    if (area == NULL) {
+        return (MF_ERROR);
+    }
 
-        // If the message queue is not found
-        if (qid_found == 0) {
-            sem_post(access_mutex_sem);
-            sem_wait(full_sem);
-            continue;
+    // Take a free reply slot, its state word is waiting from now on
+    int slot_index = -1;
+    unsigned int waiting_word = 0;
+    for (int i = 0; i < MF_MAX_CALLS && slot_index == -1; i++) {
+        unsigned int word = __atomic_load_n(&area->slots[i].word, __ATOMIC_ACQUIRE);
+        if ((word & REPLY_STATE_MASK) == REPLY_FREE
+            && __atomic_compare_exchange_n(&area->slots[i].word, &word, word | REPLY_WAITING, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            slot_index = i;
+            waiting_word = word | REPLY_WAITING;
         }
+    }
+    if (slot_index == -1) {
+        printf("Error: Calling process has MF_MAX_CALLS calls in flight\n");
+        return (MF_ERROR);
+    }
+    struct MFReplySlot* slot = &area->slots[slot_index];
+    unsigned int free_word = (waiting_word & ~REPLY_STATE_MASK) + REPLY_GENERATION;
 
-        // Get message count
-        char mq_msg_count_bytes[4];
-        memcpy(mq_msg_count_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 2, 4);
-        int mq_msg_count = bytes_to_int_little_endian(mq_msg_count_bytes);
+    // The request is the call header followed by the request data
+    char request[sizeof(struct MFCallHeader) + MAX_DATALEN];
+    struct MFCallHeader call_header = { getpid(), area->nonce, slot_index, waiting_word };
+    memcpy(request, &call_header, sizeof(struct MFCallHeader));
+    memcpy(request + sizeof(struct MFCallHeader), req, reqlen);
 
-        // If the message queue is empty, block the caller until a message is available
-        if (mq_msg_count == 0) {
-            sem_post(access_mutex_sem);
-            sem_wait(full_sem);
-            continue;
-        }
+    unsigned long long deadline_ns = monotonic_time_ns() + (unsigned long long)(timeout_ms < 0 ? 0 : timeout_ms) * 1000000;
 
-        is_received = 1;
+    if (mq_send_wait(qid, handle, request, sizeof(struct MFCallHeader) + reqlen, MF_MSG_CALL) == MF_ERROR) {
+        __atomic_store_n(&slot->word, free_word, __ATOMIC_RELEASE);
+        return (MF_ERROR);
+    }
 
-        // Get the start address difference of the message queue in the shared memory region
-        char mq_start_address_difference_bytes[4];
-        memcpy(mq_start_address_difference_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 3, 4);
-        int mq_start_address_diff = bytes_to_int_little_endian(mq_start_address_difference_bytes);
+    // Wait for the reply, a caller that times out gives the slot up unless a server is already writing the reply
+    while (1) {
+        unsigned int word = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE);
+        if ((word & REPLY_STATE_MASK) == REPLY_DONE) {
+            break;
+        }
 
-        // Calculate the start address of the message queue in the shared memory region
-        void* mq_start_address = shared_memory_address_queues + mq_start_address_diff;
+        struct timespec timeout;
+        struct timespec* timeout_ptr = NULL;
+        if (timeout_ms >= 0 && word == waiting_word) {
+            unsigned long long now_ns = monotonic_time_ns();
+            if (now_ns >= deadline_ns) {
+                if (__atomic_compare_exchange_n(&slot->word, &word, free_word, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                    printf("Error: Call to message queue with message queue id %d timed out\n", qid);
+                    return (MF_ERROR);
+                }
+                continue;
+            }
+            timeout.tv_sec = (deadline_ns - now_ns) / 1000000000ULL;
+            timeout.tv_nsec = (deadline_ns - now_ns) % 1000000000ULL;
+            timeout_ptr = &timeout;
+        }
+        syscall(SYS_futex, &slot->word, FUTEX_WAIT, word, timeout_ptr, NULL, 0);
+    }
 
-        // Get the address difference between the start address of the next message in the message queue and the start address of the message queue
-        char mq_next_msg_address_difference_bytes[4];
-        memcpy(mq_next_msg_address_difference_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 4, 4);
-        int mq_next_msg_address_diff = bytes_to_int_little_endian(mq_next_msg_address_difference_bytes);
+    // Copy the reply and free the slot
+    int reply_len = slot->len;
+    if (reply_len > resp_size) {
+        printf("Warning: Reply is truncated to the buffer size\n");
+        reply_len = resp_size;
+    }
+    if (reply_len > 0) {
+        memcpy(resp, slot->data, reply_len);
+    }
+    __atomic_store_n(&slot->word, free_word, __ATOMIC_RELEASE);
 
-        // Get the address difference between the end address of the last message in the message queue and the start address of the message queue
-        char mq_end_msg_address_difference_bytes[4];
-        memcpy(mq_end_msg_address_difference_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 5, 4);
-        // int mq_end_msg_address_diff = bytes_to_int_little_endian(mq_end_msg_address_difference_bytes);
+    return reply_len;
+}
 
-        // The message format in the message queue will be as follows:
-        // - Message length (4 bytes)
-        // - Message data (datalen bytes)
+// Serves the calls to the message queue specified by qid, see mf_call()
+// Each request is passed to handler, the reply it writes to the reply buffer (MAX_DATALEN bytes) is written into the reply slot
+// of the caller. The handler returns the reply length, MF_ERROR to fail the call or MF_SERVE_STOP to fail the call and return.
+// Messages that are not requests are dropped.
+int mf_serve(int qid, mf_handler_t handler, void* arg) {
+    // Control the message queue id
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-        // Calculate the start address of the message in the message queue
-        void* mq_msg_start_address = mq_start_address + mq_next_msg_address_diff;
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return (MF_ERROR);
+    }
 
-        // Get the message length from the message queue
-        char msg_len_bytes[4];
-        memcpy(msg_len_bytes, mq_msg_start_address, 4);
-        int msg_len = bytes_to_int_little_endian(msg_len_bytes);
+    char request[MAX_DATALEN];
+    char reply[MAX_DATALEN];
+    while (1) {
+        MF_TRACE(recv_start, MF_EV_RECV_START, qid, MAX_DATALEN);
+
+        // Block the caller until a request is available
+        struct MFCallHeader call_header;
+        int request_len = 0;
+        while (mq_try_recv(qid, handle, request, MAX_DATALEN, &request_len, 1, &call_header) == MQ_WOULD_BLOCK) {
+            MF_TRACE(block, MF_EV_BLOCK, qid, 1);
+            sem_wait(handle->full_sem);
+            MF_TRACE(wake, MF_EV_WAKE, qid, 1);
+        }
 
-        // Calculate the minimum message size to copy and update the buffer size
-        if (msg_len < bufsize) {
-            printf("Warning: Message length is smaller than the buffer size\n");
-            bufsize = msg_len;
+        if (call_header.pid == 0) {
+            printf("Warning: Message that is not a call is dropped by mf_serve\n");
+            continue;
         }
 
-        // Copy the message data to the buffer
-        memcpy(bufptr, mq_msg_start_address + sizeof(int), bufsize);
+        int reply_len = handler(request, request_len, reply, MAX_DATALEN, arg);
+        if (reply_len > MAX_DATALEN) {
+            printf("Error: Reply is longer than MAX_DATALEN\n");
+            reply_len = MF_ERROR;
+        }
+        rpc_reply(&call_header, reply, reply_len < 0 ? MF_ERROR : reply_len);
 
-        // Update the message count in the message queue header
-        mq_msg_count--;
-        int_to_bytes_little_endian(mq_msg_count, mq_msg_count_bytes);
-        memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 2, mq_msg_count_bytes, 4);
+        if (reply_len == MF_SERVE_STOP) {
+            return (MF_SUCCESS);
+        }
+    }
+}
 
-        // Erase the message from the message queue by filling the message with zeros
-        memset(mq_msg_start_address, 0, sizeof(int) + msg_len);
+// Creates a logical message queue of nparts partitions, each a message queue of mqsize KB
+// Partition 0 is named mqname and partition i is named "<mqname>.<i>", all of them take the attributes of mqname in the config file.
+// The partitions are chained in their headers: partition 0 holds the number of partitions and each partition the qid of the next one.
+int mf_create_partitioned(char* mqname, int nparts, int mqsize) {
+    if (nparts < 1 || nparts > MF_MAX_PARTITIONS) {
+        printf("Error: Number of partitions is not within the limits\n");
+        return (MF_ERROR);
+    }
+    if (strlen(mqname) + 4 > MAX_MQNAMESIZE) {
+        printf("Error: Message queue name is too long for a partitioned message queue\n");
+        return (MF_ERROR);
+    }
+    if (mq_find_by_name(mqname) != MF_ERROR) {
+        printf("Error: Message queue with the given message queue name already exists\n");
+        return (MF_ERROR);
+    }
 
-        // Update the next message address difference in the message queue header
-        // If the message queue is empty, set the next and last message address difference to 0
-        if (mq_msg_count == 0) {
-            int_to_bytes_little_endian(0, mq_next_msg_address_difference_bytes);
-            memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 4, mq_next_msg_address_difference_bytes, 4);
+    struct mf_qattr attr;
+    config_queue_attr(mqname, &attr);
 
-            int_to_bytes_little_endian(0, mq_end_msg_address_difference_bytes);
-            memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 5, mq_end_msg_address_difference_bytes, 4);
+    int qids[MF_MAX_PARTITIONS];
+    for (int i = 0; i < nparts; i++) {
+        char partition_name[MAX_MQNAMESIZE];
+        if (i == 0) {
+            snprintf(partition_name, MAX_MQNAMESIZE, "%s", mqname);
+        } else {
+            snprintf(partition_name, MAX_MQNAMESIZE, "%s.%d", mqname, i);
         }
-        // Calculate the next message address difference in the message queue
-        else {
-            // Calculate the start address of the next message in the message queue
-            void* mq_next_msg_start_address = mq_msg_start_address + sizeof(int) + msg_len;
 
-            // Check if the 4 bytes after the next message start address to be sure that a message exists there
-            char next_msg_len_bytes[4];
-            memcpy(next_msg_len_bytes, mq_next_msg_start_address, 4);
-            int next_msg_len = bytes_to_int_little_endian(next_msg_len_bytes);
-
-            // If the next message length is 0, this means that there is no message, so set the next message address difference to 0,
-            // as the next message is at the start of the message queue
-            if (next_msg_len == 0) {
-                int_to_bytes_little_endian(0, mq_next_msg_address_difference_bytes);
-                memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 4, mq_next_msg_address_difference_bytes, 4);
-            }
-            // If the next message length is not 0, this means that there is a message, so calculate the next message address difference
-            else {
-                int next_msg_address_diff = mq_next_msg_start_address - mq_start_address;
-                int_to_bytes_little_endian(next_msg_address_diff, mq_next_msg_address_difference_bytes);
-                memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 4, mq_next_msg_address_difference_bytes, 4);
+        if (mf_create_attr(partition_name, mqsize, &attr) == MF_ERROR || (qids[i] = mq_find_by_name(partition_name)) == MF_ERROR) {
+            // Remove the partitions created so far
+            for (int j = i - 1; j >= 0; j--) {
+                char created_name[MAX_MQNAMESIZE];
+                memcpy(created_name, shared_memory_address_fixed + (qids[j] - 1) * MF_MQ_HEADER_SIZE, MAX_MQNAMESIZE);
+                mf_remove(created_name);
             }
+            printf("Error: Could not create the partition %d of the message queue\n", i);
+            return (MF_ERROR);
         }
+    }
 
+    // Chain the partitions, partition 0 is published last so that the chain is complete when it is seen
+    // The other partitions are marked with the qid of partition 0, they cannot be removed on their own
+    for (int i = 0; i < nparts; i++) {
+        mq_header_set(qids[i], MQ_FIELD_NEXT_PARTITION, i + 1 < nparts ? qids[i + 1] : 0);
+        mq_header_set(qids[i], MQ_FIELD_PARTITION_HEAD, i > 0 ? qids[0] : 0);
     }
+    mq_header_set(qids[0], MQ_FIELD_PARTITIONS, nparts);
 
-    // Signal mutex semaphore
-    sem_post(access_mutex_sem);
+    printf("Partitioned message queue created with message queue name: %s, partitions: %d\n", mqname, nparts);
 
-    // Signal empty semaphore
-    sem_post(empty_sem);
+    return (MF_SUCCESS);
+}
 
-    // Close the semaphores
-    sem_close(empty_sem);
-    sem_close(full_sem);
-    sem_close(access_mutex_sem);
+// Sends the message to the partition of the logical message queue specified by qid that the key is hashed to
+// The messages with the same key go to the same partition, so they are received in the order they are sent
+int mf_send_key(int qid, void* key, int keylen, void* bufptr, int datalen) {
+    if (key == NULL || keylen <= 0) {
+        printf("Error: Key is empty\n");
+        return (MF_ERROR);
+    }
 
-    // Return the actual message length
-    return bufsize;
-}
+    int partitions = mf_partition_count(qid);
+    if (partitions == MF_ERROR) {
+        return (MF_ERROR);
+    }
 
-// Prints the status of the current shared memory and its message queues.
-int mf_print() {
-    printf("===============================================================================\n");
-    printf("Status of the current shared memory...\n");
+    return mf_send(mf_partition(qid, message_checksum(key, keylen) % partitions), bufptr, datalen);
+}
 
-    // Get the current count of message queues in the shared memory information and print it
-    char msg_queue_count_bytes[4];
-    memcpy(msg_queue_count_bytes, shared_memory_address_info, 4);
-    int msg_queue_count = bytes_to_int_little_endian(msg_queue_count_bytes);
-    printf("Number of message queues: %d\n", msg_queue_count);
+// Returns the qid of the partition index of the logical message queue specified by qid, a consumer receives from it with mf_recv()
+int mf_partition(int qid, int index) {
+    struct MFPartitionMap* map = partition_map(qid);
+    if (map == NULL) {
+        return (MF_ERROR);
+    }
+    if (index < 0 || index >= map->count) {
+        printf("Error: Partition is not within the limits\n");
+        return (MF_ERROR);
+    }
 
-    // Get the total free space in the shared memory information and print it
-    char free_space_bytes[4];
-    memcpy(free_space_bytes, shared_memory_address_info + sizeof(int), 4);
-    int free_space = bytes_to_int_little_endian(free_space_bytes);
-    printf("Total free space in the shared memory region: %d bytes\n", free_space);
+    return map->qids[index];
+}
 
-    // Get the total filled space in the shared memory information and print it
-    char filled_space_bytes[4];
-    memcpy(filled_space_bytes, shared_memory_address_info + sizeof(int) * 2, 4);
-    int filled_space = bytes_to_int_little_endian(filled_space_bytes);
-    printf("Total filled space in the shared memory region: %d bytes\n", filled_space);
+// Returns the number of partitions of the logical message queue specified by qid, 1 for a message queue that is not partitioned
+int mf_partition_count(int qid) {
+    struct MFPartitionMap* map = partition_map(qid);
+    if (map == NULL) {
+        return (MF_ERROR);
+    }
 
-    // Get the total process count in the shared memory information and print it
-    char process_count_bytes[4];
-    memcpy(process_count_bytes, shared_memory_address_info + sizeof(int) * 3, 4);
-    int process_count = bytes_to_int_little_endian(process_count_bytes);
-    printf("Total process count in the shared memory region: %d\n", process_count);
+    return map->count;
+}
 
-    // Print the filled space by headers
-    printf("Filled space in the shared memory region by message queue headers: %d bytes\n", MF_MQ_HEADER_SIZE * config.MAX_QUEUES_IN_SHMEM);
+// Joins the consumer group of the logical message queue specified by qid as the member that owns the partition member
+// Returns the group handle of the member, NULL on error
+mf_group_t* mf_group_join(int qid, int member) {
+    struct MFPartitionMap* map = partition_map(qid);
+    if (map == NULL) {
+        return NULL;
+    }
+    if (member < 0 || member >= map->count) {
+        printf("Error: Member is not within the partitions of the message queue\n");
+        return NULL;
+    }
 
-    // Print the filled space by information region
-    printf("Filled space in the shared memory region by information region: %d bytes\n", MF_SHMEM_INFO_SIZE);
+    struct mf_group* group = calloc(1, sizeof(struct mf_group));
+    if (group == NULL) {
+        printf("Error: Could not allocate the consumer group member\n");
+        return NULL;
+    }
+    group->member = member;
+    group->count = map->count;
+    memcpy(group->qids, map->qids, sizeof(int) * map->count);
 
-    // Print the shared memory size
-    printf("Shared memory size: %d\n", config.SHMEM_SIZE * 1024);
-    
-    // Print the filled and free space in the shared memory region in a sequence
-    
-    // Initialize two pointers, one for the start of the free space and one for the end of the free space
-    // Please note that these are all address differences
-    int start_free_space_i = 0;
+    printf("Joined the consumer group of message queue id: %d as member: %d of %d\n", qid, member, group->count);
 
-    // End of the free space is the end of the shared memory region, meaning end of the shared memory region for the message queues
-    // So we remove the size of the fixed shared memory region and the size of the shared memory information region from the shared memory size
+    return group;
+}
 
-    // Size of the free space
-    int free_space_size = config.SHMEM_SIZE * 1024 - (sizeof(char) * MF_MQ_HEADER_SIZE) * config.MAX_QUEUES_IN_SHMEM - MF_SHMEM_INFO_SIZE;
-    // End of the free space
-    int end_free_space_j = free_space_size;
-    
-    printf("Print the filled and free space in the shared memory region in a sequence...\n");
-    printf("Beware that the below all addresses are address differences in bytes.\n");
+// Receives a message for the member of the consumer group, blocking the caller if no partition of the group has a message
+// The messages stolen before come first, then the messages of the own partition, then a new steal from the deepest other partition.
+// Returns the message length like mf_recv()
+int mf_group_recv(mf_group_t* group, void* bufptr, int bufsize) {
+    if (group == NULL) {
+        printf("Error: Consumer group member is NULL\n");
+        return (MF_ERROR);
+    }
 
-    // Loop through the message queues in the fixed shared memory region to find the first empty slot by
-    // checking the address differences of the message queues in the fixed shared memory region
-    // While looping, update the start and end of the free space
-    int end_of_last_mq = 0; // End of the filled space right after the last empty space
-    int visited_free_space = 0; // Visited free space in the shared memory region
-    while (visited_free_space <= msg_queue_count + 1) {
-        end_free_space_j = free_space_size;
+    int qid = group->qids[group->member];
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return (MF_ERROR);
+    }
 
-        // Loop through the message queues in the fixed shared memory region
-        // to find an empty slot by checking the address differences of the start of message queues
-        // Get minimum address difference of the start of the message queues higher than the start of the free space
-        for (int i = 0; i < config.MAX_QUEUES_IN_SHMEM; i++) {
-            // First check if the message queue is empty by checking the message queue id
-            char mq_id_bytes[4];
-            memcpy(mq_id_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE, 4);
-            int mq_id = bytes_to_int_little_endian(mq_id_bytes);
-            // If the message queue is empty, continue
-            if (mq_id == 0) {
+    int msg_len = 0;
+    while (1) {
+        if (group->stolen_next < group->stolen_count) {
+            return group_take_stolen(group, bufptr, bufsize);
+        }
+        if (mq_try_recv(qid, handle, bufptr, bufsize, &msg_len, 0, NULL) == MF_SUCCESS) {
+            return msg_len;
+        }
+        if (group_steal(group) > 0) {
+            continue;
+        }
+
+        // Nothing to take, sleep on the own partition until a message arrives or it is time to look for work to steal again
+        if (mq_try_recv(qid, handle, bufptr, bufsize, &msg_len, 1, NULL) == MF_SUCCESS) {
+            return msg_len;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += MF_GROUP_STEAL_INTERVAL_US * 1000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        MF_TRACE(block, MF_EV_BLOCK, qid, 1);
+        if (sem_timedwait(handle->full_sem, &deadline) == -1) {
+            group_cancel_wait(qid, handle);
+        }
+        MF_TRACE(wake, MF_EV_WAKE, qid, 1);
+    }
+}
+
+// Leaves the consumer group, the stolen messages that are not received yet are sent to the own partition of the member
+int mf_group_leave(mf_group_t* group) {
+    if (group == NULL) {
+        printf("Error: Consumer group member is NULL\n");
+        return (MF_ERROR);
+    }
+
+    int result = MF_SUCCESS;
+    char buffer[MAX_DATALEN];
+    while (group->stolen_next < group->stolen_count) {
+        int msg_len = group_take_stolen(group, buffer, MAX_DATALEN);
+        if (msg_len == MF_ERROR || mf_send(group->qids[group->member], buffer, msg_len) == MF_ERROR) {
+            result = MF_ERROR;
+        }
+    }
+
+    printf("Left the consumer group as member: %d\n", group->member);
+    free(group);
+
+    return result;
+}
+
+// Sends the message to the message queue specified by qid with the tag, blocking the caller until the message queue has space for it
+// The tag header is stored before the message data, uncompressed, and links the message into the tag chain of its tag.
+// Tagged messages are not batched, like the requests of mf_call().
+int mf_send_tag(int qid, unsigned int tag, void* bufptr, int datalen) {
+    // Control the data length
+    if (datalen < MIN_DATALEN || datalen > MAX_DATALEN) {
+        printf("Error: Data length is not within the limits\n");
+        return (MF_ERROR);
+    }
+
+    // Control the message queue id
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
+
+    // The recovery of a durable message queue does not know the tag chains
+    if (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE) {
+        printf("Error: Durable message queues do not take tagged messages\n");
+        return (MF_ERROR);
+    }
+
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return (MF_ERROR);
+    }
+
+    // The message is the tag header followed by the message data, compressed if the message queue compresses its messages
+    char compressed_buffer[MAX_DATALEN];
+    int stored_len = datalen;
+    int msg_flags = 0;
+    void* stored_data = mq_encode_message(qid, bufptr, &stored_len, compressed_buffer, &msg_flags);
+
+    // The expiry header of the default time to live of the message queue comes after the tag header
+    char expiry_buffer[sizeof(struct MFExpiryHeader) + MAX_DATALEN];
+    stored_data = mq_add_expiry(stored_data, &stored_len, mq_expires_at(monotonic_time_ns(), mq_header_get(qid, MQ_FIELD_TTL)), expiry_buffer, &msg_flags);
+
+    char message[sizeof(struct MFTagHeader) + sizeof(struct MFExpiryHeader) + MAX_DATALEN];
+    int_to_bytes_little_endian((int)tag, message);
+    int_to_bytes_little_endian(0, message + sizeof(int));
+    memcpy(message + sizeof(struct MFTagHeader), stored_data, stored_len);
+
+    if (mq_send_wait(qid, handle, message, sizeof(struct MFTagHeader) + stored_len, msg_flags | MF_MSG_TAGGED) == MF_ERROR) {
+        return (MF_ERROR);
+    }
+
+    printf("Tagged message sent to message queue with message queue id: %d, tag: %u\n", qid, tag);
+
+    return (MF_SUCCESS);
+}
+
+// Receives the oldest tagged message of the message queue specified by qid whose tag matches tag in the bits set in mask,
+// blocking the caller until such a message is available. Returns the message length like mf_recv()
+// Only the tag chains whose low bits can match are walked. A message that is not at the head of the message queue
+// is marked removed and left as a hole, see mq_remove_tagged().
+int mf_recv_tag(int qid, unsigned int tag, unsigned int mask, void* bufptr, int bufsize) {
+    // Control the message queue id
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
+
+    MF_TRACE(recv_start, MF_EV_RECV_START, qid, bufsize);
+
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return (MF_ERROR);
+    }
+
+    int* tag_seq_address = mq_header_address(qid, MQ_FIELD_TAG_SEQ);
+    while (1) {
+        unsigned long long hold_start_ns = 0;
+        mq_lock(qid, &hold_start_ns);
+        MF_TRACE(lock_acquire, MF_EV_LOCK_ACQUIRE, qid, 0);
+
+        // Reclaim the expired messages at the head, mq_find_tagged() skips the others
+        int expired_messages = mq_header_get(qid, MQ_FIELD_ID) == qid ? mq_reclaim_expired(qid) : 0;
+
+        int prev_address_diff = -1;
+        int msg_address_diff = mq_header_get(qid, MQ_FIELD_ID) == qid ? mq_find_tagged(qid, tag, mask, &prev_address_diff) : -1;
+        if (msg_address_diff == -1) {
+            // Sleep until the next tagged message is sent, the futex compares the tag sequence as it is stored
+            int tag_seq_word = __atomic_load_n(tag_seq_address, __ATOMIC_RELAXED);
+            mq_header_set(qid, MQ_FIELD_TAG_WAITERS, 1);
+            int wake_senders = expired_messages > 0 ? mq_take_send_waiter(qid) : 0;
+            MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+            mq_unlock(qid, hold_start_ns);
+            mq_post_wakeups(handle->empty_sem, wake_senders);
+
+            MF_TRACE(block, MF_EV_BLOCK, qid, 1);
+            syscall(SYS_futex, tag_seq_address, FUTEX_WAIT, tag_seq_word, NULL, NULL, 0);
+            MF_TRACE(wake, MF_EV_WAKE, qid, 1);
+            continue;
+        }
+
+        // The message at the head is removed as mf_recv() removes it
+        char compressed_buffer[MAX_DATALEN];
+        int compressed_len = 0;
+        int msg_len;
+        if (msg_address_diff == mq_header_get(qid, MQ_FIELD_NEXT_MSG)) {
+            msg_len = mq_get_message(qid, bufptr, bufsize, compressed_buffer, &compressed_len, NULL);
+        } else {
+            msg_len = mq_remove_tagged(qid, msg_address_diff, prev_address_diff, bufptr, bufsize, compressed_buffer, &compressed_len);
+        }
+
+        // Wake up the sleeping sender if the freed space fits its message, a hole frees its space when it is reclaimed
+        int wake_senders = mq_take_send_waiter(qid);
+        if (wake_senders == 0) {
+            mq_stats_address(qid)->wakeups_skipped++;
+        }
+
+        MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+        mq_unlock(qid, hold_start_ns);
+
+        if (compressed_len > 0) {
+            msg_len = mq_decode_message(qid, compressed_buffer, compressed_len, bufptr, bufsize);
+        }
+        MF_TRACE(recv_complete, MF_EV_RECV_COMPLETE, qid, msg_len);
+
+        mq_post_wakeups(handle->empty_sem, wake_senders);
+
+        return msg_len;
+    }
+}
+
+// Moves up to n messages from the message queue src_qid to the message queue dst_qid, see mf_splice_filter()
+int mf_splice(int src_qid, int dst_qid, int n) {
+    return mf_splice_filter(src_qid, dst_qid, n, NULL, NULL);
+}
+
+// Moves up to n messages from the message queue src_qid to the message queue dst_qid, the messages filter returns 0 for are dropped
+// Both access mutexes are held while the messages are moved, the one of the lower qid is taken first.
+// Each message is copied from the source straight to the destination, as it is stored, with its flags.
+// A message leaves the source only once it is stored in the destination. If the first message does not fit yet, it stays in the
+// source and the caller lines up with the blocked senders of the destination, with a ticket, like mq_send_wait(), then tries again.
+// A message that never fits in the destination, or a tagged message for a durable destination, is an error and stays in the source.
+int mf_splice_filter(int src_qid, int dst_qid, int n, mf_filter_t filter, void* arg) {
+    // Control the message queue ids
+    if (src_qid < 1 || src_qid > config.MAX_QUEUES_IN_SHMEM || dst_qid < 1 || dst_qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
+    if (src_qid == dst_qid) {
+        printf("Error: Source and destination message queues are the same\n");
+        return (MF_ERROR);
+    }
+    if (n < 1) {
+        printf("Error: Number of messages to splice must be positive\n");
+        return (MF_ERROR);
+    }
+
+    struct MFQueueHandle* src_handle = mq_handle(src_qid);
+    struct MFQueueHandle* dst_handle = mq_handle(dst_qid);
+    if (src_handle == NULL || dst_handle == NULL) {
+        return (MF_ERROR);
+    }
+
+    int first_qid = src_qid < dst_qid ? src_qid : dst_qid;
+    int second_qid = src_qid < dst_qid ? dst_qid : src_qid;
+    int ticket = MQ_NO_TICKET; // Ticket of the caller in the line of the blocked senders of the destination
+    while (1) {
+        unsigned long long first_hold_start_ns = 0;
+        unsigned long long second_hold_start_ns = 0;
+        mq_lock(first_qid, &first_hold_start_ns);
+        mq_lock(second_qid, &second_hold_start_ns);
+        MF_TRACE(lock_acquire, MF_EV_LOCK_ACQUIRE, src_qid, 0);
+
+        // Expired messages of the source are reclaimed, they are not forwarded
+        int expired_messages = mq_header_get(src_qid, MQ_FIELD_ID) == src_qid ? mq_reclaim_expired(src_qid) : 0;
+
+        // Sleep on the source like mf_recv() until it has a message
+        // A ticket taken for the destination is at the head of the line now, it is passed on so that the caller does not hold up the line
+        if (mq_header_get(src_qid, MQ_FIELD_ID) != src_qid || mq_header_get(src_qid, MQ_FIELD_MSG_COUNT) == 0) {
+            mq_header_set(src_qid, MQ_FIELD_RECV_WAITERS, mq_header_get(src_qid, MQ_FIELD_RECV_WAITERS) + 1);
+            int wake_senders = expired_messages > 0 ? mq_take_send_waiter(src_qid) : 0;
+            int wake_turns = mq_send_turn(dst_qid, &ticket) && ticket != MQ_NO_TICKET ? mq_pass_ticket(dst_qid, &ticket) : 0;
+            MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, src_qid, 0);
+            mq_unlock(second_qid, second_hold_start_ns);
+            mq_unlock(first_qid, first_hold_start_ns);
+            mq_post_wakeups(src_handle->empty_sem, wake_senders);
+            if (wake_turns) {
+                mq_wake_turns(dst_qid, wake_turns);
+            }
+            MF_TRACE(block, MF_EV_BLOCK, src_qid, 1);
+            sem_wait(src_handle->full_sem);
+            MF_TRACE(wake, MF_EV_WAKE, src_qid, 1);
+            continue;
+        }
+
+        int taken = 0;
+        int moved = 0;
+        int moved_tagged = 0;
+        int rejected = 0;
+        int send_status = MF_SUCCESS;
+        while (taken < n) {
+            // A message that expired while the others were moved is reclaimed when it reaches the head
+            mq_reclaim_expired(src_qid);
+            if (mq_header_get(src_qid, MQ_FIELD_MSG_COUNT) == 0) {
+                break;
+            }
+
+            void* msg_start_address = mq_region_address(src_qid) + mq_header_get(src_qid, MQ_FIELD_NEXT_MSG);
+            int msg_word = bytes_to_int_little_endian(msg_start_address);
+            int msg_flags = msg_word & ~MF_MSG_LENGTH_MASK;
+            int msg_len = msg_word & MF_MSG_LENGTH_MASK;
+
+            if (filter != NULL && !splice_accepts(src_qid, msg_start_address + MF_MSG_HEADER_SIZE, msg_len, msg_flags, filter, arg)) {
+                mq_drop_message(src_qid);
+                taken++;
                 continue;
             }
 
-            // Get the address difference between the start address of the message queue and the start address of the shared memory region for message queues
-            char mq_start_address_difference_bytes[4];
-            memcpy(mq_start_address_difference_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * 3, 4);
-            int mq_start_address_diff = bytes_to_int_little_endian(mq_start_address_difference_bytes);
+            // A message the destination never takes stays in the source, the first one is an error, the others end the batch
+            int dst_exists = mq_header_get(dst_qid, MQ_FIELD_ID) == dst_qid;
+            if (dst_exists && (MF_MSG_HEADER_SIZE + msg_len > mq_header_get(dst_qid, MQ_FIELD_SIZE)
+                || ((msg_flags & MF_MSG_TAGGED) && (mq_header_get(dst_qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE)))) {
+                rejected = taken == 0;
+                break;
+            }
+
+            // The message goes to the destination only in the turn of the caller, after the blocked senders ahead of it,
+            // and after the spilled messages, like mq_try_send() sends it
+            int is_turn = mq_send_turn(dst_qid, &ticket);
+            int is_spilled = dst_exists && mq_header_get(dst_qid, MQ_FIELD_SPILL_COUNT) > 0;
+            int msg_address_diff = -1;
+            if (is_turn && dst_exists && !is_spilled && !mq_within_limits(dst_qid, MF_MSG_HEADER_SIZE + msg_len)) {
+                mq_reclaim_expired(dst_qid);
+            }
+            if (is_turn && dst_exists && !is_spilled && mq_within_limits(dst_qid, MF_MSG_HEADER_SIZE + msg_len)) {
+                msg_address_diff = mq_find_space(dst_qid, MF_MSG_HEADER_SIZE + msg_len);
+                if (msg_address_diff == -1 && mq_reclaim_expired(dst_qid) > 0) {
+                    msg_address_diff = mq_find_space(dst_qid, MF_MSG_HEADER_SIZE + msg_len);
+                }
+            }
+
+            if (msg_address_diff != -1) {
+                mq_put_message(dst_qid, msg_address_diff, msg_start_address + MF_MSG_HEADER_SIZE, msg_len, msg_flags);
+            } else if (!is_turn || !dst_exists || !(mq_header_get(dst_qid, MQ_FIELD_FLAGS) & MQ_OVERFLOW_FLAGS)
+                || spill_append(dst_qid, msg_start_address + MF_MSG_HEADER_SIZE, msg_len, msg_flags) != MF_SUCCESS) {
+                // The message stays in the source, the first one waits for its turn or for space, the others for the next call
+                if (taken == 0) {
+                    if (ticket == MQ_NO_TICKET) {
+                        ticket = mq_take_ticket(dst_qid);
+                        is_turn = mq_send_turn(dst_qid, &ticket);
+                    }
+                    send_status = is_turn ? MQ_WOULD_BLOCK : MQ_WAIT_TURN;
+                    if (is_turn) {
+                        mq_add_send_waiter(dst_qid, MF_MSG_HEADER_SIZE + msg_len);
+                    }
+                }
+                break;
+            }
+            mq_drop_message(src_qid);
+            if (msg_flags & MF_MSG_TAGGED) {
+                moved_tagged = 1;
+            }
+            taken++;
+            moved++;
+        }
+
+        // Wake up the sleeping sender of the source and the sleeping receivers of the destination
+        // The line of the blocked senders of the destination moves on once the caller stored a message or gave up
+        int wake_senders = mq_take_send_waiter(src_qid);
+        if (wake_senders == 0) {
+            mq_stats_address(src_qid)->wakeups_skipped += taken;
+        }
+        int wake_receivers = moved > 0 ? mq_take_recv_waiters(dst_qid, moved) : 0;
+        int wake_tag_receivers = moved_tagged ? mq_take_tag_waiters(dst_qid) : 0;
+        int wake_turns = send_status == MF_SUCCESS && ticket != MQ_NO_TICKET && mq_send_turn(dst_qid, &ticket)
+            && ticket != MQ_NO_TICKET ? mq_pass_ticket(dst_qid, &ticket) : 0;
+
+        MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, src_qid, 0);
+        mq_unlock(second_qid, second_hold_start_ns);
+        mq_unlock(first_qid, first_hold_start_ns);
+
+        mq_post_wakeups(src_handle->empty_sem, wake_senders);
+        mq_post_wakeups(dst_handle->full_sem, wake_receivers);
+        if (wake_tag_receivers) {
+            syscall(SYS_futex, mq_header_address(dst_qid, MQ_FIELD_TAG_SEQ), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        }
+        if (wake_turns) {
+            mq_wake_turns(dst_qid, wake_turns);
+        }
+
+        if (rejected) {
+            printf("Error: Message does not fit in the destination message queue or is tagged for a durable message queue\n");
+            return (MF_ERROR);
+        }
+
+        // Nothing is taken from the source while the first message waits for the destination
+        if (send_status != MF_SUCCESS) {
+            MF_TRACE(block, MF_EV_BLOCK, dst_qid, 0);
+            mq_wait_send(dst_qid, dst_handle, ticket, send_status);
+            MF_TRACE(wake, MF_EV_WAKE, dst_qid, 0);
+            continue;
+        }
+
+        // The messages moved to a durable message queue are acknowledged once a group commit makes them durable, see mq_send_wait()
+        if (moved > 0 && (mq_header_get(dst_qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE)) {
+            durable_wait_commit(dst_qid, __atomic_load_n(mq_header_address(dst_qid, MQ_FIELD_DURABLE_SEQ), __ATOMIC_ACQUIRE));
+        }
+
+        printf("Messages spliced from message queue id: %d to message queue id: %d, moved: %d, dropped: %d\n",
+            src_qid, dst_qid, moved, taken - moved);
+
+        return moved;
+    }
+}
+
+// Sends a message to the message queue specified by qid that is delivered at deliver_at, a CLOCK_MONOTONIC time in nanoseconds.
+// The message is held in the timer wheel of the shared timer area until then, see struct MFTimerArea. A deadline that has passed
+// is an mf_send(). The message is encoded now, so it is stored in the timer wheel as it will be stored in the message queue.
+// The wheel is advanced here and by mf_maintain(), a message whose message queue is full is retried at every tick.
+int mf_send_at(int qid, void* bufptr, int datalen, unsigned long long deliver_at) {
+    // Control the data length
+    if (datalen < MIN_DATALEN || datalen > MAX_DATALEN) {
+        printf("Error: Data length is not within the limits\n");
+        return (MF_ERROR);
+    }
+
+    // Control the message queue id
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM || mq_header_get(qid, MQ_FIELD_ID) != qid) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
+
+    unsigned long long now = monotonic_time_ns();
+    if (deliver_at <= now) {
+        return mf_send(qid, bufptr, datalen);
+    }
+
+    struct MFTimerArea* area = timer_area_map();
+    if (area == NULL) {
+        return (MF_ERROR);
+    }
+
+    char compressed_buffer[MAX_DATALEN];
+    int stored_len = datalen;
+    int msg_flags = 0;
+    void* stored_data = mq_encode_message(qid, bufptr, &stored_len, compressed_buffer, &msg_flags);
+
+    // The default time to live of the message queue counts from the delivery
+    char expiry_buffer[sizeof(struct MFExpiryHeader) + MAX_DATALEN];
+    stored_data = mq_add_expiry(stored_data, &stored_len, mq_expires_at(deliver_at, mq_header_get(qid, MQ_FIELD_TTL)), expiry_buffer, &msg_flags);
+
+    timer_lock(area);
+    int index = area->free_head;
+    if (index == TIMER_NONE) {
+        pthread_mutex_unlock(&area->mutex);
+        printf("Error: Timer wheel is full, %d messages are delayed\n", MF_MAX_TIMERS);
+        return (MF_ERROR);
+    }
+
+    // The delivery tick is rounded up, a message is never delivered before its deadline
+    struct MFTimerEntry* entry = &area->entries[index];
+    unsigned long long tick_ns = MF_TIMER_TICK_US * 1000ULL;
+    area->free_head = entry->next;
+    entry->instance = mq_header_get(qid, MQ_FIELD_INSTANCE);
+    entry->len = stored_len;
+    entry->msg_flags = msg_flags;
+    entry->deliver_tick = (deliver_at + tick_ns - 1) / tick_ns;
+    memcpy(entry->data, stored_data, stored_len);
+    entry->qid = qid;
+    area->pending++;
+    timer_insert(area, index);
+
+    // Deliver the messages whose time came while the wheel is at hand
+    timer_advance(area, monotonic_time_ns() / tick_ns);
+    pthread_mutex_unlock(&area->mutex);
+
+    printf("Delayed message sent to message queue with message queue id: %d, delivered in %llu us\n", qid, (deliver_at - now) / 1000);
+
+    return (MF_SUCCESS);
+}
+
+// Initializes the message queue attributes with the defaults, a message queue in the shared memory region
+void mf_qattr_init(struct mf_qattr* attr) {
+    memset(attr, 0, sizeof(struct mf_qattr));
+}
+
+// Copies the statistics of the message queue specified by the message queue ID (qid) to stats.
+// The statistics are kept in the shared memory region, so they cover all the processes using the message queue.
+int mf_get_stats(int qid, struct mf_stats* stats) {
+    struct mf_stats* mq_stats = mq_stats_address(qid);
+    if (mq_stats == NULL || stats == NULL) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_ERROR);
+    }
+
+    memcpy(stats, mq_stats, sizeof(struct mf_stats));
+
+    return (MF_SUCCESS);
+}
+
+// Prints the status of the current shared memory and its message queues.
+int mf_print() {
+    printf("===============================================================================\n");
+    printf("Status of the current shared memory...\n");
+
+    // Get the current count of message queues in the shared memory information and print it
+    char msg_queue_count_bytes[4];
+    memcpy(msg_queue_count_bytes, shared_memory_address_info, 4);
+    int msg_queue_count = bytes_to_int_little_endian(msg_queue_count_bytes);
+    printf("Number of message queues: %d\n", msg_queue_count);
+
+    // Get the total free space in the shared memory information and print it
+    char free_space_bytes[4];
+    memcpy(free_space_bytes, shared_memory_address_info + sizeof(int), 4);
+    int free_space = bytes_to_int_little_endian(free_space_bytes);
+    printf("Total free space in the shared memory region: %d bytes\n", free_space);
+
+    // Get the total filled space in the shared memory information and print it
+    char filled_space_bytes[4];
+    memcpy(filled_space_bytes, shared_memory_address_info + sizeof(int) * 2, 4);
+    int filled_space = bytes_to_int_little_endian(filled_space_bytes);
+    printf("Total filled space in the shared memory region: %d bytes\n", filled_space);
+
+    // Get the total process count in the shared memory information and print it
+    char process_count_bytes[4];
+    memcpy(process_count_bytes, shared_memory_address_info + sizeof(int) * 3, 4);
+    int process_count = bytes_to_int_little_endian(process_count_bytes);
+    printf("Total process count in the shared memory region: %d\n", process_count);
+
+    // Print the delayed messages held by the timer wheel
+    struct MFTimerArea* area = timer_area_map();
+    if (area != NULL) {
+        printf("Delayed messages in the timer wheel: %d\n", __atomic_load_n(&area->pending, __ATOMIC_RELAXED));
+    }
+
+    // Print the free chunks of the buffer pool
+    struct MFPoolArea* pool = pool_area_map();
+    if (pool != NULL) {
+        printf("Buffer pool: free %d of %d chunks of %d bytes\n", __atomic_load_n(&pool->free_count, __ATOMIC_RELAXED), pool->chunk_count, MF_POOL_CHUNK_SIZE);
+    }
+
+    // Print the filled space by headers
+    printf("Filled space in the shared memory region by message queue headers: %d bytes\n", MF_MQ_HEADER_SIZE * config.MAX_QUEUES_IN_SHMEM);
+
+    // Print the filled space by information region
+    printf("Filled space in the shared memory region by information region: %d bytes\n", MF_SHMEM_INFO_SIZE);
+
+    // Print the shared memory size
+    printf("Shared memory size: %d\n", config.SHMEM_SIZE * 1024);
+    
+    // Print the filled and free space of each segment of the shared memory region in a sequence
+    printf("Print the filled and free space in the shared memory region in a sequence...\n");
+    printf("Beware that the below all addresses are address differences in bytes from the start of the message queues in the segment.\n");
+
+    struct MFSegmentTable* segment_table = (struct MFSegmentTable*)shared_memory_address_segments;
+    int segment_count = __atomic_load_n(&segment_table->segment_count, __ATOMIC_ACQUIRE);
+    for (int segment = 0; segment < segment_count; segment++) {
+        printf("Segment %d, size of the message queues region: %lld bytes\n", segment, segment_size(segment));
+
+        // Initialize two pointers, one for the start of the free space and one for the end of the free space
+        long long start_free_space_i = 0;
+        long long end_free_space_j = segment_size(segment);
+
+        // Walk the message queues of the segment in the order of their address differences
+        long long end_of_last_mq = 0; // End of the filled space right after the last empty space
+        int visited_free_space = 0; // Visited free space in the segment
+        while (visited_free_space <= msg_queue_count + 1) {
+            end_free_space_j = segment_size(segment);
+
+            // Get minimum address difference of the start of the message queues of the segment higher than the start of the free space
+            for (int i = 0; i < config.MAX_QUEUES_IN_SHMEM; i++) {
+                if (!segment_holds_queue(segment, i + 1)) {
+                    continue;
+                }
+
+                long long mq_start_address_diff = mq_start_offset(i + 1);
+                if (mq_start_address_diff < end_free_space_j && mq_start_address_diff >= start_free_space_i) {
+                    end_free_space_j = mq_start_address_diff;
+                    end_of_last_mq = mq_start_address_diff + mq_header_get(i + 1, MQ_FIELD_SIZE);
+                }
+            }
+
+            // Update the visited free space
+            visited_free_space++;
+
+            // Print the start and end of the free space if the free space is not 0
+            if (start_free_space_i != end_free_space_j) {
+                printf("Start free space: %lld, End free space: %lld\n", start_free_space_i, end_free_space_j);
+            }
+
+            // Print the filled space of the message queue that ends the free space
+            if (end_free_space_j != segment_size(segment)) {
+                printf("Filled space in the shared memory region: %lld\n", end_of_last_mq - end_free_space_j);
+            } else {
+                break;
+            }
+
+            // Update the start of the free space to the end of the last message queue
+            start_free_space_i = end_of_last_mq;
+        }
+    }
+
+    // Print the number of dead processes reaped by mfserver
+    printf("Dead processes reaped: %d\n", ((struct MFRegistry*)shared_memory_address_registry)->reaped_processes);
+
+    // Print the access mutex statistics of the message queues
+    printf("Access mutex statistics of the message queues, times are in nanoseconds...\n");
+    for (int i = 0; i < config.MAX_QUEUES_IN_SHMEM; i++) {
+        char mq_id_bytes[4];
+        memcpy(mq_id_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE, 4);
+        int mq_id = bytes_to_int_little_endian(mq_id_bytes);
+        if (mq_id == 0) {
+            continue;
+        }
+
+        struct mf_stats* mq_stats = mq_stats_address(mq_id);
+        unsigned long long lock_acquisitions = mq_stats->lock_acquisitions;
+        printf("Queue %d: owner: %d, owner died: %llu, acquisitions: %llu, contended: %llu (%.2f%%), wait total: %llu, wait max: %llu, hold total: %llu, hold max: %llu, hold avg: %llu\n",
+            mq_id, mq_lock_address(mq_id)->owner_pid, mq_stats->lock_owner_died, lock_acquisitions, mq_stats->lock_contended,
+            lock_acquisitions == 0 ? 0.0 : 100.0 * mq_stats->lock_contended / lock_acquisitions,
+            mq_stats->lock_wait_ns_total, mq_stats->lock_wait_ns_max,
+            mq_stats->lock_hold_ns_total, mq_stats->lock_hold_ns_max,
+            lock_acquisitions == 0 ? 0 : mq_stats->lock_hold_ns_total / lock_acquisitions);
+
+        // Print the messages against the message count and byte limits, 0 is no limit but the size of the message queue
+        printf("Queue %d: messages: %d of at most %d, bytes: %d of at most %d, size: %d\n",
+            mq_id, mq_header_get(mq_id, MQ_FIELD_MSG_COUNT), mq_header_get(mq_id, MQ_FIELD_MAX_MSGS),
+            mq_header_get(mq_id, MQ_FIELD_MSG_BYTES), mq_header_get(mq_id, MQ_FIELD_MAX_BYTES), mq_header_get(mq_id, MQ_FIELD_SIZE));
+
+        // Print the wakeup statistics, the sleeping senders and receivers are the ones counted in the message queue header now
+        printf("Queue %d: wakeups: %llu, wakeups skipped: %llu, sleeping senders: %d, sleeping receivers: %d\n",
+            mq_id, mq_stats->wakeups, mq_stats->wakeups_skipped,
+            mq_header_get(mq_id, MQ_FIELD_SEND_WAITERS), mq_header_get(mq_id, MQ_FIELD_RECV_WAITERS));
+
+        // Print the messages received out of order whose space is not reclaimed yet
+        if (mq_header_get(mq_id, MQ_FIELD_TAG_HOLES) > 0) {
+            printf("Queue %d: holes of tagged messages received out of order: %d, sleeping tag receivers: %d\n",
+                mq_id, mq_header_get(mq_id, MQ_FIELD_TAG_HOLES), mq_header_get(mq_id, MQ_FIELD_TAG_WAITERS));
+        }
+
+        // Print the default time to live and the expired messages
+        if (mq_header_get(mq_id, MQ_FIELD_TTL) > 0 || mq_stats->messages_expired > 0) {
+            printf("Queue %d: default time to live: %d ms, messages expired: %llu\n", mq_id, mq_header_get(mq_id, MQ_FIELD_TTL), mq_stats->messages_expired);
+        }
+
+        // Print the overflow log of a spilling message queue, the refill throughput is of the time spent moving the spilled messages back
+        if (mq_header_get(mq_id, MQ_FIELD_SPILL_SIZE) > 0) {
+            printf("Queue %d: overflow log: %d messages of %d bytes, spilled: %llu messages %llu bytes, refilled: %llu messages %llu bytes, refill throughput: %.1f MB/s\n",
+                mq_id, mq_header_get(mq_id, MQ_FIELD_SPILL_COUNT), mq_header_get(mq_id, MQ_FIELD_SPILL_SIZE),
+                mq_stats->spilled_messages, mq_stats->spilled_bytes, mq_stats->refilled_messages, mq_stats->refilled_bytes,
+                mq_stats->refill_ns_total == 0 ? 0.0 : 1e3 * mq_stats->refilled_bytes / mq_stats->refill_ns_total);
+        }
+
+        // Print the chunks of the buffer pool a pooled message queue holds, the reserved ones included
+        if (mq_header_get(mq_id, MQ_FIELD_FLAGS) & MF_QATTR_POOL) {
+            printf("Queue %d: pool chunks: %d (min %d, max %d), messages in chunks: %d, spilled: %llu messages %llu bytes, refilled: %llu messages %llu bytes, refill throughput: %.1f MB/s, chunks borrowed: %llu, returned: %llu\n",
+                mq_id, mq_header_get(mq_id, MQ_FIELD_POOL_CHUNKS), mq_header_get(mq_id, MQ_FIELD_POOL_MIN), mq_header_get(mq_id, MQ_FIELD_POOL_MAX),
+                mq_header_get(mq_id, MQ_FIELD_SPILL_COUNT), mq_stats->spilled_messages, mq_stats->spilled_bytes,
+                mq_stats->refilled_messages, mq_stats->refilled_bytes,
+                mq_stats->refill_ns_total == 0 ? 0.0 : 1e3 * mq_stats->refilled_bytes / mq_stats->refill_ns_total,
+                mq_stats->pool_chunks_borrowed, mq_stats->pool_chunks_returned);
+        }
+
+        // Print the messages other members of the consumer group stole from the partition
+        if (mq_stats->messages_stolen > 0) {
+            printf("Queue %d: messages stolen: %llu\n", mq_id, mq_stats->messages_stolen);
+        }
+
+        // Print the compression statistics of a compressing message queue
+        // The ratio is of the compressed messages only, the CPU cost includes the attempts that did not get smaller
+        if (mq_header_get(mq_id, MQ_FIELD_COMPRESS_THRESHOLD) > 0) {
+            unsigned long long compress_attempts = mq_stats->compress_attempts;
+            printf("Queue %d: compression threshold: %d, attempts: %llu, compressed: %llu, bytes in: %llu, bytes out: %llu, ratio: %.2f, compress ns/msg: %llu, decompress ns total: %llu\n",
+                mq_id, mq_header_get(mq_id, MQ_FIELD_COMPRESS_THRESHOLD), compress_attempts, mq_stats->compress_messages,
+                mq_stats->compress_bytes_in, mq_stats->compress_bytes_out,
+                mq_stats->compress_bytes_out == 0 ? 1.0 : (double)mq_stats->compress_bytes_in / mq_stats->compress_bytes_out,
+                compress_attempts == 0 ? 0 : mq_stats->compress_ns_total / compress_attempts, mq_stats->decompress_ns_total);
+        }
+    }
+
+    printf("\n===============================================================================\n");
+    return (MF_SUCCESS);
+}
+
+// Creates a context that connects the calling process, see the thread safety model in mf.h
+// Each context tracks the message queues opened through it, mf_ctx_destroy() closes them and disconnects.
+mf_ctx_t* mf_ctx_create() {
+    if (mf_connect() != MF_SUCCESS) {
+        return NULL;
+    }
+
+    mf_ctx_t* ctx = malloc(sizeof(mf_ctx_t));
+    if (ctx == NULL) {
+        printf("Error: Could not allocate the context\n");
+        mf_disconnect();
+        return NULL;
+    }
+
+    ctx->open_counts = calloc(config.MAX_QUEUES_IN_SHMEM, sizeof(int));
+    if (ctx->open_counts == NULL) {
+        printf("Error: Could not allocate the context\n");
+        free(ctx);
+        mf_disconnect();
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->mutex, NULL);
+
+    return ctx;
+}
+
+// Closes the message queues that are still open through the context and disconnects
+int mf_ctx_destroy(mf_ctx_t* ctx) {
+    if (ctx == NULL) {
+        printf("Error: Context is not valid\n");
+        return (MF_ERROR);
+    }
+
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        while (ctx->open_counts[qid - 1] > 0) {
+            mf_close(qid);
+            ctx->open_counts[qid - 1]--;
+        }
+    }
+
+    pthread_mutex_destroy(&ctx->mutex);
+    free(ctx->open_counts);
+    free(ctx);
+
+    return mf_disconnect();
+}
+
+// Opens the message queue through the context, the threads of the context may share the returned qid
+int mf_ctx_open(mf_ctx_t* ctx, char* mqname) {
+    if (ctx == NULL) {
+        printf("Error: Context is not valid\n");
+        return (MF_ERROR);
+    }
+
+    int qid = mf_open(mqname);
+    if (qid == MF_ERROR) {
+        return (MF_ERROR);
+    }
+
+    pthread_mutex_lock(&ctx->mutex);
+    __atomic_add_fetch(&ctx->open_counts[qid - 1], 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    return qid;
+}
+
+// Closes the message queue opened through the context
+int mf_ctx_close(mf_ctx_t* ctx, int qid) {
+    if (ctx == NULL || qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Context or message queue id is not valid\n");
+        return (MF_ERROR);
+    }
+
+    pthread_mutex_lock(&ctx->mutex);
+    if (ctx->open_counts[qid - 1] == 0) {
+        pthread_mutex_unlock(&ctx->mutex);
+        printf("Error: Message queue is not opened through the context\n");
+        return (MF_ERROR);
+    }
+    __atomic_sub_fetch(&ctx->open_counts[qid - 1], 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    return mf_close(qid);
+}
+
+// Sends a message to a message queue opened through the context, see mf_send()
+int mf_ctx_send(mf_ctx_t* ctx, int qid, void* bufptr, int datalen) {
+    if (ctx == NULL || qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM || __atomic_load_n(&ctx->open_counts[qid - 1], __ATOMIC_ACQUIRE) == 0) {
+        printf("Error: Message queue is not opened through the context\n");
+        return (MF_ERROR);
+    }
+    return mf_send(qid, bufptr, datalen);
+}
+
+// Receives a message from a message queue opened through the context, see mf_recv()
+int mf_ctx_recv(mf_ctx_t* ctx, int qid, void* bufptr, int bufsize) {
+    if (ctx == NULL || qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM || __atomic_load_n(&ctx->open_counts[qid - 1], __ATOMIC_ACQUIRE) == 0) {
+        printf("Error: Message queue is not opened through the context\n");
+        return (MF_ERROR);
+    }
+    return mf_recv(qid, bufptr, bufsize);
+}
+
+// Creates a submission ring of the given number of entries and a completion ring of twice as many, see struct mf_sqe and struct mf_cqe
+// A worker thread of the calling process performs the submitted operations, the process must be connected
+// The rings are allocated in the memory of the process, only its submitting, reaping and worker threads use them, see mf.h
+// The number of entries is rounded up to a power of two
+mf_ring_t* mf_ring_create(int entries) {
+    if (entries <= 0) {
+        printf("Error: Ring entries must be positive\n");
+        return NULL;
+    }
+
+    unsigned int sq_entries = 1;
+    while (sq_entries < (unsigned int)entries) {
+        sq_entries <<= 1;
+    }
+
+    mf_ring_t* ring = calloc(1, sizeof(mf_ring_t));
+    if (ring == NULL) {
+        printf("Error: Could not allocate the ring\n");
+        return NULL;
+    }
+
+    ring->sq_entries = sq_entries;
+    ring->cq_entries = sq_entries * 2;
+    ring->sqes = calloc(ring->sq_entries, sizeof(struct mf_sqe));
+    ring->cqes = calloc(ring->cq_entries, sizeof(struct mf_cqe));
+    ring->pending = calloc(ring->cq_entries, sizeof(struct mf_sqe));
+    ring->blocked_queues = calloc(config.MAX_QUEUES_IN_SHMEM + 1, sizeof(char));
+    ring->waiting_queues = calloc(config.MAX_QUEUES_IN_SHMEM + 1, sizeof(char));
+    ring->wait_seqs = calloc(config.MAX_QUEUES_IN_SHMEM + 1, sizeof(int));
+    if (ring->sqes == NULL || ring->cqes == NULL || ring->pending == NULL || ring->blocked_queues == NULL
+        || ring->waiting_queues == NULL || ring->wait_seqs == NULL) {
+        printf("Error: Could not allocate the ring\n");
+        free(ring->sqes);
+        free(ring->cqes);
+        free(ring->pending);
+        free(ring->blocked_queues);
+        free(ring->waiting_queues);
+        free(ring->wait_seqs);
+        free(ring);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->sq_cond, NULL);
+    pthread_cond_init(&ring->cq_cond, NULL);
+
+    if (pthread_create(&ring->worker, NULL, ring_worker, ring) != 0) {
+        printf("Error: Could not create the ring worker thread\n");
+        pthread_mutex_destroy(&ring->mutex);
+        pthread_cond_destroy(&ring->sq_cond);
+        pthread_cond_destroy(&ring->cq_cond);
+        free(ring->sqes);
+        free(ring->cqes);
+        free(ring->pending);
+        free(ring->blocked_queues);
+        free(ring->waiting_queues);
+        free(ring->wait_seqs);
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+// Stops the worker thread and frees the ring, the operations that are not completed yet are dropped
+int mf_ring_destroy(mf_ring_t* ring) {
+    if (ring == NULL) {
+        printf("Error: Ring is not valid\n");
+        return (MF_ERROR);
+    }
+
+    pthread_mutex_lock(&ring->mutex);
+    __atomic_store_n(&ring->stop, 1, __ATOMIC_RELEASE);
+    ring_wake_worker(ring);
+    pthread_mutex_unlock(&ring->mutex);
+    pthread_join(ring->worker, NULL);
+
+    pthread_mutex_destroy(&ring->mutex);
+    pthread_cond_destroy(&ring->sq_cond);
+    pthread_cond_destroy(&ring->cq_cond);
+    free(ring->sqes);
+    free(ring->cqes);
+    free(ring->pending);
+    free(ring->blocked_queues);
+    free(ring->waiting_queues);
+    free(ring->wait_seqs);
+    free(ring);
+
+    return (MF_SUCCESS);
+}
+
+// Returns the next free submission queue entry, NULL if the submission ring is full
+// or if as many operations are in flight as the completion ring holds, reap completions and try again
+struct mf_sqe* mf_ring_get_sqe(mf_ring_t* ring) {
+    unsigned int sq_head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int cq_head = __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+    unsigned int sq_prepared = ring->sq_prepared;
+    if (sq_prepared - sq_head >= ring->sq_entries || sq_prepared - cq_head >= ring->cq_entries) {
+        return NULL;
+    }
+
+    struct mf_sqe* sqe = &ring->sqes[sq_prepared & (ring->sq_entries - 1)];
+    memset(sqe, 0, sizeof(struct mf_sqe));
+    __atomic_store_n(&ring->sq_prepared, sq_prepared + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+// Publishes the submission queue entries prepared since the last call to the worker and returns their number
+// The worker is woken up only if it sleeps, so a batch of submissions costs at most one wakeup
+int mf_ring_submit(mf_ring_t* ring) {
+    int submitted = ring->sq_prepared - ring->sq_tail;
+    if (submitted == 0) {
+        return 0;
+    }
+
+    __atomic_store_n(&ring->sq_tail, ring->sq_prepared, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&ring->mutex);
+    ring_wake_worker(ring);
+    pthread_mutex_unlock(&ring->mutex);
+
+    return submitted;
+}
+
+// Copies at most max_cqes completions to cqes and returns their number
+// The caller waits until at least min_complete completions are available, 0 does not wait
+int mf_ring_reap(mf_ring_t* ring, struct mf_cqe* cqes, int max_cqes, int min_complete) {
+    // The submissions handed out may still grow, the ones in flight are at least the ones counted here
+    unsigned int cq_head = ring->cq_head;
+    unsigned int in_flight = __atomic_load_n(&ring->sq_prepared, __ATOMIC_ACQUIRE) - cq_head;
+    if (min_complete > max_cqes || (unsigned int)min_complete > in_flight) {
+        printf("Error: Cannot wait for more completions than the operations in flight\n");
+        return (MF_ERROR);
+    }
+
+    unsigned int cq_tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (cq_tail - cq_head < (unsigned int)min_complete) {
+        pthread_mutex_lock(&ring->mutex);
+        ring->reaper_sleeping = 1;
+        while ((cq_tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE)) - cq_head < (unsigned int)min_complete) {
+            pthread_cond_wait(&ring->cq_cond, &ring->mutex);
+        }
+        ring->reaper_sleeping = 0;
+        pthread_mutex_unlock(&ring->mutex);
+    }
+
+    int reaped = 0;
+    while (reaped < max_cqes && cq_head != cq_tail) {
+        cqes[reaped++] = ring->cqes[cq_head & (ring->cq_entries - 1)];
+        cq_head++;
+    }
+
+    // The completion ring slots are free, and the submitting thread may hand out as many entries, once the head is published
+    __atomic_store_n(&ring->cq_head, cq_head, __ATOMIC_RELEASE);
+
+    return reaped;
+}
+
+// End of the library functions
+// Start of the helper functions
+
+// Read the configuration file and fill the MFConfig structure
+int read_config_file(struct MFConfig* config) {
+    // Open the configuration file
+    FILE* file = fopen(CONFIG_FILENAME, "r");
+    if (file == NULL) {
+        printf("Error: Could not open the configuration file\n");
+        exit(MF_ERROR);
+    }
+
+    // Defaults of the optional parameters
+    config->DURABLE_QUEUES[0] = '\0';
+    strcpy(config->DURABLE_DIR, ".");
+    config->DURABLE_COMMIT_US = MF_DEFAULT_DURABLE_COMMIT_US;
+    config->MAX_PROCESSES = MF_DEFAULT_MAX_PROCESSES;
+    config->SEGMENT_SIZE = MF_DEFAULT_SEGMENT_SIZE;
+    config->COMPRESSED_QUEUES[0] = '\0';
+    config->COMPRESS_THRESHOLD = MF_DEFAULT_COMPRESS_THRESHOLD;
+    config->SPILL_QUEUES[0] = '\0';
+    strcpy(config->SPILL_DIR, ".");
+    config->SPILL_SIZE = MF_DEFAULT_SPILL_SIZE;
+    config->POOLED_QUEUES[0] = '\0';
+    config->POOL_SIZE = 0;
+    config->POOL_QUEUE_MIN = 0;
+    config->POOL_QUEUE_MAX = 0;
+
+    // Reading the configuration file line by line
+    // and filling the MFConfig structure
+    // Beware that lines starting with '#' are comments
+    // and only the first two words in a line are considered
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') {
+            continue;
+        }
+
+        char key[256];
+        char value[256];
+        sscanf(line, "%s %s", key, value);
+
+        if (strcmp(key, "SHMEM_SIZE") == 0) {
+            config->SHMEM_SIZE = atoi(value);
+        } else if (strcmp(key, "MAX_MSGS_IN_QUEUE") == 0) {
+            config->MAX_MSGS_IN_QUEUE = atoi(value);
+        } else if (strcmp(key, "MAX_QUEUES_IN_SHMEM") == 0) {
+            config->MAX_QUEUES_IN_SHMEM = atoi(value);
+        } else if (strcmp(key, "SHMEM_NAME") == 0) {
+            strcpy(config->SHMEM_NAME, value);
+            // Remove the first character of the string, if it is "/"
+            if (config->SHMEM_NAME[0] == '/') {
+                memmove(config->SHMEM_NAME, config->SHMEM_NAME + 1, strlen(config->SHMEM_NAME));
+            }
+        } else if (strcmp(key, "DURABLE_QUEUES") == 0) {
+            snprintf(config->DURABLE_QUEUES, sizeof(config->DURABLE_QUEUES), "%s", value);
+        } else if (strcmp(key, "DURABLE_DIR") == 0) {
+            snprintf(config->DURABLE_DIR, sizeof(config->DURABLE_DIR), "%.127s", value);
+        } else if (strcmp(key, "DURABLE_COMMIT_US") == 0) {
+            config->DURABLE_COMMIT_US = atoi(value);
+        } else if (strcmp(key, "MAX_PROCESSES") == 0) {
+            config->MAX_PROCESSES = atoi(value);
+        } else if (strcmp(key, "SEGMENT_SIZE") == 0) {
+            config->SEGMENT_SIZE = atoi(value);
+        } else if (strcmp(key, "COMPRESSED_QUEUES") == 0) {
+            snprintf(config->COMPRESSED_QUEUES, sizeof(config->COMPRESSED_QUEUES), "%s", value);
+        } else if (strcmp(key, "COMPRESS_THRESHOLD") == 0) {
+            config->COMPRESS_THRESHOLD = atoi(value);
+        } else if (strcmp(key, "SPILL_QUEUES") == 0) {
+            snprintf(config->SPILL_QUEUES, sizeof(config->SPILL_QUEUES), "%s", value);
+        } else if (strcmp(key, "SPILL_DIR") == 0) {
+            snprintf(config->SPILL_DIR, sizeof(config->SPILL_DIR), "%.127s", value);
+        } else if (strcmp(key, "SPILL_SIZE") == 0) {
+            config->SPILL_SIZE = atoi(value);
+        } else if (strcmp(key, "POOLED_QUEUES") == 0) {
+            snprintf(config->POOLED_QUEUES, sizeof(config->POOLED_QUEUES), "%s", value);
+        } else if (strcmp(key, "POOL_SIZE") == 0) {
+            config->POOL_SIZE = atoi(value);
+        } else if (strcmp(key, "POOL_QUEUE_MIN") == 0) {
+            config->POOL_QUEUE_MIN = atoi(value);
+        } else if (strcmp(key, "POOL_QUEUE_MAX") == 0) {
+            config->POOL_QUEUE_MAX = atoi(value);
+        }
+    }
+
+    /* printf("SHMEM_SIZE: %d\n", config->SHMEM_SIZE);
+    printf("MAX_MSGS_IN_QUEUE: %d\n", config->MAX_MSGS_IN_QUEUE);
+    printf("MAX_QUEUES_IN_SHMEM: %d\n", config->MAX_QUEUES_IN_SHMEM);
+    printf("SHMEM_NAME: %s\n", config->SHMEM_NAME); */
+
+    fclose(file);
+
+    return (MF_SUCCESS);
+}
+
+
+// Rounds the address difference up to a multiple of MF_STATS_ALIGNMENT, so that the regions after it are naturally aligned
+int align_region_offset(int offset) {
+    return (offset + MF_STATS_ALIGNMENT - 1) / MF_STATS_ALIGNMENT * MF_STATS_ALIGNMENT;
+}
+
+// Address difference of the statistics region from the start address of the fixed shared memory region
+int stats_region_offset() {
+    return align_region_offset(MF_MQ_HEADER_SIZE * config.MAX_QUEUES_IN_SHMEM + MF_SHMEM_INFO_SIZE);
+}
+
+// Address difference of the access mutexes of the message queues from the start address of the fixed shared memory region
+int locks_region_offset() {
+    return align_region_offset(stats_region_offset() + sizeof(struct mf_stats) * config.MAX_QUEUES_IN_SHMEM);
+}
+
+// Address difference of the process registry from the start address of the fixed shared memory region
+int registry_region_offset() {
+    return align_region_offset(locks_region_offset() + sizeof(struct MFQueueLock) * config.MAX_QUEUES_IN_SHMEM);
+}
+
+// Size of an entry of the process registry in bytes, pid (4 bytes), reserved (4 bytes) and the open count of each message queue (4 bytes each)
+int registry_entry_size() {
+    return sizeof(int) * (2 + config.MAX_QUEUES_IN_SHMEM);
+}
+
+// Address difference of the segment table from the start address of the fixed shared memory region
+int segments_region_offset() {
+    return align_region_offset(registry_region_offset() + sizeof(struct MFRegistry) + registry_entry_size() * config.MAX_PROCESSES);
+}
+
+// Size of the fixed portion of the shared memory region that comes before the message queues
+// It includes the message queue headers, the shared memory information, the statistics and the access mutexes of the message queues
+// the process registry and the segment table, it is padded so that the message queues start at a page
+int fixed_region_size() {
+    int fixed_region_end = segments_region_offset() + sizeof(struct MFSegmentTable);
+    return align_to_queue_alignment(MF_SUPERBLOCK_SIZE + fixed_region_end) - MF_SUPERBLOCK_SIZE;
+}
+
+// Size of the control area, the superblock and the fixed portion, it is mapped by every connected process
+int control_area_size() {
+    return MF_SUPERBLOCK_SIZE + fixed_region_size();
+}
+
+// Rounds the size up to a multiple of the queue alignment, a page
+int align_to_queue_alignment(int size) {
+    return (size + queue_alignment - 1) / queue_alignment * queue_alignment;
+}
+
+// Size of the shared memory region for the message queues, what is left after the superblock and the fixed portion
+int queue_region_size() {
+    return config.SHMEM_SIZE * 1024 - control_area_size();
+}
+
+// Calculates the addresses of the regions of the shared memory region from the start address of the fixed shared memory region
+void set_region_addresses() {
+    // Shared memory information is right after the message queue headers
+    shared_memory_address_info = shared_memory_address_fixed + (sizeof(char) * MF_MQ_HEADER_SIZE) * config.MAX_QUEUES_IN_SHMEM;
+
+    // Statistics, access mutexes, the process registry and the segment table are at the end of the fixed portion, message queues come after them
+    // and are mapped separately, see mq_region_address()
+    shared_memory_address_stats = shared_memory_address_fixed + stats_region_offset();
+    shared_memory_address_locks = shared_memory_address_fixed + locks_region_offset();
+    shared_memory_address_registry = shared_memory_address_fixed + registry_region_offset();
+    shared_memory_address_segments = shared_memory_address_fixed + segments_region_offset();
+}
+
+// Returns the MF_FEATURE_* flags of the shared memory region initialized with the current configuration
+int superblock_feature_flags() {
+    int feature_flags = MF_FEATURE_ROBUST_LOCKS | MF_FEATURE_REGISTRY | MF_FEATURE_STATS | MF_FEATURE_SEGMENTS;
+    if (config.DURABLE_QUEUES[0] != '\0') {
+        feature_flags |= MF_FEATURE_DURABLE;
+    }
+    return feature_flags;
+}
+
+// Checks that the superblock is written by mf_init() of a library with the same layout and that it fits the shared memory region
+// shared_memory_size is the size of the shared memory object in bytes
+int validate_superblock(struct MFSuperblock* superblock, int shared_memory_size) {
+    if (__atomic_load_n(&superblock->magic, __ATOMIC_ACQUIRE) != MF_SUPERBLOCK_MAGIC) {
+        printf("Error: Shared memory region is not initialized by mfserver\n");
+        return (MF_ERROR);
+    }
+
+    if (superblock->layout_version != MF_LAYOUT_VERSION || superblock->superblock_size != sizeof(struct MFSuperblock)) {
+        printf("Error: Shared memory region layout version %d does not match the library layout version %d\n", superblock->layout_version, MF_LAYOUT_VERSION);
+        return (MF_ERROR);
+    }
+
+    if ((superblock->feature_flags & ~MF_FEATURES_SUPPORTED) != 0) {
+        printf("Error: Shared memory region uses features 0x%x that are not supported by the library\n", superblock->feature_flags & ~MF_FEATURES_SUPPORTED);
+        return (MF_ERROR);
+    }
+
+    struct MFConfig* published = &superblock->config;
+    // The queue alignment is a page size, a power of two
+    if (superblock->queue_alignment <= 0 || (superblock->queue_alignment & (superblock->queue_alignment - 1)) != 0) {
+        printf("Error: Superblock of the shared memory region is corrupted\n");
+        return (MF_ERROR);
+    }
+
+    if (published->SHMEM_SIZE < MIN_SHMEMSIZE || published->SHMEM_SIZE > MAX_SHMEMSIZE || published->SHMEM_SIZE * 1024 > shared_memory_size
+        || published->MAX_QUEUES_IN_SHMEM <= 0 || published->MAX_MSGS_IN_QUEUE < 0 || published->MAX_PROCESSES <= 0 || published->SEGMENT_SIZE <= 0) {
+        printf("Error: Superblock of the shared memory region is corrupted\n");
+        return (MF_ERROR);
+    }
+
+    return (MF_SUCCESS);
+}
+
+// Returns the address of the statistics of the message queue in the shared memory region, NULL if the qid is not valid
+struct mf_stats* mq_stats_address(int qid) {
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        return NULL;
+    }
+    return (struct mf_stats*)(shared_memory_address_stats + sizeof(struct mf_stats) * (qid - 1));
+}
+
+// Returns the address of the access mutex of the message queue in the shared memory region, NULL if the qid is not valid
+struct MFQueueLock* mq_lock_address(int qid) {
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM) {
+        return NULL;
+    }
+    return (struct MFQueueLock*)(shared_memory_address_locks + sizeof(struct MFQueueLock) * (qid - 1));
+}
+
+// Initializes a mutex in the shared memory region that can be used by all processes and survives the death of its owner
+// If the owner dies while holding it, the next locker gets EOWNERDEAD and must make the protected data consistent
+void init_robust_mutex(pthread_mutex_t* mutex) {
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+}
+
+// Acquires the access mutex of the message queue and records the contention statistics
+// A contended acquisition is one that could not take the access mutex immediately
+// If the previous owner died while holding the access mutex, the message queue is repaired before it is used
+// The statistics are updated while holding the access mutex, so they do not need atomic operations
+void mq_lock(int qid, unsigned long long* hold_start_ns) {
+    struct MFQueueLock* lock = mq_lock_address(qid);
+    unsigned long long wait_ns = 0;
+    int is_contended = 0;
+
+    int lock_status = pthread_mutex_trylock(&lock->mutex);
+    if (lock_status == EBUSY) {
+        unsigned long long wait_start_ns = monotonic_time_ns();
+        lock_status = pthread_mutex_lock(&lock->mutex);
+        *hold_start_ns = monotonic_time_ns();
+        wait_ns = *hold_start_ns - wait_start_ns;
+        is_contended = 1;
+    } else {
+        *hold_start_ns = monotonic_time_ns();
+    }
+
+    struct mf_stats* mq_stats = mq_stats_address(qid);
+
+    // The owner died while holding the access mutex, it may have left the message queue half updated
+    if (lock_status == EOWNERDEAD) {
+        printf("Warning: Process %d died while holding the access mutex of message queue %d, repairing the message queue\n", lock->owner_pid, qid);
+        mq_repair(qid);
+        pthread_mutex_consistent(&lock->mutex);
+        mq_stats->lock_owner_died++;
+    }
+
+    lock->owner_pid = getpid();
+
+    mq_stats->lock_acquisitions++;
+    if (is_contended) {
+        mq_stats->lock_contended++;
+        mq_stats->lock_wait_ns_total += wait_ns;
+        if (wait_ns > mq_stats->lock_wait_ns_max) {
+            mq_stats->lock_wait_ns_max = wait_ns;
+        }
+    }
+}
+
+// Records the hold time of the access mutex of the message queue and releases it
+void mq_unlock(int qid, unsigned long long hold_start_ns) {
+    struct MFQueueLock* lock = mq_lock_address(qid);
+    struct mf_stats* mq_stats = mq_stats_address(qid);
+
+    unsigned long long hold_ns = monotonic_time_ns() - hold_start_ns;
+    mq_stats->lock_hold_ns_total += hold_ns;
+    if (hold_ns > mq_stats->lock_hold_ns_max) {
+        mq_stats->lock_hold_ns_max = hold_ns;
+    }
+
+    lock->owner_pid = 0;
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+// Makes the message queue consistent after its access mutex owner died in the middle of mf_send() or mf_recv()
+// The messages are walked from the next message, the count and the end of the last message are recalculated
+// from the messages that are completely written, and the free space is cleared
+void mq_repair(int qid) {
+    // A message queue that is not created has nothing to repair
+    if (mq_header_get(qid, MQ_FIELD_ID) == 0) {
+        return;
+    }
+
+    void* mq_start_address = mq_region_address(qid);
+    if (mq_start_address == NULL) {
+        return;
+    }
+
+    int is_durable = mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE;
+    // The messages removed out of order are still in the ring, they are walked as well
+    int mq_msg_count = mq_header_get(qid, MQ_FIELD_MSG_COUNT) + mq_header_get(qid, MQ_FIELD_TAG_HOLES);
+    int mq_next_msg_address_diff = mq_header_get(qid, MQ_FIELD_NEXT_MSG);
+    int mq_end_msg_address_diff = 0;
+    ring_recover(mq_start_address, mq_header_get(qid, MQ_FIELD_SIZE), is_durable, &mq_msg_count, &mq_next_msg_address_diff, &mq_end_msg_address_diff);
+
+    mq_header_set(qid, MQ_FIELD_MSG_COUNT, mq_msg_count);
+    mq_header_set(qid, MQ_FIELD_NEXT_MSG, mq_next_msg_address_diff);
+    mq_header_set(qid, MQ_FIELD_END_MSG, mq_end_msg_address_diff);
+
+    // The dying process may have left a tag chain half linked, the chains and the holes are counted again from the messages
+    mq_rebuild_tag_chains(qid);
+
+    if (is_durable) {
+        durable_persist_state(qid);
+    }
+}
+
+// Returns the entry of the process in the process registry, NULL if it is not registered
+// If is_create is 1 and the process is not registered, a free entry is assigned to it
+// An entry is the pid (4 bytes), reserved (4 bytes) and the open count of each message queue (4 bytes each)
+// Must be called with the registry mutex held
+int* registry_entry(int pid, int is_create) {
+    int* free_entry = NULL;
+    for (int i = 0; i < config.MAX_PROCESSES; i++) {
+        int* entry = shared_memory_address_registry + sizeof(struct MFRegistry) + registry_entry_size() * i;
+        if (entry[0] == pid) {
+            return entry;
+        }
+        if (entry[0] == 0 && free_entry == NULL) {
+            free_entry = entry;
+        }
+    }
+
+    if (!is_create || free_entry == NULL) {
+        return NULL;
+    }
+
+    memset(free_entry, 0, registry_entry_size());
+    free_entry[0] = pid;
+    return free_entry;
+}
+
+// Acquires the registry mutex, it protects the process registry, the reference counts and the active process count
+// The registry only has counters, so after its owner dies it is consistent as it is
+void registry_lock() {
+    struct MFRegistry* registry = shared_memory_address_registry;
+    if (pthread_mutex_lock(&registry->mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(&registry->mutex);
+    }
+}
+
+// Releases the registry mutex
+void registry_unlock() {
+    struct MFRegistry* registry = shared_memory_address_registry;
+    pthread_mutex_unlock(&registry->mutex);
+}
+
+// Adds value to the reference count of the message queue and to the open count of the process in the process registry
+// Must be called with the registry mutex held
+void registry_add_ref(int qid, int value) {
+    int* entry = registry_entry(getpid(), 1);
+    if (entry != NULL) {
+        entry[2 + qid - 1] += value;
+    }
+    mq_header_set(qid, MQ_FIELD_REF_COUNT, mq_header_get(qid, MQ_FIELD_REF_COUNT) + value);
+}
+
+// Returns the number of times the calling process has the message queue open, -1 if the process is not in the process registry
+// Must be called with the registry mutex held
+int registry_open_count(int qid) {
+    int* entry = registry_entry(getpid(), 0);
+    if (entry == NULL) {
+        return -1;
+    }
+    return entry[2 + qid - 1];
+}
+
+// Adds value to the active process count in the shared memory information
+// Must be called with the registry mutex held
+void registry_add_active(int value) {
+    char active_processes_bytes[4];
+    memcpy(active_processes_bytes, shared_memory_address_info + sizeof(int) * 3, 4);
+    int active_processes = bytes_to_int_little_endian(active_processes_bytes) + value;
+    int_to_bytes_little_endian(active_processes, active_processes_bytes);
+    memcpy(shared_memory_address_info + sizeof(int) * 3, active_processes_bytes, 4);
+}
+
+// Releases everything the process holds in the registry, its open message queues and its active process count, and frees its entry
+// Must be called with the registry mutex held
+void registry_release(int* entry) {
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        int open_count = entry[2 + qid - 1];
+        if (open_count != 0 && mq_header_get(qid, MQ_FIELD_ID) != 0) {
+            mq_header_set(qid, MQ_FIELD_REF_COUNT, mq_header_get(qid, MQ_FIELD_REF_COUNT) - open_count);
+        }
+    }
+    registry_add_active(-1);
+    memset(entry, 0, registry_entry_size());
+}
+
+// Reaps the registered processes that died without mf_disconnect(), called by mf_maintain()
+// Their reference counts and active process counts are released
+// Returns the number of reaped processes
+int registry_reap() {
+    struct MFRegistry* registry = shared_memory_address_registry;
+    int reaped_processes = 0;
+
+    registry_lock();
+    for (int i = 0; i < config.MAX_PROCESSES; i++) {
+        int* entry = shared_memory_address_registry + sizeof(struct MFRegistry) + registry_entry_size() * i;
+        if (entry[0] == 0 || kill(entry[0], 0) == 0 || errno != ESRCH) {
+            continue;
+        }
+
+        printf("Reaped dead process %d\n", entry[0]);
+
+        // The dead process could not remove its reply area, see mf_call()
+        char reply_area_name[MAXFILENAME];
+        rpc_area_name(entry[0], reply_area_name);
+        shm_unlink(reply_area_name);
+
+        registry_release(entry);
+        registry->reaped_processes++;
+        reaped_processes++;
+    }
+    registry_unlock();
+
+    return reaped_processes;
+}
+
+// Registers the calling process in the process registry and increments the number of active processes in the shared memory information region
+// A process that dies without mf_disconnect() is reaped by mfserver through its registry entry
+void registry_register() {
+    registry_lock();
+    if (registry_entry(getpid(), 0) == NULL) {
+        if (registry_entry(getpid(), 1) == NULL) {
+            printf("Warning: Process registry is full, consider increasing MAX_PROCESSES in the config\n");
+        }
+        registry_add_active(1);
+    }
+    registry_unlock();
+}
+
+// Initializes the library mutex as a recursive mutex, the mapping of a message queue may happen while it is held
+void init_library_mutex() {
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&library_mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+}
+
+// Locks the process state of the library against the other threads of the process
+void library_lock() {
+    pthread_once(&library_mutex_once, init_library_mutex);
+    pthread_mutex_lock(&library_mutex);
+}
+
+// Unlocks the process state of the library
+void library_unlock() {
+    pthread_mutex_unlock(&library_mutex);
+}
+
+// Creates the key that closes the queue handles of a thread when it exits
+void init_thread_handles_key() {
+    pthread_key_create(&thread_handles_key, free_thread_handles);
+}
+
+// Closes the semaphores of the queue handles of an exiting thread
+void free_thread_handles(void* handles) {
+    struct MFThreadHandles* thread_handles_to_free = handles;
+    for (int i = 0; i < thread_handles_to_free->count; i++) {
+        if (thread_handles_to_free->handles[i].empty_sem != NULL) {
+            sem_close(thread_handles_to_free->handles[i].empty_sem);
+            sem_close(thread_handles_to_free->handles[i].full_sem);
+        }
+    }
+    free(thread_handles_to_free);
+}
+
+// Returns the queue handle of the message queue in the calling thread, opens its semaphores if they are not opened yet
+// A handle that belongs to a removed message queue with the same qid is reopened, they are told apart by the instance id
+// The handles are per thread, so the hot path does not share any process state between the threads
+struct MFQueueHandle* mq_handle(int qid) {
+    // The handles of the thread are reallocated if the process reconnected with more message queues
+    if (thread_handles != NULL && thread_handles->count < config.MAX_QUEUES_IN_SHMEM) {
+        free_thread_handles(thread_handles);
+        thread_handles = NULL;
+    }
+
+    if (thread_handles == NULL) {
+        pthread_once(&thread_handles_once, init_thread_handles_key);
+        thread_handles = calloc(1, sizeof(struct MFThreadHandles) + sizeof(struct MFQueueHandle) * config.MAX_QUEUES_IN_SHMEM);
+        if (thread_handles == NULL) {
+            printf("Error: Could not allocate the queue handles of the thread\n");
+            return NULL;
+        }
+        thread_handles->count = config.MAX_QUEUES_IN_SHMEM;
+        pthread_setspecific(thread_handles_key, thread_handles);
+    }
+
+    struct MFQueueHandle* handle = &thread_handles->handles[qid - 1];
+    int instance = mq_header_get(qid, MQ_FIELD_INSTANCE);
+    if (handle->empty_sem != NULL && handle->instance == instance) {
+        return handle;
+    }
+
+    if (handle->empty_sem != NULL) {
+        sem_close(handle->empty_sem);
+        sem_close(handle->full_sem);
+        handle->empty_sem = NULL;
+    }
+
+    // Assemble the semaphore names, "semaphore" + qid + "empty" and "semaphore" + qid + "full"
+    char empty_sem_name[MAXFILENAME];
+    char full_sem_name[MAXFILENAME];
+    snprintf(empty_sem_name, MAXFILENAME, "%.32s%d%.32s", base_sem_name, qid, empty_sem_additon);
+    snprintf(full_sem_name, MAXFILENAME, "%.32s%d%.32s", base_sem_name, qid, full_sem_additon);
+
+    // Open the semaphores
+    sem_t* empty_sem = sem_open(empty_sem_name, O_CREAT, 0666, 0);
+    sem_t* full_sem = sem_open(full_sem_name, O_CREAT, 0666, 0);
+    if (empty_sem == SEM_FAILED || full_sem == SEM_FAILED) {
+        printf("Error: Could not open the semaphores of the message queue %d\n", qid);
+        if (empty_sem != SEM_FAILED) {
+            sem_close(empty_sem);
+        }
+        if (full_sem != SEM_FAILED) {
+            sem_close(full_sem);
+        }
+        return NULL;
+    }
+
+    handle->instance = instance;
+    handle->empty_sem = empty_sem;
+    handle->full_sem = full_sem;
+
+    return handle;
+}
+
+// Sends a message to the message queue if it can be done without blocking
+// Returns MF_SUCCESS if the message is sent, MQ_WOULD_BLOCK if the message queue does not exist yet or has no space for the message
+// and MF_ERROR if the message does not fit in the message queue even if it is empty
+// The blocked senders are served in the order of their tickets, a sender without a ticket only sends if no sender is blocked
+// If ticket is not NULL the caller blocks, it takes a ticket when it cannot send, MQ_WAIT_TURN is returned while the ticket
+// is not at the head of the line, and MQ_WOULD_BLOCK when it is at the head and counted as the sender sleeping on the empty
+// semaphore, see mq_wait_send(). A sender with a NULL ticket never blocks, it only retries
+int mq_try_send(int qid, struct MFQueueHandle* handle, void* bufptr, int datalen, int msg_flags, int* ticket) {
+    // Time the access mutex is acquired at, used for the lock statistics
+    unsigned long long hold_start_ns = 0;
+
+    // Wait for the access mutex
+    mq_lock(qid, &hold_start_ns);
+    MF_TRACE(lock_acquire, MF_EV_LOCK_ACQUIRE, qid, 0);
+
+    // Line up behind the blocked senders, even if the message would fit, so that small messages do not starve a large one
+    if (!mq_send_turn(qid, ticket)) {
+        if (ticket != NULL && *ticket == MQ_NO_TICKET) {
+            *ticket = mq_take_ticket(qid);
+        }
+        MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+        mq_unlock(qid, hold_start_ns);
+        return ticket != NULL ? MQ_WAIT_TURN : MQ_WOULD_BLOCK;
+    }
+
+    // Check if the message queue exists, it may be created after the caller started to send
+    // Check if the message fits in the message queue even if the message queue is empty
+    int mq_exists = mq_header_get(qid, MQ_FIELD_ID) == qid;
+    if (mq_exists && MF_MSG_HEADER_SIZE + datalen > mq_header_get(qid, MQ_FIELD_SIZE)) {
+        printf("Error: Message does not fit in the message queue even though the message queue is empty\n");
+        int wake_turns = ticket != NULL && *ticket != MQ_NO_TICKET ? mq_pass_ticket(qid, ticket) : 0;
+        MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+        mq_unlock(qid, hold_start_ns);
+        if (wake_turns) {
+            mq_wake_turns(qid, wake_turns);
+        }
+        return (MF_ERROR);
+    }
+
+    // Check if the message queue is full
+    // Then find an empty slot in the message queue for the message header and the message data
+    // Expired messages never make a sender wait, they are reclaimed when the message queue is full
+    // While the overflow log of a spilling message queue holds messages, the message goes after them to keep the order
+    int is_spilled = mq_exists && mq_header_get(qid, MQ_FIELD_SPILL_COUNT) > 0;
+    int msg_address_diff = -1;
+    if (mq_exists && !is_spilled && !mq_within_limits(qid, MF_MSG_HEADER_SIZE + datalen)) {
+        mq_reclaim_expired(qid);
+    }
+    if (mq_exists && !is_spilled && mq_within_limits(qid, MF_MSG_HEADER_SIZE + datalen)) {
+        msg_address_diff = mq_find_space(qid, MF_MSG_HEADER_SIZE + datalen);
+        if (msg_address_diff == -1 && mq_reclaim_expired(qid) > 0) {
+            msg_address_diff = mq_find_space(qid, MF_MSG_HEADER_SIZE + datalen);
+        }
+    }
+
+    // A full spilling message queue appends the message to its overflow log, the sender blocks only if the log is full too
+    // A pooled message queue appends it to its chunks of the buffer pool the same way, see spill_append()
+    // The receivers move it back to the message queue, see spill_refill(), so no receiver is woken for it
+    if (msg_address_diff == -1 && mq_exists && (mq_header_get(qid, MQ_FIELD_FLAGS) & MQ_OVERFLOW_FLAGS)
+        && spill_append(qid, bufptr, datalen, msg_flags) == MF_SUCCESS) {
+        int wake_turns = ticket != NULL && *ticket != MQ_NO_TICKET ? mq_pass_ticket(qid, ticket) : 0;
+        MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+        mq_unlock(qid, hold_start_ns);
+        MF_TRACE(send_commit, MF_EV_SEND_COMMIT, qid, datalen);
+        if (wake_turns) {
+            mq_wake_turns(qid, wake_turns);
+        }
+        return (MF_SUCCESS);
+    }
+
+    // The sender at the head of the line sleeps on the empty semaphore until a receiver frees enough space for its message
+    if (msg_address_diff == -1) {
+        if (ticket != NULL) {
+            if (*ticket == MQ_NO_TICKET) {
+                *ticket = mq_take_ticket(qid);
+            }
+            mq_add_send_waiter(qid, MF_MSG_HEADER_SIZE + datalen);
+        }
+        MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+        mq_unlock(qid, hold_start_ns);
+        return (MQ_WOULD_BLOCK);
+    }
+
+    // Copy the message to the empty slot and update the message queue header
+    mq_put_message(qid, msg_address_diff, bufptr, datalen, msg_flags);
+
+    // Wake up a sleeping receiver for the message, and move the line of the blocked senders on if the caller was at its head
+    // A tagged message wakes up the tag receivers too, they check if it matches their tag
+    int wake_receivers = mq_take_recv_waiters(qid, 1);
+    int wake_tag_receivers = (msg_flags & MF_MSG_TAGGED) ? mq_take_tag_waiters(qid) : 0;
+    int wake_turns = ticket != NULL && *ticket != MQ_NO_TICKET ? mq_pass_ticket(qid, ticket) : 0;
+
+    MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+    mq_unlock(qid, hold_start_ns);
+    MF_TRACE(send_commit, MF_EV_SEND_COMMIT, qid, datalen);
+
+    // Signal the semaphore only for the receivers that sleep on it
+    mq_post_wakeups(handle->full_sem, wake_receivers);
+    if (wake_tag_receivers) {
+        syscall(SYS_futex, mq_header_address(qid, MQ_FIELD_TAG_SEQ), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    if (wake_turns) {
+        mq_wake_turns(qid, wake_turns);
+    }
+
+    return (MF_SUCCESS);
+}
+
+// Sends a message to the message queue, blocking the caller until the message queue has space for it
+// A blocked sender takes a ticket, the blocked senders are served in the order of their tickets
+// Returns MF_SUCCESS or MF_ERROR
+int mq_send_wait(int qid, struct MFQueueHandle* handle, void* bufptr, int datalen, int msg_flags) {
+    int ticket = MQ_NO_TICKET;
+    int send_status;
+    while ((send_status = mq_try_send(qid, handle, bufptr, datalen, msg_flags, &ticket)) == MQ_WOULD_BLOCK
+        || send_status == MQ_WAIT_TURN) {
+        MF_TRACE(block, MF_EV_BLOCK, qid, 0);
+        mq_wait_send(qid, handle, ticket, send_status);
+        MF_TRACE(wake, MF_EV_WAKE, qid, 0);
+    }
+
+    // A message sent to a durable message queue is acknowledged once a group commit makes it durable
+    // The change sequence read now is at least the change that stored the message
+    if (send_status == MF_SUCCESS && (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE)) {
+        durable_wait_commit(qid, __atomic_load_n(mq_header_address(qid, MQ_FIELD_DURABLE_SEQ), __ATOMIC_ACQUIRE));
+    }
+
+    return send_status;
+}
+
+// Receives a message from the message queue if it can be done without blocking, the message length is stored in msg_len
+// Returns MF_SUCCESS if a message is received and MQ_WOULD_BLOCK if the message queue does not exist yet or is empty
+// If will_wait is 1 and the message queue is empty, the caller is counted as a waiting receiver before the access mutex is released,
+// it must then wait on the full semaphore of the handle before it tries again
+// The call header of a request of mf_call() is stored in call_header, see mq_get_message()
+int mq_try_recv(int qid, struct MFQueueHandle* handle, void* bufptr, int bufsize, int* msg_len, int will_wait, struct MFCallHeader* call_header) {
+    // Time the access mutex is acquired at, used for the lock statistics
+    unsigned long long hold_start_ns = 0;
+
+    // Wait for the access mutex
+    mq_lock(qid, &hold_start_ns);
+    MF_TRACE(lock_acquire, MF_EV_LOCK_ACQUIRE, qid, 0);
+
+    // Reclaim the expired messages at the head of the message queue, they are never received
+    int expired_messages = mq_header_get(qid, MQ_FIELD_ID) == qid ? mq_reclaim_expired(qid) : 0;
+
+    // Check if the message queue exists and has a message
+    if (mq_header_get(qid, MQ_FIELD_ID) != qid || mq_header_get(qid, MQ_FIELD_MSG_COUNT) == 0) {
+        if (will_wait) {
+            mq_header_set(qid, MQ_FIELD_RECV_WAITERS, mq_header_get(qid, MQ_FIELD_RECV_WAITERS) + 1);
+        }
+        int wake_senders = expired_messages > 0 ? mq_take_send_waiter(qid) : 0;
+        MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+        mq_unlock(qid, hold_start_ns);
+        mq_post_wakeups(handle->empty_sem, wake_senders);
+        return (MQ_WOULD_BLOCK);
+    }
+
+    // Copy the next message to the buffer and remove it from the message queue
+    // A compressed message is copied as it is and decompressed after the access mutex is released
+    char compressed_buffer[MAX_DATALEN];
+    int compressed_len = 0;
+    *msg_len = mq_get_message(qid, bufptr, bufsize, compressed_buffer, &compressed_len, call_header);
+
+    // Wake up the sleeping sender if the freed space fits the message of the sender at the head of the line
+    int wake_senders = mq_take_send_waiter(qid);
+    if (wake_senders == 0) {
+        mq_stats_address(qid)->wakeups_skipped++;
+    }
+
+    MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+    mq_unlock(qid, hold_start_ns);
+
+    if (compressed_len > 0) {
+        *msg_len = mq_decode_message(qid, compressed_buffer, compressed_len, bufptr, bufsize);
+    }
+    MF_TRACE(recv_complete, MF_EV_RECV_COMPLETE, qid, *msg_len);
+
+    // Signal the empty semaphore only for a sender that sleeps on it
+    mq_post_wakeups(handle->empty_sem, wake_senders);
+
+    return (MF_SUCCESS);
+}
+
+// Waits after mq_try_send() or batch_publish() returned send_status for the ticket of the caller
+// A sender at the head of the line sleeps on the empty semaphore, see mq_take_send_waiter(), the others sleep on the head
+// ticket in the message queue header until it changes, with a futex, as the semaphore wakes no particular sender
+// The futex bitset of a sender is the low bits of its ticket, so moving the line on wakes the next sender only, see mq_wake_turns()
+void mq_wait_send(int qid, struct MFQueueHandle* handle, int ticket, int send_status) {
+    if (send_status == MQ_WOULD_BLOCK) {
+        sem_wait(handle->empty_sem);
+        return;
+    }
+
+    int* head_address = mq_header_address(qid, MQ_FIELD_SEND_TICKET_HEAD);
+    while (1) {
+        // The futex compares the word as it is stored, the ticket is compared after it is decoded
+        int head_word = __atomic_load_n(head_address, __ATOMIC_ACQUIRE);
+        int head = bytes_to_int_little_endian((char*)&head_word);
+        if (head == ticket || mq_ticket_cancelled(ticket, head)) {
+            return;
+        }
+        syscall(SYS_futex, head_address, FUTEX_WAIT_BITSET, head_word, NULL, NULL, mq_ticket_bitset(ticket));
+    }
+}
+
+// Returns 1 if the caller may try to send now: its ticket is at the head of the line, or it has no ticket and no sender is blocked
+// A cancelled ticket is dropped, see mq_reset_send_tickets()
+// Must be called with the access mutex held
+int mq_send_turn(int qid, int* ticket) {
+    int head = mq_header_get(qid, MQ_FIELD_SEND_TICKET_HEAD);
+    if (ticket != NULL && *ticket != MQ_NO_TICKET) {
+        if (*ticket == head) {
+            return 1;
+        }
+        if (!mq_ticket_cancelled(*ticket, head)) {
+            return 0;
+        }
+        *ticket = MQ_NO_TICKET;
+    }
+    return mq_header_get(qid, MQ_FIELD_SEND_TICKET_NEXT) == head;
+}
+
+// Takes the next ticket of the blocked senders
+// Must be called with the access mutex held
+int mq_take_ticket(int qid) {
+    int ticket = mq_header_get(qid, MQ_FIELD_SEND_TICKET_NEXT);
+    mq_header_set(qid, MQ_FIELD_SEND_TICKET_NEXT, (ticket + 1) & MQ_TICKET_MASK);
+    return ticket;
+}
+
+// Gives up the ticket at the head of the line after its sender is served, the next ticket is at the head now
+// Returns the futex bitset of the next ticket if another sender is blocked, 0 otherwise,
+// the caller then wakes the next sender with mq_wake_turns() after the access mutex is released
+// Must be called with the access mutex held
+int mq_pass_ticket(int qid, int* ticket) {
+    int head = (*ticket + 1) & MQ_TICKET_MASK;
+    mq_header_set(qid, MQ_FIELD_SEND_TICKET_HEAD, head);
+    *ticket = MQ_NO_TICKET;
+    return mq_header_get(qid, MQ_FIELD_SEND_TICKET_NEXT) != head ? mq_ticket_bitset(head) : 0;
+}
+
+// Returns the futex bitset of the ticket, one of 32 bits, the senders 32 tickets apart share it
+int mq_ticket_bitset(int ticket) {
+    return 1 << (ticket & 31);
+}
+
+// Returns 1 if the ticket is before the head of the line, such a ticket is never served, it was cancelled
+int mq_ticket_cancelled(int ticket, int head) {
+    int distance = (head - ticket) & MQ_TICKET_MASK;
+    return distance != 0 && distance <= MQ_TICKET_MASK / 2;
+}
+
+// Wakes up the blocked senders of the futex bitset that wait for their turn, the one at the head tries to send
+// and the others, with tickets 32 apart from it, sleep again
+void mq_wake_turns(int qid, int bitset) {
+    syscall(SYS_futex, mq_header_address(qid, MQ_FIELD_SEND_TICKET_HEAD), FUTEX_WAKE_BITSET, INT_MAX, NULL, NULL, bitset);
+}
+
+// Cancels the tickets of the blocked senders of the message queue, called by mfserver after a process with a ticket may have died
+// The blocked senders are woken up and line up again, in the order they get the access mutex
+void mq_reset_send_tickets(int qid) {
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return;
+    }
+
+    unsigned long long hold_start_ns = 0;
+    mq_lock(qid, &hold_start_ns);
+    int next = mq_header_get(qid, MQ_FIELD_SEND_TICKET_NEXT);
+    int wake_senders = 0;
+    int is_reset = next != mq_header_get(qid, MQ_FIELD_SEND_TICKET_HEAD);
+    if (is_reset) {
+        mq_header_set(qid, MQ_FIELD_SEND_TICKET_HEAD, next);
+        wake_senders = mq_header_get(qid, MQ_FIELD_SEND_WAITERS);
+        mq_header_set(qid, MQ_FIELD_SEND_WAITERS, 0);
+    }
+    mq_unlock(qid, hold_start_ns);
+
+    if (is_reset) {
+        mq_post_wakeups(handle->empty_sem, wake_senders);
+        mq_wake_turns(qid, FUTEX_BITSET_MATCH_ANY);
+    }
+}
+
+// Counts the sender at the head of the line as the sender that sleeps on the empty semaphore until msg_size bytes are free
+// Must be called with the access mutex held
+void mq_add_send_waiter(int qid, int msg_size) {
+    mq_header_set(qid, MQ_FIELD_SEND_WAIT_BYTES, msg_size);
+    mq_header_set(qid, MQ_FIELD_SEND_WAITERS, 1);
+}
+
+// Takes the sleeping sender to wake up if the message queue has space for its message
+// The woken sender is no longer counted, it counts itself again if it still does not fit. Returns the number of senders to wake, 0 or 1
+// Only the sender at the head of the line sleeps on the empty semaphore, so the wakeup is sized to the message that is sent next
+// Must be called with the access mutex held
+int mq_take_send_waiter(int qid) {
+    mq_wake_ring_waiters(qid);
+    if (mq_header_get(qid, MQ_FIELD_SEND_WAITERS) == 0 || mq_header_get(qid, MQ_FIELD_ID) != qid) {
+        return 0;
+    }
+
+    // The message of a spilling message queue goes to the overflow log while the log holds messages, or when the message queue is full
+    // The message of a pooled message queue goes to its last chunk, or to a chunk it can borrow
+    int msg_size = mq_header_get(qid, MQ_FIELD_SEND_WAIT_BYTES);
+    int has_space = mq_header_get(qid, MQ_FIELD_SPILL_COUNT) == 0 && mq_within_limits(qid, msg_size) && mq_find_space(qid, msg_size) != -1;
+    if (!has_space && (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_SPILL)) {
+        has_space = spill_find_space(qid, msg_size) != -1;
+    }
+    if (!has_space && (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_POOL)) {
+        has_space = pool_fits_tail(qid, msg_size) || pool_can_borrow(qid);
+    }
+    if (!has_space) {
+        return 0;
+    }
+
+    mq_header_set(qid, MQ_FIELD_SEND_WAITERS, 0);
+    mq_stats_address(qid)->wakeups++;
+    return 1;
+}
+
+// Takes up to count sleeping receivers to wake up for count new messages, the others are counted as skipped wakeups
+// Returns the number of receivers to wake
+// Must be called with the access mutex held
+int mq_take_recv_waiters(int qid, int count) {
+    mq_wake_ring_waiters(qid);
+    int recv_waiters = mq_header_get(qid, MQ_FIELD_RECV_WAITERS);
+    int wake_receivers = count < recv_waiters ? count : recv_waiters;
+
+    mq_header_set(qid, MQ_FIELD_RECV_WAITERS, recv_waiters - wake_receivers);
+    mq_stats_address(qid)->wakeups += wake_receivers;
+    mq_stats_address(qid)->wakeups_skipped += count - wake_receivers;
+    return wake_receivers;
+}
+
+// Wakes up the ring workers waiting for a message or for space in the message queue, see ring_worker()
+// It is called wherever the sleeping senders or receivers are taken, the woken workers retry and count themselves again if they still block
+// Ring workers rarely wait, so they are woken up with the access mutex held rather than by every caller after it is released
+// Must be called with the access mutex held
+void mq_wake_ring_waiters(int qid) {
+    if (mq_header_get(qid, MQ_FIELD_RING_WAITERS) == 0) {
+        return;
+    }
+    mq_header_set(qid, MQ_FIELD_RING_WAITERS, 0);
+    int* ring_seq = mq_header_address(qid, MQ_FIELD_RING_SEQ);
+    __atomic_store_n(ring_seq, *ring_seq + 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, ring_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Posts the semaphore once for each woken peer, called after the access mutex is released
+void mq_post_wakeups(sem_t* sem, int count) {
+    for (int i = 0; i < count; i++) {
+        sem_post(sem);
+    }
+}
+
+// Returns the batch of the message queue in the calling process, NULL if the process never sent to it in batches
+struct MFBatch* batch_of(int qid) {
+    struct MFBatch** process_batches = __atomic_load_n(&batches, __ATOMIC_ACQUIRE);
+    if (process_batches == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&process_batches[qid - 1], __ATOMIC_ACQUIRE);
+}
+
+// Stages a message in the batch of the message queue, the batch is published first if the message does not fit in it
+// and after the message is staged if the batch reached max_bytes
+// Must be called with the batch mutex held
+int batch_stage(int qid, struct MFBatch* batch, struct MFQueueHandle* handle, void* bufptr, int datalen) {
+    // The message is staged as it is stored in the message queue, compressed if the message queue compresses its messages
+    char compressed_buffer[MAX_DATALEN];
+    int stored_len = datalen;
+    int msg_flags = 0;
+    void* stored_data = mq_encode_message(qid, bufptr, &stored_len, compressed_buffer, &msg_flags);
+
+    // The default time to live of the message queue counts from the staging
+    char expiry_buffer[sizeof(struct MFExpiryHeader) + MAX_DATALEN];
+    stored_data = mq_add_expiry(stored_data, &stored_len, mq_expires_at(monotonic_time_ns(), mq_header_get(qid, MQ_FIELD_TTL)), expiry_buffer, &msg_flags);
+
+    // Check if the message fits in the message queue even if the message queue is empty
+    if (MF_MSG_HEADER_SIZE + stored_len > mq_header_get(qid, MQ_FIELD_SIZE)) {
+        printf("Error: Message does not fit in the message queue even though the message queue is empty\n");
+        return (MF_ERROR);
+    }
+
+    // Make room for the message, a message queue takes at most its message count and byte limits of a batch anyway
+    int max_msgs = mq_header_get(qid, MQ_FIELD_MAX_MSGS);
+    int max_bytes = mq_header_get(qid, MQ_FIELD_MAX_BYTES);
+    if (batch->staged_bytes + MF_MSG_HEADER_SIZE + stored_len > batch->capacity || (max_msgs > 0 && batch->staged_count >= max_msgs)
+        || (max_bytes > 0 && batch->staged_count > 0 && batch->staged_bytes - batch->published_bytes + MF_MSG_HEADER_SIZE + stored_len > max_bytes)) {
+        batch_flush(qid, batch);
+    }
+
+    // The oldest staged message sets the deadline of the batch
+    if (batch->staged_count == 0) {
+        batch->deadline_ns = monotonic_time_ns() + (unsigned long long)batch->max_delay_us * 1000;
+    }
+
+    char msg_len_bytes[4];
+    int_to_bytes_little_endian(stored_len | msg_flags, msg_len_bytes);
+    memcpy(batch->buffer + batch->staged_bytes, msg_len_bytes, 4);
+    memset(batch->buffer + batch->staged_bytes + sizeof(int), 0, 4);
+    memcpy(batch->buffer + batch->staged_bytes + MF_MSG_HEADER_SIZE, stored_data, stored_len);
+    batch->staged_bytes += MF_MSG_HEADER_SIZE + stored_len;
+    batch->staged_count++;
+
+    // Publish the batch when it is full, without waiting if the message queue is full, the flusher retries
+    if (batch->staged_bytes - batch->published_bytes >= batch->max_bytes) {
+        batch_publish(qid, batch, handle, NULL);
+    }
+
+    return (MF_SUCCESS);
+}
+
+// Publishes the staged messages of the batch in one critical section, as many as the message queue takes
+// Returns MF_SUCCESS if all of them are published and MQ_WOULD_BLOCK if the message queue is full or does not exist
+// The batch lines up with the blocked senders as a message of mq_try_send() does, with the same use of ticket and MQ_WAIT_TURN
+// Must be called with the batch mutex held
+int batch_publish(int qid, struct MFBatch* batch, struct MFQueueHandle* handle, int* ticket) {
+    if (batch->staged_count == 0) {
+        return (MF_SUCCESS);
+    }
+
+    // Time the access mutex is acquired at, used for the lock statistics
+    unsigned long long hold_start_ns = 0;
+
+    mq_lock(qid, &hold_start_ns);
+    MF_TRACE(lock_acquire, MF_EV_LOCK_ACQUIRE, qid, 0);
+
+    if (!mq_send_turn(qid, ticket)) {
+        if (ticket != NULL && *ticket == MQ_NO_TICKET) {
+            *ticket = mq_take_ticket(qid);
+        }
+        MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+        mq_unlock(qid, hold_start_ns);
+        return ticket != NULL ? MQ_WAIT_TURN : MQ_WOULD_BLOCK;
+    }
+
+    int published = 0;
+    while (batch->staged_count > 0) {
+        char* staged_msg = batch->buffer + batch->published_bytes;
+        int msg_word = bytes_to_int_little_endian(staged_msg);
+        int stored_len = msg_word & MF_MSG_LENGTH_MASK;
+
+        int msg_address_diff = -1;
+        if (mq_header_get(qid, MQ_FIELD_ID) == qid && mq_header_get(qid, MQ_FIELD_SPILL_COUNT) == 0
+            && mq_within_limits(qid, MF_MSG_HEADER_SIZE + stored_len)) {
+            msg_address_diff = mq_find_space(qid, MF_MSG_HEADER_SIZE + stored_len);
+        }
+
+        // A full spilling message queue takes the rest of the batch in its overflow log, see mq_try_send()
+        if (msg_address_diff == -1 && mq_header_get(qid, MQ_FIELD_ID) == qid && (mq_header_get(qid, MQ_FIELD_FLAGS) & MQ_OVERFLOW_FLAGS)
+            && spill_append(qid, staged_msg + MF_MSG_HEADER_SIZE, stored_len, msg_word & ~MF_MSG_LENGTH_MASK) == MF_SUCCESS) {
+            batch->published_bytes += MF_MSG_HEADER_SIZE + stored_len;
+            batch->staged_count--;
+            continue;
+        }
+        if (msg_address_diff == -1) {
+            if (ticket != NULL) {
+                if (*ticket == MQ_NO_TICKET) {
+                    *ticket = mq_take_ticket(qid);
+                }
+                mq_add_send_waiter(qid, MF_MSG_HEADER_SIZE + stored_len);
+            }
+            break;
+        }
+
+        mq_put_message(qid, msg_address_diff, staged_msg + MF_MSG_HEADER_SIZE, stored_len, msg_word & ~MF_MSG_LENGTH_MASK);
+        batch->published_bytes += MF_MSG_HEADER_SIZE + stored_len;
+        batch->staged_count--;
+        published++;
+    }
+
+    // Wake up a sleeping receiver for each published message, and move the line of the blocked senders on once the batch is published
+    int wake_receivers = mq_take_recv_waiters(qid, published);
+    int wake_turns = batch->staged_count == 0 && ticket != NULL && *ticket != MQ_NO_TICKET ? mq_pass_ticket(qid, ticket) : 0;
+
+    MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, qid, 0);
+    mq_unlock(qid, hold_start_ns);
+
+    mq_post_wakeups(handle->full_sem, wake_receivers);
+    if (wake_turns) {
+        mq_wake_turns(qid, wake_turns);
+    }
+
+    if (batch->staged_count > 0) {
+        return (MQ_WOULD_BLOCK);
+    }
+    batch->staged_bytes = 0;
+    batch->published_bytes = 0;
+    return (MF_SUCCESS);
+}
+
+// Publishes all the staged messages of the batch, blocking the caller until the message queue takes them
+// Must be called with the batch mutex held
+int batch_flush(int qid, struct MFBatch* batch) {
+    if (batch->staged_count == 0) {
+        return (MF_SUCCESS);
+    }
+
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle == NULL) {
+        return (MF_ERROR);
+    }
+
+    int ticket = MQ_NO_TICKET;
+    int publish_status;
+    while ((publish_status = batch_publish(qid, batch, handle, &ticket)) != MF_SUCCESS) {
+        MF_TRACE(block, MF_EV_BLOCK, qid, 0);
+        mq_wait_send(qid, handle, ticket, publish_status);
+        MF_TRACE(wake, MF_EV_WAKE, qid, 0);
+    }
+
+    return (MF_SUCCESS);
+}
+
+// Sets the tick of the flusher thread to the smallest max_delay_us of the batching message queues
+void batch_update_tick() {
+    int tick_us = 0;
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        struct MFBatch* batch = batch_of(qid);
+        if (batch != NULL && batch->max_bytes > 0 && (tick_us == 0 || batch->max_delay_us < tick_us)) {
+            tick_us = batch->max_delay_us;
+        }
+    }
+
+    pthread_mutex_lock(&batch_flusher_mutex);
+    batch_tick_us = tick_us;
+    pthread_mutex_unlock(&batch_flusher_mutex);
+}
+
+// Flusher thread of the process, it wakes up every batch tick and publishes the batches whose oldest message reached its deadline
+// A batch that a sender is publishing is skipped, and a full message queue is retried on the next tick, so the flusher never blocks
+void* batch_flusher_main(void* arg) {
+    pthread_mutex_lock(&batch_flusher_mutex);
+    while (!batch_flusher_stop) {
+        if (batch_tick_us == 0) {
+            pthread_cond_wait(&batch_flusher_cond, &batch_flusher_mutex);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)batch_tick_us * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&batch_flusher_cond, &batch_flusher_mutex, &deadline);
+        if (batch_flusher_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&batch_flusher_mutex);
+
+        unsigned long long now_ns = monotonic_time_ns();
+        for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+            struct MFBatch* batch = batch_of(qid);
+            if (batch == NULL || pthread_mutex_trylock(&batch->mutex) != 0) {
+                continue;
+            }
+            if (batch->staged_count > 0 && now_ns >= batch->deadline_ns) {
+                struct MFQueueHandle* handle = mq_handle(qid);
+                if (handle != NULL) {
+                    batch_publish(qid, batch, handle, NULL);
+                }
+            }
+            pthread_mutex_unlock(&batch->mutex);
+        }
+
+        pthread_mutex_lock(&batch_flusher_mutex);
+    }
+    pthread_mutex_unlock(&batch_flusher_mutex);
+
+    return NULL;
+}
+
+// Stops the flusher thread, publishes the staged messages of all the batches and frees them, called by the last mf_disconnect()
+void batch_stop_all() {
+    pthread_mutex_lock(&batch_flusher_mutex);
+    int was_running = batch_flusher_running;
+    batch_flusher_stop = 1;
+    batch_flusher_running = 0;
+    batch_tick_us = 0;
+    pthread_cond_signal(&batch_flusher_cond);
+    pthread_mutex_unlock(&batch_flusher_mutex);
+    if (was_running) {
+        pthread_join(batch_flusher, NULL);
+    }
+
+    if (batches == NULL) {
+        return;
+    }
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        struct MFBatch* batch = batches[qid - 1];
+        if (batch == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&batch->mutex);
+        batch_flush(qid, batch);
+        pthread_mutex_unlock(&batch->mutex);
+        pthread_mutex_destroy(&batch->mutex);
+        free(batch->buffer);
+        free(batch);
+    }
+    free(batches);
+    batches = NULL;
+}
+
+// Registers batch_atfork_child() to run in the child of every fork of the process
+void batch_register_atfork() {
+    pthread_atfork(NULL, NULL, batch_atfork_child);
+}
+
+// Discards the batches a forked child inherits from its parent, the parent publishes their staged messages
+// The flusher thread does not run in the child and may have held a batch mutex at the fork, so the batches are freed without
+// their mutexes and the flusher state starts over. The child turns batching on again with mf_set_batching(), which starts its own flusher
+void batch_atfork_child() {
+    if (batches != NULL) {
+        for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+            if (batches[qid - 1] != NULL) {
+                free(batches[qid - 1]->buffer);
+                free(batches[qid - 1]);
+            }
+        }
+        free(batches);
+        batches = NULL;
+    }
+
+    pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+    batch_flusher_mutex = flusher_mutex;
+    batch_flusher_cond = flusher_cond;
+    batch_flusher_running = 0;
+    batch_flusher_stop = 0;
+    batch_tick_us = 0;
+}
+
+// Worker thread of a ring, it takes the published submissions, performs them without blocking and posts their completions
+// The submissions that would block stay pending in submission order, the worker counts itself as a waiter of the message queues
+// they block on and sleeps until one of them changes or new submissions are published, see ring_wait_queues()
+// A pending submission also holds back the later submissions of the same operation on the same message queue so that they complete in order
+void* ring_worker(void* arg) {
+    mf_ring_t* ring = arg;
+
+    while (!__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+        // Take the published submissions, the in flight limit guarantees that they fit in the pending list
+        unsigned int sq_tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+        while (ring->sq_head != sq_tail) {
+            ring->pending[ring->pending_count++] = ring->sqes[ring->sq_head & (ring->sq_entries - 1)];
+            __atomic_store_n(&ring->sq_head, ring->sq_head + 1, __ATOMIC_RELEASE);
+        }
+
+        // Perform the pending submissions in order, the ones that would block are kept
+        // An unknown operation never blocks, it completes with MF_ERROR, see ring_try_operation()
+        memset(ring->blocked_queues, 0, config.MAX_QUEUES_IN_SHMEM + 1);
+        int kept = 0;
+        int completed = 0;
+        for (int i = 0; i < ring->pending_count; i++) {
+            struct mf_sqe* sqe = &ring->pending[i];
+            int qid_valid = sqe->qid >= 1 && sqe->qid <= config.MAX_QUEUES_IN_SHMEM;
+            int opcode_valid = sqe->opcode == MF_OP_SEND || sqe->opcode == MF_OP_RECV;
+
+            int result = 0;
+            if (qid_valid && opcode_valid && (ring->blocked_queues[sqe->qid] & (1 << sqe->opcode))) {
+                ring->pending[kept++] = *sqe;
+                continue;
+            }
+            if (ring_try_operation(sqe, &result) == MQ_WOULD_BLOCK) {
+                ring->blocked_queues[sqe->qid] |= 1 << sqe->opcode;
+                ring->pending[kept++] = *sqe;
+                continue;
+            }
+
+            // The in flight limit guarantees that the completion ring has space
+            struct mf_cqe* cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+            cqe->user_data = sqe->user_data;
+            cqe->opcode = sqe->opcode;
+            cqe->result = result;
+            __atomic_store_n(&ring->cq_tail, ring->cq_tail + 1, __ATOMIC_RELEASE);
+            completed++;
+        }
+        ring->pending_count = kept;
+
+        // The worker is counted as a waiter of the message queues only while it makes no progress
+        // After it is counted on new message queues it retries once before it sleeps, a change before it was counted is not missed
+        int newly_waiting = 0;
+        if (completed > 0) {
+            memset(ring->waiting_queues, 0, config.MAX_QUEUES_IN_SHMEM + 1);
+        } else if (kept > 0) {
+            newly_waiting = ring_register_waits(ring);
+        }
+
+        // Wake up the reaper once for the whole batch
+        pthread_mutex_lock(&ring->mutex);
+        if (completed > 0 && ring->reaper_sleeping) {
+            pthread_cond_signal(&ring->cq_cond);
+        }
+
+        // Sleep until new submissions are published, or until a message queue the pending submissions block on changes
+        if (completed == 0 && newly_waiting == 0 && __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE) == ring->sq_head && !ring->stop) {
+            if (ring->pending_count == 0) {
+                ring->worker_sleeping = RING_SLEEP_SUBMIT;
+                pthread_cond_wait(&ring->sq_cond, &ring->mutex);
+            } else {
+                ring->worker_sleeping = RING_SLEEP_QUEUES;
+                int wake_seq = ring->wake_seq;
+                pthread_mutex_unlock(&ring->mutex);
+                ring_wait_queues(ring, wake_seq);
+                pthread_mutex_lock(&ring->mutex);
+                memset(ring->waiting_queues, 0, config.MAX_QUEUES_IN_SHMEM + 1);
+            }
+            ring->worker_sleeping = RING_AWAKE;
+        }
+        pthread_mutex_unlock(&ring->mutex);
+    }
+
+    return NULL;
+}
+
+// Wakes up the worker of the ring if it sleeps, called with the mutex of the ring held after submissions are published or the ring is stopped
+void ring_wake_worker(mf_ring_t* ring) {
+    if (ring->worker_sleeping == RING_SLEEP_SUBMIT) {
+        pthread_cond_signal(&ring->sq_cond);
+    } else if (ring->worker_sleeping == RING_SLEEP_QUEUES) {
+        __atomic_store_n(&ring->wake_seq, ring->wake_seq + 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &ring->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// Counts the worker of the ring as a waiter of the message queues its pending submissions block on, see mq_wake_ring_waiters()
+// The MQ_FIELD_RING_SEQ of each message queue is kept for ring_wait_queues(), the message queues it is already counted on are skipped
+// Returns the number of message queues the worker is newly counted on
+int ring_register_waits(mf_ring_t* ring) {
+    int newly_waiting = 0;
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        if (ring->blocked_queues[qid] == 0 || ring->waiting_queues[qid]) {
+            continue;
+        }
+
+        unsigned long long hold_start_ns = 0;
+        mq_lock(qid, &hold_start_ns);
+        mq_header_set(qid, MQ_FIELD_RING_WAITERS, mq_header_get(qid, MQ_FIELD_RING_WAITERS) + 1);
+        ring->wait_seqs[qid] = mq_header_get(qid, MQ_FIELD_RING_SEQ);
+        mq_unlock(qid, hold_start_ns);
+
+        ring->waiting_queues[qid] = 1;
+        newly_waiting++;
+    }
+
+    return newly_waiting;
+}
+
+// Sleeps until one of the message queues the worker is counted as a waiter of is woken up, or wake_seq of the ring changes
+// The futexes of the message queues are in the shared memory and wake_seq is in the memory of the process, they are waited for together
+// If the kernel has no futex_waitv() or the message queues are too many for it, the worker retries after RING_RETRY_US
+void ring_wait_queues(mf_ring_t* ring, int wake_seq) {
+    struct futex_waitv waiters[FUTEX_WAITV_MAX];
+    memset(waiters, 0, sizeof(waiters));
+    waiters[0].uaddr = (unsigned long)&ring->wake_seq;
+    waiters[0].val = (unsigned int)wake_seq;
+    waiters[0].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+
+    unsigned int waiter_count = 1;
+    for (int qid = 1; qid <= config.MAX_QUEUES_IN_SHMEM; qid++) {
+        if (!ring->waiting_queues[qid]) {
+            continue;
+        }
+        if (waiter_count == FUTEX_WAITV_MAX) {
+            waiter_count = 0;
+            break;
+        }
+        waiters[waiter_count].uaddr = (unsigned long)mq_header_address(qid, MQ_FIELD_RING_SEQ);
+        waiters[waiter_count].val = (unsigned int)ring->wait_seqs[qid];
+        waiters[waiter_count].flags = FUTEX_32;
+        waiter_count++;
+    }
+
+    if (waiter_count > 0 && (syscall(SYS_futex_waitv, waiters, waiter_count, 0, NULL, CLOCK_MONOTONIC) != -1 || errno != ENOSYS)) {
+        return;
+    }
+
+    struct timespec timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = RING_RETRY_US * 1000;
+    syscall(SYS_futex, &ring->wake_seq, FUTEX_WAIT_PRIVATE, wake_seq, &timeout, NULL, 0);
+}
+
+// Performs a submission of a ring without blocking, the result of the operation is stored in result
+// Returns MQ_WOULD_BLOCK if the operation has to wait, MF_SUCCESS if it completed, with success or with an error
+int ring_try_operation(struct mf_sqe* sqe, int* result) {
+    *result = MF_ERROR;
+
+    if (sqe->qid < 1 || sqe->qid > config.MAX_QUEUES_IN_SHMEM) {
+        printf("Error: Message queue id is not within the limits\n");
+        return (MF_SUCCESS);
+    }
+
+    struct MFQueueHandle* handle = mq_handle(sqe->qid);
+    if (handle == NULL) {
+        return (MF_SUCCESS);
+    }
+
+    if (sqe->opcode == MF_OP_SEND) {
+        if (sqe->len < MIN_DATALEN || sqe->len > MAX_DATALEN) {
+            printf("Error: Data length is not within the limits\n");
+            return (MF_SUCCESS);
+        }
+        char compressed_buffer[MAX_DATALEN];
+        int stored_len = sqe->len;
+        int msg_flags = 0;
+        void* stored_data = mq_encode_message(sqe->qid, sqe->buf, &stored_len, compressed_buffer, &msg_flags);
+        char expiry_buffer[sizeof(struct MFExpiryHeader) + MAX_DATALEN];
+        stored_data = mq_add_expiry(stored_data, &stored_len, mq_expires_at(monotonic_time_ns(), mq_header_get(sqe->qid, MQ_FIELD_TTL)), expiry_buffer, &msg_flags);
+        int send_status = mq_try_send(sqe->qid, handle, stored_data, stored_len, msg_flags, NULL);
+        if (send_status == MQ_WOULD_BLOCK) {
+            return (MQ_WOULD_BLOCK);
+        }
+        *result = send_status;
+    } else if (sqe->opcode == MF_OP_RECV) {
+        int msg_len = 0;
+        if (mq_try_recv(sqe->qid, handle, sqe->buf, sqe->len, &msg_len, 0, NULL) == MQ_WOULD_BLOCK) {
+            return (MQ_WOULD_BLOCK);
+        }
+        *result = msg_len;
+    } else {
+        printf("Error: Unknown ring operation %d\n", sqe->opcode);
+    }
+
+    return (MF_SUCCESS);
+}
+
+// Returns the CLOCK_MONOTONIC time in nanoseconds
+unsigned long long monotonic_time_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Returns the 4-byte field of the message queue header, field is one of MQ_FIELD_*
+int mq_header_get(int qid, int field) {
+    char field_bytes[4];
+    memcpy(field_bytes, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * field, 4);
+    return bytes_to_int_little_endian(field_bytes);
+}
+
+// Sets the 4-byte field of the message queue header, field is one of MQ_FIELD_*
+void mq_header_set(int qid, int field, int value) {
+    char field_bytes[4];
+    int_to_bytes_little_endian(value, field_bytes);
+    memcpy(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * field, field_bytes, 4);
+}
+
+// Returns the address of the 4-byte field of the message queue header, for the futex of the field
+// The header size is a multiple of 4 bytes, so the field is aligned
+int* mq_header_address(int qid, int field) {
+    return (int*)(shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int) * field);
+}
+
+// Returns the qid of the message queue with the given name, MF_ERROR if it is not found
+int mq_find_by_name(char* mqname) {
+    for (int i = 0; i < config.MAX_QUEUES_IN_SHMEM; i++) {
+        if (mq_header_get(i + 1, MQ_FIELD_ID) != 0 && strncmp(shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE, mqname, MAX_MQNAMESIZE) == 0) {
+            return i + 1;
+        }
+    }
+    return (MF_ERROR);
+}
+
+// Returns the start address of the message queue in the address space of the calling process
+// Messages of a durable message queue are in its memory-mapped file, the others are in the shared memory region
+void* mq_region_address(int qid) {
+    if (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE) {
+        struct MFDurableMapping* mapping = durable_mapping(qid);
+        if (mapping == NULL) {
+            return NULL;
+        }
+        return mapping->address + MF_DURABLE_HEADER_SIZE;
+    }
+
+    struct MFQueueMapping* mapping = queue_mapping(qid);
+    if (mapping == NULL) {
+        return NULL;
+    }
+    return mapping->address;
+}
+
+// Returns the 64-bit address difference between the start address of the message queue and the start address of the message queues in its segment
+// It is -1 for a durable message queue
+long long mq_start_offset(int qid) {
+    unsigned int start_low = (unsigned int)mq_header_get(qid, MQ_FIELD_START);
+    unsigned int start_high = (unsigned int)mq_header_get(qid, MQ_FIELD_START_HIGH);
+    return (long long)(((unsigned long long)start_high << 32) | start_low);
+}
+
+// Sets the 64-bit address difference of the message queue, the low and the high 4 bytes are separate fields of the header
+void mq_set_start_offset(int qid, long long offset) {
+    mq_header_set(qid, MQ_FIELD_START, (int)(offset & 0xFFFFFFFF));
+    mq_header_set(qid, MQ_FIELD_START_HIGH, (int)(offset >> 32));
+}
+
+// Returns 1 if the message queue exists and lays in the segment, durable message queues lay in no segment
+int segment_holds_queue(int segment, int qid) {
+    if (mq_header_get(qid, MQ_FIELD_ID) == 0 || (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE)) {
+        return 0;
+    }
+    return mq_header_get(qid, MQ_FIELD_SEGMENT) == segment;
+}
+
+// Size of the region of the message queues in the segment in bytes
+// Segment 0 is the shared memory region of mfserver, its message queues come after the control area
+long long segment_size(int segment) {
+    if (segment == 0) {
+        return queue_region_size();
+    }
+    return ((struct MFSegmentTable*)shared_memory_address_segments)->segment_sizes[segment];
+}
+
+// Name of the shared memory object of the segment, "<SHMEM_NAME>.<segment>", segment 0 is SHMEM_NAME itself
+void segment_name(int segment, char* name) {
+    snprintf(name, MAXFILENAME, "%.100s.%d", config.SHMEM_NAME, segment);
+}
+
+// Returns the file descriptor of the shared memory object of the segment in the calling process, -1 on error
+// Segments created by other processes are opened when they are used for the first time
+int segment_fd(int segment) {
+    if (segment == 0) {
+        return shared_memory_id;
+    }
+
+    if (segment_fds == NULL) {
+        segment_fds = malloc(sizeof(int) * MF_MAX_SEGMENTS);
+        for (int i = 0; i < MF_MAX_SEGMENTS; i++) {
+            segment_fds[i] = -1;
+        }
+    }
+
+    if (segment_fds[segment] == -1) {
+        char name[MAXFILENAME];
+        segment_name(segment, name);
+        segment_fds[segment] = shm_open(name, O_RDWR, 0666);
+        if (segment_fds[segment] == -1) {
+            printf("Error: Could not open the segment %s\n", name);
+        }
+    }
+
+    return segment_fds[segment];
+}
+
+// Closes the file descriptors of the segments in the calling process
+void segment_close_all() {
+    if (segment_fds == NULL) {
+        return;
+    }
+    for (int i = 1; i < MF_MAX_SEGMENTS; i++) {
+        if (segment_fds[i] != -1) {
+            close(segment_fds[i]);
+            segment_fds[i] = -1;
+        }
+    }
+}
+
+// Removes the shared memory objects of the segments after segment 0, including the ones left by a previous mfserver
+void segment_remove_all() {
+    segment_close_all();
+    for (int i = 1; i < MF_MAX_SEGMENTS; i++) {
+        char name[MAXFILENAME];
+        segment_name(i, name);
+        shm_unlink(name);
+    }
+}
+
+// Finds an address difference in the segment where a message queue of mq_size bytes fits, -1 if there is no space
+// The message queues of the segment are walked in the order of their address differences to find the first gap that is large enough
+long long segment_find_space(int segment, long long mq_size) {
+    int msg_queue_count = bytes_to_int_little_endian(shared_memory_address_info);
+
+    // Initialize two pointers, one for the start of the free space and one for the end of the free space
+    // Please note that these are all address differences
+    long long start_free_space_i = 0;
+    long long end_free_space_j = segment_size(segment);
+
+    long long end_of_last_mq = 0; // End of the filled space right after the last empty space
+    int visited_free_space = 0; // Visited free space in the segment
+    while (visited_free_space <= msg_queue_count + 1) {
+        end_free_space_j = segment_size(segment);
+
+        // Get minimum address difference of the start of the message queues of the segment higher than the start of the free space
+        for (int i = 0; i < config.MAX_QUEUES_IN_SHMEM; i++) {
+            if (!segment_holds_queue(segment, i + 1)) {
+                continue;
+            }
+
+            long long mq_start_address_diff = mq_start_offset(i + 1);
+            if (mq_start_address_diff < end_free_space_j && mq_start_address_diff >= start_free_space_i) {
+                end_free_space_j = mq_start_address_diff;
+                end_of_last_mq = mq_start_address_diff + mq_header_get(i + 1, MQ_FIELD_SIZE);
+            }
+        }
+
+        // Update the visited free space
+        visited_free_space++;
+
+        // Check the empty space we found is enough for the message queue
+        if (end_free_space_j - start_free_space_i >= mq_size) {
+            return start_free_space_i;
+        }
+
+        // Update the start of the free space to the end of the last message queue
+        start_free_space_i = end_of_last_mq;
+    }
+
+    return -1;
+}
+
+// Creates a new segment for a message queue of mq_size bytes and returns its id, -1 if no segment can be created
+// The segment is SEGMENT_SIZE in the config or larger if the message queue does not fit in it
+// Must be called with the registry mutex held, so that two processes do not create the same segment
+int segment_create(long long mq_size) {
+    struct MFSegmentTable* segment_table = (struct MFSegmentTable*)shared_memory_address_segments;
+    int segment = segment_table->segment_count;
+
+    if (segment >= MF_MAX_SEGMENTS) {
+        printf("Error: Maximum number of segments of the shared memory region is reached\n");
+        return -1;
+    }
+
+    long long new_segment_size = (long long)config.SEGMENT_SIZE * 1024;
+    if (new_segment_size < mq_size) {
+        new_segment_size = mq_size;
+    }
+
+    char name[MAXFILENAME];
+    segment_name(segment, name);
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    if (fd == -1 || ftruncate(fd, new_segment_size) == -1) {
+        printf("Error: Could not create the segment %s\n", name);
+        if (fd != -1) {
+            close(fd);
+            shm_unlink(name);
+        }
+        return -1;
+    }
+    close(fd);
+
+    // Publish the size before the count, so that the processes that see the new count see its size
+    segment_table->segment_sizes[segment] = new_segment_size;
+    __atomic_store_n(&segment_table->segment_count, segment + 1, __ATOMIC_RELEASE);
+
+    // Update the total free space in the shared memory information
+    int total_free_space = bytes_to_int_little_endian(shared_memory_address_info + sizeof(int) * 2);
+    int_to_bytes_little_endian(total_free_space + (int)new_segment_size, shared_memory_address_info + sizeof(int) * 2);
+
+    printf("Segment %d of %lld bytes is created\n", segment, new_segment_size);
+
+    return segment;
+}
+
+// Returns the mapping of a message queue of the shared memory region in the calling process, maps the message queue if it is not mapped yet
+// A mapping that belongs to a removed message queue with the same qid is replaced, they are told apart by the instance id
+struct MFQueueMapping* queue_mapping(int qid) {
+    if (queue_mappings == NULL) {
+        queue_mappings = calloc(config.MAX_QUEUES_IN_SHMEM, sizeof(struct MFQueueMapping));
+    }
+
+    struct MFQueueMapping* mapping = &queue_mappings[qid - 1];
+    int instance = mq_header_get(qid, MQ_FIELD_INSTANCE);
+    if (__atomic_load_n(&mapping->address, __ATOMIC_ACQUIRE) != NULL && mapping->instance == instance) {
+        return mapping;
+    }
+
+    // The mapping is changed by one thread of the process at a time, the others use it after it is published
+    library_lock();
+    if (mapping->address != NULL && mapping->instance == instance) {
+        library_unlock();
+        return mapping;
+    }
+
+    if (mapping->address != NULL) {
+        munmap(mapping->address, mapping->size);
+        mapping->address = NULL;
+    }
+
+    // Message queues are page aligned in their segments, so their offset is a valid mmap offset
+    // The message queues of segment 0 come after the control area
+    int mq_segment = mq_header_get(qid, MQ_FIELD_SEGMENT);
+    int fd = segment_fd(mq_segment);
+    if (fd == -1) {
+        library_unlock();
+        return NULL;
+    }
+
+    int mq_size = mq_header_get(qid, MQ_FIELD_SIZE);
+    off_t mq_offset = (mq_segment == 0 ? (off_t)control_area_size() : 0) + mq_start_offset(qid);
+    void* mq_address = mmap(NULL, mq_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mq_offset);
+    if (mq_address == MAP_FAILED) {
+        printf("Error: Could not map the message queue %d to the address space of the calling process\n", qid);
+        library_unlock();
+        return NULL;
+    }
+
+    mapping->instance = instance;
+    mapping->size = mq_size;
+    __atomic_store_n(&mapping->address, mq_address, __ATOMIC_RELEASE);
+    library_unlock();
+
+    return mapping;
+}
+
+// Unmaps the message queue from the address space of the calling process, it is mapped again when it is used
+// A durable message queue is unmapped from its file
+void queue_unmap(int qid) {
+    library_lock();
+    if (queue_mappings != NULL && queue_mappings[qid - 1].address != NULL) {
+        munmap(queue_mappings[qid - 1].address, queue_mappings[qid - 1].size);
+        queue_mappings[qid - 1].address = NULL;
+    }
+
+    if (durable_mappings != NULL && durable_mappings[qid - 1].address != NULL) {
+        munmap(durable_mappings[qid - 1].address, durable_mappings[qid - 1].size);
+        close(durable_mappings[qid - 1].fd);
+        durable_mappings[qid - 1].address = NULL;
+    }
+
+    if (spill_mappings != NULL && spill_mappings[qid - 1].address != NULL) {
+        munmap(spill_mappings[qid - 1].address, spill_mappings[qid - 1].size);
+        spill_mappings[qid - 1].address = NULL;
+    }
+    library_unlock();
+}
+
+// Finds an address difference in the message queue where msg_size bytes fit, -1 if there is no space
+// The message queue is a circular buffer, the messages lay from the next message to the end of the last message
+int mq_find_space(int qid, int msg_size) {
+    int mq_size = mq_header_get(qid, MQ_FIELD_SIZE);
+    int mq_msg_count = mq_header_get(qid, MQ_FIELD_MSG_COUNT);
+    int mq_next_msg_address_diff = mq_header_get(qid, MQ_FIELD_NEXT_MSG);
+    int mq_end_msg_address_diff = mq_header_get(qid, MQ_FIELD_END_MSG);
+
+    // If the message queue is empty, the message is placed at the start of the message queue
+    if (mq_msg_count == 0) {
+        return 0;
+    }
+
+    // If the end address of the last message is bigger than the start address of the next message
+    // The message can be added to the end of the last message if it fits before the end of the message queue,
+    // otherwise it can be added to the start of the message queue if it fits before the next message
+    if (mq_end_msg_address_diff > mq_next_msg_address_diff) {
+        if (mq_size - mq_end_msg_address_diff >= msg_size) {
+            return mq_end_msg_address_diff;
+        }
+        if (msg_size <= mq_next_msg_address_diff) {
+            return 0;
+        }
+        return -1;
+    }
+
+    // If the end address of the last message is smaller than the start address of the next message
+    // There is an empty slot between the end address of the last message and the start address of the next message
+    if (mq_end_msg_address_diff < mq_next_msg_address_diff) {
+        if (mq_next_msg_address_diff - mq_end_msg_address_diff >= msg_size) {
+            return mq_end_msg_address_diff;
+        }
+        return -1;
+    }
+
+    // If the end address of the last message is equal to the start address of the next message, the message queue is full
+    return -1;
+}
+
+// Returns 1 if another message of msg_size bytes, its header included, is within the message count and byte limits of the message queue
+// An empty message queue takes a message longer than its byte limit, the message only has to fit in its size
+// Must be called with the access mutex held
+int mq_within_limits(int qid, int msg_size) {
+    int mq_msg_count = mq_header_get(qid, MQ_FIELD_MSG_COUNT);
+    int max_msgs = mq_header_get(qid, MQ_FIELD_MAX_MSGS);
+    if (max_msgs > 0 && mq_msg_count >= max_msgs) {
+        return 0;
+    }
+
+    int max_bytes = mq_header_get(qid, MQ_FIELD_MAX_BYTES);
+    return max_bytes == 0 || mq_msg_count == 0 || mq_header_get(qid, MQ_FIELD_MSG_BYTES) + msg_size <= max_bytes;
+}
+
+// Counts the bytes of the messages of the message queue, their headers included, from the next message
+// The message count of the header is of the messages that are not removed, the holes of the removed ones are walked over
+int mq_count_msg_bytes(int qid) {
+    int messages = mq_header_get(qid, MQ_FIELD_MSG_COUNT);
+    int msg_bytes = 0;
+    int msg_address_diff = mq_header_get(qid, MQ_FIELD_NEXT_MSG);
+    while (messages > 0) {
+        int msg_word = bytes_to_int_little_endian(mq_region_address(qid) + msg_address_diff);
+        int msg_len = msg_word & MF_MSG_LENGTH_MASK;
+        if (!(msg_word & MF_MSG_REMOVED)) {
+            msg_bytes += MF_MSG_HEADER_SIZE + msg_len;
+            messages--;
+        }
+        msg_address_diff = mq_following_message(qid, msg_address_diff, msg_len);
+    }
+
+    return msg_bytes;
+}
+
+// Writes the message to the given address difference in the message queue and updates the message queue header
+// The message format in the message queue is as follows:
+// - Message length (4 bytes), the stored data length with the MF_MSG_* flags in its high bits
+// - Message checksum (4 bytes), only computed for durable message queues, 0 otherwise
+// - Message data (datalen bytes), compressed if the MF_MSG_COMPRESSED flag is set
+void mq_put_message(int qid, int msg_address_diff, void* bufptr, int datalen, int msg_flags) {
+    int is_durable = mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE;
+    void* mq_msg_start_address = mq_region_address(qid) + msg_address_diff;
+
+    // Copy the message length and the checksum to the message queue
+    char msg_len_bytes[4];
+    int_to_bytes_little_endian(datalen | msg_flags, msg_len_bytes);
+    memcpy(mq_msg_start_address, msg_len_bytes, 4);
+
+    char msg_checksum_bytes[4];
+    int_to_bytes_little_endian(is_durable ? (int)message_checksum(bufptr, datalen) : 0, msg_checksum_bytes);
+    memcpy(mq_msg_start_address + sizeof(int), msg_checksum_bytes, 4);
+
+    // Copy the message data to the message queue
+    memcpy(mq_msg_start_address + MF_MSG_HEADER_SIZE, bufptr, datalen);
+
+    // Update the message count and the end of the last message in the message queue header
+    mq_header_set(qid, MQ_FIELD_MSG_COUNT, mq_header_get(qid, MQ_FIELD_MSG_COUNT) + 1);
+    mq_header_set(qid, MQ_FIELD_MSG_BYTES, mq_header_get(qid, MQ_FIELD_MSG_BYTES) + MF_MSG_HEADER_SIZE + datalen);
+    mq_header_set(qid, MQ_FIELD_END_MSG, msg_address_diff + MF_MSG_HEADER_SIZE + datalen);
+
+    // Append a tagged message to its tag chain
+    if (msg_flags & MF_MSG_TAGGED) {
+        mq_link_tagged(qid, msg_address_diff);
+    }
+
+    if (is_durable) {
+        durable_persist_state(qid);
+    }
+}
+
+// Copies the next message of the message queue to bufptr, removes it from the message queue and returns the copied length
+// If the message is longer than bufsize, it is truncated
+// A compressed message is copied to compressed_buffer (MAX_DATALEN bytes) instead, its length is stored in compressed_len
+// and 0 is returned, the caller decompresses it with mq_decode_message(). compressed_len is 0 for the other messages.
+// The call header of a request of mf_call() is not copied to bufptr, it is stored in call_header if that is not NULL,
+// the pid of call_header is 0 if the message is not a request
+int mq_get_message(int qid, void* bufptr, int bufsize, void* compressed_buffer, int* compressed_len, struct MFCallHeader* call_header) {
+    bufsize = mq_copy_message(qid, mq_header_get(qid, MQ_FIELD_NEXT_MSG), bufptr, bufsize, compressed_buffer, compressed_len, call_header);
+    mq_drop_message(qid);
+
+    return bufsize;
+}
+
+// Removes the next message of the message queue without copying it
+// Must be called with the access mutex held and a message in the message queue
+void mq_drop_message(int qid) {
+    int mq_msg_count = mq_header_get(qid, MQ_FIELD_MSG_COUNT);
+    int mq_next_msg_address_diff = mq_header_get(qid, MQ_FIELD_NEXT_MSG);
+    void* mq_msg_start_address = mq_region_address(qid) + mq_next_msg_address_diff;
+
+    // Get the message length from the message queue
+    char msg_len_bytes[4];
+    memcpy(msg_len_bytes, mq_msg_start_address, 4);
+    int msg_flags = bytes_to_int_little_endian(msg_len_bytes) & ~MF_MSG_LENGTH_MASK;
+    int msg_len = bytes_to_int_little_endian(msg_len_bytes) & MF_MSG_LENGTH_MASK;
+
+    // The oldest message is the first one of its tag chain
+    if (msg_flags & MF_MSG_TAGGED) {
+        mq_unlink_tagged(qid, mq_next_msg_address_diff, -1);
+    }
+
+    // Update the message count in the message queue header
+    // The message queue header is updated before the message is erased, so that a process dying in between leaves a consistent message queue
+    mq_msg_count--;
+    mq_header_set(qid, MQ_FIELD_MSG_COUNT, mq_msg_count);
+    mq_header_set(qid, MQ_FIELD_MSG_BYTES, mq_header_get(qid, MQ_FIELD_MSG_BYTES) - MF_MSG_HEADER_SIZE - msg_len);
+
+    // Update the next message address difference in the message queue header
+    // If the message queue is empty, set the next and last message address difference to 0
+    if (mq_msg_count == 0 && mq_header_get(qid, MQ_FIELD_TAG_HOLES) == 0) {
+        mq_header_set(qid, MQ_FIELD_NEXT_MSG, 0);
+        mq_header_set(qid, MQ_FIELD_END_MSG, 0);
+    } else {
+        mq_header_set(qid, MQ_FIELD_NEXT_MSG, mq_following_message(qid, mq_next_msg_address_diff, msg_len));
+    }
+
+    // Erase the message from the message queue by filling the message with zeros
+    memset(mq_msg_start_address, 0, MF_MSG_HEADER_SIZE + msg_len);
+
+    // The messages removed out of order right after it are reclaimed now
+    mq_reclaim_holes(qid);
+
+    if (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_DURABLE) {
+        durable_persist_state(qid);
+    }
+
+    // The spilled messages take the freed space, so a message queue with spilled messages is never empty
+    if (mq_header_get(qid, MQ_FIELD_SPILL_COUNT) > 0) {
+        spill_refill(qid);
+    }
+}
+
+// Copies the message at msg_address_diff of the message queue to bufptr without removing it, see mq_get_message()
+// The tag header of a tagged message, the call header of a request and the expiry header are not copied to bufptr
+int mq_copy_message(int qid, int msg_address_diff, void* bufptr, int bufsize, void* compressed_buffer, int* compressed_len, struct MFCallHeader* call_header) {
+    void* mq_msg_start_address = mq_region_address(qid) + msg_address_diff;
+
+    // Get the message length from the message queue
+    char msg_len_bytes[4];
+    memcpy(msg_len_bytes, mq_msg_start_address, 4);
+    int msg_flags = bytes_to_int_little_endian(msg_len_bytes) & ~MF_MSG_LENGTH_MASK;
+    int msg_len = bytes_to_int_little_endian(msg_len_bytes) & MF_MSG_LENGTH_MASK;
+
+    // The data of a tagged message starts with its tag header, the data of a request with its call header
+    int data_offset = 0;
+    if (msg_flags & MF_MSG_TAGGED) {
+        data_offset = sizeof(struct MFTagHeader);
+    }
+    if (call_header != NULL) {
+        call_header->pid = 0;
+    }
+    if (msg_flags & MF_MSG_CALL) {
+        if (call_header != NULL) {
+            memcpy(call_header, mq_msg_start_address + MF_MSG_HEADER_SIZE + data_offset, sizeof(struct MFCallHeader));
+        }
+        data_offset += sizeof(struct MFCallHeader);
+    }
+    if (msg_flags & MF_MSG_EXPIRES) {
+        data_offset += sizeof(struct MFExpiryHeader);
+    }
+
+    *compressed_len = 0;
+    if (msg_flags & MF_MSG_COMPRESSED) {
+        // Copy the compressed message data to the compressed buffer
+        memcpy(compressed_buffer, mq_msg_start_address + MF_MSG_HEADER_SIZE + data_offset, msg_len - data_offset);
+        *compressed_len = msg_len - data_offset;
+        return 0;
+    }
+
+    // Calculate the minimum message size to copy and update the buffer size
+    if (msg_len - data_offset < bufsize) {
+        printf("Warning: Message length is smaller than the buffer size\n");
+        bufsize = msg_len - data_offset;
+    }
+
+    // Copy the message data to the buffer
+    memcpy(bufptr, mq_msg_start_address + MF_MSG_HEADER_SIZE + data_offset, bufsize);
+
+    return bufsize;
+}
+
+// Returns the address difference of the message after the message of msg_len bytes at msg_address_diff
+// The next message is right after the message, unless there is no room for a message header there
+// or the message length there is 0, then the next message is at the start of the message queue
+int mq_following_message(int qid, int msg_address_diff, int msg_len) {
+    int next_msg_address_diff = msg_address_diff + MF_MSG_HEADER_SIZE + msg_len;
+    if (next_msg_address_diff + MF_MSG_HEADER_SIZE > mq_header_get(qid, MQ_FIELD_SIZE)) {
+        return 0;
+    }
+
+    char msg_len_bytes[4];
+    memcpy(msg_len_bytes, mq_region_address(qid) + next_msg_address_diff, 4);
+    return bytes_to_int_little_endian(msg_len_bytes) == 0 ? 0 : next_msg_address_diff;
+}
+
+// Computes the checksum of a message, 32-bit FNV-1a over the message data seeded with the message length
+unsigned int message_checksum(void* data, int datalen) {
+    unsigned int hash = 2166136261u ^ (unsigned int)datalen;
+    unsigned char* bytes = data;
+    for (int i = 0; i < datalen; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Compresses the message if the message queue compresses its messages and the message is at least its compression threshold long
+// Returns the data to store in the message queue and updates datalen to its length: the compressed message in compressed_buffer
+// (MAX_DATALEN bytes) with MF_MSG_COMPRESSED set in msg_flags, or bufptr itself if the message is not compressed or does not get smaller
+// It is called before the access mutex is taken, so the compression statistics are updated atomically
+void* mq_encode_message(int qid, void* bufptr, int* datalen, void* compressed_buffer, int* msg_flags) {
+    *msg_flags = 0;
+
+    int compress_threshold = mq_header_get(qid, MQ_FIELD_COMPRESS_THRESHOLD);
+    if (compress_threshold <= 0 || *datalen < compress_threshold) {
+        return bufptr;
+    }
+
+    unsigned long long start_ns = monotonic_time_ns();
+    // Only a compressed form at least one byte shorter is kept
+    int compressed_len = mf_compress_block(bufptr, *datalen, compressed_buffer, *datalen - 1);
+    unsigned long long compress_ns = monotonic_time_ns() - start_ns;
+
+    struct mf_stats* mq_stats = mq_stats_address(qid);
+    __atomic_fetch_add(&mq_stats->compress_attempts, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mq_stats->compress_ns_total, compress_ns, __ATOMIC_RELAXED);
+    if (compressed_len <= 0) {
+        return bufptr;
+    }
+    __atomic_fetch_add(&mq_stats->compress_messages, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mq_stats->compress_bytes_in, *datalen, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mq_stats->compress_bytes_out, compressed_len, __ATOMIC_RELAXED);
+
+    *datalen = compressed_len;
+    *msg_flags = MF_MSG_COMPRESSED;
+    return compressed_buffer;
+}
+
+// Decompresses a compressed message received by mq_get_message() to bufptr and returns the copied length
+// If the message is longer than bufsize, it is truncated as an uncompressed message is
+// Returns MF_ERROR if the compressed message is corrupt
+int mq_decode_message(int qid, void* compressed_buffer, int compressed_len, void* bufptr, int bufsize) {
+    unsigned long long start_ns = monotonic_time_ns();
+
+    // A buffer of MAX_DATALEN bytes holds any message, a smaller buffer gets the message through a buffer that does
+    char msg_buffer[MAX_DATALEN];
+    void* decompress_buffer = bufsize >= MAX_DATALEN ? bufptr : msg_buffer;
+    int msg_len = mf_decompress_block(compressed_buffer, compressed_len, decompress_buffer, MAX_DATALEN);
+
+    __atomic_fetch_add(&mq_stats_address(qid)->decompress_ns_total, monotonic_time_ns() - start_ns, __ATOMIC_RELAXED);
+
+    if (msg_len < MIN_DATALEN) {
+        printf("Error: Compressed message is corrupt\n");
+        return (MF_ERROR);
+    }
+
+    if (msg_len < bufsize) {
+        printf("Warning: Message length is smaller than the buffer size\n");
+        bufsize = msg_len;
+    }
+    if (decompress_buffer != bufptr) {
+        memcpy(bufptr, decompress_buffer, bufsize);
+    }
+
+    return bufsize;
+}
+
+// Fills the attributes of the message queue from the config file, see DURABLE_QUEUES, COMPRESSED_QUEUES, SPILL_QUEUES and POOLED_QUEUES
+void config_queue_attr(char* mqname, struct mf_qattr* attr) {
+    mf_qattr_init(attr);
+
+    if (is_queue_name_listed(config.DURABLE_QUEUES, mqname)) {
+        attr->flags |= MF_QATTR_DURABLE;
+    }
+    if (is_queue_name_listed(config.COMPRESSED_QUEUES, mqname)) {
+        attr->flags |= MF_QATTR_COMPRESS;
+        attr->compress_threshold = config.COMPRESS_THRESHOLD;
+    }
+    if (is_queue_name_listed(config.SPILL_QUEUES, mqname)) {
+        attr->flags |= MF_QATTR_SPILL;
+        attr->spill_size = config.SPILL_SIZE;
+    }
+    if (is_queue_name_listed(config.POOLED_QUEUES, mqname)) {
+        attr->flags |= MF_QATTR_POOL;
+        attr->pool_min = config.POOL_QUEUE_MIN;
+        attr->pool_max = config.POOL_QUEUE_MAX;
+    }
+}
+
+// Returns 1 if the message queue name is listed in queue_names, e.g. DURABLE_QUEUES of the config file, 0 otherwise
+int is_queue_name_listed(char* queue_names, char* mqname) {
+    char queue_names_copy[256];
+    snprintf(queue_names_copy, sizeof(queue_names_copy), "%s", queue_names);
+
+    // The list is a comma separated list of message queue names
+    char* saveptr;
+    for (char* name = strtok_r(queue_names_copy, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(name, mqname) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Assembles the name of the file of a durable message queue, "<DURABLE_DIR>/<SHMEM_NAME>.<mqname>.mfq"
+void durable_file_name(char* mqname, char* filename) {
+    snprintf(filename, DURABLE_FILENAME_SIZE, "%s/%s.%s.mfq", config.DURABLE_DIR, config.SHMEM_NAME, mqname);
+}
+
+// Creates the file of a durable message queue, or recovers the messages in it if it already exists
+// The recovered message count and the next and end address differences are returned to be written to the message queue header
+int durable_open_queue(int qid, char* mqname, int mqsize_bytes, int instance, int* msg_count, int* next_msg_diff, int* end_msg_diff) {
+    char filename[DURABLE_FILENAME_SIZE];
+    durable_file_name(mqname, filename);
+
+    int fd = open(filename, O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+        printf("Error: Could not open the file of the durable message queue %s\n", filename);
+        return (MF_ERROR);
+    }
+
+    // The file is the file header followed by the message queue
+    int file_size = MF_DURABLE_HEADER_SIZE + mqsize_bytes;
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    int is_existing = file_stat.st_size == file_size;
+
+    if (!is_existing && ftruncate(fd, file_size) == -1) {
+        printf("Error: Could not set the size of the file of the durable message queue\n");
+        close(fd);
+        return (MF_ERROR);
+    }
+
+    void* file_address = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (file_address == MAP_FAILED) {
+        printf("Error: Could not map the file of the durable message queue\n");
+        close(fd);
+        return (MF_ERROR);
+    }
+
+    // Recover the messages if the file belongs to a message queue of the same size, otherwise start with an empty message queue
+    *msg_count = 0;
+    *next_msg_diff = 0;
+    *end_msg_diff = 0;
+    if (is_existing && bytes_to_int_little_endian(file_address) == MF_DURABLE_MAGIC && bytes_to_int_little_endian(file_address + sizeof(int) * 2) == mqsize_bytes) {
+        *msg_count = bytes_to_int_little_endian(file_address + sizeof(int) * 4);
+        *next_msg_diff = bytes_to_int_little_endian(file_address + sizeof(int) * 5);
+        ring_recover(file_address + MF_DURABLE_HEADER_SIZE, mqsize_bytes, 1, msg_count, next_msg_diff, end_msg_diff);
+    } else {
+        memset(file_address, 0, file_size);
+    }
+
+    // Write the file header
+    int_to_bytes_little_endian(MF_DURABLE_MAGIC, file_address);
+    int_to_bytes_little_endian(MF_DURABLE_VERSION, file_address + sizeof(int));
+    int_to_bytes_little_endian(mqsize_bytes, file_address + sizeof(int) * 2);
+    int_to_bytes_little_endian(instance, file_address + sizeof(int) * 3);
+    int_to_bytes_little_endian(*msg_count, file_address + sizeof(int) * 4);
+    int_to_bytes_little_endian(*next_msg_diff, file_address + sizeof(int) * 5);
+    int_to_bytes_little_endian(*end_msg_diff, file_address + sizeof(int) * 6);
+    fdatasync(fd);
+
+    // Keep the mapping for the calling process
+    struct MFDurableMapping* mapping = durable_mapping_slot(qid);
+    if (mapping->address != NULL) {
+        munmap(mapping->address, mapping->size);
+        close(mapping->fd);
+    }
+    mapping->instance = instance;
+    mapping->fd = fd;
+    mapping->address = file_address;
+    mapping->size = file_size;
+
+    return (MF_SUCCESS);
+}
+
+// Recovers the messages of a message queue after a crash, used for the files of durable message queues and by mq_repair()
+// msg_count and next_msg_diff are the message count and the next message of the message queue header, they may be wrong
+// The messages are walked from the next message, the walk stops at the first message with an invalid length,
+// or a wrong checksum if verify_checksum is 1, which is a message that was not completely written before the crash
+// The recovered message count and the next and end address differences are returned, the free space is cleared
+void ring_recover(void* mq_start_address, int mqsize_bytes, int verify_checksum, int* msg_count, int* next_msg_diff, int* end_msg_diff) {
+    int file_msg_count = *msg_count;
+    int file_next_msg_diff = *next_msg_diff;
+
+    int recovered_count = 0;
+    int msg_address_diff = file_next_msg_diff;
+    int end_address_diff = file_next_msg_diff;
+    while (recovered_count < file_msg_count && msg_address_diff >= 0 && msg_address_diff + MF_MSG_HEADER_SIZE <= mqsize_bytes) {
+        int msg_len = bytes_to_int_little_endian(mq_start_address + msg_address_diff) & MF_MSG_LENGTH_MASK;
+
+        // Messages continue from the start of the message queue after a message length of 0, as in mf_recv()
+        if (msg_len == 0 && recovered_count > 0) {
+            msg_address_diff = 0;
+            msg_len = bytes_to_int_little_endian(mq_start_address) & MF_MSG_LENGTH_MASK;
+        }
+
+        // Validate the message length and the checksum
+        if (msg_len < MIN_DATALEN || msg_len > MAX_DATALEN + (int)MQ_MAX_DATA_PREFIX || msg_address_diff + MF_MSG_HEADER_SIZE + msg_len > mqsize_bytes) {
+            break;
+        }
+        unsigned int msg_checksum = (unsigned int)bytes_to_int_little_endian(mq_start_address + msg_address_diff + sizeof(int));
+        if (verify_checksum && msg_checksum != message_checksum(mq_start_address + msg_address_diff + MF_MSG_HEADER_SIZE, msg_len)) {
+            break;
+        }
+
+        recovered_count++;
+        end_address_diff = msg_address_diff + MF_MSG_HEADER_SIZE + msg_len;
+        msg_address_diff = end_address_diff;
+        if (msg_address_diff + MF_MSG_HEADER_SIZE > mqsize_bytes) {
+            msg_address_diff = 0;
+        }
+    }
+
+    if (recovered_count < file_msg_count) {
+        printf("Warning: %d messages of the message queue could not be recovered\n", file_msg_count - recovered_count);
+    }
+
+    if (recovered_count == 0) {
+        memset(mq_start_address, 0, mqsize_bytes);
+        *msg_count = 0;
+        *next_msg_diff = 0;
+        *end_msg_diff = 0;
+        return;
+    }
+
+    // Clear the free space so that partially written messages are not mistaken for messages
+    if (end_address_diff > file_next_msg_diff) {
+        memset(mq_start_address + end_address_diff, 0, mqsize_bytes - end_address_diff);
+        memset(mq_start_address, 0, file_next_msg_diff);
+    } else if (end_address_diff < file_next_msg_diff) {
+        memset(mq_start_address + end_address_diff, 0, file_next_msg_diff - end_address_diff);
+    }
+
+    *msg_count = recovered_count;
+    *next_msg_diff = file_next_msg_diff;
+    *end_msg_diff = end_address_diff;
+}
+
+// Recovers the durable message queues listed in DURABLE_QUEUES of the config file whose files exist
+void durable_recover_all() {
+    char durable_queues[sizeof(config.DURABLE_QUEUES)];
+    strcpy(durable_queues, config.DURABLE_QUEUES);
+
+    char* saveptr;
+    for (char* name = strtok_r(durable_queues, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+        char filename[DURABLE_FILENAME_SIZE];
+        durable_file_name(name, filename);
+
+        // Read the message queue size from the file header
+        int fd = open(filename, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        char file_header_bytes[sizeof(int) * 3];
+        int read_size = read(fd, file_header_bytes, sizeof(file_header_bytes));
+        close(fd);
+        if (read_size != sizeof(file_header_bytes) || bytes_to_int_little_endian(file_header_bytes) != MF_DURABLE_MAGIC) {
+            continue;
+        }
+        int mqsize_bytes = bytes_to_int_little_endian(file_header_bytes + sizeof(int) * 2);
+
+        struct mf_qattr attr;
+        config_queue_attr(name, &attr);
+        attr.flags |= MF_QATTR_DURABLE;
+        mf_create_attr(name, mqsize_bytes / 1024, &attr);
+    }
+}
+
+// Returns the slot of the message queue in the durable mappings of the calling process
+struct MFDurableMapping* durable_mapping_slot(int qid) {
+    if (durable_mappings == NULL) {
+        durable_mappings = calloc(config.MAX_QUEUES_IN_SHMEM, sizeof(struct MFDurableMapping));
+    }
+    return &durable_mappings[qid - 1];
+}
+
+// Returns the mapping of the file of a durable message queue in the calling process, maps the file if it is not mapped yet
+// A mapping that belongs to a removed message queue with the same qid is replaced, they are told apart by the instance id
+struct MFDurableMapping* durable_mapping(int qid) {
+    struct MFDurableMapping* mapping = durable_mapping_slot(qid);
+    int instance = mq_header_get(qid, MQ_FIELD_INSTANCE);
+    if (__atomic_load_n(&mapping->address, __ATOMIC_ACQUIRE) != NULL && mapping->instance == instance) {
+        return mapping;
+    }
+
+    // The mapping is changed by one thread of the process at a time, the others use it after it is published
+    library_lock();
+    if (mapping->address != NULL && mapping->instance == instance) {
+        library_unlock();
+        return mapping;
+    }
+
+    if (mapping->address != NULL) {
+        munmap(mapping->address, mapping->size);
+        close(mapping->fd);
+        mapping->address = NULL;
+    }
+
+    char mq_name[MAX_MQNAMESIZE];
+    memcpy(mq_name, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE, MAX_MQNAMESIZE);
+    char filename[DURABLE_FILENAME_SIZE];
+    durable_file_name(mq_name, filename);
+
+    int fd = open(filename, O_RDWR);
+    if (fd == -1) {
+        printf("Error: Could not open the file of the durable message queue %s\n", filename);
+        library_unlock();
+        return NULL;
+    }
+
+    int file_size = MF_DURABLE_HEADER_SIZE + mq_header_get(qid, MQ_FIELD_SIZE);
+    void* file_address = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (file_address == MAP_FAILED) {
+        printf("Error: Could not map the file of the durable message queue\n");
+        close(fd);
+        library_unlock();
+        return NULL;
+    }
+
+    mapping->instance = instance;
+    mapping->fd = fd;
+    mapping->size = file_size;
+    __atomic_store_n(&mapping->address, file_address, __ATOMIC_RELEASE);
+    library_unlock();
+
+    return mapping;
+}
+
+// Mirrors the message count and the next and end address differences of a durable message queue to its file header
+// Called with the access mutex held after each change of the message queue, the file is synced by the group commit
+// The change sequence is stored with release so that a group commit that reads it syncs the file with the change in it
+void durable_persist_state(int qid) {
+    struct MFDurableMapping* mapping = durable_mapping(qid);
+    if (mapping == NULL) {
+        return;
+    }
+
+    int_to_bytes_little_endian(mq_header_get(qid, MQ_FIELD_MSG_COUNT), mapping->address + sizeof(int) * 4);
+    int_to_bytes_little_endian(mq_header_get(qid, MQ_FIELD_NEXT_MSG), mapping->address + sizeof(int) * 5);
+    int_to_bytes_little_endian(mq_header_get(qid, MQ_FIELD_END_MSG), mapping->address + sizeof(int) * 6);
+
+    int* durable_seq = mq_header_address(qid, MQ_FIELD_DURABLE_SEQ);
+    __atomic_store_n(durable_seq, *durable_seq + 1, __ATOMIC_RELEASE);
+    mq_stats_address(qid)->durable_writes++;
+}
+
+// Group commit of a durable message queue, syncs its file if it has been changed since the last commit
+// All the changes made by all the processes since the last commit are made durable with one fdatasync(),
+// then the senders waiting for the commit of their messages are woken up, see durable_wait_commit()
+void durable_commit(int qid) {
+    struct MFDurableMapping* mapping = durable_mapping(qid);
+    if (mapping == NULL) {
+        return;
+    }
+
+    int* synced_seq = mq_header_address(qid, MQ_FIELD_DURABLE_SYNCED);
+    int durable_seq = __atomic_load_n(mq_header_address(qid, MQ_FIELD_DURABLE_SEQ), __ATOMIC_ACQUIRE);
+    if (durable_seq == __atomic_load_n(synced_seq, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    unsigned long long commit_start_ns = monotonic_time_ns();
+    fdatasync(mapping->fd);
+    unsigned long long commit_ns = monotonic_time_ns() - commit_start_ns;
+
+    // Two processes may commit at the same time, the synced sequence only moves forward, the sequences wrap around
+    int synced = __atomic_load_n(synced_seq, __ATOMIC_RELAXED);
+    while ((int)((unsigned int)durable_seq - (unsigned int)synced) > 0
+        && !__atomic_compare_exchange_n(synced_seq, &synced, durable_seq, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    syscall(SYS_futex, synced_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+    struct mf_stats* mq_stats = mq_stats_address(qid);
+    __atomic_fetch_add(&mq_stats->durable_commits, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mq_stats->durable_commit_ns_total, commit_ns, __ATOMIC_RELAXED);
+}
+
+// Waits until a group commit covers the change durable_seq of a durable message queue, called by mq_send_wait() after the message is stored
+// mfserver commits once in every DURABLE_COMMIT_US, the sender commits the message queue itself if no commit covers its change within the budget
+void durable_wait_commit(int qid, int durable_seq) {
+    int* synced_seq = mq_header_address(qid, MQ_FIELD_DURABLE_SYNCED);
+    unsigned long long deadline_ns = monotonic_time_ns() + (config.DURABLE_COMMIT_US > 0 ? config.DURABLE_COMMIT_US : 0) * 1000ULL;
+
+    while (1) {
+        int synced = __atomic_load_n(synced_seq, __ATOMIC_ACQUIRE);
+        if ((int)((unsigned int)synced - (unsigned int)durable_seq) >= 0) {
+            return;
+        }
+
+        unsigned long long now_ns = monotonic_time_ns();
+        if (now_ns >= deadline_ns) {
+            break;
+        }
+
+        struct timespec timeout;
+        timeout.tv_sec = (deadline_ns - now_ns) / 1000000000ULL;
+        timeout.tv_nsec = (deadline_ns - now_ns) % 1000000000ULL;
+        syscall(SYS_futex, synced_seq, FUTEX_WAIT, synced, &timeout, NULL, 0);
+    }
+
+    durable_commit(qid);
+}
+
+// Removes the file of a durable message queue and its mapping in the calling process
+void durable_remove_queue(int qid, char* mqname) {
+    struct MFDurableMapping* mapping = durable_mapping_slot(qid);
+    if (mapping->address != NULL) {
+        munmap(mapping->address, mapping->size);
+        close(mapping->fd);
+        mapping->address = NULL;
+        mapping->instance = 0;
+    }
+
+    char filename[DURABLE_FILENAME_SIZE];
+    durable_file_name(mqname, filename);
+    unlink(filename);
+}
+
+// Check if the value is negative, if it is, convert it to a positive value
+// This function is used to handle the overflow of the char type
+int char_overflow_check(int value) {
+    if (value < 0) {
+        value += 256;
+    }
+    return value;
+}
+
+// Convert 4 bytes to an integer in little-endian order
+int bytes_to_int_little_endian(char* bytes) {
+    return (int)(char_overflow_check(bytes[0])) |
+        (int)(char_overflow_check(bytes[1])) << 8 |
+        (int)(char_overflow_check(bytes[2])) << 16 |
+        (int)(char_overflow_check(bytes[3])) << 24;
+}
+
+// Convert an integer to 4 bytes in little-endian order
+void int_to_bytes_little_endian(int val, char* bytes) {
+    bytes[0] = (char)(val & 0xFF);
+    bytes[1] = (char)((val >> 8) & 0xFF);
+    bytes[2] = (char)((val >> 16) & 0xFF);
+    bytes[3] = (char)((val >> 24) & 0xFF);
+}
+
+// Name of the shared memory object of the reply area of the process, "<SHMEM_NAME>.rpc.<pid>"
+void rpc_area_name(int pid, char* name) {
+    snprintf(name, MAXFILENAME, "%.100s.rpc.%d", config.SHMEM_NAME, pid);
+}
+
+// Returns the reply area of the calling process, it is created by the first call of the process, NULL on error
+// A forked child inherits the mapping of the reply area of its parent, it creates its own instead
+struct MFReplyArea* rpc_reply_area() {
+    pthread_mutex_lock(&reply_mutex);
+    if (reply_area != NULL && reply_area_pid == getpid()) {
+        pthread_mutex_unlock(&reply_mutex);
+        return reply_area;
+    }
+    if (reply_area != NULL) {
+        munmap(reply_area, sizeof(struct MFReplyArea));
+        reply_area = NULL;
+    }
+
+    char name[MAXFILENAME];
+    rpc_area_name(getpid(), name);
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    if (fd == -1 || ftruncate(fd, sizeof(struct MFReplyArea)) == -1) {
+        printf("Error: Could not create the reply area %s\n", name);
+        if (fd != -1) {
+            close(fd);
+            shm_unlink(name);
+        }
+        pthread_mutex_unlock(&reply_mutex);
+        return NULL;
+    }
+
+    struct MFReplyArea* area = mmap(NULL, sizeof(struct MFReplyArea), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (area == MAP_FAILED) {
+        printf("Error: Could not map the reply area %s\n", name);
+        shm_unlink(name);
+        pthread_mutex_unlock(&reply_mutex);
+        return NULL;
+    }
+
+    // The new object is zero filled, all the slots are free
+    area->nonce = (unsigned int)monotonic_time_ns() | 1;
+    reply_area = area;
+    reply_area_pid = getpid();
+    pthread_mutex_unlock(&reply_mutex);
+
+    return reply_area;
+}
+
+// Returns the reply area of the caller process pid with the given nonce, mapped in the calling server process, NULL if it is gone
+// The last REPLY_MAPPINGS reply areas are kept mapped, a caller with the same pid and a new nonce is a new process
+// Must be called with the reply mutex held
+struct MFReplyArea* rpc_reply_area_of(int pid, unsigned int nonce) {
+    struct MFReplyMapping* mapping = &reply_mappings[pid % REPLY_MAPPINGS];
+    for (int i = 0; i < REPLY_MAPPINGS; i++) {
+        if (reply_mappings[i].pid == pid && reply_mappings[i].nonce == nonce) {
+            return reply_mappings[i].area;
+        }
+        if (reply_mappings[i].pid == 0) {
+            mapping = &reply_mappings[i];
+        }
+    }
+
+    if (mapping->pid != 0) {
+        munmap(mapping->area, sizeof(struct MFReplyArea));
+        mapping->pid = 0;
+    }
+
+    char name[MAXFILENAME];
+    rpc_area_name(pid, name);
+    int fd = shm_open(name, O_RDWR, 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct MFReplyArea* area = mmap(NULL, sizeof(struct MFReplyArea), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (area == MAP_FAILED) {
+        return NULL;
+    }
+    if (area->nonce != nonce) {
+        munmap(area, sizeof(struct MFReplyArea));
+        return NULL;
+    }
+
+    mapping->pid = pid;
+    mapping->nonce = nonce;
+    mapping->area = area;
+    return area;
+}
+
+// Writes the reply of resp_len bytes, or MF_ERROR, into the reply slot of the call and wakes up the caller
+// The reply is dropped if the caller is gone or gave the call up
+void rpc_reply(struct MFCallHeader* call_header, void* resp, int resp_len) {
+    if (call_header->slot < 0 || call_header->slot >= MF_MAX_CALLS) {
+        printf("Warning: Call with an invalid reply slot is dropped\n");
+        return;
+    }
+
+    pthread_mutex_lock(&reply_mutex);
+    struct MFReplyArea* area = rpc_reply_area_of(call_header->pid, call_header->nonce);
+    if (area == NULL) {
+        pthread_mutex_unlock(&reply_mutex);
+        printf("Warning: Reply to process %d is dropped, the process is gone\n", call_header->pid);
+        return;
+    }
+
+    // Claim the slot for the reply, it fails if the caller timed out
+    struct MFReplySlot* slot = &area->slots[call_header->slot];
+    unsigned int word = call_header->word;
+    if (!__atomic_compare_exchange_n(&slot->word, &word, (word & ~REPLY_STATE_MASK) | REPLY_WRITING, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        pthread_mutex_unlock(&reply_mutex);
+        printf("Warning: Reply to process %d is dropped, the call timed out\n", call_header->pid);
+        return;
+    }
+
+    slot->len = resp_len;
+    if (resp_len > 0) {
+        memcpy(slot->data, resp, resp_len);
+    }
+    __atomic_store_n(&slot->word, (call_header->word & ~REPLY_STATE_MASK) | REPLY_DONE, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &slot->word, FUTEX_WAKE, 1, NULL, NULL, 0);
+    pthread_mutex_unlock(&reply_mutex);
+}
+
+// Removes the reply area of the calling process and unmaps the reply areas of its callers, called by the last mf_disconnect()
+void rpc_close_all() {
+    pthread_mutex_lock(&reply_mutex);
+    if (reply_area != NULL && reply_area_pid == getpid()) {
+        char name[MAXFILENAME];
+        rpc_area_name(getpid(), name);
+        shm_unlink(name);
+    }
+    if (reply_area != NULL) {
+        munmap(reply_area, sizeof(struct MFReplyArea));
+        reply_area = NULL;
+    }
+
+    for (int i = 0; i < REPLY_MAPPINGS; i++) {
+        if (reply_mappings[i].pid != 0) {
+            munmap(reply_mappings[i].area, sizeof(struct MFReplyArea));
+            reply_mappings[i].pid = 0;
+        }
+    }
+    pthread_mutex_unlock(&reply_mutex);
+}
+
+// Returns the partitions of the logical message queue in the calling process, they are resolved when the message queue is used
+// for the first time, and again if it is removed and created again. NULL if the message queue does not exist
+struct MFPartitionMap* partition_map(int qid) {
+    if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM || mq_header_get(qid, MQ_FIELD_ID) != qid) {
+        printf("Error: Message queue id is not within the limits\n");
+        return NULL;
+    }
+
+    library_lock();
+    if (partition_maps == NULL) {
+        partition_maps = calloc(config.MAX_QUEUES_IN_SHMEM, sizeof(struct MFPartitionMap));
+    }
+    library_unlock();
+
+    struct MFPartitionMap* map = &partition_maps[qid - 1];
+    int instance = mq_header_get(qid, MQ_FIELD_INSTANCE);
+    if (__atomic_load_n(&map->instance, __ATOMIC_ACQUIRE) == instance) {
+        return map;
+    }
+
+    // The instance is published last, so a thread that sees it sees the resolved partitions
+    library_lock();
+    if (map->instance != instance) {
+        map->count = partition_qids(qid, map->qids);
+        __atomic_store_n(&map->instance, instance, __ATOMIC_RELEASE);
+    }
+    library_unlock();
+
+    return map;
+}
+
+// Walks the partition chain of the logical message queue, stores the qid of each partition in qids and returns their number
+// A message queue that is not partitioned is its only partition
+int partition_qids(int qid, int* qids) {
+    int partitions = mq_header_get(qid, MQ_FIELD_PARTITIONS);
+    if (partitions <= 1) {
+        qids[0] = qid;
+        return 1;
+    }
+
+    int partition_qid = qid;
+    for (int i = 0; i < partitions; i++) {
+        if (partition_qid < 1 || partition_qid > config.MAX_QUEUES_IN_SHMEM) {
+            printf("Error: Partition chain of message queue %d is broken\n", qid);
+            return i;
+        }
+        qids[i] = partition_qid;
+        partition_qid = mq_header_get(partition_qid, MQ_FIELD_NEXT_PARTITION);
+    }
+
+    return partitions;
+}
+
+// Returns the message count of the message queue, read without the access mutex, so it is only a hint of the depth
+int mq_depth_hint(int qid) {
+    char field_bytes[4];
+    int field = __atomic_load_n(mq_header_address(qid, MQ_FIELD_MSG_COUNT), __ATOMIC_RELAXED);
+    memcpy(field_bytes, &field, 4);
+    return bytes_to_int_little_endian(field_bytes);
+}
+
+// Steals a batch of messages from the deepest other partition of the consumer group into the group handle
+// Half of the depth is stolen, at most MF_GROUP_STEAL_BATCH messages, the oldest ones. Compressed messages are decompressed
+// when they are received, outside of the access mutex. Returns the number of stolen messages, 0 if no other partition has one
+int group_steal(struct mf_group* group) {
+    int victim = 0;
+    int victim_depth = 0;
+    for (int i = 0; i < group->count; i++) {
+        int depth = mq_depth_hint(group->qids[i]);
+        if (i != group->member && depth > victim_depth) {
+            victim = group->qids[i];
+            victim_depth = depth;
+        }
+    }
+    if (victim == 0) {
+        return 0;
+    }
+
+    struct MFQueueHandle* handle = mq_handle(victim);
+    if (handle == NULL) {
+        return 0;
+    }
+
+    int steal = (victim_depth + 1) / 2;
+    if (steal > MF_GROUP_STEAL_BATCH) {
+        steal = MF_GROUP_STEAL_BATCH;
+    }
+
+    unsigned long long hold_start_ns = 0;
+    mq_lock(victim, &hold_start_ns);
+    MF_TRACE(lock_acquire, MF_EV_LOCK_ACQUIRE, victim, 0);
+
+    int stolen = 0;
+    if (mq_header_get(victim, MQ_FIELD_ID) == victim) {
+        while (stolen < steal) {
+            // The expired messages are reclaimed as they reach the head, they are not stolen
+            mq_reclaim_expired(victim);
+            if (mq_header_get(victim, MQ_FIELD_MSG_COUNT) == 0) {
+                break;
+            }
+
+            struct MFStolenMessage* message = &group->stolen[stolen];
+            int compressed_len = 0;
+            message->qid = victim;
+            message->len = mq_get_message(victim, message->data, MAX_DATALEN, message->data, &compressed_len, NULL);
+            message->compressed = compressed_len > 0;
+            if (message->compressed) {
+                message->len = compressed_len;
+            }
+            stolen++;
+        }
+    }
+
+    // Wake up the sleeping sender of the partition if the freed space fits its message
+    int wake_senders = mq_take_send_waiter(victim);
+    if (wake_senders == 0) {
+        mq_stats_address(victim)->wakeups_skipped += stolen;
+    }
+    mq_stats_address(victim)->messages_stolen += stolen;
+
+    MF_TRACE(lock_release, MF_EV_LOCK_RELEASE, victim, 0);
+    mq_unlock(victim, hold_start_ns);
+
+    mq_post_wakeups(handle->empty_sem, wake_senders);
+
+    group->stolen_next = 0;
+    group->stolen_count = stolen;
+    return stolen;
+}
+
+// Copies the next stolen message of the group handle to bufptr and returns its length like mf_recv()
+int group_take_stolen(struct mf_group* group, void* bufptr, int bufsize) {
+    struct MFStolenMessage* message = &group->stolen[group->stolen_next++];
+    int msg_len;
+    if (message->compressed) {
+        msg_len = mq_decode_message(message->qid, message->data, message->len, bufptr, bufsize);
+    } else {
+        msg_len = message->len < bufsize ? message->len : bufsize;
+        memcpy(bufptr, message->data, msg_len);
+    }
+    MF_TRACE(recv_complete, MF_EV_RECV_COMPLETE, message->qid, msg_len);
+    return msg_len;
+}
+
+// Takes back the sleeping receiver a group member counted in its own partition before its timed sleep ended without a wakeup
+// If a sender already took the receiver, the semaphore post of the sender is on its way and is consumed here,
+// so a post always matches one sleep. Only the member receives from its own partition, so the counted receiver is the member.
+void group_cancel_wait(int qid, struct MFQueueHandle* handle) {
+    unsigned long long hold_start_ns = 0;
+    mq_lock(qid, &hold_start_ns);
+    int recv_waiters = mq_header_get(qid, MQ_FIELD_RECV_WAITERS);
+    if (recv_waiters > 0) {
+        mq_header_set(qid, MQ_FIELD_RECV_WAITERS, recv_waiters - 1);
+    }
+    mq_unlock(qid, hold_start_ns);
+
+    if (recv_waiters == 0) {
+        while (sem_wait(handle->full_sem) == -1) {
+        }
+    }
+}
+
+// Returns the address difference of the oldest tagged message whose tag matches tag in the bits of mask, -1 if there is none
+// The message before it in its tag chain is stored in prev_address_diff, -1 if it is the first one of the chain
+// A chain holds the tags with the same low bits, so the chains whose low bits differ from tag in the bits of mask are skipped.
+// The first match of each chain is its oldest match, the oldest of those is the one nearest to the head of the message queue.
+// An expired message does not match, it stays in its chain until it is reclaimed at the head of the message queue
+// Must be called with the access mutex held
+int mq_find_tagged(int qid, unsigned int tag, unsigned int mask, int* prev_address_diff) {
+    int mq_size = mq_header_get(qid, MQ_FIELD_SIZE);
+    int mq_next_msg_address_diff = mq_header_get(qid, MQ_FIELD_NEXT_MSG);
+    void* mq_start_address = mq_region_address(qid);
+    unsigned long long now_ns = 0; // Read when the first message with a time to live is checked
+
+    int found_address_diff = -1;
+    int found_age = 0;
+    for (unsigned int chain = 0; chain < MF_TAG_CHAINS; chain++) {
+        if (((chain ^ tag) & mask & (MF_TAG_CHAINS - 1)) != 0) {
+            continue;
+        }
+
+        int prev = -1;
+        int msg_address_diff = mq_header_get(qid, MQ_FIELD_TAG_CHAINS + 2 * chain) - 1;
+        while (msg_address_diff >= 0) {
+            unsigned int msg_tag = (unsigned int)bytes_to_int_little_endian(mq_start_address + msg_address_diff + MF_MSG_HEADER_SIZE);
+            if (((msg_tag ^ tag) & mask) == 0 && !mq_message_expired(mq_start_address + msg_address_diff, &now_ns)) {
+                int age = (msg_address_diff - mq_next_msg_address_diff + mq_size) % mq_size;
+                if (found_address_diff == -1 || age < found_age) {
+                    found_address_diff = msg_address_diff;
+                    found_age = age;
+                    *prev_address_diff = prev;
+                }
+                break;
+            }
+            prev = msg_address_diff;
+            msg_address_diff = mq_tag_next(qid, msg_address_diff);
+        }
+    }
+
+    return found_address_diff;
+}
+
+// Removes the tagged message at msg_address_diff, which is not at the head of the message queue, and copies it like mq_get_message()
+// The message is unlinked from its tag chain and marked removed, it stays in the ring as a hole until it reaches the head
+// Must be called with the access mutex held
+int mq_remove_tagged(int qid, int msg_address_diff, int prev_address_diff, void* bufptr, int bufsize, void* compressed_buffer, int* compressed_len) {
+    bufsize = mq_copy_message(qid, msg_address_diff, bufptr, bufsize, compressed_buffer, compressed_len, NULL);
+    mq_unlink_tagged(qid, msg_address_diff, prev_address_diff);
+
+    char msg_len_bytes[4];
+    memcpy(msg_len_bytes, mq_region_address(qid) + msg_address_diff, 4);
+    int_to_bytes_little_endian(bytes_to_int_little_endian(msg_len_bytes) | MF_MSG_REMOVED, msg_len_bytes);
+    memcpy(mq_region_address(qid) + msg_address_diff, msg_len_bytes, 4);
+
+    mq_header_set(qid, MQ_FIELD_MSG_COUNT, mq_header_get(qid, MQ_FIELD_MSG_COUNT) - 1);
+    mq_header_set(qid, MQ_FIELD_MSG_BYTES, mq_header_get(qid, MQ_FIELD_MSG_BYTES) - MF_MSG_HEADER_SIZE - (bytes_to_int_little_endian(msg_len_bytes) & MF_MSG_LENGTH_MASK));
+    mq_header_set(qid, MQ_FIELD_TAG_HOLES, mq_header_get(qid, MQ_FIELD_TAG_HOLES) + 1);
+
+    // The hole frees no space in the ring, but a spilled message may take the freed message count and bytes
+    if (mq_header_get(qid, MQ_FIELD_SPILL_COUNT) > 0) {
+        spill_refill(qid);
+    }
+
+    return bufsize;
+}
+
+// Appends the tagged message at msg_address_diff to the tag chain of its tag and counts it in the tag sequence
+// Must be called with the access mutex held
+void mq_link_tagged(int qid, int msg_address_diff) {
+    unsigned int tag = (unsigned int)bytes_to_int_little_endian(mq_region_address(qid) + msg_address_diff + MF_MSG_HEADER_SIZE);
+    int chain_field = MQ_FIELD_TAG_CHAINS + 2 * (tag & (MF_TAG_CHAINS - 1));
+
+    mq_set_tag_next(qid, msg_address_diff, -1);
+    int last_address_diff = mq_header_get(qid, chain_field + 1) - 1;
+    if (last_address_diff >= 0) {
+        mq_set_tag_next(qid, last_address_diff, msg_address_diff);
+    } else {
+        mq_header_set(qid, chain_field, msg_address_diff + 1);
+    }
+    mq_header_set(qid, chain_field + 1, msg_address_diff + 1);
+
+    mq_header_set(qid, MQ_FIELD_TAG_SEQ, mq_header_get(qid, MQ_FIELD_TAG_SEQ) + 1);
+}
+
+// Unlinks the tagged message at msg_address_diff from its tag chain, prev_address_diff is the message before it, -1 if none
+// Must be called with the access mutex held
+void mq_unlink_tagged(int qid, int msg_address_diff, int prev_address_diff) {
+    unsigned int tag = (unsigned int)bytes_to_int_little_endian(mq_region_address(qid) + msg_address_diff + MF_MSG_HEADER_SIZE);
+    int chain_field = MQ_FIELD_TAG_CHAINS + 2 * (tag & (MF_TAG_CHAINS - 1));
+    int next_address_diff = mq_tag_next(qid, msg_address_diff);
+
+    if (prev_address_diff >= 0) {
+        mq_set_tag_next(qid, prev_address_diff, next_address_diff);
+    } else {
+        mq_header_set(qid, chain_field, next_address_diff + 1);
+    }
+    if (mq_header_get(qid, chain_field + 1) == msg_address_diff + 1) {
+        mq_header_set(qid, chain_field + 1, prev_address_diff + 1);
+    }
+}
+
+// Returns the address difference of the next message of the tag chain after the tagged message at msg_address_diff, -1 if none
+int mq_tag_next(int qid, int msg_address_diff) {
+    return bytes_to_int_little_endian(mq_region_address(qid) + msg_address_diff + MF_MSG_HEADER_SIZE + sizeof(int)) - 1;
+}
+
+// Sets the next message of the tag chain after the tagged message at msg_address_diff, -1 ends the chain
+void mq_set_tag_next(int qid, int msg_address_diff, int next_address_diff) {
+    int_to_bytes_little_endian(next_address_diff + 1, mq_region_address(qid) + msg_address_diff + MF_MSG_HEADER_SIZE + sizeof(int));
+}
+
+// Reclaims the holes of the messages removed out of order that reached the head of the message queue
+// The head of the message queue is never a hole after the access mutex is released, and a message queue without messages has no holes
+// Must be called with the access mutex held
+void mq_reclaim_holes(int qid) {
+    int holes = mq_header_get(qid, MQ_FIELD_TAG_HOLES);
+    while (holes > 0) {
+        int msg_address_diff = mq_header_get(qid, MQ_FIELD_NEXT_MSG);
+        void* mq_msg_start_address = mq_region_address(qid) + msg_address_diff;
+        int msg_word = bytes_to_int_little_endian(mq_msg_start_address);
+        if (!(msg_word & MF_MSG_REMOVED)) {
+            break;
+        }
+        int msg_len = msg_word & MF_MSG_LENGTH_MASK;
+
+        holes--;
+        mq_header_set(qid, MQ_FIELD_TAG_HOLES, holes);
+        if (holes == 0 && mq_header_get(qid, MQ_FIELD_MSG_COUNT) == 0) {
+            mq_header_set(qid, MQ_FIELD_NEXT_MSG, 0);
+            mq_header_set(qid, MQ_FIELD_END_MSG, 0);
+        } else {
+            mq_header_set(qid, MQ_FIELD_NEXT_MSG, mq_following_message(qid, msg_address_diff, msg_len));
+        }
+        memset(mq_msg_start_address, 0, MF_MSG_HEADER_SIZE + msg_len);
+    }
+}
+
+// Links the tag chains again and counts the messages, their bytes and the holes from the messages of the message queue, see mq_repair()
+// The recovered message count of the header includes the holes when it is called
+void mq_rebuild_tag_chains(int qid) {
+    for (int chain = 0; chain < MF_TAG_CHAINS; chain++) {
+        mq_header_set(qid, MQ_FIELD_TAG_CHAINS + 2 * chain, 0);
+        mq_header_set(qid, MQ_FIELD_TAG_CHAINS + 2 * chain + 1, 0);
+    }
+
+    int messages = mq_header_get(qid, MQ_FIELD_MSG_COUNT);
+    int msg_count = 0;
+    int holes = 0;
+    int msg_address_diff = mq_header_get(qid, MQ_FIELD_NEXT_MSG);
+    for (int i = 0; i < messages; i++) {
+        int msg_word = bytes_to_int_little_endian(mq_region_address(qid) + msg_address_diff);
+        if (msg_word & MF_MSG_REMOVED) {
+            holes++;
+        } else {
+            msg_count++;
+            if (msg_word & MF_MSG_TAGGED) {
+                mq_link_tagged(qid, msg_address_diff);
+            }
+        }
+        msg_address_diff = mq_following_message(qid, msg_address_diff, msg_word & MF_MSG_LENGTH_MASK);
+    }
+
+    mq_header_set(qid, MQ_FIELD_MSG_COUNT, msg_count);
+    mq_header_set(qid, MQ_FIELD_TAG_HOLES, holes);
+    mq_header_set(qid, MQ_FIELD_MSG_BYTES, mq_count_msg_bytes(qid));
+    mq_reclaim_holes(qid);
+}
+
+// Takes the sleeping tag receivers to wake up for a new tagged message, returns 1 if there are any
+// All of them are woken up, as each of them waits for its own tag
+// Must be called with the access mutex held
+int mq_take_tag_waiters(int qid) {
+    if (mq_header_get(qid, MQ_FIELD_TAG_WAITERS) == 0) {
+        return 0;
+    }
+    mq_header_set(qid, MQ_FIELD_TAG_WAITERS, 0);
+    return 1;
+}
+
+// Calls the filter of mf_splice_filter() on the data of a stored message, without the tag header, the call header and the expiry header
+// A compressed message is decompressed for the filter, it is moved compressed
+int splice_accepts(int qid, void* data, int msg_len, int msg_flags, mf_filter_t filter, void* arg) {
+    int data_offset = mq_expiry_offset(msg_flags);
+    if (msg_flags & MF_MSG_EXPIRES) {
+        data_offset += sizeof(struct MFExpiryHeader);
+    }
+
+    if (msg_flags & MF_MSG_COMPRESSED) {
+        char msg_buffer[MAX_DATALEN];
+        int decompressed_len = mf_decompress_block(data + data_offset, msg_len - data_offset, msg_buffer, MAX_DATALEN);
+        if (decompressed_len < MIN_DATALEN) {
+            printf("Error: Compressed message is corrupt\n");
+            return 0;
+        }
+        return filter(msg_buffer, decompressed_len, arg);
+    }
+
+    return filter(data + data_offset, msg_len - data_offset, arg);
+}
+
+// Sends the message to the message queue with a time to live of ttl_ms milliseconds, 0 if it does not expire,
+// blocking the caller until space is available. The message is compressed if the message queue compresses its messages
+// Returns MF_SUCCESS or MF_ERROR
+int mq_send_ttl(int qid, struct MFQueueHandle* handle, void* bufptr, int datalen, int ttl_ms) {
+    // Compress the message once, before the access mutex is taken, if the message queue compresses its messages
+    char compressed_buffer[MAX_DATALEN];
+    int stored_len = datalen;
+    int msg_flags = 0;
+    void* stored_data = mq_encode_message(qid, bufptr, &stored_len, compressed_buffer, &msg_flags);
+
+    char expiry_buffer[sizeof(struct MFExpiryHeader) + MAX_DATALEN];
+    stored_data = mq_add_expiry(stored_data, &stored_len, mq_expires_at(monotonic_time_ns(), ttl_ms), expiry_buffer, &msg_flags);
+
+    return mq_send_wait(qid, handle, stored_data, stored_len, msg_flags);
+}
+
+// Returns the time a message expires at if it lives ttl_ms milliseconds from start_ns, 0 if ttl_ms is 0 and the message does not expire
+unsigned long long mq_expires_at(unsigned long long start_ns, int ttl_ms) {
+    if (ttl_ms <= 0) {
+        return 0;
+    }
+    return start_ns + (unsigned long long)ttl_ms * 1000000ULL;
+}
+
+// Puts the expiry header before the stored data of a message in message_buffer (sizeof(struct MFExpiryHeader) + MAX_DATALEN bytes)
+// and sets MF_MSG_EXPIRES, returns the data to store. A message that does not expire, expires_at 0, is returned as it is
+void* mq_add_expiry(void* stored_data, int* stored_len, unsigned long long expires_at, void* message_buffer, int* msg_flags) {
+    if (expires_at == 0) {
+        return stored_data;
+    }
+
+    struct MFExpiryHeader expiry_header;
+    expiry_header.expires_at = expires_at;
+    memcpy(message_buffer, &expiry_header, sizeof(struct MFExpiryHeader));
+    memcpy(message_buffer + sizeof(struct MFExpiryHeader), stored_data, *stored_len);
+    *stored_len += sizeof(struct MFExpiryHeader);
+    *msg_flags |= MF_MSG_EXPIRES;
+    return message_buffer;
+}
+
+// Returns the offset of the expiry header in the stored data of a message, after the tag header and the call header
+int mq_expiry_offset(int msg_flags) {
+    int data_offset = 0;
+    if (msg_flags & MF_MSG_TAGGED) {
+        data_offset += sizeof(struct MFTagHeader);
+    }
+    if (msg_flags & MF_MSG_CALL) {
+        data_offset += sizeof(struct MFCallHeader);
+    }
+    return data_offset;
+}
+
+// Returns 1 if the stored message at msg_start_address has a time to live and it passed
+// The time is read once in now_ns by the first message with a time to live, a caller that checks many messages passes 0 in now_ns
+int mq_message_expired(void* msg_start_address, unsigned long long* now_ns) {
+    int msg_flags = bytes_to_int_little_endian(msg_start_address) & ~MF_MSG_LENGTH_MASK;
+    if (!(msg_flags & MF_MSG_EXPIRES)) {
+        return 0;
+    }
+
+    struct MFExpiryHeader expiry_header;
+    memcpy(&expiry_header, msg_start_address + MF_MSG_HEADER_SIZE + mq_expiry_offset(msg_flags), sizeof(struct MFExpiryHeader));
+    if (*now_ns == 0) {
+        *now_ns = monotonic_time_ns();
+    }
+    return expiry_header.expires_at <= *now_ns;
+}
+
+// Removes the expired messages at the head of the message queue in one pass and returns their number
+// The messages behind the first one that has not expired are left, they are reclaimed when they reach the head
+// The caller wakes up the sleeping sender if any message is reclaimed, see mq_take_send_waiter()
+// Must be called with the access mutex held and the message queue existing
+int mq_reclaim_expired(int qid) {
+    unsigned long long now_ns = 0;
+    int expired_messages = 0;
+    while (mq_header_get(qid, MQ_FIELD_MSG_COUNT) > 0
+        && mq_message_expired(mq_region_address(qid) + mq_header_get(qid, MQ_FIELD_NEXT_MSG), &now_ns)) {
+        mq_drop_message(qid);
+        expired_messages++;
+    }
+
+    if (expired_messages > 0) {
+        mq_stats_address(qid)->messages_expired += expired_messages;
+    }
+    return expired_messages;
+}
+
+// Returns 1 if the message at the head of the message queue looks expired, read without the access mutex as a hint for mf_maintain()
+int mq_expired_hint(int qid) {
+    if (mq_header_get(qid, MQ_FIELD_ID) != qid || mq_depth_hint(qid) == 0) {
+        return 0;
+    }
+    void* mq_start_address = mq_region_address(qid);
+    if (mq_start_address == NULL) {
+        return 0;
+    }
+
+    unsigned long long now_ns = 0;
+    return mq_message_expired(mq_start_address + mq_header_get(qid, MQ_FIELD_NEXT_MSG), &now_ns);
+}
+
+// Assembles the name of the overflow log of a spilling message queue, "<SPILL_DIR>/<SHMEM_NAME>.<mqname>.spill"
+void spill_file_name(char* mqname, char* filename) {
+    snprintf(filename, DURABLE_FILENAME_SIZE, "%s/%s.%s.spill", config.SPILL_DIR, config.SHMEM_NAME, mqname);
+}
 
-            // Check if the start address of the message queue is higher than the start of the free space
-            // and lower than the end of the free space, then update the end of the free space and end of the last message queue
-            if (mq_start_address_diff < end_free_space_j && mq_start_address_diff >= start_free_space_i) {
-                end_free_space_j = mq_start_address_diff;
+// Creates the overflow log of a spilling message queue, spill_size_bytes bytes of zeros, the processes map it when they spill
+// The log is a circular buffer of messages stored like in the message queue, its head, tail and message count are in the message queue header
+int spill_create_log(char* mqname, int spill_size_bytes) {
+    char filename[DURABLE_FILENAME_SIZE];
+    spill_file_name(mqname, filename);
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        printf("Error: Could not create the overflow log %s\n", filename);
+        return (MF_ERROR);
+    }
+    if (ftruncate(fd, spill_size_bytes) == -1) {
+        printf("Error: Could not set the size of the overflow log\n");
+        close(fd);
+        unlink(filename);
+        return (MF_ERROR);
+    }
+    close(fd);
+
+    return (MF_SUCCESS);
+}
+
+// Returns the mapping slot of the overflow log of the message queue in the calling process
+struct MFSpillMapping* spill_mapping_slot(int qid) {
+    if (spill_mappings == NULL) {
+        spill_mappings = calloc(config.MAX_QUEUES_IN_SHMEM, sizeof(struct MFSpillMapping));
+    }
+    return &spill_mappings[qid - 1];
+}
+
+// Returns the mapping of the overflow log of a spilling message queue in the calling process, maps the log if it is not mapped yet
+// A mapping that belongs to a removed message queue with the same qid is replaced, they are told apart by the instance id
+struct MFSpillMapping* spill_mapping(int qid) {
+    struct MFSpillMapping* mapping = spill_mapping_slot(qid);
+    int instance = mq_header_get(qid, MQ_FIELD_INSTANCE);
+    if (__atomic_load_n(&mapping->address, __ATOMIC_ACQUIRE) != NULL && mapping->instance == instance) {
+        return mapping;
+    }
+
+    // The mapping is changed by one thread of the process at a time, the others use it after it is published
+    library_lock();
+    if (mapping->address != NULL && mapping->instance == instance) {
+        library_unlock();
+        return mapping;
+    }
+
+    if (mapping->address != NULL) {
+        munmap(mapping->address, mapping->size);
+        mapping->address = NULL;
+    }
+
+    char mq_name[MAX_MQNAMESIZE];
+    memcpy(mq_name, shared_memory_address_fixed + (qid - 1) * MF_MQ_HEADER_SIZE, MAX_MQNAMESIZE);
+    char filename[DURABLE_FILENAME_SIZE];
+    spill_file_name(mq_name, filename);
+
+    int fd = open(filename, O_RDWR);
+    if (fd == -1) {
+        printf("Error: Could not open the overflow log %s\n", filename);
+        library_unlock();
+        return NULL;
+    }
+
+    // The file descriptor is not needed after the log is mapped, the log is never synced
+    int log_size = mq_header_get(qid, MQ_FIELD_SPILL_SIZE);
+    void* log_address = mmap(NULL, log_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (log_address == MAP_FAILED) {
+        printf("Error: Could not map the overflow log of the message queue\n");
+        library_unlock();
+        return NULL;
+    }
+
+    mapping->instance = instance;
+    mapping->size = log_size;
+    __atomic_store_n(&mapping->address, log_address, __ATOMIC_RELEASE);
+    library_unlock();
+
+    return mapping;
+}
+
+// Finds an offset in the overflow log where msg_size bytes fit, -1 if the log is full, see mq_find_space()
+// Must be called with the access mutex held
+int spill_find_space(int qid, int msg_size) {
+    int log_size = mq_header_get(qid, MQ_FIELD_SPILL_SIZE);
+    int head = mq_header_get(qid, MQ_FIELD_SPILL_HEAD);
+    int tail = mq_header_get(qid, MQ_FIELD_SPILL_TAIL);
+
+    if (mq_header_get(qid, MQ_FIELD_SPILL_COUNT) == 0) {
+        return msg_size <= log_size ? 0 : -1;
+    }
+
+    // The messages lay from the head to the tail, wrapped around the end of the log if the tail is before the head
+    if (tail > head) {
+        if (log_size - tail >= msg_size) {
+            return tail;
+        }
+        return msg_size <= head ? 0 : -1;
+    }
+    if (tail < head && head - tail >= msg_size) {
+        return tail;
+    }
+    return -1;
+}
+
+// Appends the stored data of a message to the overflow log of the message queue, or to the chunks of a pooled message queue
+// Returns MF_SUCCESS, or MQ_WOULD_BLOCK if the log is full or cannot be mapped, then the sender blocks like on a message queue that does not spill
+// Must be called with the access mutex held
+int spill_append(int qid, void* bufptr, int datalen, int msg_flags) {
+    void* log_address = spill_log_address(qid);
+    if (log_address == NULL) {
+        return (MQ_WOULD_BLOCK);
+    }
+
+    // A message that does not fit in the last chunk of a pooled message queue goes to a new chunk, see pool_borrow_tail()
+    int msg_address_diff = -1;
+    if (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_POOL) {
+        msg_address_diff = pool_fits_tail(qid, MF_MSG_HEADER_SIZE + datalen) ? mq_header_get(qid, MQ_FIELD_SPILL_TAIL) : pool_borrow_tail(qid);
+        if (msg_address_diff == -1) {
+            return (MQ_WOULD_BLOCK);
+        }
+    } else {
+        msg_address_diff = spill_find_space(qid, MF_MSG_HEADER_SIZE + datalen);
+        if (msg_address_diff == -1) {
+            return (MQ_WOULD_BLOCK);
+        }
+
+        // A message that does not fit before the end of the log goes to its start, a zero length word marks the wrap for the reader
+        int log_size = mq_header_get(qid, MQ_FIELD_SPILL_SIZE);
+        int tail = mq_header_get(qid, MQ_FIELD_SPILL_TAIL);
+        if (msg_address_diff == 0 && mq_header_get(qid, MQ_FIELD_SPILL_COUNT) > 0 && log_size - tail >= (int)sizeof(int)) {
+            int_to_bytes_little_endian(0, log_address + tail);
+        }
+    }
+
+    // The message is stored like in the message queue, the checksum is not computed
+    void* msg_start_address = log_address + msg_address_diff;
+    int_to_bytes_little_endian(datalen | msg_flags, msg_start_address);
+    int_to_bytes_little_endian(0, msg_start_address + sizeof(int));
+    memcpy(msg_start_address + MF_MSG_HEADER_SIZE, bufptr, datalen);
+
+    mq_header_set(qid, MQ_FIELD_SPILL_TAIL, msg_address_diff + MF_MSG_HEADER_SIZE + datalen);
+    mq_header_set(qid, MQ_FIELD_SPILL_COUNT, mq_header_get(qid, MQ_FIELD_SPILL_COUNT) + 1);
+
+    struct mf_stats* mq_stats = mq_stats_address(qid);
+    mq_stats->spilled_messages++;
+    mq_stats->spilled_bytes += datalen;
+    return (MF_SUCCESS);
+}
 
-                // Get the message queue size to calculate the end of the last message queue
-                char mq_size_bytes[4];
-                memcpy(mq_size_bytes, shared_memory_address_fixed + i * MF_MQ_HEADER_SIZE + sizeof(char) * MAX_MQNAMESIZE + sizeof(int), 4);
-                int mq_size = bytes_to_int_little_endian(mq_size_bytes);
+// Moves the messages at the head of the overflow log back to the message queue while they fit, in order, and returns their number
+// Expired messages are dropped on the way. The receivers and the tag receivers sleeping on the message queue are woken for them,
+// the refill runs deep in the receive paths, see mq_drop_message(), so they are woken here with the access mutex held
+// The drained chunks of a pooled message queue are returned on the way, see spill_next_head()
+// Must be called with the access mutex held
+int spill_refill(int qid) {
+    void* log_address = spill_log_address(qid);
+    if (log_address == NULL) {
+        return 0;
+    }
 
-                // Calculate the end of the last message queue to update the start of the free space next time
-                end_of_last_mq = mq_start_address_diff + mq_size;
+    unsigned long long refill_start_ns = monotonic_time_ns();
+    unsigned long long now_ns = refill_start_ns;
+    int spill_count = mq_header_get(qid, MQ_FIELD_SPILL_COUNT);
+    int head = mq_header_get(qid, MQ_FIELD_SPILL_HEAD);
+    int refilled_messages = 0;
+    int refilled_tagged = 0;
+    int expired_messages = 0;
+    unsigned long long refilled_bytes = 0;
+    while (spill_count > 0) {
+        head = spill_next_head(qid, log_address, head);
+        void* msg_start_address = log_address + head;
+        int msg_word = bytes_to_int_little_endian(msg_start_address);
+        int msg_len = msg_word & MF_MSG_LENGTH_MASK;
+
+        if (mq_message_expired(msg_start_address, &now_ns)) {
+            expired_messages++;
+        } else {
+            int msg_address_diff = -1;
+            if (mq_within_limits(qid, MF_MSG_HEADER_SIZE + msg_len)) {
+                msg_address_diff = mq_find_space(qid, MF_MSG_HEADER_SIZE + msg_len);
+            }
+            if (msg_address_diff == -1) {
+                break;
+            }
+            mq_put_message(qid, msg_address_diff, msg_start_address + MF_MSG_HEADER_SIZE, msg_len, msg_word & ~MF_MSG_LENGTH_MASK);
+            refilled_messages++;
+            refilled_bytes += msg_len;
+            if (msg_word & MF_MSG_TAGGED) {
+                refilled_tagged = 1;
             }
         }
 
-        // Update the visited free space
-        visited_free_space++;
+        head += MF_MSG_HEADER_SIZE + msg_len;
+        spill_count--;
+    }
+
+    // An empty log starts over at its start, an empty pooled message queue returns its last chunk
+    if (spill_count == 0) {
+        if (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_POOL) {
+            pool_return_chunk(qid, head / MF_POOL_CHUNK_SIZE);
+        }
+        head = 0;
+        mq_header_set(qid, MQ_FIELD_SPILL_TAIL, 0);
+    }
+    mq_header_set(qid, MQ_FIELD_SPILL_HEAD, head);
+    mq_header_set(qid, MQ_FIELD_SPILL_COUNT, spill_count);
+
+    struct mf_stats* mq_stats = mq_stats_address(qid);
+    mq_stats->refilled_messages += refilled_messages;
+    mq_stats->refilled_bytes += refilled_bytes;
+    mq_stats->refill_ns_total += monotonic_time_ns() - refill_start_ns;
+    mq_stats->messages_expired += expired_messages;
+
+    // Wake up the receivers only if some sleep, a refill usually follows a receive from a message queue that is not empty
+    struct MFQueueHandle* handle = mq_handle(qid);
+    if (handle != NULL && refilled_messages > 0 && mq_header_get(qid, MQ_FIELD_RECV_WAITERS) > 0) {
+        mq_post_wakeups(handle->full_sem, mq_take_recv_waiters(qid, refilled_messages));
+    }
+    if (refilled_tagged && mq_take_tag_waiters(qid)) {
+        syscall(SYS_futex, mq_header_address(qid, MQ_FIELD_TAG_SEQ), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+
+    return refilled_messages;
+}
+
+// Removes the overflow log of a spilling message queue and its mapping in the calling process
+void spill_remove_queue(int qid, char* mqname) {
+    struct MFSpillMapping* mapping = spill_mapping_slot(qid);
+    if (mapping->address != NULL) {
+        munmap(mapping->address, mapping->size);
+        mapping->address = NULL;
+        mapping->instance = 0;
+    }
+
+    char filename[DURABLE_FILENAME_SIZE];
+    spill_file_name(mqname, filename);
+    unlink(filename);
+}
 
-        // Print the start and end of the free space if the free space is not 0
-        if (start_free_space_i != end_free_space_j) {
-            printf("Start free space: %d, End free space: %d\n", start_free_space_i, end_free_space_j);
+// Returns the address the offsets of the spilled messages start from, the overflow log or the first chunk of the buffer pool, NULL on error
+void* spill_log_address(int qid) {
+    if (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_POOL) {
+        struct MFPoolArea* pool = pool_area_map();
+        return pool == NULL ? NULL : (void*)pool + pool_data_offset(pool->chunk_count);
+    }
+
+    struct MFSpillMapping* mapping = spill_mapping(qid);
+    return mapping == NULL ? NULL : mapping->address;
+}
+
+// Returns the offset of the next spilled message from the head offset, after the wrap of the overflow log or in the next chunk
+// A zero length word marks the end of the messages before the end of the log or the chunk, a drained chunk is returned
+// Must be called with the access mutex held and a spilled message
+int spill_next_head(int qid, void* log_address, int head) {
+    if (mq_header_get(qid, MQ_FIELD_FLAGS) & MF_QATTR_POOL) {
+        if (bytes_to_int_little_endian(log_address + head) != 0) {
+            return head;
         }
+        int chunk = head / MF_POOL_CHUNK_SIZE;
+        int next_chunk = pool_area->next[chunk];
+        pool_return_chunk(qid, chunk);
+        return next_chunk * MF_POOL_CHUNK_SIZE;
+    }
+
+    if (mq_header_get(qid, MQ_FIELD_SPILL_SIZE) - head < (int)sizeof(int) || bytes_to_int_little_endian(log_address + head) == 0) {
+        return 0;
+    }
+    return head;
+}
 
-        // Print the filled space in the shared memory region if the visited free space is not the message queue count
-        if (visited_free_space != msg_queue_count + 1) {
-            printf("Filled space in the shared memory region: %d\n", end_free_space_j - start_free_space_i);
+// Name of the shared memory object of the buffer pool, "<SHMEM_NAME>.pool"
+void pool_area_name(char* name) {
+    snprintf(name, MAXFILENAME, "%.100s.pool", config.SHMEM_NAME);
+}
+
+// Returns the offset of the first chunk in the buffer pool, the header and the links of the chunks are before it, rounded up to a page
+int pool_data_offset(int chunk_count) {
+    return align_to_queue_alignment(sizeof(struct MFPoolArea) + chunk_count * sizeof(int));
+}
+
+// Creates the buffer pool of POOL_SIZE KB with all the chunks free and maps it, called by mf_init()
+// A buffer pool left by a previous mfserver is removed, there is no buffer pool if POOL_SIZE is 0
+int pool_create_area() {
+    char name[MAXFILENAME];
+    pool_area_name(name);
+    shm_unlink(name);
+    if (config.POOL_SIZE <= 0) {
+        return (MF_SUCCESS);
+    }
+    if (config.POOL_SIZE > MF_MAX_POOL_SIZE) {
+        printf("Error: Buffer pool size is not within the limits\n");
+        return (MF_ERROR);
+    }
+
+    int chunk_count = config.POOL_SIZE * 1024 / MF_POOL_CHUNK_SIZE;
+    int size = pool_data_offset(chunk_count) + chunk_count * MF_POOL_CHUNK_SIZE;
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        printf("Error: Could not create the buffer pool %s\n", name);
+        if (fd != -1) {
+            close(fd);
+            shm_unlink(name);
         }
+        return (MF_ERROR);
+    }
 
-        // If the empty space is not enough, update the start of the free space to the end of the last message queue
-        // Update the start of the free space to the end of the last message queue
-        start_free_space_i = end_of_last_mq;
+    struct MFPoolArea* pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pool == MAP_FAILED) {
+        printf("Error: Could not map the buffer pool %s\n", name);
+        shm_unlink(name);
+        return (MF_ERROR);
     }
 
-    printf("\n===============================================================================\n");
+    // All the chunks are free, linked in order, the pages of a chunk are not touched until it is used
+    init_robust_mutex(&pool->mutex);
+    pool->chunk_count = chunk_count;
+    for (int chunk = 0; chunk < chunk_count; chunk++) {
+        pool->next[chunk] = chunk + 1 < chunk_count ? chunk + 1 : POOL_NONE;
+    }
+    pool->free_head = chunk_count > 0 ? 0 : POOL_NONE;
+    pool->free_count = chunk_count;
+    pool_area = pool;
+    pool_area_size = size;
+
     return (MF_SUCCESS);
 }
 
-// End of the library functions
-// Start of the helper functions
+// Returns the buffer pool mapped in the calling process, it is mapped the first time it is used, NULL if there is no buffer pool
+// The size of the mapping is the size of the shared memory object, the connecting processes do not read POOL_SIZE
+struct MFPoolArea* pool_area_map() {
+    if (__atomic_load_n(&pool_area, __ATOMIC_ACQUIRE) != NULL) {
+        return pool_area;
+    }
 
-// Read the configuration file and fill the MFConfig structure
-int read_config_file(struct MFConfig* config) {
-    // Open the configuration file
-    FILE* file = fopen(CONFIG_FILENAME, "r");
-    if (file == NULL) {
-        printf("Error: Could not open the configuration file\n");
-        exit(MF_ERROR);
+    library_lock();
+    if (pool_area == NULL) {
+        char name[MAXFILENAME];
+        pool_area_name(name);
+        int fd = shm_open(name, O_RDWR, 0666);
+        if (fd == -1) {
+            library_unlock();
+            return NULL;
+        }
+        struct stat pool_stat;
+        void* address = MAP_FAILED;
+        if (fstat(fd, &pool_stat) == 0) {
+            address = mmap(NULL, pool_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (address == MAP_FAILED) {
+            library_unlock();
+            printf("Error: Could not map the buffer pool %s\n", name);
+            return NULL;
+        }
+        pool_area_size = pool_stat.st_size;
+        __atomic_store_n(&pool_area, address, __ATOMIC_RELEASE);
     }
+    library_unlock();
 
-    // Reading the configuration file line by line
-    // and filling the MFConfig structure
-    // Beware that lines starting with '#' are comments
-    // and only the first two words in a line are considered
-    char line[256];
-    while (fgets(line, sizeof(line), file)) {
-        if (line[0] == '#') {
-            continue;
+    return pool_area;
+}
+
+// Unmaps the buffer pool from the calling process, called by the last mf_disconnect() and by mf_destroy()
+void pool_unmap() {
+    library_lock();
+    if (pool_area != NULL) {
+        munmap(pool_area, pool_area_size);
+        pool_area = NULL;
+    }
+    library_unlock();
+}
+
+// Acquires the mutex of the buffer pool
+// If the previous owner died while holding the mutex, a chunk it was returning may be lost, but no chunk is given twice:
+// a chunk is linked before it becomes the first free chunk, and it is unlinked after. The free chunks are counted again.
+void pool_lock(struct MFPoolArea* pool) {
+    if (pthread_mutex_lock(&pool->mutex) == EOWNERDEAD) {
+        printf("Warning: A process died while holding the mutex of the buffer pool, counting the free chunks again\n");
+        int free_count = 0;
+        for (int chunk = pool->free_head; chunk != POOL_NONE && free_count < pool->chunk_count; chunk = pool->next[chunk]) {
+            free_count++;
         }
+        pool->free_count = free_count;
+        pthread_mutex_consistent(&pool->mutex);
+    }
+}
 
-        char key[256];
-        char value[256];
-        sscanf(line, "%s %s", key, value);
+// Takes count free chunks of the buffer pool and returns the first of them, they stay linked in a list, POOL_NONE if fewer are free
+int pool_take_chunks(struct MFPoolArea* pool, int count) {
+    pool_lock(pool);
+    if (pool->free_count < count || count == 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        return POOL_NONE;
+    }
 
-        if (strcmp(key, "SHMEM_SIZE") == 0) {
-            config->SHMEM_SIZE = atoi(value);
-        } else if (strcmp(key, "MAX_MSGS_IN_QUEUE") == 0) {
-            config->MAX_MSGS_IN_QUEUE = atoi(value);
-        } else if (strcmp(key, "MAX_QUEUES_IN_SHMEM") == 0) {
-            config->MAX_QUEUES_IN_SHMEM = atoi(value);
-        } else if (strcmp(key, "SHMEM_NAME") == 0) {
-            strcpy(config->SHMEM_NAME, value);
-            // Remove the first character of the string, if it is "/"
-            if (config->SHMEM_NAME[0] == '/') {
-                memmove(config->SHMEM_NAME, config->SHMEM_NAME + 1, strlen(config->SHMEM_NAME));
-            }
+    int first_chunk = pool->free_head;
+    int last_chunk = first_chunk;
+    for (int i = 1; i < count; i++) {
+        last_chunk = pool->next[last_chunk];
+    }
+    pool->free_head = pool->next[last_chunk];
+    pool->free_count -= count;
+    pthread_mutex_unlock(&pool->mutex);
+
+    pool->next[last_chunk] = POOL_NONE;
+    return first_chunk;
+}
+
+// Gives count chunks linked from first_chunk to last_chunk back to the free chunks of the buffer pool
+void pool_give_chunks(struct MFPoolArea* pool, int first_chunk, int last_chunk, int count) {
+    pool_lock(pool);
+    pool->next[last_chunk] = pool->free_head;
+    pool->free_head = first_chunk;
+    pool->free_count += count;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Returns 1 if msg_size bytes fit after the newest message in the last chunk of the pooled message queue, 0 otherwise
+// The last 4 bytes of a chunk are never used by a message, the zero length word that ends the messages of the chunk always fits
+// Must be called with the access mutex held
+int pool_fits_tail(int qid, int msg_size) {
+    if (mq_header_get(qid, MQ_FIELD_SPILL_COUNT) == 0) {
+        return 0;
+    }
+    int tail = mq_header_get(qid, MQ_FIELD_SPILL_TAIL);
+    return tail % MF_POOL_CHUNK_SIZE + msg_size <= MF_POOL_CHUNK_SIZE - (int)sizeof(int);
+}
+
+// Returns 1 if the pooled message queue can take another chunk, from its reserved chunks or from the free chunks within its maximum
+// The free chunks are counted without the mutex of the buffer pool, as a hint for mq_take_send_waiter()
+// Must be called with the access mutex held
+int pool_can_borrow(int qid) {
+    struct MFPoolArea* pool = pool_area_map();
+    if (pool == NULL) {
+        return 0;
+    }
+    if (mq_header_get(qid, MQ_FIELD_POOL_RESERVE) != 0) {
+        return 1;
+    }
+    return mq_header_get(qid, MQ_FIELD_POOL_CHUNKS) < mq_header_get(qid, MQ_FIELD_POOL_MAX)
+        && __atomic_load_n(&pool->free_count, __ATOMIC_RELAXED) > 0;
+}
+
+// Takes a chunk for the next message of the pooled message queue and links it after its last chunk, or makes it the first chunk
+// A reserved chunk is taken first, then a free chunk of the buffer pool if the message queue holds fewer chunks than its maximum
+// Returns the offset of the start of the chunk, -1 if no chunk can be taken
+// Must be called with the access mutex held
+int pool_borrow_tail(int qid) {
+    struct MFPoolArea* pool = pool_area_map();
+    if (pool == NULL) {
+        return -1;
+    }
+
+    int chunk = mq_header_get(qid, MQ_FIELD_POOL_RESERVE) - 1;
+    if (chunk != POOL_NONE) {
+        mq_header_set(qid, MQ_FIELD_POOL_RESERVE, pool->next[chunk] + 1);
+    } else {
+        if (mq_header_get(qid, MQ_FIELD_POOL_CHUNKS) >= mq_header_get(qid, MQ_FIELD_POOL_MAX)) {
+            return -1;
+        }
+        chunk = pool_take_chunks(pool, 1);
+        if (chunk == POOL_NONE) {
+            return -1;
         }
+        mq_header_set(qid, MQ_FIELD_POOL_CHUNKS, mq_header_get(qid, MQ_FIELD_POOL_CHUNKS) + 1);
+        mq_stats_address(qid)->pool_chunks_borrowed++;
+    }
+    pool->next[chunk] = POOL_NONE;
+
+    // The messages of the last chunk end with a zero length word, the reader follows the link to the new chunk from there
+    int chunk_start = chunk * MF_POOL_CHUNK_SIZE;
+    if (mq_header_get(qid, MQ_FIELD_SPILL_COUNT) > 0) {
+        int tail = mq_header_get(qid, MQ_FIELD_SPILL_TAIL);
+        int_to_bytes_little_endian(0, (void*)pool + pool_data_offset(pool->chunk_count) + tail);
+        pool->next[tail / MF_POOL_CHUNK_SIZE] = chunk;
+    } else {
+        mq_header_set(qid, MQ_FIELD_SPILL_HEAD, chunk_start);
     }
 
-    /* printf("SHMEM_SIZE: %d\n", config->SHMEM_SIZE);
-    printf("MAX_MSGS_IN_QUEUE: %d\n", config->MAX_MSGS_IN_QUEUE);
-    printf("MAX_QUEUES_IN_SHMEM: %d\n", config->MAX_QUEUES_IN_SHMEM);
-    printf("SHMEM_NAME: %s\n", config->SHMEM_NAME); */
+    return chunk_start;
+}
 
-    fclose(file);
+// Returns a drained chunk of the pooled message queue, it is reserved while the message queue holds no more than its minimum chunks,
+// otherwise it goes back to the free chunks of the buffer pool
+// Must be called with the access mutex held
+void pool_return_chunk(int qid, int chunk) {
+    struct MFPoolArea* pool = pool_area;
+    if (mq_header_get(qid, MQ_FIELD_POOL_CHUNKS) <= mq_header_get(qid, MQ_FIELD_POOL_MIN)) {
+        pool->next[chunk] = mq_header_get(qid, MQ_FIELD_POOL_RESERVE) - 1;
+        mq_header_set(qid, MQ_FIELD_POOL_RESERVE, chunk + 1);
+        return;
+    }
+
+    pool_give_chunks(pool, chunk, chunk, 1);
+    mq_header_set(qid, MQ_FIELD_POOL_CHUNKS, mq_header_get(qid, MQ_FIELD_POOL_CHUNKS) - 1);
+    mq_stats_address(qid)->pool_chunks_returned++;
+}
+
+// Gives all the chunks of a pooled message queue that is removed back to the buffer pool, its spilled messages are dropped
+void pool_release_queue(int qid) {
+    struct MFPoolArea* pool = pool_area_map();
+    if (pool == NULL) {
+        return;
+    }
+
+    // The chunks of the chain, from the chunk of the oldest message to the chunk of the newest one
+    if (mq_header_get(qid, MQ_FIELD_SPILL_COUNT) > 0) {
+        int first_chunk = mq_header_get(qid, MQ_FIELD_SPILL_HEAD) / MF_POOL_CHUNK_SIZE;
+        int last_chunk = mq_header_get(qid, MQ_FIELD_SPILL_TAIL) / MF_POOL_CHUNK_SIZE;
+        int count = 1;
+        for (int chunk = first_chunk; chunk != last_chunk; chunk = pool->next[chunk]) {
+            count++;
+        }
+        pool_give_chunks(pool, first_chunk, last_chunk, count);
+    }
+
+    // The reserved chunks
+    int first_reserved = mq_header_get(qid, MQ_FIELD_POOL_RESERVE) - 1;
+    if (first_reserved != POOL_NONE) {
+        int last_reserved = first_reserved;
+        int count = 1;
+        while (pool->next[last_reserved] != POOL_NONE) {
+            last_reserved = pool->next[last_reserved];
+            count++;
+        }
+        pool_give_chunks(pool, first_reserved, last_reserved, count);
+    }
+
+    mq_header_set(qid, MQ_FIELD_SPILL_COUNT, 0);
+    mq_header_set(qid, MQ_FIELD_POOL_CHUNKS, 0);
+    mq_header_set(qid, MQ_FIELD_POOL_RESERVE, 0);
+}
+
+// Name of the shared memory object of the timer area, "<SHMEM_NAME>.timers"
+void timer_area_name(char* name) {
+    snprintf(name, MAXFILENAME, "%.100s.timers", config.SHMEM_NAME);
+}
+
+// Creates the timer area with an empty timer wheel and maps it, called by mf_init()
+// A timer area left by a previous mfserver is truncated, its delayed messages are lost
+int timer_create_area() {
+    char name[MAXFILENAME];
+    timer_area_name(name);
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    if (fd == -1 || ftruncate(fd, sizeof(struct MFTimerArea)) == -1) {
+        printf("Error: Could not create the timer area %s\n", name);
+        if (fd != -1) {
+            close(fd);
+            shm_unlink(name);
+        }
+        return (MF_ERROR);
+    }
+
+    struct MFTimerArea* area = mmap(NULL, sizeof(struct MFTimerArea), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (area == MAP_FAILED) {
+        printf("Error: Could not map the timer area %s\n", name);
+        shm_unlink(name);
+        return (MF_ERROR);
+    }
+
+    // The new object is zero filled, all the entries are free
+    init_robust_mutex(&area->mutex);
+    area->tick = monotonic_time_ns() / (MF_TIMER_TICK_US * 1000ULL);
+    timer_rebuild(area);
+    timer_area = area;
 
     return (MF_SUCCESS);
 }
 
+// Returns the timer area mapped in the calling process, it is mapped the first time it is used, NULL on error
+// A forked child inherits the mapping of its parent, it is a shared mapping of the same object
+struct MFTimerArea* timer_area_map() {
+    library_lock();
+    if (timer_area == NULL) {
+        char name[MAXFILENAME];
+        timer_area_name(name);
+        int fd = shm_open(name, O_RDWR, 0666);
+        if (fd == -1) {
+            library_unlock();
+            printf("Error: Could not open the timer area %s, is mfserver running?\n", name);
+            return NULL;
+        }
+        struct MFTimerArea* area = mmap(NULL, sizeof(struct MFTimerArea), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (area == MAP_FAILED) {
+            library_unlock();
+            printf("Error: Could not map the timer area %s\n", name);
+            return NULL;
+        }
+        timer_area = area;
+    }
+    library_unlock();
 
-// Check if the value is negative, if it is, convert it to a positive value
-// This function is used to handle the overflow of the char type
-int char_overflow_check(int value) {
-    if (value < 0) {
-        value += 256;
+    return timer_area;
+}
+
+// Unmaps the timer area from the calling process, called by the last mf_disconnect() and by mf_destroy()
+void timer_unmap() {
+    library_lock();
+    if (timer_area != NULL) {
+        munmap(timer_area, sizeof(struct MFTimerArea));
+        timer_area = NULL;
     }
-    return value;
+    library_unlock();
 }
 
-// Convert 4 bytes to an integer in little-endian order
-int bytes_to_int_little_endian(char* bytes) {
-    return (int)(char_overflow_check(bytes[0])) |
-        (int)(char_overflow_check(bytes[1])) << 8 |
-        (int)(char_overflow_check(bytes[2])) << 16 |
-        (int)(char_overflow_check(bytes[3])) << 24;
+// Acquires the mutex of the timer area
+// If the previous owner died while holding the mutex, the lists may be half updated, they are built again from the entries
+void timer_lock(struct MFTimerArea* area) {
+    if (pthread_mutex_lock(&area->mutex) == EOWNERDEAD) {
+        printf("Warning: A process died while holding the mutex of the timer area, rebuilding the timer wheel\n");
+        timer_rebuild(area);
+        pthread_mutex_consistent(&area->mutex);
+    }
 }
 
-// Convert an integer to 4 bytes in little-endian order
-void int_to_bytes_little_endian(int val, char* bytes) {
-    bytes[0] = (char)(val & 0xFF);
-    bytes[1] = (char)((val >> 8) & 0xFF);
-    bytes[2] = (char)((val >> 16) & 0xFF);
-    bytes[3] = (char)((val >> 24) & 0xFF);
-}
\ No newline at end of file
+// Builds the free list, the timer wheel and the pending count from the entries, an entry with a qid holds a message
+// The expired messages go to the due list, the messages of a tick are put back in the order of their entries
+void timer_rebuild(struct MFTimerArea* area) {
+    area->free_head = TIMER_NONE;
+    area->pending = 0;
+    area->due.head = TIMER_NONE;
+    area->due.tail = TIMER_NONE;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            area->slots[level][slot].head = TIMER_NONE;
+            area->slots[level][slot].tail = TIMER_NONE;
+        }
+    }
+
+    for (int index = MF_MAX_TIMERS - 1; index >= 0; index--) {
+        if (area->entries[index].qid == 0) {
+            area->entries[index].next = area->free_head;
+            area->free_head = index;
+        }
+    }
+    for (int index = 0; index < MF_MAX_TIMERS; index++) {
+        if (area->entries[index].qid != 0) {
+            area->pending++;
+            timer_insert(area, index);
+        }
+    }
+}
+
+// Appends the entry to the list
+void timer_list_append(struct MFTimerArea* area, struct MFTimerList* list, int index) {
+    area->entries[index].next = TIMER_NONE;
+    if (list->tail == TIMER_NONE) {
+        list->head = index;
+    } else {
+        area->entries[list->tail].next = index;
+    }
+    list->tail = index;
+}
+
+// Inserts the entry into the slot of its delivery tick in the lowest level whose span holds its delay, or into the due list
+// if the tick is expired. A delay beyond the span of the wheel goes to the farthest slot of the top level, the entry is
+// inserted again when that slot is spread.
+void timer_insert(struct MFTimerArea* area, int index) {
+    struct MFTimerEntry* entry = &area->entries[index];
+    if (entry->deliver_tick < area->tick) {
+        timer_list_append(area, &area->due, index);
+        return;
+    }
+
+    unsigned long long delay = entry->deliver_tick - area->tick;
+    unsigned long long slot_tick = entry->deliver_tick;
+    unsigned long long wheel_span = 1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS);
+    if (delay >= wheel_span) {
+        slot_tick = area->tick + wheel_span - 1;
+        delay = wheel_span - 1;
+    }
+
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delay >= (1ULL << (TIMER_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (int)((slot_tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1));
+    timer_list_append(area, &area->slots[level][slot], index);
+}
+
+// Expires the ticks of the timer wheel up to now_tick and delivers the expired messages, called with the timer mutex held
+// At the start of each span of a level, the slot of the level for that span is spread over the levels below it,
+// from the top level down, then the messages of the level 0 slot of the tick move to the due list.
+void timer_advance(struct MFTimerArea* area, unsigned long long now_tick) {
+    // An empty wheel jumps to the current tick instead of expiring the ticks one by one
+    if (area->pending == 0) {
+        if (area->tick <= now_tick) {
+            area->tick = now_tick + 1;
+        }
+        return;
+    }
+
+    while (area->tick <= now_tick) {
+        unsigned long long tick = area->tick;
+        for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+            if ((tick & ((1ULL << (TIMER_SLOT_BITS * level)) - 1)) != 0) {
+                continue;
+            }
+            struct MFTimerList* list = &area->slots[level][(tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+            int index = list->head;
+            list->head = TIMER_NONE;
+            list->tail = TIMER_NONE;
+            while (index != TIMER_NONE) {
+                int next = area->entries[index].next;
+                timer_insert(area, index);
+                index = next;
+            }
+        }
+
+        // Move the expired messages to the due list in their order
+        struct MFTimerList* expired = &area->slots[0][tick & (TIMER_SLOTS - 1)];
+        if (expired->head != TIMER_NONE) {
+            if (area->due.tail == TIMER_NONE) {
+                area->due.head = expired->head;
+            } else {
+                area->entries[area->due.tail].next = expired->head;
+            }
+            area->due.tail = expired->tail;
+            expired->head = TIMER_NONE;
+            expired->tail = TIMER_NONE;
+        }
+        area->tick = tick + 1;
+    }
+
+    timer_deliver_due(area);
+}
+
+// Delivers the messages of the due list to their message queues without blocking, called with the timer mutex held
+// A message whose message queue is full stays in the due list, and so do the later messages to that message queue,
+// so the delayed messages of a message queue arrive in the order of their ticks. A message whose message queue
+// is removed, or removed and created again, is dropped.
+void timer_deliver_due(struct MFTimerArea* area) {
+    char blocked_queues[config.MAX_QUEUES_IN_SHMEM + 1];
+    memset(blocked_queues, 0, sizeof(blocked_queues));
+
+    int prev = TIMER_NONE;
+    int index = area->due.head;
+    while (index != TIMER_NONE) {
+        struct MFTimerEntry* entry = &area->entries[index];
+        int next = entry->next;
+        int qid = entry->qid;
+
+        if (qid < 1 || qid > config.MAX_QUEUES_IN_SHMEM || blocked_queues[qid]) {
+            prev = index;
+            index = next;
+            continue;
+        }
+
+        int send_status = MF_ERROR;
+        if (mq_header_get(qid, MQ_FIELD_ID) == qid && mq_header_get(qid, MQ_FIELD_INSTANCE) == entry->instance) {
+            struct MFQueueHandle* handle = mq_handle(qid);
+            if (handle != NULL) {
+                send_status = mq_try_send(qid, handle, entry->data, entry->len, entry->msg_flags, NULL);
+            }
+        } else {
+            printf("Warning: Delayed message to message queue %d is dropped, the message queue is removed\n", qid);
+        }
+
+        if (send_status == MQ_WOULD_BLOCK) {
+            blocked_queues[qid] = 1;
+            prev = index;
+            index = next;
+            continue;
+        }
+
+        // Unlink the entry from the due list and free it
+        if (prev == TIMER_NONE) {
+            area->due.head = next;
+        } else {
+            area->entries[prev].next = next;
+        }
+        if (area->due.tail == index) {
+            area->due.tail = prev;
+        }
+        entry->qid = 0;
+        entry->next = area->free_head;
+        area->free_head = index;
+        area->pending--;
+        index = next;
+    }
+}
@@ -16,7 +16,8 @@
 
 // min and max queue size
 #define MIN_MQSIZE  16 // KB // says MB in the project description // assumed to be KB
-#define MAX_MQSIZE  128 // KB  // says MB in the project description // assumed to be KB
+#define MAX_MQSIZE  65536 // KB  // says MB in the project description // assumed to be KB
+// message queues larger than the free space of the shared memory region are placed in new segments, see SEGMENT_SIZE in the config
 // MQSIZE should be a multiple of 4KB
 // 1 KB is 2^12 bytes = 1024 bytes
 
@@ -36,24 +37,345 @@
 #define MF_ERROR -1
 // unseccessful completion
 
-// bytes 128+4+4+4+4+4+4+4, 156 bytes total, description of the header of the message queue lay in the fixed shared memory
-#define MF_MQ_HEADER_SIZE 156
+// bytes 128+4*19+4+4+4+8*(4+4)+4+4*4+4*4+4*3+4*2+4*2+4, 348 bytes total, description of the header of the message queue lay in the fixed shared memory
+// name, id, size, message count, start (low 4 bytes), next message, end of last message, reference count, flags, instance id,
+// segment, start (high 4 bytes), compression threshold, sleeping senders, sleeping receivers, message size of the sleeping sender,
+// next ticket of the blocked senders, ticket at the head of the blocked senders, number of partitions, qid of the next partition,
+// removed messages not reclaimed yet, tagged message sequence, sleeping tag receivers, first and last message of each tag chain,
+// default time to live of the messages, messages in the overflow log, head and tail of the overflow log, size of the overflow log,
+// chunks held from the buffer pool, minimum and maximum chunks, first reserved chunk, maximum messages, maximum bytes, bytes of the messages,
+// changes of a durable message queue, changes covered by its last group commit, ring worker wakeups, waiting ring workers,
+// qid of partition 0 of the logical message queue of a partition
+#define MF_MQ_HEADER_SIZE 348
+
+// bytes 4+4, length and checksum, header of each message in a message queue
+#define MF_MSG_HEADER_SIZE 8
+// the length word holds the length of the stored message data in its low bits and the message flags in its high bits
+#define MF_MSG_LENGTH_MASK 0x00FFFFFF
+#define MF_MSG_COMPRESSED 0x01000000 // message data is compressed, the length is the compressed length
+#define MF_MSG_CALL 0x02000000 // message is a request of mf_call(), its data starts with the call header
+#define MF_MSG_TAGGED 0x04000000 // message is sent by mf_send_tag(), its data starts with the tag header
+#define MF_MSG_REMOVED 0x08000000 // message is removed out of order by mf_recv_tag(), its space is reclaimed when it reaches the head
+#define MF_MSG_EXPIRES 0x10000000 // message has a time to live, its data starts with the expiry header after the tag and call headers
+
+// bytes 4096, a page, superblock at the start of the shared memory, the message queue headers come after it
+// it publishes the configuration of mfserver to the connecting processes
+#define MF_SUPERBLOCK_SIZE 4096
+#define MF_SUPERBLOCK_MAGIC 0x4253464D // "MFSB"
+#define MF_LAYOUT_VERSION 16 // incremented when the layout of the shared memory changes
+
+// feature flags of the shared memory in the superblock
+#define MF_FEATURE_ROBUST_LOCKS 0x1 // access mutexes are robust pthread mutexes
+#define MF_FEATURE_REGISTRY 0x2 // connected processes are in the process registry
+#define MF_FEATURE_STATS 0x4 // message queue statistics are kept
+#define MF_FEATURE_DURABLE 0x8 // some message queues are durable
+#define MF_FEATURE_SEGMENTS 0x10 // message queues lay in segments with 64-bit address differences
+#define MF_FEATURES_SUPPORTED (MF_FEATURE_ROBUST_LOCKS | MF_FEATURE_REGISTRY | MF_FEATURE_STATS | MF_FEATURE_DURABLE | MF_FEATURE_SEGMENTS)
+
+// segments of the shared memory, segment 0 is the shared memory of mfserver, the others are "<SHMEM_NAME>.<segment>"
+#define MF_MAX_SEGMENTS 64
+#define MF_DEFAULT_SEGMENT_SIZE 65536 // KB, default SEGMENT_SIZE of the config
 
 // bytes 16, 4+4+4+4, description of the shared memory lay after the fixed shared memory
 #define MF_SHMEM_INFO_SIZE 16
 
+// alignment of the statistics region that lays after the shared memory information
+#define MF_STATS_ALIGNMENT 64
+
+// Statistics of a message queue, kept in the shared memory for each message queue, see mf_get_stats()
+// The lock statistics are about the access mutex of the message queue, times are in nanoseconds
+struct mf_stats {
+    unsigned long long lock_acquisitions; // number of times the access mutex is acquired
+    unsigned long long lock_contended; // number of acquisitions that had to wait for another holder
+    unsigned long long lock_wait_ns_total; // total time spent waiting for the access mutex
+    unsigned long long lock_wait_ns_max; // longest wait for the access mutex
+    unsigned long long lock_hold_ns_total; // total time the access mutex is held
+    unsigned long long lock_hold_ns_max; // longest hold of the access mutex
+    unsigned long long lock_owner_died; // number of times the access mutex owner died holding it and the message queue is repaired
+    unsigned long long durable_writes; // number of changes to a durable message queue
+    unsigned long long durable_commits; // number of group commits (fdatasync) of a durable message queue
+    unsigned long long durable_commit_ns_total; // total time spent in the group commits
+    unsigned long long compress_attempts; // number of sent messages of at least the compression threshold
+    unsigned long long compress_messages; // number of those messages that are stored compressed, the others did not get smaller
+    unsigned long long compress_bytes_in; // total length of the compressed messages before compression
+    unsigned long long compress_bytes_out; // total length of the compressed messages after compression
+    unsigned long long compress_ns_total; // total time spent compressing, including the attempts that did not get smaller
+    unsigned long long decompress_ns_total; // total time spent decompressing received messages
+    unsigned long long wakeups; // number of semaphore posts for a sleeping sender or receiver
+    unsigned long long wakeups_skipped; // number of sends and receives that posted no semaphore as no peer was sleeping for them
+    unsigned long long messages_stolen; // number of messages taken from the message queue by another member of its consumer group
+    unsigned long long messages_expired; // number of messages reclaimed unreceived because their time to live passed
+    unsigned long long spilled_messages; // number of messages a full spilling message queue appended to its overflow log
+    unsigned long long spilled_bytes; // total stored length of the spilled messages
+    unsigned long long refilled_messages; // number of spilled messages moved back from the overflow log to the message queue
+    unsigned long long refilled_bytes; // total stored length of the refilled messages
+    unsigned long long refill_ns_total; // total time spent moving the spilled messages back
+    unsigned long long pool_chunks_borrowed; // number of chunks a pooled message queue took from the free chunks of the buffer pool
+    unsigned long long pool_chunks_returned; // number of chunks it gave back to the buffer pool when they were drained
+};
+
+// Message queue attribute flags
+#define MF_QATTR_DURABLE 0x1
+// message queue is backed by a memory-mapped file and recovered from it, see DURABLE_QUEUES in the config file
+// mf_send() returns once a group commit made the message durable, within DURABLE_COMMIT_US. The messages batched by mf_set_batching(),
+// delayed by mf_send_at(), moved by mf_splice() or sent through mf_ring_t are made durable by the next group commit, they may be
+// lost if the machine fails before it.
+// mf_create_attr() of an existing durable message queue fails unless the size and the attributes are the same
+#define MF_QATTR_COMPRESS 0x2
+// messages of at least compress_threshold bytes are compressed by mf_send() and decompressed by mf_recv(), see COMPRESSED_QUEUES in the config file
+#define MF_QATTR_SPILL 0x4
+// a full message queue appends the messages to a memory-mapped overflow log instead of blocking the sender, see SPILL_QUEUES in the config file
+#define MF_QATTR_POOL 0x8
+// a full message queue appends the messages to chunks borrowed from the shared buffer pool, see POOLED_QUEUES in the config file
+
+#define MF_DEFAULT_COMPRESS_THRESHOLD 256 // bytes, default compression threshold of a compressing message queue
+
+// Attributes of a message queue, see mf_create_attr()
+struct mf_qattr {
+    int flags; // MF_QATTR_* flags
+    int compress_threshold; // shortest message that is compressed with MF_QATTR_COMPRESS, 0 for MF_DEFAULT_COMPRESS_THRESHOLD
+    int ttl_ms; // default time to live of the messages in milliseconds, see mf_send_ttl(), 0 if the messages do not expire
+    int spill_size; // size of the overflow log of MF_QATTR_SPILL in KB, 0 for MF_DEFAULT_SPILL_SIZE
+    int pool_min; // KB of buffer pool chunks MF_QATTR_POOL keeps even when they are drained, rounded up to chunks
+    int pool_max; // KB of buffer pool chunks MF_QATTR_POOL may hold at a time, rounded up to chunks, 0 for the whole buffer pool
+    int max_msgs; // most messages in the message queue, 0 for MAX_MSGS_IN_QUEUE of the config, MF_UNLIMITED_MSGS for no limit
+    int max_bytes; // most bytes the messages take in the message queue, their 8-byte headers included, 0 for no limit but its size
+};
+
+// max_msgs of a message queue that takes messages while they fit in its size, however many they are
+// An empty message queue always takes a message that fits in its size, even if it is longer than max_bytes
+#define MF_UNLIMITED_MSGS -1
+
+// Durable message queue files
+#define MF_DURABLE_MAGIC 0x3151464D // "MFQ1"
+#define MF_DURABLE_VERSION 1
+#define MF_DURABLE_HEADER_SIZE 4096 // file header before the message queue, a page
+#define MF_DEFAULT_DURABLE_COMMIT_US 2000 // default latency budget of the group commit
+
+// Overflow logs of the spilling message queues
+// A spilling message queue (MF_QATTR_SPILL) that is full appends the sent messages to its overflow log, a memory-mapped file
+// "<SPILL_DIR>/<SHMEM_NAME>.<mqname>.spill" of spill_size KB, and the sender goes on. While the log holds messages every message
+// is appended to it, and the receivers move the messages at its head back into the message queue as they free space, so the
+// messages are received in the order they are sent. A sender blocks only when the overflow log is full too. The log is not
+// durable, a spilling message queue cannot be durable. mf_print() shows the spilled and refilled messages and the refill throughput.
+#define MF_DEFAULT_SPILL_SIZE 65536 // KB, default SPILL_SIZE of the config
+#define MF_MAX_SPILL_SIZE 1048576 // KB, largest overflow log
+
+// Shared buffer pool of the pooled message queues
+// mf_init() creates the buffer pool "<SHMEM_NAME>.pool" of POOL_SIZE KB, split into chunks of MF_POOL_CHUNK_SIZE bytes.
+// A pooled message queue (MF_QATTR_POOL) has a small ring of its own, mqsize of mf_create_attr(), and when the ring is full it
+// spills the messages like MF_QATTR_SPILL, to a chain of chunks it borrows from the free chunks of the buffer pool instead of a file.
+// A drained chunk goes back to the free chunks, so the memory of the message queues follows their backlog. The message queue
+// holds pool_min KB of chunks from its creation on, even when they are drained, and borrows at most pool_max KB at a time.
+// A sender blocks when the message queue cannot borrow a chunk. mf_print() shows the chunks held and the free chunks.
+#define MF_POOL_CHUNK_SIZE 16384 // bytes, a chunk holds at least one message of MAX_DATALEN bytes
+#define MF_MAX_POOL_SIZE 1048576 // KB, largest buffer pool
+
+#define MF_DEFAULT_MAX_PROCESSES 64
+// default maximum number of processes in the process registry, see MAX_PROCESSES in the config file
+
+// The library is in C, see mf.hpp for the C++ front-end
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 int mf_init();
 int mf_destroy();
 int mf_connect();
 int mf_disconnect();
 int mf_create(char* mqname, int mqsize);
+int mf_create_attr(char* mqname, int mqsize, struct mf_qattr* attr);
+void mf_qattr_init(struct mf_qattr* attr);
 int mf_remove(char* mqname);
 int mf_open(char* mqname);
 int mf_close(int qid);
 int mf_send(int qid, void* bufptr, int datalen);
 int mf_recv(int qid, void* bufptr, int bufsize);
 int mf_print();
+int mf_get_stats(int qid, struct mf_stats* stats);
+int mf_maintain();
+
+// Sending in batches
+// mf_set_batching() makes mf_send() of the calling process stage the messages of the message queue in a buffer of the process.
+// The staged messages are published in one critical section when max_bytes bytes are staged, when the oldest one has waited
+// max_delay_us microseconds (a flusher thread of the process publishes it) or when mf_flush() is called.
+// mf_close() and mf_disconnect() publish the staged messages. Messages sent through a ring are not staged.
+int mf_set_batching(int qid, int max_bytes, int max_delay_us);
+int mf_flush(int qid);
+
+// Request/reply calls
+// mf_call() sends the request to the message queue and waits for the reply of the server up to timeout_ms milliseconds,
+// a negative timeout_ms waits forever. It returns the reply length, a reply longer than resp_size is truncated, or MF_ERROR.
+// The server writes the reply directly into a reply slot of the calling process in the shared memory object
+// "<SHMEM_NAME>.rpc.<pid>" and wakes up only the caller. A process has at most MF_MAX_CALLS calls in flight, from any of its threads.
+// mf_serve() receives the requests of the message queue and answers each of them with the reply handler writes to resp,
+// at most resp_size (MAX_DATALEN) bytes. handler returns the reply length, MF_ERROR to fail the call, or MF_SERVE_STOP
+// to fail the call and make mf_serve() return. Requests are neither compressed nor batched, mf_recv() gets their data
+// without the reply slot, so the caller of such a request times out.
+#define MF_MAX_CALLS 64
+#define MF_SERVE_STOP -2
+
+typedef int (*mf_handler_t)(void* req, int reqlen, void* resp, int resp_size, void* arg);
+
+int mf_call(int qid, void* req, int reqlen, void* resp, int resp_size, int timeout_ms);
+int mf_serve(int qid, mf_handler_t handler, void* arg);
+
+// Partitioned message queues
+// mf_create_partitioned() creates a logical message queue of nparts partitions, each a message queue of mqsize KB:
+// partition 0 is named mqname and partition i is named "<mqname>.<i>". mf_open(), mf_close() and mf_remove() of mqname
+// open, close and remove all the partitions, mf_remove() of "<mqname>.<i>" fails. mf_send_key() sends the message to the partition the hash of the key selects,
+// so the messages of a key keep their order while the partitions are drained in parallel. A consumer attaches to a partition
+// with mf_partition(), which returns the qid of the partition to pass to mf_recv(). A message queue that is not partitioned
+// is a logical message queue of one partition.
+#define MF_MAX_PARTITIONS 64
+
+int mf_create_partitioned(char* mqname, int nparts, int mqsize);
+int mf_send_key(int qid, void* key, int keylen, void* bufptr, int datalen);
+int mf_partition(int qid, int index);
+int mf_partition_count(int qid);
+
+// Tagged messages
+// mf_send_tag() sends a message with a 32-bit tag. mf_recv_tag() receives the oldest tagged message whose tag matches tag
+// in the bits set in mask, blocking the caller until there is one: a mask of 0xFFFFFFFF matches the tag exactly and a mask of 0
+// matches any tagged message. mf_recv() receives tagged messages too, in their order. The tagged messages are chained by the
+// low bits of their tags, MF_TAG_CHAINS chains in the message queue header, so mf_recv_tag() walks the chains that can match
+// instead of the message queue. A message received out of order leaves a hole that is reclaimed when it reaches the head of
+// the message queue. Durable message queues do not take tagged messages.
+#define MF_TAG_CHAINS 8
+
+int mf_send_tag(int qid, unsigned int tag, void* bufptr, int datalen);
+int mf_recv_tag(int qid, unsigned int tag, unsigned int mask, void* bufptr, int bufsize);
+
+// Forwarding between message queues
+// mf_splice() moves up to n messages from the message queue src_qid to the message queue dst_qid, each message is copied once,
+// from the source to the destination in the shared memory, as it is stored: a compressed message stays compressed, a tagged message
+// keeps its tag and a request of mf_call() keeps its reply slot, so a pipeline stage forwards calls too. It blocks until src_qid has
+// a message, moves the messages that fit in dst_qid and, if none fits, waits for space for one message like mf_send(). A message
+// leaves src_qid only once it is stored in dst_qid, the waiting message stays at the head of src_qid. A message larger than dst_qid,
+// or a tagged message for a durable dst_qid, is never moved: it stays in src_qid and mf_splice() returns MF_ERROR for it.
+// mf_splice_filter() moves a message only if filter returns nonzero for its data, the other messages are dropped. filter is called
+// with the access mutexes of both message queues held: it must be quick, must not block and must not call the library,
+// a filter that sends to or receives from either message queue deadlocks.
+// Both return the number of moved messages, 0 if filter dropped all the messages taken, or MF_ERROR.
+typedef int (*mf_filter_t)(void* data, int datalen, void* arg);
+
+int mf_splice(int src_qid, int dst_qid, int n);
+int mf_splice_filter(int src_qid, int dst_qid, int n, mf_filter_t filter, void* arg);
+
+// Time to live
+// mf_send_ttl() sends a message that expires ttl_ms milliseconds later, a ttl_ms of 0 sends a message that does not expire.
+// mf_send(), mf_send_tag(), mf_send_key() and mf_send_at() give their messages the default time to live of the message queue,
+// ttl_ms of mf_create_attr(). The time to live counts from the send, or from the delivery for mf_send_at(), a message whose
+// sender blocked on a full message queue for longer is stored expired. An expired message is never received: the receivers,
+// and mfserver every DURABLE_COMMIT_US, reclaim the expired messages at the head of the message queue in bulk, and a sender
+// that finds the message queue full reclaims them before it blocks. mf_recv_tag() skips an expired message anywhere in the
+// message queue, it is reclaimed when it reaches the head. The reclaimed messages are counted in messages_expired of mf_stats.
+int mf_send_ttl(int qid, void* bufptr, int datalen, int ttl_ms);
+
+// Delayed messages
+// mf_send_at() sends a message that mf_recv() sees at deliver_at, a CLOCK_MONOTONIC time in nanoseconds, e.g. now plus the delay.
+// Until then the message is held in a hierarchical timer wheel in the shared memory object "<SHMEM_NAME>.timers", which mf_init()
+// creates: 4 levels of 64 slots over ticks of MF_TIMER_TICK_US microseconds, a message is inserted and expired in constant time.
+// The wheel is advanced by mfserver every tick while it holds messages, and by mf_send_at(). A message is never delivered before
+// its deadline, it is delivered within about a tick after it unless its message queue is full, then it is retried every tick.
+// The delayed messages of a message queue arrive in the order of their deadlines, those with the same tick in the order they were sent.
+// At most MF_MAX_TIMERS messages are delayed at a time. A delayed message is not durable, it is dropped if its message queue is removed.
+#define MF_MAX_TIMERS 1024
+#define MF_TIMER_TICK_US 1000
+
+int mf_send_at(int qid, void* bufptr, int datalen, unsigned long long deliver_at);
+
+// Consumer groups
+// The partitions of a logical message queue are the queues of the members of a consumer group, member i owns partition i.
+// mf_group_join() returns the group handle of a member, mf_group_recv() receives a message for it: the member takes the messages
+// of its own partition first, and when that is empty it steals a batch of up to MF_GROUP_STEAL_BATCH messages (half of the depth)
+// from the deepest other partition. The depth is the message count in the partition header, read without the access mutex as a hint.
+// A member with nothing to take sleeps on its own partition and looks for work to steal every MF_GROUP_STEAL_INTERVAL_US.
+// The stolen messages are kept in the group handle until they are received, mf_group_leave() sends the rest back to the own partition.
+// Stealing gives up the order of the messages of a partition. A group handle is used by one thread, and only the member
+// receives from its own partition. Each member is usually a separate process or thread.
+#define MF_GROUP_STEAL_BATCH 16
+#define MF_GROUP_STEAL_INTERVAL_US 500
+
+typedef struct mf_group mf_group_t;
+
+mf_group_t* mf_group_join(int qid, int member);
+int mf_group_recv(mf_group_t* group, void* bufptr, int bufsize);
+int mf_group_leave(mf_group_t* group);
+
+// Thread safety
+// mf_connect() and mf_disconnect() are counted per process, any thread may call them and the last mf_disconnect() disconnects the process.
+// A forked child that calls mf_connect() keeps the mappings of its parent and registers itself as a new process.
+// A forked child does not inherit the batches of mf_set_batching(), the parent publishes the messages staged before the fork,
+// the child calls mf_set_batching() again to send in batches.
+// mf_send() and mf_recv() may be called by any number of threads on the same or different message queues,
+// each thread caches the semaphores of the message queues it uses, so the threads share no process state on the hot path.
+// mf_open() and mf_close() are thread safe, a message queue is unmapped when the process closes it for the last time,
+// so a thread keeps the message queue open while it sends or receives.
+// mf_create() is serialized across the processes by the registry mutex, a message queue is found only once it is fully created.
+// mf_remove() is not, remove a message queue only when no thread uses it.
+// Do not fork while another thread is inside the library.
+
+// Context of a part of an application, e.g. a thread or a worker pool, that uses the MF library
+// It connects the process, tracks the message queues opened through it and closes them when it is destroyed.
+typedef struct mf_ctx mf_ctx_t;
+
+mf_ctx_t* mf_ctx_create();
+int mf_ctx_destroy(mf_ctx_t* ctx);
+int mf_ctx_open(mf_ctx_t* ctx, char* mqname);
+int mf_ctx_close(mf_ctx_t* ctx, int qid);
+int mf_ctx_send(mf_ctx_t* ctx, int qid, void* bufptr, int datalen);
+int mf_ctx_recv(mf_ctx_t* ctx, int qid, void* bufptr, int bufsize);
+
+// Asynchronous send and receive through a submission ring and a completion ring
+// The application gets a submission queue entry (SQE) with mf_ring_get_sqe(), fills it and publishes the prepared entries
+// with mf_ring_submit(). A worker thread of the library drains the submission ring in batches, performs the operations
+// without blocking and posts a completion queue entry (CQE) for each of them, mf_ring_reap() returns them.
+// Operations of the same kind on the same message queue complete in submission order, an operation that would block waits in the worker
+// while the operations on the other message queues go on, the worker sleeps until the message queues it waits for change.
+// An operation with an unknown opcode completes with MF_ERROR. A ring is used by one submitting and one reaping thread.
+// The rings are in the memory of the process, not in the shared memory region: the buffers of the entries are addresses of the process,
+// which mfserver could not read or write, so the worker is a thread of the process and the rings need not be seen by other processes.
+#define MF_OP_SEND 1 // send len bytes from buf to qid, the result is MF_SUCCESS or MF_ERROR
+#define MF_OP_RECV 2 // receive a message of at most len bytes from qid into buf, the result is the message length or MF_ERROR
+
+struct mf_sqe {
+    int opcode; // MF_OP_*
+    int qid; // message queue id
+    void* buf; // buffer of the message, it must stay valid until the completion is reaped
+    int len; // data length for MF_OP_SEND, buffer size for MF_OP_RECV
+    unsigned long long user_data; // copied to the completion
+};
+
+struct mf_cqe {
+    unsigned long long user_data; // user_data of the submission
+    int opcode; // opcode of the submission
+    int result; // result of the operation
+};
+
+typedef struct mf_ring mf_ring_t;
+
+mf_ring_t* mf_ring_create(int entries);
+int mf_ring_destroy(mf_ring_t* ring);
+struct mf_sqe* mf_ring_get_sqe(mf_ring_t* ring);
+int mf_ring_submit(mf_ring_t* ring);
+int mf_ring_reap(mf_ring_t* ring, struct mf_cqe* cqes, int max_cqes, int min_complete);
+
+// Tracing of the hot path
+// Events are recorded in a per-process ring, see mf_trace.h for the trace points.
+// Setting the MF_TRACE environment variable to a file name prefix starts the trace ring in mf_connect()
+// and dumps it to "<prefix>.<pid>" in mf_disconnect(). Use mftrace to convert the dumps to Chrome trace format.
+// The ring is allocated once per process, mf_trace_start() after mf_trace_stop() reuses it and refuses a larger capacity.
+#define MF_TRACE_DEFAULT_EVENTS 65536
+// default capacity of the trace ring started by the MF_TRACE environment variable
+
+int mf_trace_start(int capacity);
+int mf_trace_stop();
+int mf_trace_dump(char* filename);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
 
@@ -0,0 +1,427 @@
+#ifndef _MF_HPP_
+#define _MF_HPP_
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// C++20 coroutine front-end of the MF library, header only.
+// A reactor owns an asynchronous ring (see mf_ring_create() in mf.h) and runs coroutines on the calling thread.
+// co_await on channel::send() or channel::recv() submits the operation to the ring and suspends the coroutine instead of blocking,
+// the reactor resumes it when the completion of the operation is reaped. The worker of the ring waits for the message queues,
+// so one thread can serve thousands of message queues with one coroutine for each.
+//
+//     mf::reactor reactor;
+//     mf::channel channel(reactor, "mq1");
+//     reactor.spawn([](mf::channel& ch) -> mf::task {
+//         std::vector<char> message = co_await ch.recv();
+//         co_await ch.send(message.data(), (int)message.size());
+//     }(channel));
+//     reactor.run();
+//
+// mf_connect() must be called before a reactor is created. A reactor and its channels are used by one thread.
+
+#include <bit>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "mf.h"
+
+namespace mf {
+
+// Coroutine started by reactor::spawn(), it starts suspended and its frame is destroyed when it returns
+class task {
+public:
+    struct promise_type {
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    task(task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task() {
+        // A task that is never spawned is never resumed
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    std::coroutine_handle<> release() { return std::exchange(handle, nullptr); }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// An operation of a suspended coroutine, it lives in the coroutine frame until the coroutine is resumed
+struct operation {
+    int opcode; // MF_OP_*
+    int qid;
+    void* buf;
+    int len;
+    int result; // result of the completion
+    std::coroutine_handle<> waiter; // coroutine resumed by the completion
+};
+
+class reactor {
+public:
+    // entries is the size of the submission ring, more operations than entries wait in the reactor until a slot is free
+    explicit reactor(int entries = 4096) : ring(mf_ring_create(entries)) {
+        if (ring == nullptr) {
+            throw std::runtime_error("mf_ring_create failed");
+        }
+    }
+
+    reactor(const reactor&) = delete;
+    reactor& operator=(const reactor&) = delete;
+
+    ~reactor() {
+        // Coroutines that are still suspended are not resumed, mf_ring_destroy() drops the operations that are not completed
+        // Once the worker is stopped no buffer of an operation is used, the frames of the suspended coroutines are destroyed
+        mf_ring_destroy(ring);
+        for (std::coroutine_handle<> handle : ready) {
+            handle.destroy();
+        }
+        std::vector<std::coroutine_handle<>> suspended;
+        for (operation* op : backlog) {
+            suspended.push_back(op->waiter);
+        }
+        for (operation* op : submitted) {
+            suspended.push_back(op->waiter);
+        }
+        // The operations live in the frames, their waiters are taken before any frame is destroyed
+        for (std::coroutine_handle<> handle : suspended) {
+            handle.destroy();
+        }
+    }
+
+    // Schedules a coroutine, it starts running in run()
+    void spawn(task coroutine) { ready.push_back(coroutine.release()); }
+
+    // Runs the coroutines until all of them return
+    void run() {
+        struct mf_cqe cqes[256];
+
+        while (!ready.empty() || !backlog.empty() || !submitted.empty()) {
+            // Resume the runnable coroutines, they run until they return or suspend on a new operation
+            while (!ready.empty()) {
+                std::coroutine_handle<> handle = ready.front();
+                ready.pop_front();
+                handle.resume();
+            }
+
+            submit_backlog();
+            if (submitted.empty()) {
+                continue;
+            }
+
+            // Wait for at least one completion, then take all the completions that are ready
+            int reaped = mf_ring_reap(ring, cqes, 256, 1);
+            if (reaped == MF_ERROR) {
+                throw std::runtime_error("mf_ring_reap failed");
+            }
+            for (int i = 0; i < reaped; i++) {
+                operation* op = reinterpret_cast<operation*>(static_cast<uintptr_t>(cqes[i].user_data));
+                op->result = cqes[i].result;
+                submitted.erase(op);
+                ready.push_back(op->waiter);
+            }
+        }
+    }
+
+    // Called by the awaiters of the channels when a coroutine suspends
+    void enqueue(operation* op) { backlog.push_back(op); }
+
+private:
+    // Moves the waiting operations to the submission ring, as many as there are free entries
+    void submit_backlog() {
+        int prepared = 0;
+        while (!backlog.empty()) {
+            struct mf_sqe* sqe = mf_ring_get_sqe(ring);
+            if (sqe == nullptr) {
+                break;
+            }
+            operation* op = backlog.front();
+            backlog.pop_front();
+            sqe->opcode = op->opcode;
+            sqe->qid = op->qid;
+            sqe->buf = op->buf;
+            sqe->len = op->len;
+            sqe->user_data = static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(op));
+            submitted.insert(op);
+            prepared++;
+        }
+        if (prepared > 0) {
+            mf_ring_submit(ring);
+        }
+    }
+
+    mf_ring_t* ring;
+    std::deque<std::coroutine_handle<>> ready; // coroutines to resume
+    std::deque<operation*> backlog; // operations waiting for a free submission entry
+    std::unordered_set<operation*> submitted; // operations submitted and not reaped, their coroutines are suspended
+};
+
+// A message queue used by the coroutines of a reactor
+class channel {
+public:
+    // Awaiter of send(), the result of co_await is MF_SUCCESS or MF_ERROR
+    class send_awaiter : private operation {
+    public:
+        send_awaiter(reactor& owner, int qid, const void* buf, int len)
+            : operation{MF_OP_SEND, qid, const_cast<void*>(buf), len, MF_ERROR, {}}, owner(owner) {}
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            waiter = handle;
+            owner.enqueue(this);
+        }
+        int await_resume() const noexcept { return result; }
+
+    private:
+        reactor& owner;
+    };
+
+    // Awaiter of recv() into a buffer of the caller, the result of co_await is the message length or MF_ERROR
+    class recv_awaiter : private operation {
+    public:
+        recv_awaiter(reactor& owner, int qid, void* buf, int bufsize)
+            : operation{MF_OP_RECV, qid, buf, bufsize, MF_ERROR, {}}, owner(owner) {}
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            waiter = handle;
+            owner.enqueue(this);
+        }
+        int await_resume() const noexcept { return result; }
+
+    private:
+        reactor& owner;
+    };
+
+    // Awaiter of recv() without a buffer, the result of co_await is the message, empty on an error
+    class message_awaiter : private operation {
+    public:
+        message_awaiter(reactor& owner, int qid)
+            : operation{MF_OP_RECV, qid, nullptr, MAX_DATALEN, MF_ERROR, {}}, owner(owner), message(MAX_DATALEN) {
+            buf = message.data();
+        }
+        message_awaiter(message_awaiter&& other)
+            : operation(other), owner(other.owner), message(std::move(other.message)) {
+            buf = message.data();
+        }
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            waiter = handle;
+            owner.enqueue(this);
+        }
+        std::vector<char> await_resume() {
+            message.resize(result > 0 ? result : 0);
+            return std::move(message);
+        }
+
+    private:
+        reactor& owner;
+        std::vector<char> message;
+    };
+
+    // Opens the message queue, it is closed when the channel is destroyed
+    channel(reactor& owner, const std::string& mqname) : owner(owner), owned(true) {
+        std::vector<char> name(mqname.begin(), mqname.end());
+        name.push_back('\0');
+        qid = mf_open(name.data());
+        if (qid == MF_ERROR) {
+            throw std::runtime_error("mf_open failed for " + mqname);
+        }
+    }
+
+    // Uses a message queue opened by the caller, it stays open when the channel is destroyed
+    channel(reactor& owner, int qid) : owner(owner), qid(qid), owned(false) {}
+
+    channel(const channel&) = delete;
+    channel& operator=(const channel&) = delete;
+
+    ~channel() {
+        if (owned) {
+            mf_close(qid);
+        }
+    }
+
+    int id() const { return qid; }
+    reactor& get_reactor() const { return owner; }
+
+    // The buffer must stay valid until the co_await returns
+    send_awaiter send(const void* buf, int datalen) { return send_awaiter(owner, qid, buf, datalen); }
+    recv_awaiter recv(void* buf, int bufsize) { return recv_awaiter(owner, qid, buf, bufsize); }
+    message_awaiter recv() { return message_awaiter(owner, qid); }
+
+private:
+    reactor& owner;
+    int qid;
+    bool owned;
+};
+
+// Serialization hook of the message types of typed_channel that are not trivially copyable
+// A specialization gives the encoded size of a value, writes it into the buffer of the send and reads it back:
+//     static int size(const T& value); // at most MAX_DATALEN
+//     static void write(const T& value, char* data); // writes size(value) bytes
+//     static T read(const char* data, int datalen);
+template <typename T>
+struct serializer;
+
+template <>
+struct serializer<std::string> {
+    static int size(const std::string& value) { return value.empty() ? 1 : (int)value.size(); }
+    static void write(const std::string& value, char* data) {
+        // An empty string is sent as one zero byte, messages are at least MIN_DATALEN long
+        if (value.empty()) {
+            data[0] = '\0';
+        } else {
+            std::memcpy(data, value.data(), value.size());
+        }
+    }
+    static std::string read(const char* data, int datalen) {
+        return datalen == 1 && data[0] == '\0' ? std::string() : std::string(data, datalen);
+    }
+};
+
+// A message queue whose messages are values of T
+// A trivially copyable T is sent and received as its bytes, the size checks are done at compile time and the value
+// is copied between the message queue and the coroutine without a length. Other types go through serializer<T>,
+// which writes the value into a message buffer reserved in the coroutine frame, there is no allocation on the way.
+// The result of co_await on recv() is the value, or no value if the receive fails or the message is not a T.
+template <typename T>
+class typed_channel {
+public:
+    static constexpr bool fixed_size = std::is_trivially_copyable_v<T>;
+
+    static_assert(!fixed_size || (sizeof(T) >= MIN_DATALEN && sizeof(T) <= MAX_DATALEN), "T does not fit in a message");
+    static_assert(!fixed_size || alignof(T) <= alignof(std::max_align_t), "T is over-aligned");
+
+public:
+    // Awaiter of send() of a trivially copyable T, the value is sent from where it is
+    class fixed_send_awaiter : private operation {
+    public:
+        fixed_send_awaiter(reactor& owner, int qid, const T& value)
+            : operation{MF_OP_SEND, qid, const_cast<T*>(&value), (int)sizeof(T), MF_ERROR, {}}, owner(owner) {}
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            waiter = handle;
+            owner.enqueue(this);
+        }
+        int await_resume() const noexcept { return result; }
+
+    private:
+        reactor& owner;
+    };
+
+    // Awaiter of recv() of a trivially copyable T, the message is received into the buffer of the awaiter
+    // The buffer has room for one more byte, so a longer message is told apart from a T instead of being cut to one
+    class fixed_recv_awaiter : private operation {
+    public:
+        fixed_recv_awaiter(reactor& owner, int qid)
+            : operation{MF_OP_RECV, qid, nullptr, (int)sizeof(T) + 1, MF_ERROR, {}}, owner(owner) {}
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            // The awaiter does not move once the coroutine is suspended
+            buf = data;
+            waiter = handle;
+            owner.enqueue(this);
+        }
+        std::optional<T> await_resume() noexcept {
+            if (result != (int)sizeof(T)) {
+                return std::nullopt;
+            }
+            bytes value;
+            std::memcpy(value.data, data, sizeof(T));
+            return std::bit_cast<T>(value);
+        }
+
+    private:
+        // Storage of the value, T need not be default constructible
+        struct bytes {
+            alignas(T) unsigned char data[sizeof(T)];
+        };
+
+        reactor& owner;
+        unsigned char data[sizeof(T) + 1];
+    };
+
+    // Awaiter of send() of a serialized T, the value is written into the buffer of the awaiter
+    class serialized_send_awaiter : private operation {
+    public:
+        serialized_send_awaiter(reactor& owner, int qid, const T& value)
+            : operation{MF_OP_SEND, qid, nullptr, serializer<T>::size(value), MF_ERROR, {}}, owner(owner), source(value) {}
+        bool await_ready() noexcept {
+            // A value that does not fit fails without a submission
+            return len < MIN_DATALEN || len > MAX_DATALEN;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            serializer<T>::write(source, data);
+            buf = data;
+            waiter = handle;
+            owner.enqueue(this);
+        }
+        int await_resume() const noexcept { return result; }
+
+    private:
+        reactor& owner;
+        const T& source;
+        char data[MAX_DATALEN];
+    };
+
+    // Awaiter of recv() of a serialized T
+    class serialized_recv_awaiter : private operation {
+    public:
+        serialized_recv_awaiter(reactor& owner, int qid)
+            : operation{MF_OP_RECV, qid, nullptr, MAX_DATALEN, MF_ERROR, {}}, owner(owner) {}
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            buf = data;
+            waiter = handle;
+            owner.enqueue(this);
+        }
+        std::optional<T> await_resume() {
+            if (result < MIN_DATALEN) {
+                return std::nullopt;
+            }
+            return serializer<T>::read(data, result);
+        }
+
+    private:
+        reactor& owner;
+        char data[MAX_DATALEN];
+    };
+
+    using send_awaiter = std::conditional_t<fixed_size, fixed_send_awaiter, serialized_send_awaiter>;
+    using recv_awaiter = std::conditional_t<fixed_size, fixed_recv_awaiter, serialized_recv_awaiter>;
+
+    typed_channel(reactor& owner, const std::string& mqname) : untyped(owner, mqname) {}
+    typed_channel(reactor& owner, int qid) : untyped(owner, qid) {}
+
+    int id() const { return untyped.id(); }
+
+    // The value must stay valid until the co_await returns, a temporary in the co_await expression does
+    send_awaiter send(const T& value) { return send_awaiter(untyped.get_reactor(), untyped.id(), value); }
+    recv_awaiter recv() { return recv_awaiter(untyped.get_reactor(), untyped.id()); }
+
+private:
+    channel untyped;
+};
+
+} // namespace mf
+
+#endif
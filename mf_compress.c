@@ -0,0 +1,206 @@
+#include <string.h>
+#include "mf.h"
+#include "mf_compress.h"
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Message compressor of the MF library, see mf_compress.h for the block format.
+// The compressor finds matches with a hash table of the last position of each 4-byte sequence, it takes the first match
+// it finds and does not search further, which keeps it fast enough to run on every send of a compressing message queue.
+// The decompressor checks every length and offset against the block and the output buffer, a corrupt block is rejected.
+
+#define COMPRESS_HASH_BITS 12 // hash table of 4096 positions, more than the positions of a message
+#define COMPRESS_MIN_MATCH 4 // shortest match, a match length of 0 in the token is COMPRESS_MIN_MATCH bytes
+#define COMPRESS_MAX_OFFSET 65535 // largest offset of a 2-byte offset
+#define COMPRESS_LAST_LITERALS 5 // the last bytes of a block are always literals
+#define COMPRESS_MATCH_LIMIT 12 // a match starts at least this many bytes before the end of the block
+
+// Function prototypes
+unsigned int compress_read32(const unsigned char* bytes);
+unsigned int compress_hash(unsigned int sequence);
+unsigned char* compress_write_length(unsigned char* op, unsigned char* oend, int length);
+
+int mf_compress_block(const void* src, int src_len, void* dst, int dst_capacity) {
+    const unsigned char* in = src;
+    const unsigned char* iend = in + src_len;
+    const unsigned char* ip = in;
+    const unsigned char* anchor = in; // start of the literals of the next sequence
+    unsigned char* out = dst;
+    unsigned char* op = out;
+    unsigned char* oend = out + dst_capacity;
+
+    // Positions of the 4-byte sequences by their hash, a stale or colliding position is caught by comparing the bytes
+    unsigned short positions[1 << COMPRESS_HASH_BITS];
+    memset(positions, 0, sizeof(positions));
+
+    if (src_len > COMPRESS_MATCH_LIMIT) {
+        const unsigned char* mflimit = iend - COMPRESS_MATCH_LIMIT;
+        const unsigned char* match_end_limit = iend - COMPRESS_LAST_LITERALS;
+
+        while (ip < mflimit) {
+            unsigned int sequence = compress_read32(ip);
+            unsigned int hash = compress_hash(sequence);
+            const unsigned char* ref = in + positions[hash];
+            positions[hash] = (unsigned short)(ip - in);
+
+            if (ref >= ip || ip - ref > COMPRESS_MAX_OFFSET || compress_read32(ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            // Extend the match backwards over the pending literals and forwards up to the last literals
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char* match_end = ip + COMPRESS_MIN_MATCH;
+            const unsigned char* ref_end = ref + COMPRESS_MIN_MATCH;
+            while (match_end < match_end_limit && *match_end == *ref_end) {
+                match_end++;
+                ref_end++;
+            }
+
+            int literal_len = ip - anchor;
+            int match_len = match_end - ip - COMPRESS_MIN_MATCH;
+            int offset = ip - ref;
+
+            // Token, literals, offset and the length extensions must fit in the output
+            if (oend - op < 1 + literal_len + literal_len / 255 + 1 + 2 + match_len / 255 + 1) {
+                return 0;
+            }
+
+            unsigned char* token = op++;
+            *token = (unsigned char)(((literal_len >= 15 ? 15 : literal_len) << 4) | (match_len >= 15 ? 15 : match_len));
+            if (literal_len >= 15) {
+                op = compress_write_length(op, oend, literal_len - 15);
+            }
+            memcpy(op, anchor, literal_len);
+            op += literal_len;
+            *op++ = (unsigned char)(offset & 0xFF);
+            *op++ = (unsigned char)(offset >> 8);
+            if (match_len >= 15) {
+                op = compress_write_length(op, oend, match_len - 15);
+            }
+
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+
+    // The last sequence holds the remaining literals
+    int literal_len = iend - anchor;
+    if (oend - op < 1 + literal_len + literal_len / 255 + 1) {
+        return 0;
+    }
+    unsigned char* token = op++;
+    *token = (unsigned char)((literal_len >= 15 ? 15 : literal_len) << 4);
+    if (literal_len >= 15) {
+        op = compress_write_length(op, oend, literal_len - 15);
+    }
+    memcpy(op, anchor, literal_len);
+    op += literal_len;
+
+    return op - out;
+}
+
+int mf_decompress_block(const void* src, int src_len, void* dst, int dst_capacity) {
+    const unsigned char* ip = src;
+    const unsigned char* iend = ip + src_len;
+    unsigned char* out = dst;
+    unsigned char* op = out;
+    unsigned char* oend = out + dst_capacity;
+
+    while (ip < iend) {
+        int token = *ip++;
+
+        // Literals
+        int literal_len = token >> 4;
+        if (literal_len == 15) {
+            int extension;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                extension = *ip++;
+                literal_len += extension;
+            } while (extension == 255);
+        }
+        if (literal_len > iend - ip || literal_len > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, literal_len);
+        op += literal_len;
+        ip += literal_len;
+
+        // The last sequence has no match
+        if (ip == iend) {
+            break;
+        }
+
+        // Match
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - out) {
+            return -1;
+        }
+        int match_len = token & 0xF;
+        if (match_len == 15) {
+            int extension;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                extension = *ip++;
+                match_len += extension;
+            } while (extension == 255);
+        }
+        match_len += COMPRESS_MIN_MATCH;
+        if (match_len > oend - op) {
+            return -1;
+        }
+
+        // The match may overlap the bytes it produces, e.g. a run of one byte has offset 1, copy it byte by byte then
+        const unsigned char* ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+        } else {
+            for (int i = 0; i < match_len; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += match_len;
+    }
+
+    return op - out;
+}
+
+// Helper functions
+
+// Reads 4 bytes of the input, unaligned
+unsigned int compress_read32(const unsigned char* bytes) {
+    unsigned int value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Multiplicative hash of a 4-byte sequence to COMPRESS_HASH_BITS bits
+unsigned int compress_hash(unsigned int sequence) {
+    return (sequence * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+// Writes the extension bytes of a literal or match length, 255 for each full 255 and the remainder
+// The caller has checked that the bytes fit before oend
+unsigned char* compress_write_length(unsigned char* op, unsigned char* oend, int length) {
+    while (length >= 255 && op < oend) {
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op < oend) {
+        *op++ = (unsigned char)length;
+    }
+    return op;
+}
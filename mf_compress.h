@@ -0,0 +1,22 @@
+#ifndef _MF_COMPRESS_H_
+#define _MF_COMPRESS_H_
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Internal message compressor of the MF library.
+// It is included by the library sources only, applications enable compression per message queue, see MF_QATTR_COMPRESS in mf.h.
+
+// A fast LZ77 compressor in the LZ4 block format: each sequence is a token (4 bits literal length, 4 bits match length - 4),
+// the literal length extension bytes, the literals, a 2-byte little-endian offset and the match length extension bytes.
+// The last sequence has literals only. Messages are at most MAX_DATALEN bytes, so the whole message is one block.
+
+// Compresses src_len bytes of src into dst
+// Returns the compressed length, or 0 if the compressed form does not fit in dst_capacity bytes
+int mf_compress_block(const void* src, int src_len, void* dst, int dst_capacity);
+
+// Decompresses src_len bytes of src into dst
+// Returns the decompressed length, or -1 if the block is corrupt or the result does not fit in dst_capacity bytes
+int mf_decompress_block(const void* src, int src_len, void* dst, int dst_capacity);
+
+#endif
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "mf.h"
+#include "mf_trace.h"
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Per-process trace ring of the MF library.
+// The ring is a power of two array of events, writers reserve a slot with an atomic increment of the head,
+// so that recording an event never takes a lock and never blocks, the oldest events are overwritten.
+// Each slot is a seqlock: its sequence number is cleared before the event is written and set after it, the dump copies the event
+// and checks the sequence number again, so it skips the slots that are being written and the ones overwritten while it copies them.
+// The ring is allocated by the first mf_trace_start() and never freed, a recorder may still be writing into it after
+// mf_trace_stop(), so a later mf_trace_start() reuses it and only a capacity the ring does not hold is refused.
+
+// An event in the trace ring
+struct MFTraceEvent {
+    unsigned long seq; // Index of the event plus one, 0 if the slot is not written yet
+    unsigned long ts_ns; // CLOCK_MONOTONIC timestamp in nanoseconds
+    int tid; // Thread id of the caller
+    int event; // Event id, one of MF_EV_*
+    int qid; // Message queue id
+    int arg; // Event argument
+};
+
+// The trace ring, the mask is published with the events so that a recorder never masks an index for another ring
+struct MFTraceRing {
+    unsigned long mask; // Capacity of the trace ring minus one
+    struct MFTraceEvent events[]; // Events of the trace ring
+};
+
+// Global variables
+int mf_trace_enabled = 0; // Set to 1 while the trace ring is recording
+struct MFTraceRing* trace_ring = NULL; // Trace ring, allocated by the first mf_trace_start()
+unsigned long trace_ring_head = 0; // Index of the next event to be written
+unsigned long trace_ring_start = 0; // Index of the first event of the current recording, the dump skips the older ones
+__thread int trace_tid = 0; // Cached thread id of the calling thread
+
+// Names of the events in the dump file, indexed by the event id
+const char* trace_event_names[MF_EV_COUNT] = {
+    "unknown",
+    "send_start",
+    "send_commit",
+    "recv_start",
+    "recv_complete",
+    "block",
+    "wake",
+    "lock_acquire",
+    "lock_release"
+};
+
+
+// Starts recording the hot path events of the calling process into a trace ring
+// The capacity is the number of events kept, it is rounded up to a power of two
+int mf_trace_start(int capacity) {
+    if (capacity <= 0) {
+        printf("Error: Trace ring capacity must be positive\n");
+        return (MF_ERROR);
+    }
+
+    // Round the capacity up to a power of two so that the slot is found by masking the index
+    unsigned long ring_capacity = 1;
+    while (ring_capacity < (unsigned long)capacity) {
+        ring_capacity <<= 1;
+    }
+
+    // A previous trace ring is reused, the threads recording into it may not have seen mf_trace_stop() yet
+    // Of two threads starting the first trace ring at once, the one that does not install its ring frees it and uses the other one
+    struct MFTraceRing* ring = __atomic_load_n(&trace_ring, __ATOMIC_ACQUIRE);
+    if (ring == NULL) {
+        struct MFTraceRing* new_ring = calloc(1, sizeof(struct MFTraceRing) + ring_capacity * sizeof(struct MFTraceEvent));
+        if (new_ring == NULL) {
+            printf("Error: Could not allocate the trace ring\n");
+            return (MF_ERROR);
+        }
+        new_ring->mask = ring_capacity - 1;
+        if (__atomic_compare_exchange_n(&trace_ring, &ring, new_ring, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            ring = new_ring;
+        } else {
+            free(new_ring);
+        }
+    }
+    if (ring_capacity > ring->mask + 1) {
+        printf("Error: Trace ring is already allocated with a capacity of %lu events\n", ring->mask + 1);
+        return (MF_ERROR);
+    }
+
+    // The head keeps counting, so the sequence numbers of the events of a previous recording never match a new index
+    __atomic_store_n(&trace_ring_start, __atomic_load_n(&trace_ring_head, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_store_n(&mf_trace_enabled, 1, __ATOMIC_RELEASE);
+
+    return (MF_SUCCESS);
+}
+
+// Stops recording events, the recorded events are kept until the next mf_trace_start()
+// A thread that is recording an event when it is called finishes writing it into the trace ring
+int mf_trace_stop() {
+    __atomic_store_n(&mf_trace_enabled, 0, __ATOMIC_RELEASE);
+    return (MF_SUCCESS);
+}
+
+// Writes the recorded events to the given file, one event per line in the order they were recorded
+// The line format is "timestamp_ns pid tid event qid arg", mftrace converts the file to Chrome trace format
+int mf_trace_dump(char* filename) {
+    struct MFTraceRing* ring = __atomic_load_n(&trace_ring, __ATOMIC_ACQUIRE);
+    if (ring == NULL) {
+        printf("Error: Trace ring is not started\n");
+        return (MF_ERROR);
+    }
+
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        printf("Error: Could not open the trace file %s\n", filename);
+        return (MF_ERROR);
+    }
+
+    // Only the last capacity events of the current recording are in the trace ring
+    unsigned long head = __atomic_load_n(&trace_ring_head, __ATOMIC_ACQUIRE);
+    unsigned long first = __atomic_load_n(&trace_ring_start, __ATOMIC_RELAXED);
+    if (head - first > ring->mask + 1) {
+        first = head - (ring->mask + 1);
+    }
+
+    int pid = (int)getpid();
+    for (unsigned long i = first; i < head; i++) {
+        struct MFTraceEvent* slot = &ring->events[i & ring->mask];
+
+        // Skip the slot if it is being written or it is already overwritten
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1) {
+            continue;
+        }
+
+        // Copy the event, then skip it if a recorder started writing the slot again while it was copied
+        struct MFTraceEvent event;
+        event.ts_ns = __atomic_load_n(&slot->ts_ns, __ATOMIC_RELAXED);
+        event.tid = __atomic_load_n(&slot->tid, __ATOMIC_RELAXED);
+        event.event = __atomic_load_n(&slot->event, __ATOMIC_RELAXED);
+        event.qid = __atomic_load_n(&slot->qid, __ATOMIC_RELAXED);
+        event.arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1) {
+            continue;
+        }
+
+        fprintf(file, "%lu %d %d %s %d %d\n", event.ts_ns, pid, event.tid, mf_trace_event_name(event.event), event.qid, event.arg);
+    }
+
+    fclose(file);
+
+    return (MF_SUCCESS);
+}
+
+// Records an event in the trace ring of the calling process
+void mf_trace_record(int event, int qid, int arg) {
+    // The ring and its mask are loaded once, together
+    struct MFTraceRing* ring = __atomic_load_n(&trace_ring, __ATOMIC_ACQUIRE);
+    if (ring == NULL) {
+        return;
+    }
+
+    if (trace_tid == 0) {
+        trace_tid = (int)syscall(SYS_gettid);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // Reserve a slot, invalidate it while it is being written and publish it with the sequence number
+    // The fence keeps the event stores from becoming visible before the invalidation, see mf_trace_dump()
+    unsigned long index = __atomic_fetch_add(&trace_ring_head, 1, __ATOMIC_RELAXED);
+    struct MFTraceEvent* slot = &ring->events[index & ring->mask];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->ts_ns, (unsigned long)now.tv_sec * 1000000000UL + (unsigned long)now.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->tid, trace_tid, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->event, event, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->qid, qid, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+// Returns the name of the event, used in the dump file
+const char* mf_trace_event_name(int event) {
+    if (event <= 0 || event >= MF_EV_COUNT) {
+        return trace_event_names[0];
+    }
+    return trace_event_names[event];
+}
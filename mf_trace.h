@@ -0,0 +1,50 @@
+#ifndef _MF_TRACE_H_
+#define _MF_TRACE_H_
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Internal tracing interface of the MF library.
+// It is included by the library sources only, applications use the mf_trace_* functions in mf.h.
+
+// Trace points of the hot path
+// Each trace point is both a static USDT probe (compiled out by default)
+// and a record in the per-process trace ring (disabled by default, enabled at runtime).
+#define MF_EV_SEND_START 1 // mf_send() is entered, arg is the data length
+#define MF_EV_SEND_COMMIT 2 // message is placed in the message queue, arg is the data length
+#define MF_EV_RECV_START 3 // mf_recv() is entered, arg is the buffer size
+#define MF_EV_RECV_COMPLETE 4 // message is removed from the message queue, arg is the message length
+#define MF_EV_BLOCK 5 // caller blocks on a semaphore, arg is 0 for sender and 1 for receiver
+#define MF_EV_WAKE 6 // caller wakes up from a semaphore, arg is 0 for sender and 1 for receiver
+#define MF_EV_LOCK_ACQUIRE 7 // access mutex of the message queue is acquired
+#define MF_EV_LOCK_RELEASE 8 // access mutex of the message queue is released
+#define MF_EV_COUNT 9
+
+// Static USDT probes, provider name is "mf"
+// Build with "make USDT=1" to compile them in, they need <sys/sdt.h> (systemtap-sdt-dev)
+#ifdef MF_USDT
+#include <sys/sdt.h>
+#define MF_PROBE(name, qid, arg) DTRACE_PROBE2(mf, name, qid, arg)
+#else
+#define MF_PROBE(name, qid, arg) do {} while (0)
+#endif
+
+// Set to 1 while the trace ring of the process is recording
+extern int mf_trace_enabled;
+
+// Records an event in the trace ring of the calling process
+void mf_trace_record(int event, int qid, int arg);
+
+// Returns the name of the event, used in the dump file
+const char* mf_trace_event_name(int event);
+
+// Fires the USDT probe and records the event in the trace ring if it is enabled
+#define MF_TRACE(name, event, qid, arg) \
+    do { \
+        MF_PROBE(name, qid, arg); \
+        if (mf_trace_enabled) { \
+            mf_trace_record(event, qid, arg); \
+        } \
+    } while (0)
+
+#endif
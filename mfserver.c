@@ -57,7 +57,11 @@ int main(int argc, char* argv[]) {
     printf("mfserver initialized successfully.\n");
     printf("mfserver pid=%d\n", (int)getpid());
 
-    while (1) { sleep(1000); }
+    // Do the periodic work of the library, e.g. the group commit of the durable message queues
+    while (1) {
+        int interval_us = mf_maintain();
+        usleep(interval_us > 0 ? interval_us : 1000);
+    }
 
     exit(0);
 }
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Converts the trace ring dumps of the MF library (see mf_trace_dump()) to Chrome trace format.
+// The output can be loaded to chrome://tracing or https://ui.perfetto.dev for timeline analysis.
+// usage: ./mftrace dumpfile... > trace.json
+
+// Chrome trace phase and slice name of each event in the dump file
+// Start events open a slice and the matching complete events close it, so the slices nest per thread as
+// mf_send/mf_recv > access_mutex and mf_send/mf_recv > blocked
+struct TraceEventMapping {
+    char* event;
+    char* phase;
+    char* name;
+};
+
+struct TraceEventMapping mappings[] = {
+    { "send_start", "B", "mf_send" },
+    { "send_commit", "E", "mf_send" },
+    { "recv_start", "B", "mf_recv" },
+    { "recv_complete", "E", "mf_recv" },
+    { "block", "B", "blocked" },
+    { "wake", "E", "blocked" },
+    { "lock_acquire", "B", "access_mutex" },
+    { "lock_release", "E", "access_mutex" },
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("usage: ./mftrace dumpfile... > trace.json\n");
+        exit(1);
+    }
+
+    printf("{\"traceEvents\":[\n");
+
+    int is_first = 1;
+    for (int i = 1; i < argc; i++) {
+        FILE* file = fopen(argv[i], "r");
+        if (file == NULL) {
+            fprintf(stderr, "Error: Could not open the trace file %s\n", argv[i]);
+            exit(1);
+        }
+
+        // Each line is "timestamp_ns pid tid event qid arg"
+        char line[256];
+        while (fgets(line, sizeof(line), file)) {
+            unsigned long ts_ns;
+            int pid, tid, qid, arg;
+            char event[64];
+            if (sscanf(line, "%lu %d %d %63s %d %d", &ts_ns, &pid, &tid, event, &qid, &arg) != 6) {
+                continue;
+            }
+
+            // Unknown events are emitted as instant events
+            char* phase = "i";
+            char* name = event;
+            for (int j = 0; j < (int)(sizeof(mappings) / sizeof(mappings[0])); j++) {
+                if (strcmp(mappings[j].event, event) == 0) {
+                    phase = mappings[j].phase;
+                    name = mappings[j].name;
+                    break;
+                }
+            }
+
+            // Chrome trace timestamps are in microseconds
+            printf("%s{\"name\":\"%s\",\"cat\":\"mf\",\"ph\":\"%s\",\"ts\":%lu.%03lu,\"pid\":%d,\"tid\":%d,\"args\":{\"event\":\"%s\",\"qid\":%d,\"arg\":%d}}",
+                is_first ? "" : ",\n", name, phase, ts_ns / 1000, ts_ns % 1000, pid, tid, event, qid, arg);
+            is_first = 0;
+        }
+
+        fclose(file);
+    }
+
+    printf("\n]}\n");
+
+    return 0;
+}
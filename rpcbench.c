@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "mf.h"
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Measures the round-trip latency of a request/reply between two processes.
+// The server process echoes the requests. The round trip is measured with mf_call() and mf_serve(),
+// then with a request message queue and a reply message queue and two mf_send()/mf_recv() pairs.
+// Run mfserver first.
+// usage: ./rpcbench [calls] [message_size]
+
+char call_mqname[32] = "rpcbench";
+char request_mqname[32] = "rpcbench_request";
+char reply_mqname[32] = "rpcbench_reply";
+
+unsigned long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int echo_handler(void* req, int reqlen, void* resp, int resp_size, void* arg) {
+    memcpy(resp, req, reqlen);
+    // The last request is a single byte, it stops the server
+    return reqlen == 1 ? MF_SERVE_STOP : reqlen;
+}
+
+int compare_latencies(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Prints the percentiles of count latencies in microseconds, the latencies are sorted
+void print_latencies(char* name, unsigned long long* latencies, int count) {
+    qsort(latencies, count, sizeof(unsigned long long), compare_latencies);
+    printf("%-10s  %7d  %9.1f  %9.1f  %9.1f\n", name, count,
+        latencies[count / 2] / 1e3, latencies[count * 99 / 100] / 1e3, latencies[count - 1] / 1e3);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 3) {
+        printf("usage: ./rpcbench [calls] [message_size]\n");
+        exit(1);
+    }
+
+    int calls = argc > 1 ? atoi(argv[1]) : 10000;
+    int message_size = argc > 2 ? atoi(argv[2]) : 64;
+    if (calls <= 0 || message_size < 2 || message_size > MAX_DATALEN) {
+        printf("calls must be positive and message_size between 2 and MAX_DATALEN\n");
+        exit(1);
+    }
+
+    // The library prints on every message, keep the output of the benchmark readable
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    if (mf_connect() != MF_SUCCESS) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        printf("mf_connect failed, is mfserver running?\n");
+        exit(1);
+    }
+    mf_create(call_mqname, 64);
+    mf_create(request_mqname, 64);
+    mf_create(reply_mqname, 64);
+
+    char buffer[MAX_DATALEN];
+    char reply[MAX_DATALEN];
+    memset(buffer, 'r', MAX_DATALEN);
+    unsigned long long* latencies = malloc(sizeof(unsigned long long) * calls);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    printf("round trips of %d bytes in microseconds\n", message_size);
+    printf("method        calls        p50        p99        max\n");
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+
+    // mf_call() and mf_serve()
+    pid_t server = fork();
+    if (server == 0) {
+        mf_connect();
+        int qid = mf_open(call_mqname);
+        mf_serve(qid, echo_handler, NULL);
+        mf_close(qid);
+        mf_disconnect();
+        exit(0);
+    }
+
+    int qid = mf_open(call_mqname);
+    for (int i = 0; i < calls; i++) {
+        unsigned long long start = now_ns();
+        mf_call(qid, buffer, message_size, reply, MAX_DATALEN, -1);
+        latencies[i] = now_ns() - start;
+    }
+    mf_call(qid, buffer, 1, reply, MAX_DATALEN, -1);
+    waitpid(server, NULL, 0);
+    mf_close(qid);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    print_latencies("mf_call", latencies, calls);
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+
+    // Two mf_send()/mf_recv() pairs
+    server = fork();
+    if (server == 0) {
+        mf_connect();
+        int request_qid = mf_open(request_mqname);
+        int reply_qid = mf_open(reply_mqname);
+        for (int i = 0; i < calls; i++) {
+            int request_len = mf_recv(request_qid, buffer, MAX_DATALEN);
+            mf_send(reply_qid, buffer, request_len);
+        }
+        mf_close(request_qid);
+        mf_close(reply_qid);
+        mf_disconnect();
+        exit(0);
+    }
+
+    int request_qid = mf_open(request_mqname);
+    int reply_qid = mf_open(reply_mqname);
+    for (int i = 0; i < calls; i++) {
+        unsigned long long start = now_ns();
+        mf_send(request_qid, buffer, message_size);
+        mf_recv(reply_qid, reply, MAX_DATALEN);
+        latencies[i] = now_ns() - start;
+    }
+    waitpid(server, NULL, 0);
+    mf_close(request_qid);
+    mf_close(reply_qid);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    print_latencies("send/recv", latencies, calls);
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+
+    mf_remove(call_mqname);
+    mf_remove(request_mqname);
+    mf_remove(reply_mqname);
+    mf_disconnect();
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(null_fd);
+    close(saved_stdout);
+    free(latencies);
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "mf.h"
+
+// Görkem Kadir Solun 22003214
+// Murat Çağrı Kara 22102505
+
+// Measures how the throughput of one process scales with the number of sender and receiver threads.
+// For each thread count T (1, 2, 4, ... max_threads), T sender threads and T receiver threads share one message queue
+// through a context, each sender sends the given number of messages and each receiver receives as many.
+// Run mfserver first.
+// usage: ./threadbench [messages_per_thread] [max_threads]
+
+#define BENCH_MSG_SIZE 64
+
+char mqname[32] = "threadbench";
+
+mf_ctx_t* ctx;
+int qid;
+int messages_per_thread;
+
+void* sender(void* arg) {
+    char sendbuffer[BENCH_MSG_SIZE];
+    memset(sendbuffer, 's', BENCH_MSG_SIZE);
+    for (int i = 0; i < messages_per_thread; i++) {
+        mf_ctx_send(ctx, qid, sendbuffer, BENCH_MSG_SIZE);
+    }
+    return NULL;
+}
+
+void* receiver(void* arg) {
+    char recvbuffer[MAX_DATALEN];
+    for (int i = 0; i < messages_per_thread; i++) {
+        mf_ctx_recv(ctx, qid, recvbuffer, MAX_DATALEN);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 3) {
+        printf("usage: ./threadbench [messages_per_thread] [max_threads]\n");
+        exit(1);
+    }
+
+    messages_per_thread = argc > 1 ? atoi(argv[1]) : 20000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    if (messages_per_thread <= 0 || max_threads <= 0) {
+        printf("messages_per_thread and max_threads must be positive\n");
+        exit(1);
+    }
+
+    // The library prints on every message, keep the output of the benchmark readable
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+
+    ctx = mf_ctx_create();
+    if (ctx == NULL) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        printf("mf_ctx_create failed, is mfserver running?\n");
+        exit(1);
+    }
+    mf_create(mqname, 64);
+    qid = mf_ctx_open(ctx, mqname);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    printf("threads  messages  seconds  messages/s\n");
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * 2 * max_threads);
+    for (int thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        fflush(stdout);
+        dup2(null_fd, STDOUT_FILENO);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (int i = 0; i < thread_count; i++) {
+            pthread_create(&threads[i], NULL, receiver, NULL);
+            pthread_create(&threads[thread_count + i], NULL, sender, NULL);
+        }
+        for (int i = 0; i < 2 * thread_count; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        long messages = (long)thread_count * messages_per_thread;
+        printf("%7d  %8ld  %7.3f  %10.0f\n", thread_count, messages, seconds, messages / seconds);
+    }
+
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    mf_ctx_close(ctx, qid);
+    mf_remove(mqname);
+    mf_ctx_destroy(ctx);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+
+    close(null_fd);
+    close(saved_stdout);
+    free(threads);
+
+    return 0;
+}